@@ -0,0 +1,10129 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * libccli as a single file, generated by scripts/amalgamate.sh.
+ * Do not edit, change the files in src/ instead.
+ *
+ * Build it with the ccli.h next to it, and link with -lpthread.
+ * Define HAVE_SDT to have the USDT probes (needs sys/sdt.h).
+ */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#line 1 "src/simd.h"
+/* SPDX-License-Identifier: LGPL-2.1 */
+#ifndef __CCLI_SIMD_H
+#define __CCLI_SIMD_H
+
+#include <stdbool.h>
+
+/*
+ * The string kernels of the hot paths, with a version for each SIMD
+ * instruction set (see simd.c). The best one that the CPU supports is
+ * picked once when the library is loaded.
+ */
+struct simd_ops {
+	const char	*name;
+	bool		(*supported)(void);
+	/* The number of bytes at the start of @a that are in @b, up to a NUL */
+	int		(*prefix)(const char *a, const char *b);
+	/* The number of bytes at the start of @s before a space, quote, '\' or NUL */
+	int		(*plain)(const char *s);
+	/* Like strstr(), where @nlen is the length of @needle */
+	const char	*(*find)(const char *hay, const char *needle, int nlen);
+};
+
+/* What is used, and all the versions built in (ending with NULL) */
+extern const struct simd_ops *simd;
+extern const struct simd_ops *simd_variants[];
+
+static inline int str_prefix(const char *a, const char *b)
+{
+	return simd->prefix(a, b);
+}
+
+static inline int str_plain(const char *s)
+{
+	return simd->plain(s);
+}
+
+/* Like strstr(), returns a pointer into @hay that is not const */
+static inline char *str_find(const char *hay, const char *needle, int nlen)
+{
+	return (char *)simd->find(hay, needle, nlen);
+}
+
+#endif
+
+#line 1 "src/ccli-local.h"
+/* SPDX-License-Identifier: LGPL-2.1 */
+#ifndef __CCLI_LOCAL_H
+#define __CCLI_LOCAL_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <termios.h>
+#include <time.h>
+
+#include "ccli.h"
+
+#define __hidden __attribute__((visibility ("hidden")))
+
+#define ISSPACE(c) isspace((unsigned char)(c))
+
+
+
+/*
+ * The counters of ccli_stats() are plain loads and stores, and not an
+ * atomic add, so that counting costs nothing on the hot path. A count
+ * may be lost when another thread adds to it at the same time.
+ */
+#define stat_read(ccli, field)					\
+	__atomic_load_n(&(ccli)->stats.field, __ATOMIC_RELAXED)
+
+#define stat_add(ccli, field, val)					\
+	__atomic_store_n(&(ccli)->stats.field,				\
+			 __atomic_load_n(&(ccli)->stats.field,		\
+					 __ATOMIC_RELAXED) + (val),	\
+			 __ATOMIC_RELAXED)
+
+/*
+ * Static tracepoints (USDT) for perf, bpftrace and systemtap, under the
+ * provider "libccli". With sys/sdt.h, each one is a single nop until a
+ * tracer attaches to it. Without it, they compile to nothing.
+ *
+ *  command__start(name, argc)	command__end(name, ret)
+ *  completion__start(line)	completion__end(candidates, matched)
+ *  history__search__start()	history__search__end(found)
+ *  redraw(bytes)			input__read(bytes)
+ */
+#ifdef HAVE_SDT
+# include <sys/sdt.h>
+# define trace_probe(name, ...)	STAP_PROBEV(libccli, name, ##__VA_ARGS__)
+#else
+static inline void trace_probe_nop(int x, ...) { }
+# define trace_probe(name, ...)	trace_probe_nop(0, ##__VA_ARGS__)
+#endif
+
+struct pool_block;
+
+/* Per session cache of freed blocks, handed back out before using malloc */
+struct pool {
+	struct ccli		*ccli;
+	struct pool_block	*free;
+	struct ccli_pool_stats	stats;
+};
+
+struct line_buf {
+	char *line;
+	struct pool *pool;	/* Where line came from (NULL for malloc) */
+	int max;	/* Longest the line may get (0 for no limit) */
+	int size;
+	int len;
+	int pos;
+	int start;	/* used for \ newline */
+};
+
+struct arena_chunk;
+
+#define DEFAULT_HISTORY_MAX	256
+#define DEFAULT_PAGE_SCROLL	24
+
+#define READ_BUF		256
+
+#define POOL_MAX_FREE		8
+/* Blocks bigger than this are not kept, so one huge line does not pin it */
+#define POOL_MAX_BLOCK		(16 * 1024)
+
+enum {
+	CHAR_ERROR		= -1,
+	CHAR_INTR		= -2,
+	CHAR_EXIT		= -3,
+	CHAR_IGNORE_END		= -10,
+	CHAR_DEL		= -12,
+	CHAR_UP			= -13,
+	CHAR_DOWN		= -14,
+	CHAR_RIGHT		= -15,
+	CHAR_LEFT		= -16,
+	CHAR_HOME		= -17,
+	CHAR_END		= -18,
+	CHAR_PAGEUP		= -19,
+	CHAR_PAGEDOWN		= -20,
+	CHAR_DELWORD		= -21,
+	CHAR_RIGHT_WORD		= -22,
+	CHAR_LEFT_WORD		= -23,
+	CHAR_IGNORE_START_H	= -24,
+	CHAR_BACKSPACE		= -25,
+	CHAR_REVERSE		= -26,
+	CHAR_IGNORE_START	= -27,
+	CHAR_INSERT		= -28,
+	CHAR_DEL_BEGINNING	= -29,
+	/* CHAR_NEWLINE is to tell line_insert() a "\ and newline" was hit */
+	CHAR_NEWLINE		= -128,
+};
+
+struct command {
+	char			*cmd;
+	ccli_command_callback	callback;
+	ccli_completion		completion;
+	void			*data;
+	int			timeout;	/* In ms, see ccli_set_timeout() */
+};
+
+/*
+ * The registered commands and callbacks. A table is never modified once
+ * it is published in ccli->cmds, see commands.c.
+ */
+struct command_table {
+	struct command_table	*next;	/* On the retired list */
+	char			*dead;	/* A name that newer tables do not have */
+	struct command		enter;
+	struct command		unknown;
+	ccli_completion		default_completion;
+	void			*default_completion_data;
+	ccli_interrupt		interrupt;
+	void			*interrupt_data;
+	int			nr_commands;
+	struct command		commands[];
+};
+
+/* Output from other threads, waiting for the loop to write it */
+struct output {
+	struct output		*next;
+	int			len;
+	char			buf[];
+};
+
+/* A ccli_line_inject() from another thread */
+struct inject {
+	int			pos;
+	char			str[];
+};
+
+/* Output that is collected instead of written out (see watch.c) */
+struct capture {
+	char			*buf;
+	int			len;
+	int			size;
+	bool			failed;		/* Something did not fit in buf */
+};
+
+#define JSON_BUF		1024
+
+/* Builds JSON on the stack, to write it to the output or a capture */
+struct json_writer {
+	struct ccli		*ccli;
+	struct capture		*cap;		/* NULL to write to the output */
+	int			len;
+	int			ret;
+	bool			comma;
+	char			buf[JSON_BUF];
+};
+
+struct watchdog;
+struct recorder;
+struct metrics;
+struct pager;
+
+/* The deadline of an outer command while a nested one executes */
+struct watchdog_save {
+	const char		*cmd;
+	struct timespec		deadline;
+	int			ms;
+	bool			armed;
+	bool			cancelled;
+};
+
+/* The times of one command, see stats.c */
+#define TIMING_BUCKETS		26	/* Under 1us, then a power of 2 of us each */
+#define TIMING_HASH		64
+
+struct timing {
+	struct timing		*next;
+	char			*name;
+	unsigned long		count;
+	unsigned long long	sum_ns;
+	unsigned long long	max_ns;
+	unsigned long		buckets[TIMING_BUCKETS];
+};
+
+struct timings {
+	struct timing		*hash[TIMING_HASH];
+	int			nr;
+	bool			perf;	/* Print the cost of each command */
+};
+
+/* The start of a command that is timed */
+struct timing_save {
+	struct timespec		start;
+	struct ccli_stats	stats;
+};
+
+struct signal_handler {
+	ccli_signal		callback;
+	void			*data;
+};
+
+struct ccli {
+	struct ccli_allocator	allocator;
+	struct ccli_allocator	self_allocator;
+	struct ccli_limits	limits;
+	struct termios		savein;
+	struct termios		saveout;
+	struct line_buf		*line;
+	char			*temp_line;
+	int			temp_size;
+	bool			temp_saved;
+	int			history_max;
+	int			history_size;
+	int			history_start;
+	int			history_bytes;
+	unsigned long		current_line;
+	bool			in_tty;
+	bool			in_completion;
+	int			in;
+	int			out;
+#ifndef CCLI_NO_PAGER
+	int			w_row;
+	struct pager		*pager;
+#endif
+#ifndef CCLI_NO_FILE_COMPLETION
+	int			display_index;
+#endif
+	struct command_table	*cmds;
+	struct command_table	*retired;
+	int			cmd_readers;
+	pthread_mutex_t		cmd_lock;
+	pthread_mutex_t		history_lock;
+	struct output		*output;
+	struct inject		*inject;
+	int			wakefd;
+	pthread_t		loop_thread;
+	bool			looping;
+	bool			at_prompt;
+	struct capture		*capture;
+	struct watchdog		*watchdog;
+#ifndef CCLI_NO_RECORD
+	struct recorder		*recorder;
+#endif
+	struct ccli_stats	stats;
+	struct timings		*timings;
+	struct metrics		*metrics;
+	enum ccli_table_format	table_format;
+	enum ccli_output_mode	output_mode;
+	char			*prompt;
+	char			**history;
+	struct ccli_shared_history *shared;
+	char			*shared_buf;
+	unsigned long		shared_end;
+	char			**comp_list;
+	struct arena_chunk	*comp_arena;
+	struct pool		pools[CCLI_NR_POOLS];
+	int			sigfd;
+	sigset_t		sigmask;
+	sigset_t		sigblocked;
+	struct signal_handler	signals[NSIG];
+	unsigned char		read_start;
+	unsigned char		read_end;
+	char			read_buf[READ_BUF];
+};
+
+extern int execute(struct ccli *ccli, const char *line, bool hist);
+
+extern void clear_line(struct ccli *ccli, struct line_buf *line);
+extern int read_char(struct ccli *ccli);
+
+extern int write_out(struct ccli *ccli, const char *buf, int len);
+extern int read_in(struct ccli *ccli, void *buf, int len);
+extern void echo(struct ccli *ccli, char ch);
+extern int echo_str(struct ccli *ccli, char *str);
+extern void echo_str_len(struct ccli *ccli, char *str, int len);
+extern int print_str(struct ccli *ccli, const char *str, int len);
+extern int queue_str(struct ccli *ccli, const char *str, int len);
+extern void output_flush(struct ccli *ccli);
+extern bool other_thread(struct ccli *ccli);
+extern void echo_prompt(struct ccli *ccli);
+
+extern struct command *find_command(struct command_table *cmds, const char *cmd);
+extern struct command_table *commands_get(struct ccli *ccli);
+extern void commands_put(struct ccli *ccli);
+extern struct command_table *commands_copy(struct ccli *ccli, int extra);
+extern void commands_publish(struct ccli *ccli, struct command_table *cmds,
+			     char *dead);
+extern int commands_init(struct ccli *ccli);
+extern void commands_free(struct ccli *ccli);
+
+extern bool check_for_ctrl_c(struct ccli *ccli);
+#ifndef CCLI_NO_PAGER
+extern char page_stop(struct ccli *ccli);
+extern int pager_add(struct ccli *ccli, const char *str, int len);
+extern void pager_free(struct ccli *ccli);
+
+/* Between ccli_pager_start() and ccli_pager_stop() */
+static inline bool paging(struct ccli *ccli)
+{
+	return ccli->pager != NULL;
+}
+#else
+/* Without the pager, answer "continue without paging" */
+static inline char page_stop(struct ccli *ccli) { return 'c'; }
+static inline int pager_add(struct ccli *ccli, const char *str, int len) { return len; }
+static inline void pager_free(struct ccli *ccli) { }
+static inline bool paging(struct ccli *ccli) { return false; }
+#endif
+
+extern void line_refresh(struct ccli *ccli, struct line_buf *line, int pad);
+extern void line_refresh_tail(struct ccli *ccli, struct line_buf *line,
+			      int from, int pad);
+
+extern void get_global_allocator(struct ccli_allocator *allocator);
+extern int region_init(struct ccli_allocator *allocator, void *mem, size_t size);
+extern void *mem_alloc(struct ccli *ccli, size_t size);
+extern void *mem_zalloc(struct ccli *ccli, size_t size);
+extern void *mem_realloc(struct ccli *ccli, void *ptr, size_t size);
+extern void mem_free(struct ccli *ccli, void *ptr);
+extern char *mem_strdup(struct ccli *ccli, const char *str);
+extern int mem_vasprintf(struct ccli *ccli, char **strp, const char *fmt, va_list ap);
+__attribute__((__format__(printf, 3, 4)))
+extern int mem_asprintf(struct ccli *ccli, char **strp, const char *fmt, ...);
+
+extern void *pool_alloc(struct pool *pool, size_t size);
+extern void *pool_zalloc(struct pool *pool, size_t size);
+extern void *pool_realloc(struct pool *pool, void *ptr, size_t size);
+extern size_t pool_size(void *ptr);
+extern void pool_free(struct pool *pool, void *ptr);
+extern void pool_destroy(struct pool *pool);
+
+extern int line_init(struct line_buf *line, struct pool *pool);
+extern int line_init_str(struct line_buf *line, const char *str,
+			 struct pool *pool);
+extern void line_reset(struct line_buf *line);
+extern void line_cleanup(struct line_buf *line);
+extern int line_insert(struct line_buf *line, char ch);
+extern bool line_state_escaped(struct line_buf *line);
+extern void line_right(struct line_buf *line);
+extern void line_left(struct line_buf *line);
+extern void line_right_word(struct line_buf *line);
+extern void line_left_word(struct line_buf *line);
+extern void line_home(struct line_buf *line);
+extern void line_end(struct line_buf *line);
+extern void line_backspace(struct line_buf *line);
+extern void line_del(struct line_buf *line);
+extern int line_del_word(struct line_buf *line);
+extern int line_del_beginning(struct line_buf *line);
+extern int line_copy(struct line_buf *dst, struct line_buf *src, int len);
+extern int line_parse(struct ccli *ccli, const char *line, char ***pargv);
+extern const char *line_word(const char *line, int n);
+extern void line_argv_free(struct ccli *ccli, char **argv);
+extern void line_replace(struct line_buf *line, char *str);
+
+extern size_t ring_buf_size(struct ccli_shared_history *hist);
+extern int ring_size(struct ccli_shared_history *hist);
+extern unsigned long ring_head(struct ccli_shared_history *hist);
+extern int ring_add(struct ccli_shared_history *hist, const char *line);
+extern char *ring_get(struct ccli_shared_history *hist, unsigned long seq,
+		      char *buf);
+
+extern int history_add(struct ccli *ccli, const char *line);
+extern int history_up(struct ccli *ccli, struct line_buf *line, int cnt);
+extern int history_down(struct ccli *ccli, struct line_buf *line, int cnt);
+extern int history_search(struct ccli *ccli, struct line_buf *line, int *pad);
+
+extern void free_argv(int argc, char **argv);
+
+extern int signal_handle(struct ccli *ccli);
+extern void signal_block(struct ccli *ccli);
+extern void signal_unblock(struct ccli *ccli);
+extern void signal_cleanup(struct ccli *ccli);
+
+extern bool watchdog_arm(struct ccli *ccli, const char *cmd, int ms,
+			 struct watchdog_save *save);
+extern void watchdog_disarm(struct ccli *ccli, struct watchdog_save *save);
+extern void watchdog_free(struct ccli *ccli);
+
+#ifndef CCLI_NO_RECORD
+static inline bool recording(struct ccli *ccli) { return ccli->recorder; }
+extern void record_input(struct ccli *ccli, const void *data, int size);
+extern void record_env_start(struct ccli *ccli);
+extern void record_env_stop(struct ccli *ccli);
+#else
+static inline bool recording(struct ccli *ccli) { return false; }
+static inline void record_input(struct ccli *ccli, const void *data, int size) { }
+static inline void record_env_start(struct ccli *ccli) { }
+static inline void record_env_stop(struct ccli *ccli) { }
+#endif
+
+extern void timing_start(struct ccli *ccli, struct timing_save *save);
+extern void timing_end(struct ccli *ccli, const char *name,
+		       struct timing_save *save);
+extern int timings_init(struct ccli *ccli);
+extern void timings_free(struct ccli *ccli);
+
+extern int metrics_fd(struct ccli *ccli);
+extern void metrics_handle(struct ccli *ccli);
+extern void metrics_free(struct ccli *ccli);
+
+extern int capture_add(struct ccli *ccli, struct capture *cap,
+		       const char *str, int len);
+
+extern void json_init(struct json_writer *w, struct ccli *ccli,
+		      struct capture *cap);
+extern int json_flush(struct json_writer *w);
+extern void json_raw(struct json_writer *w, const char *str, int len);
+extern void json_string(struct json_writer *w, const char *str);
+extern bool json_number(const char *str);
+extern void json_begin(struct json_writer *w);
+extern void json_end(struct json_writer *w);
+extern void json_key(struct json_writer *w, const char *key);
+extern void json_value(struct json_writer *w, const char *str);
+
+extern void do_completion(struct ccli *ccli, struct line_buf *line, int tab);
+
+#endif
+
+#line 1 "src/ccli.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * CLI interface for C.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <dirent.h>
+
+
+
+//#define DEBUG
+#ifdef DEBUG
+#define dprint printf
+#else
+#define dprint(x...)
+#endif
+
+static void cleanup(struct ccli *ccli)
+{
+	tcsetattr(ccli->in, TCSANOW, &ccli->savein);
+	tcsetattr(ccli->out, TCSANOW, &ccli->saveout);
+}
+
+/**
+ * ccli_console_release - Put back the console
+ * @ccli: The CLI descriptor to put back
+ *
+ * Call this to put back the ccli input/output file handles
+ * back to what it was originally.
+ *
+ * This can be used for when the command is forked, and the
+ * child needs the original terminal. The ccli_console_release()
+ * is called, and when done, ccli_console_acquire() puts it
+ * back for ccli processing.
+ *
+ * This also unblocks the signals that were blocked by
+ * ccli_register_signal().
+ */
+void ccli_console_release(struct ccli *ccli)
+{
+	if (!ccli)
+		return;
+	cleanup(ccli);
+	signal_unblock(ccli);
+}
+
+/**
+ * ccli_console_acquire - Set the console back to be used by ccli
+ * @ccli: The CLI descriptor to set
+ *
+ * Call this to set the console back for ccli to process.
+ * This is usually called after a ccli_console_release().
+ *
+ * This can be used for when the command is forked, and the
+ * child needs the original terminal. The ccli_console_release()
+ * is called, and when done, ccli_console_acquire() puts it
+ * back for ccli processing.
+ *
+ * This also blocks the signals registered with ccli_register_signal()
+ * again.
+ */
+void ccli_console_acquire(struct ccli *ccli)
+{
+	struct termios ttyin;
+
+	memset(&ttyin, 0, sizeof(ccli->savein));
+	tcgetattr(ccli->in, &ttyin);
+	ttyin.c_lflag &= ~ICANON;
+	ttyin.c_lflag &= ~(ECHO | ECHONL | ISIG);
+	tcsetattr(ccli->in, TCSANOW, (void*)&ttyin);
+
+	signal_block(ccli);
+}
+
+static void inc_read_buf_start(struct ccli *ccli)
+{
+	if (ccli->read_start == READ_BUF - 1)
+		ccli->read_start = 0;
+	else
+		ccli->read_start++;
+}
+
+static void inc_read_buf_end(struct ccli *ccli)
+{
+	if (ccli->read_end == READ_BUF - 1)
+		ccli->read_end = 0;
+	else
+		ccli->read_end++;
+}
+
+static bool read_buf_empty(struct ccli *ccli)
+{
+	return ccli->read_start == ccli->read_end;
+}
+
+static bool read_buf_full(struct ccli *ccli)
+{
+	if (ccli->read_start)
+		return ccli->read_end + 1 == ccli->read_start;
+	return ccli->read_end == READ_BUF - 1;
+}
+
+/* All writes to the output and reads from the input go through these */
+__hidden int write_out(struct ccli *ccli, const char *buf, int len)
+{
+	int ret;
+
+	ret = write(ccli->out, buf, len);
+	stat_add(ccli, writes, 1);
+	if (ret > 0)
+		stat_add(ccli, bytes_written, ret);
+	return ret;
+}
+
+__hidden int read_in(struct ccli *ccli, void *buf, int len)
+{
+	int ret;
+
+	ret = read(ccli->in, buf, len);
+	stat_add(ccli, reads, 1);
+	if (ret > 0) {
+		stat_add(ccli, bytes_read, ret);
+		if (recording(ccli))
+			record_input(ccli, buf, ret);
+	}
+	trace_probe(input__read, ret);
+	return ret;
+}
+
+__hidden void echo(struct ccli *ccli, char ch)
+{
+	echo_str_len(ccli, &ch, 1);
+}
+
+__hidden int echo_str(struct ccli *ccli, char *str)
+{
+	int len = strlen(str);
+
+	if (ccli->capture)
+		return capture_add(ccli, ccli->capture, str, len);
+
+	if (paging(ccli))
+		return pager_add(ccli, str, len);
+
+	return write_out(ccli, str, len);
+}
+
+__hidden void echo_str_len(struct ccli *ccli, char *str, int len)
+{
+	if (ccli->capture)
+		capture_add(ccli, ccli->capture, str, len);
+	else if (paging(ccli))
+		pager_add(ccli, str, len);
+	else
+		write_out(ccli, str, len);
+}
+
+__hidden void echo_prompt(struct ccli *ccli)
+{
+	if (!ccli->prompt)
+		return;
+
+	echo_str(ccli, ccli->prompt);
+}
+
+__hidden void clear_line(struct ccli *ccli, struct line_buf *line)
+{
+	int len;
+	int i;
+
+	echo(ccli, '\r');
+
+	len = line->len;
+	if (ccli->prompt)
+		len += strlen(ccli->prompt);
+
+	for (i = 0; i < len; i++)
+		echo(ccli, ' ');
+}
+
+/*
+ * Other threads may call ccli_printf() and ccli_line_inject() while
+ * ccli_loop() is running. They can not write to the output themselves,
+ * as that would mix with what the loop is echoing, and they can not
+ * touch the line being edited. Instead, the output is pushed onto a
+ * lock-free stack, and an inject replaces the one pending request.
+ * Then the loop is woken up through the wakefd eventfd, and it writes
+ * out the output and injects the string itself.
+ */
+
+/* True if called from a thread other than the one running ccli_loop() */
+__hidden bool other_thread(struct ccli *ccli)
+{
+	return __atomic_load_n(&ccli->looping, __ATOMIC_SEQ_CST) &&
+		!pthread_equal(ccli->loop_thread, pthread_self());
+}
+
+static void wake_loop(struct ccli *ccli)
+{
+	uint64_t val = 1;
+
+	write(ccli->wakefd, &val, sizeof(val));
+}
+
+/* Write out what other threads printed, oldest first */
+__hidden void output_flush(struct ccli *ccli)
+{
+	struct output *list;
+	struct output *next;
+	struct output *rev = NULL;
+
+	if (!__atomic_load_n(&ccli->output, __ATOMIC_RELAXED))
+		return;
+
+	list = __atomic_exchange_n(&ccli->output, NULL, __ATOMIC_SEQ_CST);
+
+	/* The stack has the newest first */
+	for (; list; list = next) {
+		next = list->next;
+		list->next = rev;
+		rev = list;
+	}
+
+	for (; rev; rev = next) {
+		next = rev->next;
+		echo_str_len(ccli, rev->buf, rev->len);
+		mem_free(ccli, rev);
+	}
+}
+
+static void output_add(struct ccli *ccli, struct output *out)
+{
+	out->next = __atomic_load_n(&ccli->output, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&ccli->output, &out->next, out,
+					    true, __ATOMIC_SEQ_CST,
+					    __ATOMIC_RELAXED))
+		;
+
+	wake_loop(ccli);
+}
+
+static void output_push(struct ccli *ccli, struct output *out)
+{
+	output_add(ccli, out);
+
+	/* The loop may have exited before it could see it */
+	if (!__atomic_load_n(&ccli->looping, __ATOMIC_SEQ_CST))
+		output_flush(ccli);
+}
+
+static void output_free(struct ccli *ccli)
+{
+	struct output *next;
+	struct output *out;
+
+	for (out = ccli->output; out; out = next) {
+		next = out->next;
+		mem_free(ccli, out);
+	}
+	ccli->output = NULL;
+}
+
+static int inject_str(struct line_buf *line, const char *str, int pos)
+{
+	int ret = 0;
+	int i;
+
+	if (pos >= 0)
+		line->pos = pos > line->len ? line->len : pos;
+
+	for (i = 0; i < strlen(str); i++)
+		ret |= line_insert(line, str[i]);
+
+	return ret;
+}
+
+static int inject_request(struct ccli *ccli, const char *str, int pos)
+{
+	struct inject *inject;
+	struct inject *old;
+	int len = strlen(str);
+
+	inject = mem_alloc(ccli, sizeof(*inject) + len + 1);
+	if (!inject)
+		return -1;
+
+	inject->pos = pos;
+	memcpy(inject->str, str, len + 1);
+
+	/* A request that the loop did not get to yet is replaced */
+	old = __atomic_exchange_n(&ccli->inject, inject, __ATOMIC_ACQ_REL);
+	mem_free(ccli, old);
+
+	wake_loop(ccli);
+	return 0;
+}
+
+/* Do what other threads asked for while the loop waits at the prompt */
+static void handle_requests(struct ccli *ccli)
+{
+	struct line_buf *line = ccli->line;
+	struct inject *inject = NULL;
+	bool output;
+
+	output = __atomic_load_n(&ccli->output, __ATOMIC_RELAXED) != NULL;
+	if (__atomic_load_n(&ccli->inject, __ATOMIC_RELAXED))
+		inject = __atomic_exchange_n(&ccli->inject, NULL, __ATOMIC_ACQUIRE);
+
+	if (!output && !inject)
+		return;
+
+	/* Print the output where the line is, and then show the line again */
+	if (output) {
+		clear_line(ccli, line);
+		echo(ccli, '\r');
+		output_flush(ccli);
+	}
+
+	if (inject) {
+		inject_str(line, inject->str, inject->pos);
+		mem_free(ccli, inject);
+	}
+
+	line_refresh(ccli, line, 0);
+}
+
+/*
+ * Wait for input, while handling signals and the requests of other
+ * threads. Returns 0 when there is input to read, 1 if a signal
+ * callback asked to exit, and -1 on error.
+ */
+static int wait_input(struct ccli *ccli)
+{
+	struct pollfd fds[4];
+	uint64_t val;
+	int nr;
+	int ret;
+
+	for (;;) {
+		if (ccli->at_prompt)
+			handle_requests(ccli);
+		else
+			output_flush(ccli);
+
+		fds[0].fd = ccli->in;
+		fds[0].events = POLLIN;
+		fds[1].fd = ccli->wakefd;
+		fds[1].events = POLLIN;
+		fds[2].fd = ccli->sigfd;
+		fds[2].events = POLLIN;
+		fds[3].fd = metrics_fd(ccli);
+		fds[3].events = POLLIN;
+		/* poll() skips the negative ones */
+		nr = fds[3].fd >= 0 ? 4 : ccli->sigfd >= 0 ? 3 : 2;
+
+		ret = poll(fds, nr, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (nr > 2 && (fds[2].revents & POLLIN)) {
+			if (signal_handle(ccli))
+				return 1;
+		}
+
+		if (nr > 3 && (fds[3].revents & POLLIN))
+			metrics_handle(ccli);
+
+		/* Handle the requests before reading more input */
+		if (fds[1].revents & POLLIN) {
+			read(ccli->wakefd, &val, sizeof(val));
+			continue;
+		}
+
+		/* Let read() report hang ups and errors */
+		if (fds[0].revents)
+			return 0;
+	}
+}
+
+__hidden int read_char(struct ccli *ccli)
+{
+	bool bracket = false;
+	bool semi = false;
+	bool five = false;
+	bool esc = false;
+	unsigned char ch;
+	int num = 0;
+	int r;
+
+	for (;;) {
+		if (!read_buf_empty(ccli)) {
+			ch = ccli->read_buf[ccli->read_start];
+			inc_read_buf_start(ccli);
+		} else {
+			r = wait_input(ccli);
+			if (r)
+				return r > 0 ? CHAR_EXIT : CHAR_ERROR;
+			r = read_in(ccli, &ch, 1);
+			if (r <= 0)
+				return CHAR_ERROR;
+		}
+
+		switch (ch) {
+		case 3: /* ETX */
+			return CHAR_INTR;
+		case 18: /* DC2 */
+			return CHAR_REVERSE;
+		case 21: /* Ctrl^u */
+			return CHAR_DEL_BEGINNING;
+		case 27: /* ESC */
+			esc = true;
+			break;
+		case 127: /* DEL */
+			if (esc)
+				return CHAR_DELWORD;
+			return CHAR_BACKSPACE;
+		default:
+			if (esc) {
+				esc = false;
+				if (ch != '[') {
+					dprint("unknown esc char %c (%d)\n", ch, ch);
+					break;
+				}
+				bracket = true;
+				break;
+			}
+			if (bracket) {
+				bracket = false;
+				switch (ch) {
+				case 'A':
+					return CHAR_UP;
+				case 'B':
+					return CHAR_DOWN;
+				case 'C':
+					return CHAR_RIGHT;
+				case 'D':
+					return CHAR_LEFT;
+				case 'H':
+					return CHAR_HOME;
+				case 'F':
+					return CHAR_END;
+				case '1':
+				case '2':
+				case '3':
+				case '4':
+				case '5':
+				case '6':
+					num = ch - '0';
+					break;
+				default:
+					dprint("unknown bracket %c (%d)\n", ch, ch);
+					break;
+				}
+				break;
+			}
+			if (num) {
+				switch (ch) {
+				case '~':
+					break;
+				case ';':
+					num = 0;
+					semi = true;
+					break;
+				default:
+					dprint("unknown num=%d %c (%d)\n", num, ch, ch);
+					num = 0;
+					break;
+				}
+				switch (num) {
+				case 1:
+					return CHAR_HOME;
+				case 2:
+					return CHAR_INSERT;
+				case 3:
+					return CHAR_DEL;
+				case 4:
+					return CHAR_END;
+				case 5:
+					return CHAR_PAGEUP;
+				case 6:
+					return CHAR_PAGEDOWN;
+				default:
+					break;
+				}
+				num = 0;
+				break;
+			}
+			if (semi) {
+				if (ch != '5') {
+					dprint("Unknown semi %c (%d)\n", ch, ch);
+					break;
+				}
+				semi = false;
+				five = true;
+				break;
+			}
+			if (five){
+				switch (ch) {
+				case 'C':
+					return CHAR_RIGHT_WORD;
+				case 'D':
+					return CHAR_LEFT_WORD;
+				default:
+					dprint("Unknown five %c (%d)\n", ch, ch);
+				}
+				five = false;
+			}
+
+			if (isprint(ch) || isspace(ch))
+				return ch;
+
+			dprint("unknown char '%d'\n", ch);
+			return ch;
+		}
+	}
+}
+
+/**
+ * ccli_getchar - read a character from ccli stdin
+ * @ccli: The command line descriptor to read from
+ *
+ * Reads a character from ccli->in. Note, it will only return printable
+ * characters, -1 on error or EOF and zero on Ctrl^C.
+ *
+ * Returns the printable input from the user or 0 on Ctrl^C or -1
+ *   on error or EOL.
+ */
+int ccli_getchar(struct ccli *ccli)
+{
+	int r;
+
+	for (;;) {
+		r = read_char(ccli);
+		switch (r) {
+		case CHAR_INTR:
+			return 0;
+		case CHAR_IGNORE_START ... CHAR_IGNORE_END:
+			continue;
+		default:
+			if (r < 0)
+				return -1;
+		}
+		break;
+	}
+
+	return r;
+}
+
+static int unknown_default(struct ccli *ccli, const char *command,
+			   const char *line, void *data,
+			   int argc, char **argv)
+{
+	echo_str(ccli, "Command not found: ");
+	echo_str(ccli, argv[0]);
+	echo(ccli, '\n');
+	return 0;
+}
+
+static int enter_default(struct ccli *ccli, const char *command,
+			 const char *line, void *data,
+			 int argc, char **argv)
+{
+	return 0;
+}
+
+static int exec_exit(struct ccli *ccli, const char *command,
+		     const char *line, void *data,
+		     int argc, char **argv)
+{
+	ccli_printf(ccli, "Exiting\n");
+	return 1;
+}
+
+static int interrupt_default(struct ccli *ccli, const char *line,
+			     int pos, void *data)
+{
+	echo_str(ccli, "^C\n");
+	return 1;
+}
+
+static struct ccli *alloc_ccli(const char *prompt, int in, int out,
+			       const struct ccli_allocator *allocator,
+			       const struct ccli_limits *limits)
+{
+	struct ccli *ccli;
+	int i;
+
+	ccli = allocator->malloc(sizeof(*ccli), allocator->data);
+	if (!ccli)
+		return NULL;
+
+	memset(ccli, 0, sizeof(*ccli));
+
+	ccli->allocator = *allocator;
+	ccli->self_allocator = *allocator;
+
+	if (limits)
+		ccli->limits = *limits;
+
+	for (i = 0; i < CCLI_NR_POOLS; i++)
+		ccli->pools[i].ccli = ccli;
+
+	pthread_mutex_init(&ccli->cmd_lock, NULL);
+	pthread_mutex_init(&ccli->history_lock, NULL);
+
+	ccli->sigfd = -1;
+	sigemptyset(&ccli->sigmask);
+	sigemptyset(&ccli->sigblocked);
+
+	ccli->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ccli->wakefd < 0)
+		goto free;
+
+	if (commands_init(ccli) < 0)
+		goto free;
+
+	if (prompt) {
+		ccli->prompt = mem_strdup(ccli, prompt);
+		if (!ccli->prompt)
+			goto free;
+	}
+
+	ccli->in = in;
+	ccli->out = out;
+	ccli->in_tty = isatty(in);
+
+	ccli->history_max = DEFAULT_HISTORY_MAX;
+
+	memset(&ccli->savein, 0, sizeof(ccli->savein));
+	memset(&ccli->saveout, 0, sizeof(ccli->saveout));
+
+	tcgetattr(STDIN_FILENO, &ccli->savein);
+	tcgetattr(STDOUT_FILENO, &ccli->saveout);
+
+	ccli_console_acquire(ccli);
+
+	/* Nothing else can see the commands yet */
+	ccli->cmds->unknown.callback = unknown_default;
+	ccli->cmds->enter.callback = enter_default;
+	ccli->cmds->interrupt = interrupt_default;
+	ccli_register_command(ccli, "exit", exec_exit, NULL);
+
+	return ccli;
+
+ free:
+	ccli_free(ccli);
+	return NULL;
+}
+
+/**
+ * ccli_alloc - Allocate a new ccli descriptor.
+ * @prompt: The prompt to display (NULL for none)
+ * @in: The input file descriptor.
+ * @out: The output file descriptor.
+ *
+ * Allocates the comand line interface descriptor, taking
+ * over control of the @in and @out file descriptors.
+ *
+ * Returns the allocated descriptor on success (must be freed with
+ *   ccli_free(), and NULL on error.
+ */
+struct ccli *ccli_alloc(const char *prompt, int in, int out)
+{
+	struct ccli_allocator allocator;
+
+	/* The descriptor gets its own copy of the global allocator */
+	get_global_allocator(&allocator);
+
+	return alloc_ccli(prompt, in, out, &allocator, NULL);
+}
+
+/**
+ * ccli_alloc_static - Allocate a ccli descriptor that never uses the heap
+ * @prompt: The prompt to display (NULL for none)
+ * @in: The input file descriptor.
+ * @out: The output file descriptor.
+ * @mem: The memory to use for everything the descriptor allocates
+ * @size: The size of @mem
+ * @limits: Limits on what the descriptor may hold (NULL for none)
+ *
+ * Like ccli_alloc(), but the descriptor itself and everything it
+ * allocates afterward comes out of @mem. Nothing is allocated from
+ * the heap. When @mem runs out, the operation that needed the memory
+ * fails with ENOMEM.
+ *
+ * The @limits bound how much of @mem can be used, so that running
+ * out of memory can be made impossible. A field that is zero has
+ * no limit.
+ *
+ *  line_max - The longest line that can be typed, or executed by
+ *             ccli_execute(). Going past it fails with E2BIG.
+ *  history_bytes - The most bytes of text kept in the history. The
+ *             oldest lines are dropped to make room for new ones.
+ *             A line longer than this is not added (ENOSPC).
+ *  commands_max - The most commands that can be registered, which
+ *             includes the builtin "exit" command (ENOSPC).
+ *  completions_max - The most words a completion list can hold.
+ *             Words added past it are dropped (ENOSPC).
+ *
+ * @mem must stay around until after ccli_free() is called on the
+ * returned descriptor.
+ *
+ * Returns the allocated descriptor on success (must be freed with
+ *   ccli_free(), and NULL on error.
+ */
+struct ccli *ccli_alloc_static(const char *prompt, int in, int out,
+			       void *mem, size_t size,
+			       const struct ccli_limits *limits)
+{
+	struct ccli_allocator allocator;
+
+	if (!mem) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (region_init(&allocator, mem, size) < 0)
+		return NULL;
+
+	return alloc_ccli(prompt, in, out, &allocator, limits);
+}
+
+/**
+ * ccli_free - Free an allocated ccli descriptor.
+ * @ccli: The descriptor to free.
+ *
+ * Free the @ccli descriptor created with ccli_alloc().
+ */
+void ccli_free(struct ccli *ccli)
+{
+	struct ccli_allocator *a;
+	int i;
+
+	if (!ccli)
+		return;
+
+	cleanup(ccli);
+	signal_cleanup(ccli);
+	watchdog_free(ccli);
+	metrics_free(ccli);
+	timings_free(ccli);
+	pager_free(ccli);
+	if (recording(ccli))
+		ccli_record_stop(ccli);
+
+	mem_free(ccli, ccli->prompt);
+
+	commands_free(ccli);
+
+	for (i = 0; i < ccli->history_size && i < ccli->history_max; i++)
+		mem_free(ccli, ccli->history[i]);
+	mem_free(ccli, ccli->history);
+
+	mem_free(ccli, ccli->temp_line);
+	mem_free(ccli, ccli->shared_buf);
+
+	output_free(ccli);
+	mem_free(ccli, ccli->inject);
+	if (ccli->wakefd >= 0)
+		close(ccli->wakefd);
+
+	pthread_mutex_destroy(&ccli->cmd_lock);
+	pthread_mutex_destroy(&ccli->history_lock);
+
+	for (i = 0; i < CCLI_NR_POOLS; i++)
+		pool_destroy(&ccli->pools[i]);
+
+	a = &ccli->self_allocator;
+	a->free(ccli, a->data);
+}
+
+/**
+ * ccli_in - return the input file descriptor.
+ * @ccli: The CLI descriptor to get the input file descriptor from.
+ *
+ * Returns the file descriptor for @ccli that was given as the
+ *   input in ccli_alloc();
+ */
+int ccli_in(struct ccli *ccli)
+{
+	return ccli->in;
+}
+
+/**
+ * ccli_out - return the output file descriptor.
+ * @ccli: The CLI descriptor to get the output file descriptor from.
+ *
+ * Returns the file descriptor for @ccli that was given as the
+ *   output in ccli_alloc();
+ */
+int ccli_out(struct ccli *ccli)
+{
+	return ccli->out;
+}
+
+/**
+ * ccli_vprintf - Write to the output descriptor of ccli
+ * @ccli: The CLI descriptor to write to.
+ * @fmt: A printf() like format to write.
+ * @ap: The argument list
+ *
+ * Writes to the output descriptor of @ccli the content passed in.
+ *
+ * This may be called from any thread. If another thread is running
+ * ccli_loop(), then the output is handed to the loop to write out
+ * above the line being entered, and this returns without waiting
+ * for it to be written.
+ *
+ * Returns the number of characters written on success, and
+ *   -1 on error.
+ */
+int ccli_vprintf(struct ccli *ccli, const char *fmt, va_list ap)
+{
+	struct output *out = NULL;
+	va_list ap2;
+	int len;
+
+	va_copy(ap2, ap);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	if (len > 0) {
+		out = mem_alloc(ccli, sizeof(*out) + len + 1);
+		if (out)
+			len = vsnprintf(out->buf, len + 1, fmt, ap2);
+		else
+			len = -1;
+	}
+	va_end(ap2);
+
+	if (len <= 0) {
+		mem_free(ccli, out);
+		return len;
+	}
+
+	out->len = len;
+
+	if (other_thread(ccli)) {
+		output_push(ccli, out);
+		return len;
+	}
+
+	/* Keep what other threads printed before this in order */
+	if (!ccli->capture)
+		output_flush(ccli);
+
+	echo_str_len(ccli, out->buf, len);
+	mem_free(ccli, out);
+
+	return len;
+}
+
+/* Write @str like ccli_printf() does, without formatting it */
+__hidden int print_str(struct ccli *ccli, const char *str, int len)
+{
+	struct output *out;
+
+	if (len <= 0)
+		return len;
+
+	if (other_thread(ccli)) {
+		out = mem_alloc(ccli, sizeof(*out) + len);
+		if (!out)
+			return -1;
+		memcpy(out->buf, str, len);
+		out->len = len;
+		output_push(ccli, out);
+		return len;
+	}
+
+	if (!ccli->capture)
+		output_flush(ccli);
+
+	echo_str_len(ccli, (char *)str, len);
+
+	return len;
+}
+
+/*
+ * Queue @str for the thread that executes commands to write, even if it
+ * is not running ccli_loop(), as the watchdog must never write while the
+ * command it warns about may be writing.
+ */
+__hidden int queue_str(struct ccli *ccli, const char *str, int len)
+{
+	struct output *out;
+
+	out = mem_alloc(ccli, sizeof(*out) + len);
+	if (!out)
+		return -1;
+	memcpy(out->buf, str, len);
+	out->len = len;
+	output_add(ccli, out);
+
+	return len;
+}
+
+/**
+ * ccli_printf - Write to the output descriptor of ccli
+ * @ccli: The CLI descriptor to write to.
+ * @fmt: A printf() like format to write.
+ *
+ * Writes to the output descriptor of @ccli the content passed in.
+ *
+ * Returns the number of characters written on success, and
+ *   -1 on error.
+ */
+int ccli_printf(struct ccli *ccli, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = ccli_vprintf(ccli, fmt, ap);
+	va_end(ap);
+
+	return len;
+}
+
+#define NR_STATS	(sizeof(struct ccli_stats) / sizeof(unsigned long))
+
+/**
+ * ccli_stats - read the counters of a ccli descriptor
+ * @ccli: The CLI descriptor to read the counters of
+ * @stats: Where to store the counters
+ *
+ * Each descriptor counts the read() and write() calls it makes on its
+ * input and output along with the bytes they transferred, the times it
+ * redrew the line being entered, the allocations it made, and the
+ * completions and history searches that were done. This is cheap enough
+ * to always be on, and is meant to see what a change to how the line is
+ * drawn does on real terminals.
+ *
+ * This may be called from any thread, but the counters are not read
+ * all at once, and may be a little behind what another thread does.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_stats(struct ccli *ccli, struct ccli_stats *stats)
+{
+	unsigned long *src;
+	unsigned long *dst;
+	int i;
+
+	if (!ccli || !stats) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	src = (unsigned long *)&ccli->stats;
+	dst = (unsigned long *)stats;
+
+	for (i = 0; i < NR_STATS; i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/**
+ * ccli_stats_reset - zero the counters of a ccli descriptor
+ * @ccli: The CLI descriptor to zero the counters of
+ *
+ * Set all the counters that ccli_stats() reads back to zero.
+ */
+void ccli_stats_reset(struct ccli *ccli)
+{
+	unsigned long *cnt;
+	int i;
+
+	if (!ccli)
+		return;
+
+	cnt = (unsigned long *)&ccli->stats;
+
+	for (i = 0; i < NR_STATS; i++)
+		__atomic_store_n(&cnt[i], 0, __ATOMIC_RELAXED);
+}
+
+#ifndef CCLI_NO_PAGER
+__hidden char page_stop(struct ccli *ccli)
+{
+	char ans;
+
+	echo_str(ccli, "--Type <RET> for more, q to quit, c to continue without paging--");
+	read_in(ccli, &ans, 1);
+	echo(ccli, '\n');
+	return ans;
+}
+
+/*
+ * Stop at every window full of lines of ccli_page(). Returns the line
+ * count to continue with, or -1 if the user asked to quit.
+ */
+static int page_next(struct ccli *ccli, int line)
+{
+	struct winsize w;
+	int ret;
+
+	/* The pager of ccli_pager_start() does the paging */
+	if (paging(ccli))
+		return line;
+
+	if (line == 1 || !ccli->w_row) {
+		ret = ioctl(ccli->in, TIOCGWINSZ, &w);
+		if (ret < 0)
+			return 0;
+		ccli->w_row = w.ws_row;
+		if (line == 1)
+			return line;
+	}
+
+	if (!(line % ccli->w_row)) {
+		switch (page_stop(ccli)) {
+		case 'q':
+			return -1;
+		case 'c':
+			return 0;
+		}
+	}
+	return line;
+}
+#else
+/* Built with CCLI_NO_PAGER: ccli_page() never stops */
+static int page_next(struct ccli *ccli, int line)
+{
+	return line;
+}
+#endif
+
+__hidden bool check_for_ctrl_c(struct ccli *ccli)
+{
+	struct timeval tv;
+	fd_set rfds;
+	char ch;
+	int ret;
+
+	memset(&tv, 0, sizeof(tv));
+	FD_ZERO(&rfds);
+	FD_SET(ccli->in, &rfds);
+	if (select(ccli->in + 1, &rfds, NULL, NULL, &tv) > 0) {
+		ret = read_in(ccli, &ch, 1);
+		if (ret == 1) {
+			if (ch == 3)
+				return true;
+			if (!read_buf_full(ccli)) {
+				ccli->read_buf[ccli->read_end] = ch;
+				inc_read_buf_end(ccli);
+			}
+		}
+	}
+	return false;
+}
+
+/**
+ * ccli_page - Write to the output descriptor of ccli and prompt at window size
+ * @ccli: The CLI descriptor to write to.
+ * @line: The current line count
+ * @fmt: A printf() like format to write.
+ *
+ * Just like ccli_printf() which rites to the output descriptor of @ccli
+ * the content passed in, but this will also stop to ask the user to
+ * read more, quit or continue when the amount reaches the size of
+ * the window.
+ *
+ * When @line matches the window size, the prompt will be displayed.
+ * Note, the window size is only calculated when @line is zero.
+ *
+ * If @line is less than zero, no prompt will be displayed. Nor is it
+ * between ccli_pager_start() and ccli_pager_stop(), as the pager does
+ * the paging.
+ *
+ * Return -1 on error (with ERRNO set) or if the user asks to quit.
+ *         1 for another screen full.
+ *         0 to not stop.
+
+ */
+int ccli_page(struct ccli *ccli, int line, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	switch (line) {
+	case 0:
+		if (check_for_ctrl_c(ccli))
+			return -1;
+		break;
+	default:
+		if (line < 0)
+			return line;
+		line = page_next(ccli, line);
+		if (line < 0)
+			return -1;
+	}
+
+	va_start(ap, fmt);
+	len = ccli_vprintf(ccli, fmt, ap);
+	va_end(ap);
+
+	return len >= 0 ? line > 0 ? line + 1 : line : len;
+}
+
+/**
+ * ccli_line_clear - clear the internal line
+ * ccli: The CLI desciptor to clear the command line for.
+ *
+ * This will clear out the internal contents stored for the command.
+ * Note, it does not affect what the user is displayed.
+ * This is useful for the interrupt callback to clear the line if
+ * need be.
+ */
+void ccli_line_clear(struct ccli *ccli)
+{
+	if (!ccli || !ccli->line)
+		return;
+
+	line_reset(ccli->line);
+}
+
+/**
+ * ccli_line_inject - Inject content into the command line at pos.
+ * @ccli: The CLI descriptor to inject content into.
+ * @str: The string to inject.
+ * @pos: The position to inject the line into.
+ *
+ * This injects content into the internal command line at @pos. If @pos
+ * is negative, then it just injects @str at the current location
+ * of line->pos. If @pos is greater than the length of line->line,
+ * then it will simply append the string to the line.
+ *
+ * This may be called from another thread while ccli_loop() is running.
+ * Then the loop is asked to inject @str the next time it waits for
+ * input at the prompt, and the line is redisplayed with it. If the
+ * loop has not gotten to an earlier request yet, that request is
+ * replaced by this one.
+ *
+ * Returns 0 on success or -1 on failure.
+ */
+int ccli_line_inject(struct ccli *ccli, const char *str, int pos)
+{
+	if (!ccli || !str) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (other_thread(ccli))
+		return inject_request(ccli, str, pos);
+
+	if (!ccli->line) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return inject_str(ccli->line, str, pos);
+}
+
+/**
+ * ccli_line_refresh: Refresh the displayed line.
+ * @ccli: The CLI descriptor to refresh the command line for.
+ *
+ * In case the interrupt callback makes modifications to the command line,
+ * it can call this to refresh it to show the conents of the internal
+ * line.
+ */
+void ccli_line_refresh(struct ccli *ccli)
+{
+	if (!ccli || !ccli->line)
+		return;
+
+	line_refresh(ccli, ccli->line, 0);
+}
+
+/**
+ * ccli_loop - Execute a command loop for the user.
+ * @ccli: The CLI descriptor to execute on.
+ *
+ * This reads the input descriptor of @ccli and lets the user
+ * execute shell like commands on the command line.
+ *
+ * While the loop runs, other threads may register and unregister
+ * commands, print with ccli_printf() and inject into the line with
+ * ccli_line_inject().
+ *
+ * Returns 0 on success (when one of the commands exits the loop)
+ *  or -1 on error.
+ */
+int ccli_loop(struct ccli *ccli)
+{
+	struct command_table *cmds;
+	struct line_buf line;
+	ccli_interrupt interrupt;
+	void *data;
+	char ch;
+	int tab = 0;
+	int ret = 0;
+	int pad;
+
+	if (line_init(&line, &ccli->pools[CCLI_POOL_LINE]))
+		return -1;
+
+	ccli->line = &line;
+	ccli->loop_thread = pthread_self();
+	__atomic_store_n(&ccli->looping, true, __ATOMIC_SEQ_CST);
+
+	record_env_start(ccli);
+	echo_prompt(ccli);
+
+	while (!ret) {
+		ccli->at_prompt = true;
+		ch = read_char(ccli);
+		ccli->at_prompt = false;
+		if (ch == CHAR_ERROR)
+			break;
+
+ again:
+		if (ch != '\t')
+			tab = 0;
+
+		if (line_state_escaped(&line) && ch == '\n') {
+			ch = CHAR_NEWLINE;
+			echo_str(ccli, "\n> ");
+		}
+
+		switch (ch) {
+		case '\n':
+			echo(ccli, '\n');
+			ret = execute(ccli, line.line, true);
+			if (ret)
+				break;
+			line_reset(&line);
+			echo_prompt(ccli);
+			break;
+		case '\t':
+			do_completion(ccli, &line, tab++);
+			break;
+		case CHAR_INTR:
+			cmds = commands_get(ccli);
+			interrupt = cmds->interrupt;
+			data = cmds->interrupt_data;
+			commands_put(ccli);
+			ret = interrupt(ccli, line.line, line.pos, data);
+			break;
+		case CHAR_EXIT:
+			/* A signal callback asked to exit */
+			ret = 1;
+			break;
+		case CHAR_REVERSE:
+			clear_line(ccli, &line);
+			ch = history_search(ccli, &line, &pad);
+			pad = pad > line.len ? pad - line.len : 0;
+			line_refresh(ccli, &line, pad);
+			if (ch != CHAR_INTR)
+				goto again;
+			break;
+		case CHAR_BACKSPACE:
+			if (line.pos == line.start)
+				break;
+			line_backspace(&line);
+			echo(ccli, '\b');
+			line_refresh_tail(ccli, &line, line.pos, 1);
+			break;
+		case CHAR_DEL:
+			if (line.pos == line.len)
+				break;
+			line_del(&line);
+			line_refresh_tail(ccli, &line, line.pos, 1);
+			break;
+		case CHAR_DELWORD:
+			pad = line_del_word(&line);
+			line_refresh(ccli, &line, pad);
+			break;
+		case CHAR_DEL_BEGINNING:
+			pad = line_del_beginning(&line);
+			line_refresh(ccli, &line, pad);
+			break;
+		case CHAR_UP:
+			history_up(ccli, &line, 1);
+			line_refresh(ccli, &line, 0);
+			break;
+		case CHAR_DOWN:
+			history_down(ccli, &line, 1);
+			line_refresh(ccli, &line, 0);
+			break;
+		case CHAR_LEFT:
+			line_left(&line);
+			line_refresh(ccli, &line, 0);
+			break;
+		case CHAR_RIGHT:
+			line_right(&line);
+			line_refresh(ccli, &line, 0);
+			break;
+		case CHAR_HOME:
+			line_home(&line);
+			line_refresh(ccli, &line, 0);
+			break;
+		case CHAR_END:
+			line_end(&line);
+			line_refresh(ccli, &line, 0);
+			break;
+		case CHAR_PAGEUP:
+			history_up(ccli, &line, DEFAULT_PAGE_SCROLL);
+			line_refresh(ccli, &line, 0);
+			break;
+		case CHAR_PAGEDOWN:
+			history_down(ccli, &line, DEFAULT_PAGE_SCROLL);
+			line_refresh(ccli, &line, 0);
+			break;
+		case CHAR_LEFT_WORD:
+			line_left_word(&line);
+			line_refresh(ccli, &line, 0);
+			break;
+		case CHAR_RIGHT_WORD:
+			line_right_word(&line);
+			line_refresh(ccli, &line, 0);
+			break;
+		case CHAR_INSERT:
+			/* Todo */
+			break;
+		default:
+			if (ch == CHAR_NEWLINE) {
+				line_insert(&line, ch);
+				line_refresh(ccli, &line, 0);
+				break;
+			}
+			if (isprint(ch)) {
+				if (!line_insert(&line, ch))
+					line_refresh_tail(ccli, &line, line.pos - 1, 0);
+				break;
+			}
+			dprint("unknown char '%d'\n", ch);
+		}
+	}
+
+	__atomic_store_n(&ccli->looping, false, __ATOMIC_SEQ_CST);
+	output_flush(ccli);
+	record_env_stop(ccli);
+	mem_free(ccli, __atomic_exchange_n(&ccli->inject, NULL, __ATOMIC_ACQUIRE));
+
+	line_cleanup(&line);
+	ccli->line = NULL;
+	return 0;
+}
+
+#line 1 "src/line.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+
+
+__hidden void free_argv(int argc, char **argv)
+{
+	for (argc--; argc >= 0; argc--)
+		mem_free(NULL, argv[argc]);
+	mem_free(NULL, argv);
+}
+
+static char *line_alloc(struct pool *pool, int size)
+{
+	if (pool)
+		return pool_zalloc(pool, size);
+	return mem_zalloc(NULL, size);
+}
+
+/* The longest a line from @pool may get (0 for no limit) */
+static int line_max(struct pool *pool)
+{
+	return pool ? pool->ccli->limits.line_max : 0;
+}
+
+__hidden int line_init(struct line_buf *line, struct pool *pool)
+{
+	int max = line_max(pool);
+	int size = BUFSIZ;
+
+	/* No need to allocate more than the line can hold */
+	if (max && max + 1 < size)
+		size = max + 1;
+
+	memset(line, 0, sizeof(*line));
+	line->line = line_alloc(pool, size);
+	line->size = size;
+	line->max = max;
+	line->pool = pool;
+	if (!line->line)
+		return -1;
+	return 0;
+}
+
+/**
+ * line_init_str - Initialize a line_buf with a given string
+ * @line: The line_buf to initialize
+ * @str: The string to initialize it with.
+ * @pool: The pool to allocate the line from (NULL for malloc)
+ *
+ * Initilize the line with a given string.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+__hidden int line_init_str(struct line_buf *line, const char *str,
+			   struct pool *pool)
+{
+	int max = line_max(pool);
+	int len = strlen(str);
+	/* strlen(str) + 1 + BUFSIZ - 1 */
+	int size = ((len + BUFSIZ) / BUFSIZ) * BUFSIZ;
+
+	memset(line, 0, sizeof(*line));
+
+	if (max) {
+		if (len > max) {
+			errno = E2BIG;
+			return -1;
+		}
+		if (max + 1 < size)
+			size = max + 1;
+	}
+
+	line->line = line_alloc(pool, size);
+	line->size = size;
+	line->max = max;
+	line->len = len;
+	line->pos = len;
+	line->pool = pool;
+
+	if (!line->line)
+		return -1;
+
+	strcpy(line->line, str);
+
+	return 0;
+}
+
+__hidden void line_reset(struct line_buf *line)
+{
+	memset(line->line, 0, line->size);
+	line->len = 0;
+	line->pos = 0;
+	line->start = 0;
+}
+
+__hidden void line_cleanup(struct line_buf *line)
+{
+	if (line->pool)
+		pool_free(line->pool, line->line);
+	else
+		mem_free(NULL, line->line);
+	memset(line, 0, sizeof(*line));
+}
+
+__hidden int line_insert(struct line_buf *line, char ch)
+{
+	char *extend_line;
+	int len;
+
+	/*
+	 * In the case of '\' followed by a newline, the '\'
+	 * should no longer be part of the line string (although
+	 * it stays printed). And the "start" of the line becomes
+	 * the current position.
+	 */
+	if (ch == CHAR_NEWLINE) {
+		/* start a new line */
+		if (!line->len || line->line[line->len - 1] != '\\') {
+			fprintf(stderr, "Bad new line escape?\n");
+			return -1;
+		}
+		line->len--;
+		line->pos = line->len;
+		line->line[line->len] = '\0';
+		line->start = line->len;
+		return 0;
+	}
+	if (line->max && line->len >= line->max) {
+		errno = E2BIG;
+		return -1;
+	}
+	if (line->len == line->size - 1) {
+		if (line->pool)
+			extend_line = pool_realloc(line->pool, line->line,
+						   line->size + BUFSIZ);
+		else
+			extend_line = mem_realloc(NULL, line->line,
+						  line->size + BUFSIZ);
+		if (!extend_line)
+			return -1;
+		/* The line must always stay nul terminated */
+		memset(extend_line + line->size, 0, BUFSIZ);
+		line->line = extend_line;
+		line->size += BUFSIZ;
+	}
+
+	if (line->pos < line->len) {
+		len = line->len - line->pos;
+		memmove(line->line + line->pos + 1, line->line + line->pos, len);
+	}
+
+	line->line[line->pos++] = ch;
+	line->len++;
+
+	return 0;
+}
+
+__hidden bool line_state_escaped(struct line_buf *line)
+{
+	int escape = 0;
+	int i;
+
+	for (i = line->len - 1; i >= 0 && line->line[i] == '\\'; i--)
+		escape ^= 1;
+
+	return escape;
+}
+
+__hidden void line_right(struct line_buf *line)
+{
+	if (line->pos < line->len)
+		line->pos++;
+}
+
+__hidden void line_left(struct line_buf *line)
+{
+	if (line->pos > line->start)
+		line->pos--;
+}
+
+__hidden void line_home(struct line_buf *line)
+{
+	line->pos = line->start;
+}
+
+__hidden void line_end(struct line_buf *line)
+{
+	line->pos = line->len;
+}
+
+__hidden void line_backspace(struct line_buf *line)
+{
+	int len;
+
+	if (line->pos == line->start)
+		return;
+
+	len = line->len - line->pos;
+	line->pos--;
+	line->len--;
+	memmove(line->line + line->pos, line->line + line->pos + 1, len);
+	line->line[line->len] = '\0';
+}
+
+__hidden void line_right_word(struct line_buf *line)
+{
+	while (line->pos < line->len && !isalnum(line->line[++line->pos]))
+		;
+
+	while (line->pos < line->len && isalnum(line->line[++line->pos]))
+		;
+}
+
+__hidden void line_left_word(struct line_buf *line)
+{
+	while ((line->pos-- > line->start) && !isalnum(line->line[line->pos]))
+		;
+
+	while ((line->pos > line->start) && isalnum(line->line[line->pos]))
+		line->pos--;
+
+	if (!isalnum(line->line[line->pos]))
+		line->pos++;
+}
+
+static int del_words(struct line_buf *line, int old_pos)
+{
+	int len;
+
+	len = line->len - old_pos;
+	line->len -= old_pos - line->pos;
+	memmove(line->line + line->pos, line->line + old_pos, len);
+	memset(line->line + line->len, 0, old_pos - line->pos);
+
+	return old_pos - line->pos;
+}
+
+__hidden int line_del_beginning(struct line_buf *line)
+{
+	int s = line->pos;
+
+	if (line->pos == line->start)
+		return 0;
+
+	line_home(line);
+	return del_words(line, s);
+}
+
+__hidden int line_del_word(struct line_buf *line)
+{
+	int s = line->pos;
+
+	if (line->pos == line->start)
+		return 0;
+
+	line_left_word(line);
+	return del_words(line, s);
+}
+
+__hidden void line_del(struct line_buf *line)
+{
+	int len;
+
+	if (line->pos == line->len)
+		return;
+
+	len = line->len - line->pos;
+	line->len--;
+	memmove(line->line + line->pos, line->line + line->pos + 1, len);
+	line->line[line->len] = '\0';
+}
+
+__hidden int line_copy(struct line_buf *dst, struct line_buf *src, int len)
+{
+	memset(dst, 0, sizeof(*dst));
+	dst->size = src->size;
+	dst->max = src->max;
+	dst->pool = src->pool;
+	dst->line = line_alloc(src->pool, src->size);
+	if (!dst->line)
+		return -1;
+
+	if (len > src->len)
+		len = src->len;
+	strncpy(dst->line, src->line, len);
+	dst->pos = len;
+	dst->len = len;
+
+	return 0;
+}
+
+/*
+ * Find the next word in @p. Returns the start of the word and sets @end
+ * to the character after it, or returns NULL if there's no more words.
+ */
+static const char *next_word(const char *p, const char **end)
+{
+	const char *word;
+	bool last = false;
+	char q = 0;
+
+	while (ISSPACE(*p))
+		p++;
+
+	if (!*p)
+		return NULL;
+
+	word = p;
+
+	for ( ; !last && *p; p++) {
+
+		/* Outside of quotes, skip what can not end the word at once */
+		if (!q) {
+			p += str_plain(p);
+			if (!*p)
+				break;
+		}
+
+		switch (*p) {
+		case '\'':
+		case '"':
+			if (!q)
+				q = *p;
+			else if (*p == q)
+				q = 0;
+			break;
+		case '\\':
+			p++;
+			if (!*p)
+				p--;
+			break;
+
+		default:
+			if (q)
+				break;
+			if (ISSPACE(*p))
+				last = true;
+			break;
+		}
+	}
+
+	/* Do not include the space that was found */
+	if (last)
+		p--;
+
+	*end = p;
+	return word;
+}
+
+/* Copy @len bytes of @word into @arg with the quotes and backslashes removed */
+static void copy_word(char *arg, const char *word, int len)
+{
+	const char *end = word + len;
+	char q = 0;
+
+	for (; word < end; word++) {
+		switch (*word) {
+		case '\'':
+		case '"':
+			if (!q)
+				q = *word;
+			else if (*word == q)
+				q = 0;
+			break;
+		case '\\':
+			/* A backslash at the end is kept */
+			if (word + 1 < end)
+				word++;
+			/* fallthrough */
+		default:
+			*arg++ = *word;
+			break;
+		}
+	}
+	*arg = '\0';
+}
+
+/**
+ * ccli_line_parse - parse a string into its arguments
+ * @line: The string to parse
+ * @pargv: A pointer to place the array of strings
+ *
+ * Parse the @line into the arguments as the ccli would behave
+ * when the user enters on the command line. @pargv is a pointer
+ * to a string array that will be allocated and the arguments
+ *  will be placed on it.
+ *
+ * Returns the number of arguments that were parsed out of
+ *    line or -1 on error. For all return values greater than zero
+ *    @pargv should be freed with ccli_argv_free(), but it does
+ *    not need to be called on the return of zero or less.
+ */
+int ccli_line_parse(const char *line, char ***pargv)
+{
+	char **argv = NULL;
+	const char *word;
+	const char *p;
+	char *arg;
+	char **v;
+	int argc = 0;
+	int len;
+
+	if (!pargv) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* In case ccli_argv_free() gets called on a return of zero */
+	*pargv = NULL;
+
+	for (p = line; (word = next_word(p, &p)); ) {
+		len = p - word;
+
+		arg = mem_alloc(NULL, len + 1);
+		if (!arg)
+			goto fail;
+
+		/* Add two, one for a NULL value at the end */
+		v = mem_realloc(NULL, argv, sizeof(*v) * (argc + 2));
+		if (!v) {
+			mem_free(NULL, arg);
+			goto fail;
+		}
+		argv = v;
+
+		copy_word(arg, word, len);
+		argv[argc++] = arg;
+		argv[argc] = NULL;
+	}
+
+	*pargv = argv;
+
+	return argc;
+
+ fail:
+	free_argv(argc, argv);
+	return -1;
+}
+
+/**
+ * ccli_free_argv - free a list of strings
+ * @argv: The list of strings returned by ccli_line_parse()
+ *
+ * Free the list of strings that was allocatde by ccli_line_parse.
+ */
+void ccli_argv_free(char **argv)
+{
+	int i;
+
+	if (!argv)
+		return;
+
+	for (i = 0; argv[i]; i++)
+		mem_free(NULL, argv[i]);
+	mem_free(NULL, argv);
+}
+
+/**
+ * line_parse - parse a line for the ccli internals
+ * @ccli: The CLI descriptor to take the memory from
+ * @line: The string to parse
+ * @pargv: A pointer to place the array of strings
+ *
+ * Works like ccli_line_parse(), but the array and all the strings are
+ * placed in a single block from the argv pool of @ccli. As every word
+ * is at least followed by one space, there can not be more than
+ * half the length of @line words, and all the words with their
+ * nul terminators can not take up more than the length of @line
+ * plus one.
+ *
+ * Returns the number of arguments or -1 on error. @pargv must be
+ *  freed with line_argv_free().
+ */
+__hidden int line_parse(struct ccli *ccli, const char *line, char ***pargv)
+{
+	const char *word;
+	const char *p;
+	char **argv;
+	char *arg;
+	size_t size;
+	int argc = 0;
+	int len;
+
+	len = strlen(line);
+	size = sizeof(*argv) * (len / 2 + 2) + len + 1;
+
+	argv = pool_alloc(&ccli->pools[CCLI_POOL_ARGV], size);
+	if (!argv)
+		return -1;
+
+	arg = (char *)(argv + len / 2 + 2);
+
+	for (p = line; (word = next_word(p, &p)); ) {
+		len = p - word;
+		copy_word(arg, word, len);
+		argv[argc++] = arg;
+		arg += strlen(arg) + 1;
+	}
+	argv[argc] = NULL;
+
+	*pargv = argv;
+
+	return argc;
+}
+
+/* Returns where word @n (from zero) of @line starts, as line_parse() splits it */
+__hidden const char *line_word(const char *line, int n)
+{
+	const char *word;
+	const char *p;
+
+	for (p = line; (word = next_word(p, &p)); n--) {
+		if (!n)
+			return word;
+	}
+
+	return NULL;
+}
+
+__hidden void line_argv_free(struct ccli *ccli, char **argv)
+{
+	pool_free(&ccli->pools[CCLI_POOL_ARGV], argv);
+}
+
+__hidden void line_replace(struct line_buf *line, char *str)
+{
+	int len = strlen(str);
+
+	if (len >= line->size)
+		len = line->size - 1;
+
+	strncpy(line->line, str, len);
+	if (len < line->len)
+		memset(line->line + len, 0, line->len - len);
+	line->len = len;
+	line->pos = len;
+}
+
+__hidden void line_refresh(struct ccli *ccli, struct line_buf *line, int pad)
+{
+	unsigned long start = stat_read(ccli, bytes_written);
+	char padding[pad + 3];
+	int len;
+
+	/* Just append two spaces */
+	pad += 2;
+
+	memset(padding, ' ', pad);
+	padding[pad] = '\0';
+
+	stat_add(ccli, redraws, 1);
+
+	echo(ccli, '\r');
+
+	if (line->start)
+		echo_str(ccli, "> ");
+	else
+		echo_prompt(ccli);
+	echo_str(ccli, line->line + line->start);
+	echo_str(ccli, padding);
+	while (pad--)
+		echo(ccli, '\b');
+
+	for (len = line->len; len > line->pos; len--)
+		echo(ccli, '\b');
+
+	trace_probe(redraw, stat_read(ccli, bytes_written) - start);
+}
+
+/*
+ * After an insert or a delete at @from, where the cursor is, only what
+ * is after it moved. Write that out instead of the prompt and the whole
+ * line, so that typing costs the same however long the line is. @pad is
+ * how many characters the line got shorter, which are cleared after it.
+ */
+__hidden void line_refresh_tail(struct ccli *ccli, struct line_buf *line,
+				int from, int pad)
+{
+	unsigned long start = stat_read(ccli, bytes_written);
+	int len;
+
+	stat_add(ccli, redraws, 1);
+
+	echo_str_len(ccli, line->line + from, line->len - from);
+	for (len = pad; len; len--)
+		echo(ccli, ' ');
+
+	for (len = line->len - line->pos + pad; len; len--)
+		echo(ccli, '\b');
+
+	trace_probe(redraw, stat_read(ccli, bytes_written) - start);
+}
+
+#line 1 "src/history.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * CLI interface for C.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+
+
+#define CCLI_HISTORY_LINE_START \
+	"####---ccli---####"
+
+#define CCLI_HISTORY_LINE_END \
+	"%%%%---ccli---%%%%"
+
+static inline int history_idx(struct ccli *ccli, unsigned long idx)
+{
+	return idx % ccli->history_max;
+}
+
+/*
+ * The sequence number that follows the newest line in the history. The
+ * sequence of a shared history is that of its ring, which is an unsigned
+ * long so that it does not wrap after 2^31 lines.
+ */
+static inline unsigned long history_end(struct ccli *ccli)
+{
+	if (ccli->shared)
+		return ccli->shared_end;
+	return ccli->history_size;
+}
+
+/* The oldest line in the history that may still be around */
+static inline unsigned long history_first(struct ccli *ccli)
+{
+	unsigned long size;
+	int first;
+
+	if (ccli->shared) {
+		size = ring_size(ccli->shared);
+		return ccli->shared_end > size ? ccli->shared_end - size : 0;
+	}
+
+	first = ccli->history_size - ccli->history_max;
+	if (first < ccli->history_start)
+		first = ccli->history_start;
+	return first;
+}
+
+/*
+ * Return the line at @seq, or NULL if a shared history no longer has it.
+ * The lines of a shared history are copied into @buf.
+ */
+static char *history_get(struct ccli *ccli, unsigned long seq, char *buf)
+{
+	if (ccli->shared)
+		return ring_get(ccli->shared, seq, buf);
+	return ccli->history[history_idx(ccli, seq)];
+}
+
+/*
+ * Other sessions may have added to a shared history. Unless this session
+ * is in the middle of moving through it, catch up to the newest line.
+ */
+static void history_refresh(struct ccli *ccli)
+{
+	if (!ccli->shared || ccli->current_line < ccli->shared_end)
+		return;
+
+	ccli->shared_end = ring_head(ccli->shared);
+	ccli->current_line = ccli->shared_end;
+}
+
+/* Replace the string at @idx with @str, keeping track of the bytes used */
+static void history_set(struct ccli *ccli, int idx, char *str)
+{
+	if (ccli->history[idx]) {
+		ccli->history_bytes -= strlen(ccli->history[idx]) + 1;
+		mem_free(ccli, ccli->history[idx]);
+	}
+
+	ccli->history[idx] = str;
+
+	if (str)
+		ccli->history_bytes += strlen(str) + 1;
+}
+
+static int __history_add(struct ccli *ccli, const char *line)
+{
+	int limit = ccli->limits.history_bytes;
+	char **lines;
+	char *str;
+	int first;
+
+	if (ccli->shared) {
+		if (ring_add(ccli->shared, line) < 0)
+			return -1;
+		ccli->shared_end = ring_head(ccli->shared);
+		ccli->current_line = ccli->shared_end;
+		return 0;
+	}
+
+	if (limit && strlen(line) + 1 > limit) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	if (ccli->history_size < ccli->history_max) {
+		lines = mem_realloc(ccli, ccli->history,
+				    sizeof(*lines) * (ccli->history_size + 1));
+		if (!lines)
+			return -1;
+		lines[ccli->history_size] = NULL;
+		ccli->history = lines;
+	}
+
+	str = mem_strdup(ccli, line);
+	if (!str)
+		return -1;
+
+	history_set(ccli, history_idx(ccli, ccli->history_size), str);
+
+	ccli->history_size++;
+	ccli->current_line = ccli->history_size;
+
+	/* Drop the oldest lines until the history fits in its limit */
+	while (limit && ccli->history_bytes > limit) {
+		first = history_first(ccli);
+		history_set(ccli, history_idx(ccli, first), NULL);
+		ccli->history_start = first + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The history_lock protects the history from other threads that load
+ * it or read it with ccli_history_copy() while the loop is moving
+ * through it. It is never held while waiting for input.
+ */
+__hidden int history_add(struct ccli *ccli, const char *line)
+{
+	int ret;
+
+	pthread_mutex_lock(&ccli->history_lock);
+	ret = __history_add(ccli, line);
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	return ret;
+}
+
+/* Store the current line into the history in case it was modified */
+static void history_update(struct ccli *ccli, unsigned long current)
+{
+	int limit = ccli->limits.history_bytes;
+	char *str;
+	int len;
+	int idx;
+
+	/* The lines of a shared history are never modified */
+	if (ccli->shared)
+		return;
+
+	idx = history_idx(ccli, current);
+	str = ccli->history[idx];
+	len = strlen(str);
+
+	/* Moving over a line without changing it costs nothing */
+	if (strcmp(str, ccli->line->line) == 0)
+		return;
+
+	/* A line that got shorter still fits where it is */
+	if (strlen(ccli->line->line) < len) {
+		strcpy(str, ccli->line->line);
+		ccli->history_bytes -= len - strlen(str);
+		return;
+	}
+
+	/* Keep the original if the modified line would not fit */
+	if (limit && ccli->history_bytes - strlen(ccli->history[idx]) +
+	    ccli->line->len > limit)
+		return;
+
+	str = mem_strdup(ccli, ccli->line->line);
+	if (str)
+		history_set(ccli, idx, str);
+}
+
+static void save_current(struct ccli *ccli, unsigned long current)
+{
+	int len = strlen(ccli->line->line);
+	char *str;
+
+	if (current < history_end(ccli)) {
+		history_update(ccli, current);
+		return;
+	}
+
+	/*
+	 * Store the current line in case it was modifed. The buffer is
+	 * kept, and made as big as the line buffer so that it is only
+	 * allocated again when that grows.
+	 */
+	if (len >= ccli->temp_size) {
+		str = mem_realloc(ccli, ccli->temp_line, ccli->line->size);
+		if (!str)
+			return;
+		ccli->temp_line = str;
+		ccli->temp_size = ccli->line->size;
+	}
+	memcpy(ccli->temp_line, ccli->line->line, len + 1);
+	ccli->temp_saved = true;
+}
+
+__hidden int history_up(struct ccli *ccli, struct line_buf *line, int cnt)
+{
+	unsigned long current;
+	unsigned long first;
+	unsigned long seq;
+	char *str = NULL;
+	int ret = 1;
+
+	pthread_mutex_lock(&ccli->history_lock);
+
+	history_refresh(ccli);
+
+	current = ccli->current_line;
+	first = history_first(ccli);
+
+	seq = current > first && current - first > cnt ? current - cnt : first;
+
+	/* Skip lines that a shared history no longer has */
+	for (; seq < current; seq++) {
+		str = history_get(ccli, seq, ccli->shared_buf);
+		if (str)
+			break;
+	}
+
+	if (seq >= current)
+		goto out;
+
+	clear_line(ccli, line);
+	save_current(ccli, current);
+
+	ccli->current_line = seq;
+	line_replace(line, str);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&ccli->history_lock);
+	return ret;
+}
+
+static void restore_current(struct ccli *ccli, struct line_buf *line)
+{
+	/* Restore the command that was before moving in history */
+	if (ccli->temp_saved) {
+		clear_line(ccli, line);
+		line_replace(line, ccli->temp_line);
+		ccli->temp_saved = false;
+	}
+}
+
+__hidden int history_down(struct ccli *ccli, struct line_buf *line, int cnt)
+{
+	unsigned long current;
+	unsigned long end;
+	unsigned long seq;
+	char *str = NULL;
+	int ret = 1;
+
+	pthread_mutex_lock(&ccli->history_lock);
+
+	current = ccli->current_line;
+	end = history_end(ccli);
+
+	/* Skip lines that a shared history no longer has */
+	for (seq = current + cnt; seq < end; seq++) {
+		str = history_get(ccli, seq, ccli->shared_buf);
+		if (str)
+			break;
+	}
+
+	if (seq >= end) {
+		ccli->current_line = end;
+		restore_current(ccli, line);
+		goto out;
+	}
+
+	clear_line(ccli, line);
+
+	history_update(ccli, current);
+
+	ccli->current_line = seq;
+	line_replace(line, str);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&ccli->history_lock);
+	return ret;
+}
+
+#define REVERSE_STR	"reverse-i-search"
+
+static void refresh(struct ccli *ccli, struct line_buf *line,
+		    struct line_buf *search, int *old_len, const char *p)
+{
+	int len = 0;
+	int pos = 0;
+	int i;
+
+	echo_str(ccli, "\r(");
+	if (!p)
+		len += echo_str(ccli, "failed ");
+
+	len += echo_str(ccli, REVERSE_STR ")`");
+	len += echo_str(ccli, search->line);
+	len += echo_str(ccli, "': ");
+	len += echo_str(ccli, line->line);
+
+	len += line->len;
+
+	if (*old_len > len) {
+		pos = *old_len - len;
+		for (i = 0; i < pos; i++)
+			echo(ccli, ' ');
+	}
+
+	pos += line->len - line->pos;
+	for (i = 0; i < pos; i++)
+		echo(ccli, '\b');
+
+	*old_len = len;
+}
+
+__hidden int history_search(struct ccli *ccli, struct line_buf *line, int *pad)
+{
+	unsigned long save_current_line;
+	unsigned long min;
+	unsigned long end;
+	unsigned long top;
+	unsigned long i;
+	struct line_buf search;
+	char *last_hist = NULL;
+	char *hist = NULL;
+	char *p = NULL;
+	int old_len;
+	int pos = line->pos;
+	int ret;
+	int ch;
+
+	*pad = 0;
+
+	stat_add(ccli, history_searches, 1);
+	trace_probe(history__search__start);
+
+	if (line_init(&search, &ccli->pools[CCLI_POOL_LINE]))
+		return CHAR_INTR;
+
+	old_len = line->len + strlen(REVERSE_STR) + 6;
+
+	pthread_mutex_lock(&ccli->history_lock);
+	history_refresh(ccli);
+	save_current_line = ccli->current_line;
+
+	min = history_first(ccli);
+	end = history_end(ccli);
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	echo_str(ccli, "\r(" REVERSE_STR ")`': ");
+	echo_str(ccli, line->line);
+	pos = line->len - pos;
+	for (i = 0; i < pos; i++)
+		echo(ccli, '\b');
+
+	/* Lines below @top are searched, starting with the one before it */
+	top = ccli->current_line + 1;
+
+	for (;;) {
+		ch = read_char(ccli);
+		switch (ch) {
+		case CHAR_INTR:
+			echo_str(ccli, "^C\n");
+			pthread_mutex_lock(&ccli->history_lock);
+			ccli->current_line = save_current_line;
+			pthread_mutex_unlock(&ccli->history_lock);
+			line_reset(line);
+			line_reset(&search);
+			goto out;
+		case CHAR_IGNORE_START_H ... CHAR_IGNORE_END:
+		case CHAR_ERROR:
+		case CHAR_EXIT:
+		case '\n':
+			goto out;
+		case CHAR_BACKSPACE:
+			if (!search.len)
+				break;
+			line_backspace(&search);
+			goto search;
+			break;
+		case CHAR_REVERSE:
+			if (top > min)
+				top--;
+			/*
+			 * Skip lines that are the same as the last match. It
+			 * was copied into @line, as the history may change
+			 * once the lock is released.
+			 */
+			last_hist = p ? line->line : NULL;
+			goto search;
+		default:
+			ret = line_insert(&search, ch);
+			if (ret)
+				break;
+ search:
+			pthread_mutex_lock(&ccli->history_lock);
+			p = NULL;
+			for (i = top; i-- > min; ) {
+				if (i >= end)
+					continue;
+				hist = history_get(ccli, i, ccli->shared_buf);
+				if (!hist)
+					continue;
+				p = str_find(hist, search.line, search.len);
+				if (!p)
+					continue;
+				/* Skip duplicates */
+				if (last_hist && strcmp(last_hist, hist) == 0) {
+					p = NULL;
+					continue;
+				}
+				break;
+			}
+			if (p) {
+				if (ccli->current_line >= end)
+					save_current(ccli, ccli->current_line);
+				ccli->current_line = i;
+				line_replace(line, hist);
+				line->pos = p - hist + search.len;
+				top = i + 1;
+			}
+			pthread_mutex_unlock(&ccli->history_lock);
+			refresh(ccli, line, &search, &old_len, p);
+			break;
+		}
+	}
+ out:
+	trace_probe(history__search__end, p != NULL);
+	*pad = search.len + line->len + sizeof(REVERSE_STR) + 5;
+	line_cleanup(&search);
+	return ch;
+}
+
+/**
+ * ccli_history - return a previous entered line from the past
+ * @ccli: The ccli descriptor to read the histor from
+ * @past: How far back to go
+ *
+ * Reads the line that happened @past commands ago and returns it.
+ *
+ * If @ccli uses a shared history (see ccli_set_shared_history()), then
+ * the line is a copy that is only valid until the next call.
+ *
+ * The returned string may be freed when a line is added to the history,
+ * so it must only be used by the thread that runs ccli_loop(). Other
+ * threads should use ccli_history_copy().
+ *
+ * Returns a string that should not be modifiied if there was
+ *   a command that happened @past commands ago, otherwise NULL.
+ */
+const char *ccli_history(struct ccli *ccli, int past)
+{
+	const char *str = NULL;
+
+	pthread_mutex_lock(&ccli->history_lock);
+
+	history_refresh(ccli);
+
+	if (past >= 1 && past <= history_end(ccli) - history_first(ccli))
+		str = history_get(ccli, history_end(ccli) - past,
+				  ccli->shared_buf);
+
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	return str;
+}
+
+/**
+ * ccli_history_copy - copy a previous entered line from the past
+ * @ccli: The ccli descriptor to read the history from
+ * @past: How far back to go
+ * @buf: The buffer to copy the line into
+ * @size: The size of @buf
+ *
+ * Like ccli_history(), but copies the line into @buf, such that it
+ * is safe to call from any thread, even while another thread is
+ * running ccli_loop(). If the line does not fit in @buf, it is
+ * truncated. @buf is always nul terminated if @size is not zero.
+ *
+ * Returns the length of the line (which if it is @size or more
+ *   means the line was truncated), or -1 if there was no command
+ *   @past commands ago.
+ */
+int ccli_history_copy(struct ccli *ccli, int past, char *buf, size_t size)
+{
+	char *str = NULL;
+	int len = -1;
+
+	if (!ccli || (!buf && size)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ccli->history_lock);
+
+	history_refresh(ccli);
+
+	if (past >= 1 && past <= history_end(ccli) - history_first(ccli))
+		str = history_get(ccli, history_end(ccli) - past,
+				  ccli->shared_buf);
+
+	if (str) {
+		len = strlen(str);
+		if (size) {
+			size = len < size ? len : size - 1;
+			memcpy(buf, str, size);
+			buf[size] = '\0';
+		}
+	} else {
+		errno = ENOENT;
+	}
+
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	return len;
+}
+
+#ifndef CCLI_NO_HISTORY_FILE
+static int save_fd(struct ccli *ccli, const char *tag, int fd)
+{
+	char *str = CCLI_HISTORY_LINE_START;
+	unsigned long first;
+	char buf[64];
+	int cnt;
+	int ret;
+	int i;
+
+	history_refresh(ccli);
+
+	first = history_first(ccli);
+	cnt = history_end(ccli) - first;
+
+	/* Do nothing if there's no history */
+	if (!cnt)
+		return 0;
+
+	ret = write(fd, str, strlen(str));
+	if (ret < strlen(str))
+		return -1;
+
+	str = " ";
+	ret = write(fd, str, 1);
+	if (ret != 1)
+		return -1;
+
+	ret = write(fd, tag, strlen(tag));
+	if (ret < strlen(tag))
+		return -1;
+
+	snprintf(buf, 64, " %d\n", cnt);
+	ret = write(fd, buf, strlen(buf));
+	if (ret < strlen(buf))
+		return -1;
+
+	for (i = 0; i < cnt; i++) {
+		/* Lines a shared history no longer has are left empty */
+		str = history_get(ccli, first + i, ccli->shared_buf);
+		if (!str)
+			str = "";
+		ret = write(fd, str, strlen(str));
+		if (ret < strlen(str))
+			return -1;
+		ret = write(fd, "\n", 1);
+		if (ret < 1)
+			return -1;
+	}
+
+	str = CCLI_HISTORY_LINE_END;
+
+	ret = write(fd, str, strlen(str));
+	if (ret < strlen(str))
+		return -1;
+
+	str = " ";
+	ret = write(fd, str, 1);
+	if (ret != 1)
+		return -1;
+
+	ret = write(fd, tag, strlen(tag));
+	if (ret < strlen(tag))
+		return -1;
+
+	str = "\n";
+	ret = write(fd, str, 1);
+	if (ret < 1)
+		return -1;
+
+	return cnt;
+}
+
+/**
+ * ccli_history_save_fd - Write the history into the file descriptor
+ * @ccli: The ccli descriptor to write the history of
+ * @tag: The tag to give this history segment
+ * @fd: The file descriptor to write the history into
+ *
+ * Will write the contents of the history into the file descriptor.
+ * It will first write a special line that will denote the @tag and
+ * size of the history. The @tag is used so that multiple histories
+ * can be loaded into the same file, and can be retrieved via the
+ * @tag.
+ *
+ * Returns the number of history lines written on success and -1
+ *  on error.
+ */
+int ccli_history_save_fd(struct ccli *ccli, const char *tag, int fd)
+{
+	int ret;
+
+	if (!ccli || !tag || fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ccli->history_lock);
+	ret = save_fd(ccli, tag, fd);
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	return ret;
+}
+
+static char *update_line(struct ccli *ccli, char *line, int *linesz, int cnt)
+{
+	char *tmp;
+
+	if (*linesz <= (cnt + 1)) {
+		tmp = mem_realloc(ccli, line, cnt + BUFSIZ);
+		if (!tmp) {
+			mem_free(ccli, line);
+			return NULL;
+		}
+		line = tmp;
+		*linesz = cnt + BUFSIZ;
+	}
+	return line;
+}
+
+static int read_bytes(struct ccli *ccli, int fd, char **pline, int *linesz)
+{
+	char *line = *pline;
+	char ch;
+	int cnt = 0;
+	int r;
+
+	while ((r = read(fd, &ch, 1)) == 1) {
+		if (ch == '\n')
+			break;
+		line = update_line(ccli, line, linesz, cnt + 1);
+		if (!line) {
+			*pline = NULL;
+			return -1;
+		}
+		line[cnt++] = ch;
+	}
+	if (r < 0)
+		return -1;
+
+	line[cnt] = '\0';
+	*pline = line;
+
+	if (!cnt)
+		return r > 0 ? 0 : -1;
+
+	return cnt;
+}
+
+static int read_line(struct ccli *ccli, int fd, char **pline, int *linesz)
+{
+	char buf[BUFSIZ];
+	char *line;
+	char *p;
+	off64_t offset;
+	int cnt = 0;
+	int len;
+	int r;
+
+	/* Make sure line is allocated */
+	*pline = update_line(ccli, *pline, linesz, 0);
+	line = *pline;
+	if (!line)
+		return -1;
+	line[0] = '\0';
+
+	offset = lseek64(fd, 0, SEEK_CUR);
+	if (offset < 0) {
+		/*
+		 * The fd could be a pipe or a stream, and we do not want
+		 * to read any more than we have to. So we are stuck with
+		 * reading one byte at a time.
+		 */
+		return read_bytes(ccli, fd, pline, linesz);
+	}
+
+	while ((r = read(fd, buf, BUFSIZ)) > 0) {
+		p = memchr(buf, '\n', r);
+
+		len = p ? p - buf : r;
+
+		line = update_line(ccli, line, linesz, cnt + len);
+		if (!line) {
+			*pline = NULL;
+			return -1;
+		}
+		memcpy(line + cnt, buf, len);
+		cnt += len;
+		line[cnt] = '\0';
+
+		if (p)
+			break;
+	}
+	*pline = line;
+
+	if (r < 0 || (!r && !cnt))
+		return -1;
+
+	/* Put back to after the new line (cnt is at new line) */
+	offset = lseek64(fd, offset + cnt + 1, SEEK_SET);
+	// What should we do if this fails?
+
+	return cnt;
+}
+
+static int has_tag(const char *line, const char *str, const char *tag)
+{
+	int taglen;
+	char *p;
+
+	taglen = strlen(tag);
+	p = strstr(line, tag);
+	if (!p)
+		return -1
+;
+	if (p[taglen] != ' ')
+		return -1;
+
+	for (p += taglen; isspace(*p); p++)
+		;
+
+	return atoi(p);
+}
+
+/**
+ * ccli_history_load_fd - Read the history into the file descriptor
+ * @ccli: The ccli descriptor to read the history from
+ * @tag: The tag to use to find in the file
+ * @fd: The file descriptor to read the history from
+ *
+ * Will read the file descriptor looking for the start of history
+ * that matches the @tag. Then it will load the found history into
+ * the @ccli history.
+ *
+ * Returns the number of history lines read on success and -1
+ *  on error.
+ */
+int ccli_history_load_fd(struct ccli *ccli, const char *tag, int fd)
+{
+	char *str = CCLI_HISTORY_LINE_START;
+	char *line = NULL;
+	char *p;
+	int linesz = 0;
+	int cnt = -1;
+	int ret;
+	int i;
+
+	if (!ccli || !tag || fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	do {
+		ret = read_line(ccli, fd, &line, &linesz);
+		if (ret < 0)
+			break;
+		cnt = has_tag(line, str, tag);
+	} while (cnt < 0);
+
+	for (i = 0; i < cnt; i++) {
+		ret = read_line(ccli, fd, &line, &linesz);
+		if (ret < 0)
+			break;
+		/* Do not add empty lines */
+		if (!ret)
+			continue;
+		/* Do not add "exit" if that was last item */
+		if (i == cnt - 1 && strncmp(line, "exit", 4) == 0) {
+			for (p = line + 4; isspace(*p); p++)
+				;
+			if (!*p)
+				continue;
+		}
+		history_add(ccli, line);
+	}
+	if (i < cnt)
+		goto out;
+
+	read_line(ccli, fd, &line, &linesz);
+	/* TODO: test for the end tag. */
+out:
+	mem_free(ccli, line);
+
+	return cnt;
+}
+
+static int remove_section(int fd, off_t start, off_t size)
+{
+	char buf[BUFSIZ];
+	off_t roffset;
+	off_t offset;
+	int r;
+
+	offset = lseek(fd, start, SEEK_SET);
+	if (offset < 0)
+		return -1;
+
+	roffset = lseek64(fd, size, SEEK_CUR);
+	do {
+		r = read(fd, buf, BUFSIZ);
+		if (r < 0)
+			return -1;
+		offset = lseek(fd, offset, SEEK_SET);
+		if (offset < 0)
+			return -1;
+		offset += r;
+		write(fd, buf, r);
+		roffset = lseek(fd, roffset + r, SEEK_SET);
+		if (roffset < 0)
+			return -1;
+	} while (r);
+
+	/* Set to the end of the new file */
+	lseek(fd, offset, SEEK_SET);
+	return 0;
+}
+
+/**
+ * ccli_history_save_file - Write the history into a file
+ * @ccli: The ccli descriptor to write the history of
+ * @tag: The tag to give this history segment
+ * @file: The file path to write to
+ *
+ * It will first search for the @tag, and if it is there, it will
+ * remove the contents of that @tag and replace it with the
+ * new content.
+ * Will write the contents of the history into the @file path.
+ * It will first write a special line that will denote the @tag and
+ * size of the history. The @tag is used so that multiple histories
+ * can be loaded into the same file, and can be retrieved via the
+ * @tag.
+ *
+ * Returns the number of history lines written on success and -1
+ *  on error.
+ */
+int ccli_history_save_file(struct ccli *ccli, const char *tag, const char *file)
+{
+	char *str = CCLI_HISTORY_LINE_START;
+	off_t start, end;
+	char *line = NULL;
+	int linesz = 0;
+	int cnt = -1;
+	int ret;
+	int fd;
+	int i;
+
+	fd = open(file, O_RDWR | O_CREAT, 0640);
+	if (fd < 0)
+		return -1;
+
+	/* First remove the current tag */
+	do {
+		start = lseek(fd, 0, SEEK_CUR);
+		ret = read_line(ccli, fd, &line, &linesz);
+		if (ret < 0)
+			break;
+		cnt = has_tag(line, str, tag);
+	} while (cnt < 0);
+
+	for (i = 0; i < cnt; i++) {
+		ret = read_line(ccli, fd, &line, &linesz);
+		if (ret < 0)
+			break;
+	}
+	/* read one more line for end tag */
+	read_line(ccli, fd, &line, &linesz);
+	end = lseek(fd, 0, SEEK_CUR);
+
+	/* Remove this section if found */
+	if (cnt >= 0)
+		remove_section(fd, start, end - start);
+
+	ret = ccli_history_save_fd(ccli, tag, fd);
+	if (ret < 0)
+		goto out;
+
+	/* In case what we wrote is less than what we removed */
+	end = lseek(fd, 0, SEEK_CUR);
+	ftruncate(fd, end);
+out:
+	mem_free(ccli, line);
+	close(fd);
+	return ret;
+}
+
+/**
+ * ccli_history_load_file - Read the history from the given file path
+ * @ccli: The ccli descriptor to read the history from
+ * @tag: The tag to use to find in the file
+ * @file: The file path to read the history from
+ *
+ * Will read the @file looking for the start of history
+ * that matches the @tag. Then it will load the found history into
+ * the @ccli history.
+ *
+ * Returns the number of history lines read on success and -1
+ *  on error.
+ */
+int ccli_history_load_file(struct ccli *ccli, const char *tag, const char *file)
+{
+	int ret;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = ccli_history_load_fd(ccli, tag, fd);
+
+	close(fd);
+	return ret;
+}
+
+static char *get_cache_file(struct ccli *ccli)
+{
+	char *cache_path;
+	char *home;
+	char *file;
+	int ret;
+
+	cache_path = secure_getenv("XDG_CACHE_HOME");
+	if (!cache_path) {
+		home = secure_getenv("HOME");
+		if (!home)
+			return NULL;
+		ret = mem_asprintf(ccli, &cache_path, "%s/.cache", home);
+		if (ret < 0)
+			return NULL;
+	} else {
+		/* So we can always free it later */
+		cache_path = mem_strdup(ccli, cache_path);
+	}
+	if (!cache_path)
+		return NULL;
+
+	ret = mem_asprintf(ccli, &file, "%s/ccli", cache_path);
+	mem_free(ccli, cache_path);
+
+	return ret < 0 ? NULL : file;
+}
+
+/**
+ * ccli_history_save - Write the history into the default ccli file
+ * @ccli: The ccli descriptor to write the history of
+ * @tag: The tag to give this history segment
+ *
+ * Will write the contents of the history into the the default
+ * ccli file that is located in $(XDG_CACHE_HOME)/ccli or in
+ * $(HOME)/.cache/ccli.
+ *
+ * It will first write a special line that will denote the @tag and
+ * size of the history. The @tag is used so that multiple histories
+ * can be loaded into the same file, and can be retrieved via the
+ * @tag.
+ *
+ * Returns the number of history lines written on success and -1
+ *  on error.
+ */
+int ccli_history_save(struct ccli *ccli, const char *tag)
+{
+	char *file;
+	int ret;
+
+	file = get_cache_file(ccli);
+	ret = ccli_history_save_file(ccli, tag, file);
+	mem_free(ccli, file);
+
+	return ret;
+}
+
+/**
+ * ccli_history_load - Read the history from the default path
+ * @ccli: The ccli descriptor to read the history from
+ * @tag: The tag to use to find in the file
+ *
+ * Will read the default path defined by either $XDG_CACHE_HOME/ccli or
+ * $HOME/.cache/ccli and then look for the history
+ * that matches the @tag. Then it will load the found history into
+ * the @ccli history.
+ *
+ * Returns the number of history lines read on success and -1
+ *  on error.
+ */
+int ccli_history_load(struct ccli *ccli, const char *tag)
+{
+	char *file;
+	int ret;
+
+	file = get_cache_file(ccli);
+	ret = ccli_history_load_file(ccli, tag, file);
+	mem_free(ccli, file);
+
+	return ret;
+}
+#else
+/* Built with CCLI_NO_HISTORY_FILE: the history is only kept in memory */
+int ccli_history_save_fd(struct ccli *ccli, const char *tag, int fd)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_history_load_fd(struct ccli *ccli, const char *tag, int fd)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_history_save_file(struct ccli *ccli, const char *tag, const char *file)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_history_load_file(struct ccli *ccli, const char *tag, const char *file)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_history_save(struct ccli *ccli, const char *tag)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_history_load(struct ccli *ccli, const char *tag)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
+
+#line 1 "src/commands.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * CLI interface for C.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <stddef.h>
+
+
+
+/*
+ * The commands, along with the other registered callbacks, are kept in
+ * a table that is never modified once it is published in ccli->cmds.
+ * Registering a command makes a copy of the table with the change and
+ * swaps it in. That way ccli_loop() never has to take a lock to look up
+ * a command, and other threads can register and unregister commands
+ * while it runs. The writers are serialized by cmd_lock.
+ *
+ * A table that was swapped out may still be in use by a reader, so it
+ * is put on the retired list, and freed once there are no readers. A
+ * reader increments cmd_readers before reading ccli->cmds, and a writer
+ * reads cmd_readers after swapping ccli->cmds. Both are sequentially
+ * consistent, so when a writer sees no readers, any reader that comes
+ * after it will see the new table.
+ */
+
+static inline size_t table_size(int nr)
+{
+	return sizeof(struct command_table) + sizeof(struct command) * nr;
+}
+
+/* Free the retired tables if nothing is reading them (under cmd_lock) */
+static void commands_reclaim(struct ccli *ccli)
+{
+	struct command_table *cmds;
+
+	if (__atomic_load_n(&ccli->cmd_readers, __ATOMIC_SEQ_CST))
+		return;
+
+	while ((cmds = ccli->retired)) {
+		__atomic_store_n(&ccli->retired, cmds->next, __ATOMIC_RELAXED);
+		mem_free(ccli, cmds->dead);
+		mem_free(ccli, cmds);
+	}
+}
+
+/**
+ * commands_get - get the current command table to read
+ * @ccli: The CLI descriptor to get the commands of
+ *
+ * The table is valid until commands_put() is called. Nothing may
+ * wait on another thread while holding it.
+ */
+__hidden struct command_table *commands_get(struct ccli *ccli)
+{
+	__atomic_fetch_add(&ccli->cmd_readers, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ccli->cmds, __ATOMIC_SEQ_CST);
+}
+
+__hidden void commands_put(struct ccli *ccli)
+{
+	if (__atomic_sub_fetch(&ccli->cmd_readers, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	/* The last reader out frees what the writers could not */
+	if (__atomic_load_n(&ccli->retired, __ATOMIC_RELAXED) &&
+	    !pthread_mutex_trylock(&ccli->cmd_lock)) {
+		commands_reclaim(ccli);
+		pthread_mutex_unlock(&ccli->cmd_lock);
+	}
+}
+
+/**
+ * commands_copy - copy the current command table (under cmd_lock)
+ * @ccli: The CLI descriptor to copy the commands of
+ * @extra: The number of commands to make room for
+ *
+ * The new commands past the end of the copy are left uninitialized.
+ *
+ * Returns the copy, or NULL on error.
+ */
+__hidden struct command_table *commands_copy(struct ccli *ccli, int extra)
+{
+	struct command_table *old = ccli->cmds;
+	struct command_table *cmds;
+	int nr = old ? old->nr_commands : 0;
+
+	cmds = mem_alloc(ccli, table_size(nr + extra));
+	if (!cmds)
+		return NULL;
+
+	if (old)
+		memcpy(cmds, old, table_size(nr));
+	else
+		memset(cmds, 0, sizeof(*cmds));
+
+	cmds->next = NULL;
+	cmds->dead = NULL;
+
+	return cmds;
+}
+
+/**
+ * commands_publish - replace the command table (under cmd_lock)
+ * @ccli: The CLI descriptor to set the commands of
+ * @cmds: The table to use from now on
+ * @dead: A command name that is no longer used by @cmds, to free with the old one
+ */
+__hidden void commands_publish(struct ccli *ccli, struct command_table *cmds,
+			       char *dead)
+{
+	struct command_table *old;
+
+	old = __atomic_exchange_n(&ccli->cmds, cmds, __ATOMIC_SEQ_CST);
+	if (old) {
+		old->dead = dead;
+		old->next = ccli->retired;
+		__atomic_store_n(&ccli->retired, old, __ATOMIC_RELAXED);
+	}
+
+	commands_reclaim(ccli);
+}
+
+__hidden int commands_init(struct ccli *ccli)
+{
+	ccli->cmds = commands_copy(ccli, 0);
+	return ccli->cmds ? 0 : -1;
+}
+
+/* Only called when nothing else can be using @ccli */
+__hidden void commands_free(struct ccli *ccli)
+{
+	struct command_table *cmds = ccli->cmds;
+	int i;
+
+	if (cmds) {
+		for (i = 0; i < cmds->nr_commands; i++)
+			mem_free(ccli, cmds->commands[i].cmd);
+		mem_free(ccli, cmds);
+		ccli->cmds = NULL;
+	}
+
+	commands_reclaim(ccli);
+}
+
+__hidden struct command *find_command(struct command_table *cmds, const char *cmd)
+{
+	int i;
+
+	for (i = 0; i < cmds->nr_commands; i++) {
+		if (strcmp(cmd, cmds->commands[i].cmd) == 0)
+			return &cmds->commands[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * ccli_unregister_command - Remove a command from the CLI interface
+ * @ccli: The CLI descriptor to remove the command from
+ * @command_name: The command name to remove
+ *
+ * Removes the registered command named @command_name from @ccli.
+ *
+ * This may be called from any thread, even while another thread is
+ * running ccli_loop().
+ *
+ * Returns 0 on successful removal, or -1 on error or @command_name not found.
+ *   ERRNO will only be set for error and will not be touched if the
+ *  @command_name was not found.
+ */
+int ccli_unregister_command(struct ccli *ccli, const char *command_name)
+{
+	struct command_table *cmds;
+	struct command *cmd;
+	int ret = -1;
+	int cnt;
+	int i;
+
+	if (!ccli || !command_name) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	cmd = find_command(ccli->cmds, command_name);
+	if (!cmd)
+		goto out;
+
+	cmds = commands_copy(ccli, 0);
+	if (!cmds)
+		goto out;
+
+	i = cmd - ccli->cmds->commands;
+	cnt = (cmds->nr_commands - i) - 1;
+	if (cnt)
+		memmove(&cmds->commands[i], &cmds->commands[i + 1],
+			cnt * sizeof(*cmd));
+	cmds->nr_commands--;
+
+	/* Readers of the old table may still be looking at the name */
+	commands_publish(ccli, cmds, cmd->cmd);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&ccli->cmd_lock);
+	return ret;
+}
+
+/**
+ * ccli_register_command - Register a command for the CLI interface.
+ * @ccli: The CLI descriptor to register a command for.
+ * @command_name: the text that will execute the command.
+ * @callback: The callback function to call when the command is executed.
+ * @data: Data to pass to the @callback function.
+ *
+ * Register the command @command_name to @ccli. When the user types
+ * that command, it will trigger the @callback which will be passed
+ * the arguments that the user typed, along with the @data pointer.
+ *
+ * This may be called from any thread, even while another thread is
+ * running ccli_loop(). A command that is already executing when it
+ * is replaced finishes with the @callback and @data it started with.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_command(struct ccli *ccli, const char *command_name,
+			  ccli_command_callback callback, void *data)
+{
+	struct command_table *cmds;
+	struct command *old;
+	struct command *cmd;
+	char *name = NULL;
+	int ret = -1;
+
+	if (!ccli || !command_name || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	old = find_command(ccli->cmds, command_name);
+	if (!old) {
+		if (ccli->limits.commands_max &&
+		    ccli->cmds->nr_commands >= ccli->limits.commands_max) {
+			errno = ENOSPC;
+			goto out;
+		}
+
+		name = mem_strdup(ccli, command_name);
+		if (!name)
+			goto out;
+	}
+
+	cmds = commands_copy(ccli, old ? 0 : 1);
+	if (!cmds) {
+		mem_free(ccli, name);
+		goto out;
+	}
+
+	if (old) {
+		/* override it with this one */
+		cmd = &cmds->commands[old - ccli->cmds->commands];
+	} else {
+		cmd = &cmds->commands[cmds->nr_commands++];
+		memset(cmd, 0, sizeof(*cmd));
+		cmd->cmd = name;
+	}
+
+	cmd->callback = callback;
+	cmd->data = data;
+
+	commands_publish(ccli, cmds, NULL);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&ccli->cmd_lock);
+	return ret;
+}
+
+/* Replace one of the special callbacks held in the command table */
+static int register_special(struct ccli *ccli, size_t offset,
+			    ccli_command_callback callback, void *data)
+{
+	struct command_table *cmds;
+	struct command *cmd;
+
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	cmds = commands_copy(ccli, 0);
+	if (!cmds) {
+		pthread_mutex_unlock(&ccli->cmd_lock);
+		return -1;
+	}
+
+	cmd = (void *)cmds + offset;
+	cmd->callback = callback;
+	cmd->data = data;
+
+	commands_publish(ccli, cmds, NULL);
+
+	pthread_mutex_unlock(&ccli->cmd_lock);
+	return 0;
+}
+
+/**
+ * ccli_register_default - Register a callback for just "enter".
+ * @ccli: The CLI descriptor to register the default for.
+ * @callback: The callback function to call when just "enter" is hit.
+ * @data: Data to pass to the @callback function.
+ *
+ * When the user hits enter with nothing on the command line, the
+ * @callback function will be called just like any other command is
+ * called, but the command_name parameter will be empty.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_default(struct ccli *ccli,
+			  ccli_command_callback callback, void *data)
+{
+	if (!ccli || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return register_special(ccli, offsetof(struct command_table, enter),
+				callback, data);
+}
+
+/**
+ * ccli_register_unknown - Register a callback for unknown commands.
+ * @ccli: The CLI descriptor to register the default for.
+ * @callback: The callback function to call when a command is unknown
+ * @data: Data to pass to the @callback function.
+ *
+ * When the user hits enters a command that is not registered, the
+ * @callback function will be called just like any other command is
+ * called.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_unknown(struct ccli *ccli,
+			  ccli_command_callback callback, void *data)
+{
+	if (!ccli || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return register_special(ccli, offsetof(struct command_table, unknown),
+				callback, data);
+}
+
+/**
+ * ccli_register_interrupt - Register what to do on SIGINT
+ * @ccli: The CLI descriptor to register to.
+ * @callback: The callback function to call when user hits Ctrl^C
+ * @data: The data to pass to the callback.
+ *
+ * This allows the application to register a function when the user
+ * hits Ctrl^C. Currently the default operation is simply to print
+ * "^C\n" and exit. But this allows the application to override that
+ * operation.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_interrupt(struct ccli *ccli, ccli_interrupt callback,
+			    void *data)
+{
+	struct command_table *cmds;
+
+	if (!ccli || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	cmds = commands_copy(ccli, 0);
+	if (!cmds) {
+		pthread_mutex_unlock(&ccli->cmd_lock);
+		return -1;
+	}
+
+	cmds->interrupt = callback;
+	cmds->interrupt_data = data;
+	commands_publish(ccli, cmds, NULL);
+
+	pthread_mutex_unlock(&ccli->cmd_lock);
+	return 0;
+}
+
+__hidden int execute(struct ccli *ccli, const char *line, bool hist)
+{
+	struct watchdog_save save;
+	struct timing_save tsave;
+	struct command_table *cmds;
+	struct command *found = NULL;
+	struct command cmd;
+	bool armed;
+	char **argv;
+	int argc;
+	int ret = 0;
+
+	argc = line_parse(ccli, line, &argv);
+	if (argc < 0) {
+		echo_str(ccli, "Error parsing command\n");
+		return 0;
+	}
+
+	/*
+	 * The command is copied out of the table, as the table is not
+	 * held while the command executes. The name passed to it is
+	 * argv[0] which is the same string.
+	 */
+	cmds = commands_get(ccli);
+	if (!argc) {
+		cmd = cmds->enter;
+	} else {
+		found = find_command(cmds, argv[0]);
+		cmd = found ? *found : cmds->unknown;
+	}
+	commands_put(ccli);
+
+	if (!argc) {
+		line_argv_free(ccli, argv);
+		trace_probe(command__start, "", 0);
+		armed = watchdog_arm(ccli, "", cmd.timeout, &save);
+		ret = cmd.callback(ccli, "", line, cmd.data, 0, NULL);
+		if (armed)
+			watchdog_disarm(ccli, &save);
+		trace_probe(command__end, "", ret);
+		return ret;
+	}
+
+	trace_probe(command__start, argv[0], argc);
+	if (ccli->timings)
+		timing_start(ccli, &tsave);
+	armed = watchdog_arm(ccli, argv[0], cmd.timeout, &save);
+	ret = cmd.callback(ccli, argv[0], line, cmd.data, argc, argv);
+	if (armed)
+		watchdog_disarm(ccli, &save);
+	if (ccli->timings)
+		timing_end(ccli, found ? argv[0] : NULL, &tsave);
+	trace_probe(command__end, argv[0], ret);
+
+	line_argv_free(ccli, argv);
+
+	if (hist)
+		history_add(ccli, line);
+
+	return ret;
+}
+
+/**
+ * ccli_execute - Execute a command from outside the loop
+ * @ccli: The ccli descriptor
+ * @line_str: The line to execute as if a user typed it.
+ * @hist: Add to history or not?
+ *
+ * Execute a line as if the user typed it from outside the loop.
+ * The application may want to initiate some commands before executing
+ * the loop (like to reply commands from a previous session). This
+ * gives that ability.
+ *
+ * If @hist is true, then the command is added to the history,
+ * otherwise it is not.
+ *
+ * This must not be called while another thread is running ccli_loop()
+ * on @ccli, as the command would be executed on that loop's line.
+ *
+ * Returns whatever the command being executed would return.
+ *  If a memory allocation happens, -1 is returned and ERRNO is set.
+ */
+int ccli_execute(struct ccli *ccli, const char *line_str, bool hist)
+{
+	struct line_buf *old_line = ccli->line;
+	struct line_buf line;
+	int ret;
+
+	ret = line_init_str(&line, line_str, &ccli->pools[CCLI_POOL_LINE]);
+	if (ret < 0)
+		return ret;
+
+	ccli->line = &line;
+	ret = execute(ccli, line.line, hist);
+	line_cleanup(&line);
+	ccli->line = old_line;
+	return ret;
+}
+
+#line 1 "src/complete.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * CLI interface for C.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <stdarg.h>
+#include <sys/ioctl.h>
+
+
+
+/**
+ * ccli_register_completion - Register a completion for command
+ * @ccli: The CLI descriptor to register a completion for.
+ * @command_name: The command that the completion is for.
+ * @completion: The completion function to call.
+ *
+ * Register a @completion function to be called when the user had
+ * typed a command and hits tab on one of its pramaters.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_completion(struct ccli *ccli, const char *command_name,
+			     ccli_completion completion)
+{
+	struct command_table *cmds;
+	struct command *cmd;
+	int ret = -1;
+
+	if (!ccli || !command_name || !completion) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	cmd = find_command(ccli->cmds, command_name);
+	if (!cmd) {
+		errno = ENODEV;
+		goto out;
+	}
+
+	cmds = commands_copy(ccli, 0);
+	if (!cmds)
+		goto out;
+
+	cmds->commands[cmd - ccli->cmds->commands].completion = completion;
+	commands_publish(ccli, cmds, NULL);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&ccli->cmd_lock);
+	return ret;
+}
+
+/**
+ * ccli_register_default_completion - Register a completion to do for unknown commmands
+ * @ccli: The CLI descriptor to register the default completion
+ * @completion: The completion function to call for unknown commands
+ * @data: The data to pass to that completion.
+ *
+ * Have @completion be called for the first word parsing that doesn't have a
+ * command registered for it.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_default_completion(struct ccli *ccli, ccli_completion completion,
+				     void *data)
+{
+	struct command_table *cmds;
+
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	cmds = commands_copy(ccli, 0);
+	if (!cmds) {
+		pthread_mutex_unlock(&ccli->cmd_lock);
+		return -1;
+	}
+
+	cmds->default_completion = completion;
+	cmds->default_completion_data = data;
+	commands_publish(ccli, cmds, NULL);
+
+	pthread_mutex_unlock(&ccli->cmd_lock);
+	return 0;
+}
+
+/* If @str starts with @match, that is @mlen long */
+static inline bool has_prefix(const char *str, const char *match, int mlen)
+{
+	return str_prefix(str, match) == mlen;
+}
+
+static void print_completion_flat(struct ccli *ccli, const char *match,
+				  int len, int nr_str, char **strings, int index)
+{
+	int i;
+
+	for (i = 0; i < nr_str; i++) {
+		if (has_prefix(strings[i], match, len)) {
+			echo_str(ccli, strings[i] + index);
+			echo(ccli, '\n');
+		}
+	}
+}
+
+static void echo_spaces(struct ccli *ccli, int cnt)
+{
+	static const char spaces[] = "                                ";
+	int len;
+
+	for (; cnt > 0; cnt -= len) {
+		len = cnt < sizeof(spaces) - 1 ? cnt : sizeof(spaces) - 1;
+		echo_str_len(ccli, (char *)spaces, len);
+	}
+}
+
+static void print_completion(struct ccli *ccli, const char *match,
+			     int len, int nr_str, char **strings, int index)
+{
+	struct winsize w;
+	char *str;
+	int max_len = 0;
+	int cols, rows;
+	int i, x, c = 0;
+	int ret;
+
+	if (index > len)
+		index = len;
+
+	if (!ccli->in_tty)
+		return print_completion_flat(ccli, match, len,
+					     nr_str, strings, index);
+
+	ret = ioctl(ccli->in, TIOCGWINSZ, &w);
+	if (ret)
+		return print_completion_flat(ccli, match, len,
+					     nr_str, strings, index);
+	cols = w.ws_col;
+
+	for (i = 0, x = 0; i < nr_str; i++) {
+		if (has_prefix(strings[i], match, len)) {
+			if (strlen(strings[i]) > max_len)
+				max_len = strlen(strings[i]);
+			if (i != x) {
+				/* Keep all matches at the front */
+				str = strings[x];
+				strings[x] = strings[i];
+				strings[i] = str;
+			}
+			x++;
+		}
+	}
+	if (!max_len)
+		return;
+
+	max_len -= index;
+
+	nr_str = x;
+
+	cols = cols / (max_len + 2);
+	if (!cols)
+		cols = 1;
+
+	rows = (nr_str + cols - 1) / cols;
+
+	for (i = 0; i < rows; i++) {
+		char ans = 0;;
+
+		if (check_for_ctrl_c(ccli))
+			break;
+
+		if (!c && i && !(i % (w.ws_row - 1))) {
+			ans = page_stop(ccli);
+			switch (ans) {
+			case 'q':
+				i = rows;
+				continue;
+			case 'c':
+				c = 1;
+				break;
+			}
+		}
+		for (x = 0; x < cols; x++) {
+			if (x * rows + i >= nr_str)
+				continue;
+			if (x)
+				echo_str(ccli, "  ");
+			str = strings[x * rows + i];
+			str += index;
+			echo_str(ccli, str);
+			echo_spaces(ccli, max_len - strlen(str));
+		}
+		echo(ccli, '\n');
+	}
+}
+
+
+static int find_matches(const char *match, int mlen, char **list, int cnt,
+			int *last_match, int *max)
+{
+	int max_match = -1;
+	int matched = 0;
+	int i, x, l, m = -1;
+
+	for (i = 0; i < cnt; i++) {
+		/* If list[i] failed to allocate, we need to handle that */
+		if (!list[i])
+			continue;
+		if (has_prefix(list[i], match, mlen)) {
+			if (m >= 0) {
+				x = str_prefix(list[m], list[i]);
+				if (max_match < 0 || x < max_match)
+					max_match = x;
+			} else {
+				m = i;
+			}
+			matched++;
+			l = i;
+		}
+	}
+	*last_match = l;
+	*max = max_match;
+	return matched;
+}
+
+/*
+ * The words of the list that do_completion() hands to the completion
+ * callbacks are copied into an arena instead of being allocated one
+ * at a time. The arena chunks come from the completion pool, so once
+ * the pool is warmed up, hitting tab does not need to allocate.
+ */
+struct arena_chunk {
+	struct arena_chunk	*next;
+	size_t			size;
+	size_t			used;
+	char			data[];
+};
+
+/* The first arena chunk, each new chunk doubles in size */
+#define ARENA_CHUNK	(BUFSIZ - sizeof(struct arena_chunk))
+
+static char *arena_alloc(struct ccli *ccli, size_t len)
+{
+	struct arena_chunk *chunk = ccli->comp_arena;
+	size_t size;
+	char *p;
+
+	if (!chunk || chunk->used + len > chunk->size) {
+		size = chunk ? chunk->size * 2 : ARENA_CHUNK;
+		while (size < len)
+			size *= 2;
+		chunk = pool_alloc(&ccli->pools[CCLI_POOL_COMPLETION],
+				   sizeof(*chunk) + size);
+		if (!chunk)
+			return NULL;
+		/* The pool may have given us more than we asked for */
+		chunk->size = pool_size(chunk) - sizeof(*chunk);
+		chunk->used = 0;
+		chunk->next = ccli->comp_arena;
+		ccli->comp_arena = chunk;
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += len;
+	return p;
+}
+
+static bool arena_owns(struct ccli *ccli, const char *word)
+{
+	struct arena_chunk *chunk;
+
+	for (chunk = ccli->comp_arena; chunk; chunk = chunk->next) {
+		if (word >= chunk->data && word < chunk->data + chunk->size)
+			return true;
+	}
+	return false;
+}
+
+static void arena_release(struct ccli *ccli)
+{
+	struct arena_chunk *chunk;
+
+	while (ccli->comp_arena) {
+		chunk = ccli->comp_arena;
+		ccli->comp_arena = chunk->next;
+		pool_free(&ccli->pools[CCLI_POOL_COMPLETION], chunk);
+	}
+}
+
+/* Is @list the list that do_completion() allocated from the pool? */
+static bool is_comp_list(struct ccli *ccli, char **list)
+{
+	return ccli && list && list == ccli->comp_list;
+}
+
+static char *list_strdup(struct ccli *ccli, char **list, const char *word)
+{
+	char *str;
+	int len;
+
+	if (!is_comp_list(ccli, list))
+		return mem_strdup(ccli, word);
+
+	len = strlen(word) + 1;
+	str = arena_alloc(ccli, len);
+	if (str)
+		memcpy(str, word, len);
+	return str;
+}
+
+static void list_word_free(struct ccli *ccli, char *word)
+{
+	if (ccli && arena_owns(ccli, word))
+		return;
+	mem_free(ccli, word);
+}
+
+static int do_strcmp(char * const *a, char * const *b)
+{
+	/* Handle NULLs (they go at the end) */
+	if (!*a || !*b) {
+		if (*a)
+			return -1;
+		return !!(*b);
+	}
+
+	return strcmp(*a, *b);
+}
+
+static void swap_words(char **list, int a, int b)
+{
+	char *tmp = list[a];
+
+	list[a] = list[b];
+	list[b] = tmp;
+}
+
+static void sift_down(char **list, int start, int cnt)
+{
+	int child;
+
+	while ((child = start * 2 + 1) < cnt) {
+		if (child + 1 < cnt &&
+		    do_strcmp(&list[child], &list[child + 1]) < 0)
+			child++;
+		if (do_strcmp(&list[start], &list[child]) >= 0)
+			break;
+		swap_words(list, start, child);
+		start = child;
+	}
+}
+
+/*
+ * qsort() may allocate memory for a merge sort, and completions must
+ * work without the heap (see ccli_alloc_static()). Use a heap sort,
+ * as that is done in place.
+ */
+static void sort_words(char **list, int cnt)
+{
+	int i;
+
+	for (i = cnt / 2 - 1; i >= 0; i--)
+		sift_down(list, i, cnt);
+
+	for (i = cnt - 1; i > 0; i--) {
+		swap_words(list, 0, i);
+		sift_down(list, 0, i);
+	}
+}
+
+static int sort_unique(struct ccli *ccli, char **list, int cnt)
+{
+	int l;
+	int i;
+
+	sort_words(list, cnt);
+
+	for (l = 0, i = 0; i < cnt && list[i]; i++) {
+		if (!i)
+			continue;
+		if (strcmp(list[l], list[i]) != 0) {
+			l++;
+			if (l != i) {
+				list_word_free(ccli, list[l]);
+				list[l] = list[i];
+				list[i] = NULL;
+			}
+		}
+	}
+
+	if (l < cnt && list[l])
+		l++;
+
+	for (i = l; i < cnt; i++) {
+		list_word_free(ccli, list[i]);
+		list[i] = NULL;
+	}
+
+	return l;
+}
+
+static void insert_word(struct ccli *ccli, struct line_buf *line,
+			const char *word, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		line_insert(line, word[i]);
+}
+
+/* Allocate new lists in 64 word blocks */
+#define LIST_BLK	64
+#define LIST_MASK	(LIST_BLK - 1)
+
+static char **update_list(struct ccli *ccli, char ***list, int size)
+{
+	struct pool *pool;
+	char **words = *list;
+
+	if (ccli && ccli->limits.completions_max &&
+	    size >= ccli->limits.completions_max) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	if (!(size & LIST_MASK)) {
+		/* (size + 1 + LIST_BLK - 1) & ~(LIST_MASK) */
+		size = (size + LIST_BLK) & ~(LIST_MASK);
+
+		/*
+		 * The first list created while doing a completion
+		 * comes from the completion pool.
+		 */
+		if (ccli && ccli->in_completion && !words && !ccli->comp_list) {
+			pool = &ccli->pools[CCLI_POOL_COMPLETION];
+			words = pool_alloc(pool, sizeof(*words) * (size + 2));
+			ccli->comp_list = words;
+		} else if (is_comp_list(ccli, words)) {
+			pool = &ccli->pools[CCLI_POOL_COMPLETION];
+			words = pool_realloc(pool, words, sizeof(*words) * (size + 2));
+			if (words)
+				ccli->comp_list = words;
+		} else {
+			/* Add two to be on the safe side */
+			words = mem_realloc(ccli, words, sizeof(*words) * (size + 2));
+		}
+		if (!words)
+			return NULL;
+		*list = words;
+	}
+	return words;
+}
+
+/**
+ * ccli_list_add - add an copy of a word to the completion list
+ * @ccli: The CLI descriptor.
+ * @list: The list to add to.
+ * @cnt: The current count of items in the list (do not touch)
+ * @word: The word to add to the list.
+ *
+ * Add a @word to the completion list. It will allocate and copy the
+ * @word. If it fails the allocation of the copy, it will continue as
+ * the list can handle NULL entries.
+ *
+ * When adding to the list passed to a completion callback, the copy
+ * comes from the completion pool of @ccli, and must only be freed
+ * with ccli_list_free().
+ *
+ * The @cnt must be initialized to zero, and not touched by the application.
+ * The only modifications to @cnt should be done by one of the list
+ * helper functions.
+ *
+ * Returns the new size of the list on success (even if it fails to
+ *   do the copy, but it does increase the size of the list.
+ *
+ * Returns -1 if it failed to increase the size of the list.
+ */
+int ccli_list_add(struct ccli *ccli, char ***list, int *cnt, const char *word)
+{
+	char **words;
+	int size = *cnt;
+
+	words = update_list(ccli, list, size);
+	if (!words)
+		return -1;
+
+	words[size] = list_strdup(ccli, words, word);
+	/* It's OK if it fails, we can handle it. */
+
+	*cnt = size + 1;
+	return *cnt;
+}
+
+/**
+ * ccli_list_insert - add a pointer to a word to the completion list
+ * @ccli: The CLI descriptor.
+ * @list: The list to add to.
+ * @cnt: The current count of items in the list (do not touch)
+ * @word: The word to add to the list.
+ *
+ * Add a @word to the completion list. It will add the pointer to @word
+ * to the list. The difference between this and ccli_list_add() is that
+ * ccli_list_add() will allocate a copy of @word, where this will use
+ * @word itself to add to the list.
+ *
+ * Note, @word will be freed when the list is freed. If an allocator was
+ * set with ccli_set_allocator(), then @word must come from it.
+ *
+ * The @cnt must be initialized to zero, and not touched by the application.
+ * The only modifications to @cnt should be done by one of the list
+ * helper functions.
+ *
+ * Returns the new size of the list on success, or -1 if it failed to
+ *   increase the size of the list.
+ */
+int ccli_list_insert(struct ccli *ccli, char ***list, int *cnt, char *word)
+{
+	char **words;
+	int size = *cnt;
+
+	words = update_list(ccli, list, size);
+	if (!words)
+		return -1;
+
+	words[size] = word;
+
+	*cnt = size + 1;
+	return *cnt;
+}
+
+/**
+ * ccli_list_add_printf - add a string to the list
+ * @ccli: The CLI descriptor.
+ * @list: The list to add to.
+ * @cnt: The current count of items in the list (do not touch)
+ * @fmt: The printf format to add
+ *
+ * Add a string to the completion list that is defined by the fmt
+ * and parameters.
+ *
+ * The @cnt must be initialized to zero, and not touched by the application.
+ * The only modifications to @cnt should be done by one of the list
+ * helper functions.
+ *
+ * Returns the new size of the list on success (even if it fails to
+ *   allocate the string, but it does increase the size of the list.
+ *
+ * Returns -1 if it failed to increase the size of the list.
+ */
+int ccli_list_add_printf(struct ccli *ccli, char ***list, int *cnt, const char *fmt, ...)
+{
+	va_list ap;
+	char **words;
+	char *str;
+	int size = *cnt;
+	int len;
+
+	words = update_list(ccli, list, size);
+	if (!words)
+		return -1;
+
+	va_start(ap, fmt);
+	if (is_comp_list(ccli, words)) {
+		va_list ap2;
+
+		va_copy(ap2, ap);
+		len = vsnprintf(NULL, 0, fmt, ap2);
+		va_end(ap2);
+		str = len >= 0 ? arena_alloc(ccli, len + 1) : NULL;
+		if (str)
+			vsnprintf(str, len + 1, fmt, ap);
+		words[size] = str;
+	} else {
+		mem_vasprintf(ccli, &str, fmt, ap);
+		words[size] = str;
+	}
+	va_end(ap);
+	/* It's OK if it fails, we can handle it. */
+
+	*cnt = size + 1;
+	return *cnt;
+}
+
+/**
+ * ccli_list_free - free a completion list
+ * @ccli: The CLI descriptor.
+ * @list: The list to free.
+ * @cnt: The number of items on the list.
+ *
+ * Will free the @list.
+ */
+void ccli_list_free(struct ccli *ccli, char ***list, int cnt)
+{
+	char **words = *list;
+	int i;
+
+	if (!words)
+		return;
+
+	for (i = 0; i < cnt; i++)
+		list_word_free(ccli, words[i]);
+
+	if (is_comp_list(ccli, words)) {
+		pool_free(&ccli->pools[CCLI_POOL_COMPLETION], words);
+		ccli->comp_list = NULL;
+	} else {
+		mem_free(ccli, words);
+	}
+	*list = NULL;
+}
+
+static void release_list(struct ccli *ccli, char **list, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		list_word_free(ccli, list[i]);
+
+	if (is_comp_list(ccli, list))
+		list = NULL;
+	mem_free(ccli, list);
+
+	/* The callback may have replaced the list that came from the pool */
+	pool_free(&ccli->pools[CCLI_POOL_COMPLETION], ccli->comp_list);
+	ccli->comp_list = NULL;
+
+	arena_release(ccli);
+}
+
+__hidden void do_completion(struct ccli *ccli, struct line_buf *line, int tab)
+{
+	struct command_table *cmds;
+	struct command *cmd = NULL;
+	struct line_buf copy;
+	char **list = NULL;
+	char empty[1] = "";
+	char **argv;
+	char *match;
+	char delim;
+	int matched = 0;
+	int index = 0;
+	int word;
+	int argc;
+	int mlen;
+	int last;
+	int max;
+	int len;
+	int cnt = 0;
+	int ret;
+	int i;
+
+	stat_add(ccli, completions, 1);
+
+	ret = line_copy(&copy, line, line->pos);
+	if (ret < 0)
+		return;
+
+	trace_probe(completion__start, copy.line);
+
+	argc = line_parse(ccli, copy.line, &argv);
+	if (argc < 0)
+		goto out;
+
+	ccli->in_completion = true;
+
+	word = argc - 1;
+
+	/* If the cursor is on a space, there's no word to match */
+	if (word < 0 || ISSPACE(copy.line[copy.pos - 1])) {
+		match = empty;
+		word++;
+	} else {
+		match = argv[word];
+	}
+
+	mlen = strlen(match);
+
+	cmds = commands_get(ccli);
+
+	/* Do the registered completions first */
+	if (word) {
+		cmd = find_command(cmds, argv[0]);
+		if (cmd && cmd->completion)
+			cnt = cmd->completion(ccli, cmd->cmd, copy.line, word,
+					      match, &list, cmd->data);
+	}
+
+	/*
+	 * Next do the default completion operation
+	 * if command completion was not done
+	 */
+	if ((!cmd || !cmd->completion) && cmds->default_completion)
+		cnt = cmds->default_completion(ccli, NULL, copy.line, word,
+					       match, &list,
+					       cmds->default_completion_data);
+	delim = match[mlen];
+	match[mlen] = '\0';
+	if (!delim)
+		delim = ' ';
+
+	/* If nothing was matched yet */
+	if (cnt >= 0 && !word) {
+		/* Try matching with the list of commands */
+		for (i = 0; i < cmds->nr_commands; i++) {
+			/* No need to add what will not match */
+			if (!has_prefix(cmds->commands[i].cmd, match, mlen))
+				continue;
+			ccli_list_add(ccli, &list, &cnt, cmds->commands[i].cmd);
+		}
+	}
+
+	commands_put(ccli);
+
+	if (cnt < 0) {
+		cnt = 0;
+		goto free_list;
+	}
+
+#ifndef CCLI_NO_FILE_COMPLETION
+	index = ccli->display_index;
+#endif
+
+	cnt = sort_unique(ccli, list, cnt);
+	matched = find_matches(match, mlen, list, cnt, &last, &max);
+
+	trace_probe(completion__end, cnt, matched);
+
+	if (matched == 1) {
+		len = strlen(list[last]);
+		insert_word(ccli, line, list[last] + mlen, len - mlen);
+		if (delim != CCLI_NOSPACE)
+			line_insert(line, delim);
+	}
+
+	if (matched > 1 && max > mlen)
+		insert_word(ccli, line, list[last] + mlen, max - mlen);
+
+	if (tab && matched > 1) {
+		echo(ccli, '\n');
+		print_completion(ccli, match, mlen, cnt, list, index);
+	}
+	line_refresh(ccli, line, 0);
+
+ free_list:
+	release_list(ccli, list, cnt);
+	ccli->in_completion = false;
+	line_argv_free(ccli, argv);
+ out:
+#ifndef CCLI_NO_FILE_COMPLETION
+	ccli->display_index = 0;
+#endif
+	line_cleanup(&copy);
+	line_refresh(ccli, ccli->line, 0);
+}
+
+#line 1 "src/file.c"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <string.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "ccli.h"
+
+
+
+#ifndef CCLI_NO_FILE_COMPLETION
+static int file_completion(struct ccli *ccli, char ***list,
+			   int *cnt, int mode, const char **ext, char *match,
+			   const char *dirname)
+{
+	char filename[PATH_MAX];
+	struct dirent *dent;
+	const char *dname;
+	const char *base;
+	struct stat st;
+	int mode_ifmt = mode & S_IFMT;
+	int mode_perm = mode & ~S_IFMT;
+	DIR *dir;
+	char *m;
+	int mlen;
+	int len;
+	int ret = *cnt;
+
+	mlen = strlen(match);
+
+	m = mem_strdup(ccli, match);
+	if (!m)
+		return -1;
+
+	if (!mlen) {
+		base = "";
+		dname = "";
+	} else if (m[mlen - 1] == '/') {
+		base = "";
+		dname = m;
+	} else {
+		for (base = match + strlen(match); base >= match && *base != '/'; base--)
+			;
+		base++;
+		dname = m;
+		m[base - match] = '\0';
+	}
+
+	len = strlen(base);
+
+	/*
+	 * dirname comes from the PATH list. If it is NULL and dname has no
+	 * length, then set dirname to ".", and search the current directory.
+	 * Note, this is only hit for seaching for local directories, as the
+	 * caller will set mode to be S_IFDIR.
+	 *
+	 * If there is a directory name, set the display_index to its length
+	 * to tell the printing output to skip over it.
+	 */
+	if (!dirname && dname[0] == '\0')
+		dirname = ".";
+	else
+		ccli->display_index = strlen(dname);
+
+	if (dirname)
+		dir = opendir(dirname);
+	else
+		dir = opendir(dname);
+	if (!dir) {
+		mem_free(ccli, m);
+		return -1;
+	}
+
+	while ((dent = readdir(dir)) > 0) {
+		int type = 0;
+
+		if (strcmp(dent->d_name, ".") == 0 ||
+		    strcmp(dent->d_name, "..") == 0) {
+			continue;
+		}
+
+		if (len && strncmp(dent->d_name, base, len) != 0)
+			continue;
+
+		if (dirname)
+			snprintf(filename, PATH_MAX, "%s/%s", dirname, dent->d_name);
+		else
+			snprintf(filename, PATH_MAX, "%s%s", dname, dent->d_name);
+
+		/* File doesn't exist? */
+		if (stat(filename, &st) != 0)
+			continue;
+
+		/* Always match directories */
+		if ((st.st_mode & S_IFMT) == S_IFDIR) {
+			type = S_IFDIR;
+
+		/* If file type is given, check for it */
+		} else if (mode_ifmt && (mode_ifmt != (st.st_mode & S_IFMT))) {
+			continue;
+
+		/* If permissions are given, check for them */
+		} else if (mode_perm && !(mode_perm & st.st_mode)) {
+				continue;
+
+		/* If file extensions are given, match them too */
+		} else if (ext) {
+			int dlen = strlen(dent->d_name);
+			bool found = false;
+			int i;
+
+			for (i = 0; !found && ext[i]; i++) {
+				int elen = strlen(ext[i]);
+				char *d;
+
+				if (dlen < elen)
+					continue;
+
+				d = dent->d_name + (dlen - elen);
+
+				if (strcmp(d, ext[i]) == 0) {
+					found = true;
+					break;
+				}
+			}
+			if (!found)
+				continue;
+		}
+
+		/* If dirname is specified, only list the files */
+		if (dirname)
+			snprintf(filename, PATH_MAX, "%s", dent->d_name);
+
+		if (type == S_IFDIR) {
+			strcat(filename, "/");
+			match[mlen] = CCLI_NOSPACE;
+		}
+		ret = ccli_list_add(ccli, list, cnt, filename);
+	}
+	closedir(dir);
+
+	mem_free(ccli, m);
+
+	return ret;
+}
+
+/**
+ * ccli_file_completion - helper to find local files
+ * @ccli: The ccli descriptor
+ * @list: The list of files to return for the completion
+ * @cnt: A pointer of the current number of list items.
+ * @match: The current match string
+ * @ext: A NULL terminated list of possible file extensions (maybe NULL)
+ * @PATH: An optional pointer to a PATH environment variable (may be NULL)
+ *
+ * This is a helper function for the use case of finding files within an
+ * option of a command. It will match the @match string (or all files if
+ * the string has no length). If @match starts with a '/', then it will do
+ * an absolute path lookup. Otherwise it will look at @PATH and parse it like
+ * the PATH environment variable, and seach for matches within the directories
+ * specified by that variable (using the "path1:path2:path3" syntax).
+ *
+ * Returns the number of items in list, or -1 on error.
+ */
+int ccli_file_completion(struct ccli *ccli, char ***list, int *cnt, char *match,
+                         int mode, const char **ext, const char *PATH)
+{
+	char *savetok;
+	char *tok;
+	char *P;
+	char delim = '\0';
+	int mlen = strlen(match);
+	int ret;
+
+	/* If match is already a directory ... */
+	if (strchr(match, '/'))
+		return file_completion(ccli, list, cnt, mode, ext, match, NULL);
+
+	/* If PATH is NULL only look at current directories */
+	if (!PATH)
+		return file_completion(ccli, list, cnt, S_IFDIR, ext, match, NULL);
+
+	P = mem_strdup(ccli, PATH);
+	if (!P)
+		return -1;
+
+	for (tok = P, ret = 0; ret >= 0 ; tok = NULL) {
+		tok = strtok_r(tok, ":", &savetok);
+		if (!tok)
+			break;
+		ret = file_completion(ccli, list, cnt, mode, ext, match, tok);
+		/* Handle modifying of the match end */
+		if (delim == '\0')
+			delim = match[mlen];
+		match[mlen] = '\0';
+	}
+	mem_free(ccli, P);
+
+	/* Update the delim part of match */
+	if (delim != '\0')
+		match[mlen] = delim;
+	return ret;
+}
+#else
+/* Built with CCLI_NO_FILE_COMPLETION */
+int ccli_file_completion(struct ccli *ccli, char ***list, int *cnt, char *match,
+                         int mode, const char **ext, const char *PATH)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
+
+#line 1 "src/pool.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Per session memory pools.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+
+
+/*
+ * Every block handed out by the pool has this header in front of it.
+ * While the block is in use, only the size is valid. When the block
+ * is freed back to the pool, next is used to link it on the free list.
+ */
+struct pool_block {
+	struct pool_block	*next;
+	size_t			size;
+};
+
+static inline struct pool_block *to_block(void *ptr)
+{
+	return (struct pool_block *)ptr - 1;
+}
+
+/**
+ * pool_alloc - allocate a block from a pool
+ * @pool: The pool to allocate from
+ * @size: The minimum size of the block
+ *
+ * Returns the smallest block on the free list of @pool that can hold
+ * @size bytes, and only if there is none, allocates a new one.
+ *
+ * Returns the block or NULL on allocation failure.
+ */
+__hidden void *pool_alloc(struct pool *pool, size_t size)
+{
+	struct pool_block **best = NULL;
+	struct pool_block **last;
+	struct pool_block *blk;
+
+	pool->stats.allocs++;
+
+	for (last = &pool->free; *last; last = &(*last)->next) {
+		if ((*last)->size < size)
+			continue;
+		if (!best || (*last)->size < (*best)->size)
+			best = last;
+	}
+
+	if (best) {
+		blk = *best;
+		*best = blk->next;
+		pool->stats.hits++;
+		pool->stats.cached--;
+		pool->stats.cached_bytes -= blk->size;
+		return blk + 1;
+	}
+
+	pool->stats.misses++;
+
+	blk = mem_alloc(pool->ccli, sizeof(*blk) + size);
+	if (!blk)
+		return NULL;
+
+	blk->size = size;
+	return blk + 1;
+}
+
+__hidden void *pool_zalloc(struct pool *pool, size_t size)
+{
+	void *ptr;
+
+	ptr = pool_alloc(pool, size);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+/**
+ * pool_realloc - grow a block that came from a pool
+ * @pool: The pool that @ptr came from
+ * @ptr: The block to grow (may be NULL)
+ * @size: The new size
+ *
+ * Nothing is done if @ptr is already big enough. Otherwise, this acts
+ * like realloc(), where @ptr is still valid if this fails.
+ *
+ * Returns the new block or NULL on failure.
+ */
+__hidden void *pool_realloc(struct pool *pool, void *ptr, size_t size)
+{
+	struct pool_block *blk;
+
+	if (!ptr)
+		return pool_alloc(pool, size);
+
+	blk = to_block(ptr);
+	if (blk->size >= size)
+		return ptr;
+
+	pool->stats.allocs++;
+	pool->stats.misses++;
+
+	blk = mem_realloc(pool->ccli, blk, sizeof(*blk) + size);
+	if (!blk)
+		return NULL;
+
+	blk->size = size;
+	return blk + 1;
+}
+
+/* Return the usable size of a block returned by pool_alloc() */
+__hidden size_t pool_size(void *ptr)
+{
+	return to_block(ptr)->size;
+}
+
+/**
+ * pool_free - put a block back into a pool
+ * @pool: The pool that @ptr came from
+ * @ptr: The block to free
+ *
+ * Adds @ptr to the free list of @pool to be used by the next
+ * pool_alloc(). If the pool already has POOL_MAX_FREE blocks
+ * cached, or @ptr is bigger than POOL_MAX_BLOCK, then @ptr is really
+ * freed.
+ */
+__hidden void pool_free(struct pool *pool, void *ptr)
+{
+	struct pool_block *blk;
+
+	if (!ptr)
+		return;
+
+	blk = to_block(ptr);
+
+	if (pool->stats.cached >= POOL_MAX_FREE || blk->size > POOL_MAX_BLOCK) {
+		pool->stats.releases++;
+		mem_free(pool->ccli, blk);
+		return;
+	}
+
+	blk->next = pool->free;
+	pool->free = blk;
+	pool->stats.cached++;
+	pool->stats.cached_bytes += blk->size;
+}
+
+__hidden void pool_destroy(struct pool *pool)
+{
+	struct pool_block *blk;
+
+	while (pool->free) {
+		blk = pool->free;
+		pool->free = blk->next;
+		mem_free(pool->ccli, blk);
+	}
+	pool->stats.cached = 0;
+	pool->stats.cached_bytes = 0;
+}
+
+/**
+ * ccli_pool_stats - read the statistics of a memory pool
+ * @ccli: The CLI descriptor that owns the pool
+ * @type: Which pool to read
+ * @stats: Where to store the statistics
+ *
+ * Each ccli descriptor keeps a cache of the memory used for
+ * line buffers, parsed arguments and completions, so that executing
+ * commands does not need to go back to malloc() once it has warmed up.
+ * This reads how well the @type pool is doing.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_pool_stats(struct ccli *ccli, enum ccli_pool_type type,
+		    struct ccli_pool_stats *stats)
+{
+	if (!ccli || !stats || type < 0 || type >= CCLI_NR_POOLS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*stats = ccli->pools[type].stats;
+	return 0;
+}
+
+#line 1 "src/alloc.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Memory allocation for libccli.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <stdarg.h>
+
+
+
+#ifdef CCLI_STATIC_MEMORY
+/*
+ * Built to never touch the heap. Memory must come from the buffer given
+ * to ccli_alloc_static(), or from an allocator set by ccli_set_allocator().
+ */
+static void *default_malloc(size_t size, void *data)
+{
+	errno = ENOMEM;
+	return NULL;
+}
+
+static void *default_realloc(void *ptr, size_t size, void *data)
+{
+	errno = ENOMEM;
+	return NULL;
+}
+
+static void default_free(void *ptr, void *data)
+{
+}
+#else
+static void *default_malloc(size_t size, void *data)
+{
+	return malloc(size);
+}
+
+static void *default_realloc(void *ptr, size_t size, void *data)
+{
+	return realloc(ptr, size);
+}
+
+static void default_free(void *ptr, void *data)
+{
+	free(ptr);
+}
+#endif
+
+static const struct ccli_allocator default_allocator = {
+	.malloc		= default_malloc,
+	.realloc	= default_realloc,
+	.free		= default_free,
+};
+
+/* Used by ccli_alloc() and for anything done without a descriptor */
+static struct ccli_allocator global_allocator = {
+	.malloc		= default_malloc,
+	.realloc	= default_realloc,
+	.free		= default_free,
+};
+
+/*
+ * The region allocator hands out memory from a single buffer that the
+ * application gave to ccli_alloc_static(). It is a first fit allocator
+ * that keeps its free list in address order, so that a freed block can
+ * be merged with the free blocks on either side of it. Other threads may
+ * print or register commands while the loop runs, so it is protected by
+ * a spin lock that is only held while walking the free list.
+ */
+#define REGION_ALIGN		16
+#define REGION_HDR		REGION_ALIGN
+#define REGION_MIN		(REGION_HDR + REGION_ALIGN)
+
+struct region_block {
+	size_t			size;	/* Includes the header */
+	struct region_block	*next;	/* Only used when free */
+};
+
+struct region {
+	struct region_block	*free;
+	size_t			size;
+	bool			lock;
+};
+
+static inline size_t region_round(size_t size)
+{
+	return (size + REGION_ALIGN - 1) & ~((size_t)REGION_ALIGN - 1);
+}
+
+static inline struct region_block *region_block(void *ptr)
+{
+	return ptr - REGION_HDR;
+}
+
+static inline size_t region_need(size_t size)
+{
+	size = region_round(size) + REGION_HDR;
+	return size < REGION_MIN ? REGION_MIN : size;
+}
+
+/*
+ * Take @need bytes from the start of the free block that @pblk points to.
+ * If what is left over is too small to be a block, all of it is taken.
+ * Returns the number of bytes taken.
+ */
+static size_t region_take(struct region_block **pblk, size_t need)
+{
+	struct region_block *blk = *pblk;
+	struct region_block *split;
+
+	if (blk->size - need < REGION_MIN) {
+		*pblk = blk->next;
+		return blk->size;
+	}
+
+	split = (void *)blk + need;
+	split->size = blk->size - need;
+	split->next = blk->next;
+	blk->size = need;
+	*pblk = split;
+	return need;
+}
+
+static void region_lock(struct region *region)
+{
+	while (__atomic_test_and_set(&region->lock, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void region_unlock(struct region *region)
+{
+	__atomic_clear(&region->lock, __ATOMIC_RELEASE);
+}
+
+static void *__region_malloc(struct region *region, size_t size)
+{
+	struct region_block **pblk;
+	struct region_block *blk;
+	size_t need;
+
+	if (size >= region->size)
+		goto nomem;
+
+	need = region_need(size);
+
+	for (pblk = &region->free; (blk = *pblk); pblk = &blk->next) {
+		if (blk->size < need)
+			continue;
+		region_take(pblk, need);
+		return (void *)blk + REGION_HDR;
+	}
+ nomem:
+	errno = ENOMEM;
+	return NULL;
+}
+
+static void __region_free(struct region *region, void *ptr)
+{
+	struct region_block **pblk;
+	struct region_block *prev = NULL;
+	struct region_block *next;
+	struct region_block *blk;
+
+	if (!ptr)
+		return;
+
+	blk = region_block(ptr);
+
+	for (pblk = &region->free; (next = *pblk) && next < blk; pblk = &next->next)
+		prev = next;
+
+	if (next && (void *)blk + blk->size == (void *)next) {
+		blk->size += next->size;
+		blk->next = next->next;
+	} else {
+		blk->next = next;
+	}
+
+	if (prev && (void *)prev + prev->size == (void *)blk) {
+		prev->size += blk->size;
+		prev->next = blk->next;
+	} else {
+		*pblk = blk;
+	}
+}
+
+static void *__region_realloc(struct region *region, void *ptr, size_t size)
+{
+	struct region_block **pblk;
+	struct region_block *next;
+	struct region_block *blk;
+	void *end;
+	size_t need;
+	void *p;
+
+	if (!ptr)
+		return __region_malloc(region, size);
+
+	if (size >= region->size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	blk = region_block(ptr);
+	need = region_need(size);
+	if (need <= blk->size)
+		return ptr;
+
+	/* Try to grow into the free block that follows it */
+	end = (void *)blk + blk->size;
+	for (pblk = &region->free; (next = *pblk) && (void *)next < end;
+	     pblk = &next->next)
+		;
+
+	if ((void *)next == end && blk->size + next->size >= need) {
+		blk->size += region_take(pblk, need - blk->size);
+		return ptr;
+	}
+
+	p = __region_malloc(region, size);
+	if (!p)
+		return NULL;
+
+	memcpy(p, ptr, blk->size - REGION_HDR);
+	__region_free(region, ptr);
+	return p;
+}
+
+static void *region_malloc(size_t size, void *data)
+{
+	struct region *region = data;
+	void *p;
+
+	region_lock(region);
+	p = __region_malloc(region, size);
+	region_unlock(region);
+
+	return p;
+}
+
+static void region_free(void *ptr, void *data)
+{
+	struct region *region = data;
+
+	region_lock(region);
+	__region_free(region, ptr);
+	region_unlock(region);
+}
+
+static void *region_realloc(void *ptr, size_t size, void *data)
+{
+	struct region *region = data;
+	void *p;
+
+	region_lock(region);
+	p = __region_realloc(region, ptr, size);
+	region_unlock(region);
+
+	return p;
+}
+
+/**
+ * region_init - Set up an allocator that uses only the given memory
+ * @allocator: The allocator to initialize
+ * @mem: The memory to allocate from
+ * @size: The size of @mem
+ *
+ * The bookkeeping of the region lives at the start of @mem, so
+ * @mem must stay around for as long as @allocator is used.
+ *
+ * Returns 0 on success and -1 if @mem is too small.
+ */
+__hidden int region_init(struct ccli_allocator *allocator, void *mem, size_t size)
+{
+	struct region *region;
+	struct region_block *blk;
+	void *start;
+	void *end;
+
+	start = (void *)region_round((unsigned long)mem);
+	end = (void *)(((unsigned long)mem + size) & ~((unsigned long)REGION_ALIGN - 1));
+
+	if (end < start ||
+	    end - start < region_round(sizeof(*region)) + REGION_MIN) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	region = start;
+	blk = start + region_round(sizeof(*region));
+	blk->size = end - (void *)blk;
+	blk->next = NULL;
+	region->free = blk;
+	region->size = blk->size;
+	region->lock = false;
+
+	allocator->malloc = region_malloc;
+	allocator->realloc = region_realloc;
+	allocator->free = region_free;
+	allocator->data = region;
+
+	return 0;
+}
+
+static inline struct ccli_allocator *get_allocator(struct ccli *ccli)
+{
+	return ccli ? &ccli->allocator : &global_allocator;
+}
+
+__hidden void get_global_allocator(struct ccli_allocator *allocator)
+{
+	*allocator = global_allocator;
+}
+
+__hidden void *mem_alloc(struct ccli *ccli, size_t size)
+{
+	struct ccli_allocator *a = get_allocator(ccli);
+
+	if (ccli)
+		stat_add(ccli, allocs, 1);
+	return a->malloc(size, a->data);
+}
+
+__hidden void *mem_zalloc(struct ccli *ccli, size_t size)
+{
+	void *ptr;
+
+	ptr = mem_alloc(ccli, size);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+__hidden void *mem_realloc(struct ccli *ccli, void *ptr, size_t size)
+{
+	struct ccli_allocator *a = get_allocator(ccli);
+
+	if (ccli)
+		stat_add(ccli, allocs, 1);
+	return a->realloc(ptr, size, a->data);
+}
+
+__hidden void mem_free(struct ccli *ccli, void *ptr)
+{
+	struct ccli_allocator *a = get_allocator(ccli);
+
+	if (ptr)
+		a->free(ptr, a->data);
+}
+
+__hidden char *mem_strdup(struct ccli *ccli, const char *str)
+{
+	char *p;
+	int len;
+
+	len = strlen(str) + 1;
+	p = mem_alloc(ccli, len);
+	if (p)
+		memcpy(p, str, len);
+	return p;
+}
+
+__hidden int mem_vasprintf(struct ccli *ccli, char **strp, const char *fmt, va_list ap)
+{
+	va_list ap2;
+	char *str;
+	int len;
+
+	*strp = NULL;
+
+	va_copy(ap2, ap);
+	len = vsnprintf(NULL, 0, fmt, ap2);
+	va_end(ap2);
+	if (len < 0)
+		return -1;
+
+	str = mem_alloc(ccli, len + 1);
+	if (!str)
+		return -1;
+
+	vsnprintf(str, len + 1, fmt, ap);
+	*strp = str;
+	return len;
+}
+
+__hidden int mem_asprintf(struct ccli *ccli, char **strp, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = mem_vasprintf(ccli, strp, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+static char *copy_str(struct ccli_allocator *a, const char *str)
+{
+	char *p;
+	int len;
+
+	if (!str)
+		return NULL;
+
+	len = strlen(str) + 1;
+	p = a->malloc(len, a->data);
+	if (p)
+		memcpy(p, str, len);
+	return p;
+}
+
+static void free_strs(struct ccli_allocator *a, char **strs, int cnt)
+{
+	int i;
+
+	if (!strs)
+		return;
+
+	for (i = 0; i < cnt; i++) {
+		if (strs[i])
+			a->free(strs[i], a->data);
+	}
+	a->free(strs, a->data);
+}
+
+/*
+ * Everything that the ccli descriptor holds on to between commands
+ * must be freed by the allocator that allocated it. When the allocator
+ * of a descriptor is changed, copy it all over to the new one.
+ */
+static int migrate_allocator(struct ccli *ccli, struct ccli_allocator *to)
+{
+	struct ccli_allocator *from = &ccli->allocator;
+	struct command_table *cmds = ccli->cmds;
+	struct command_table *commands = NULL;
+	size_t table_size;
+	char **history = NULL;
+	char **names = NULL;
+	char *shared_buf = NULL;
+	char *prompt = NULL;
+	char *temp = NULL;
+	int nr_hist;
+	int i;
+
+	nr_hist = ccli->history_size;
+	if (nr_hist > ccli->history_max)
+		nr_hist = ccli->history_max;
+
+	if (ccli->prompt) {
+		prompt = copy_str(to, ccli->prompt);
+		if (!prompt)
+			goto fail;
+	}
+
+	if (ccli->temp_line) {
+		temp = copy_str(to, ccli->temp_line);
+		if (!temp)
+			goto fail;
+	}
+
+	/* What is in the shared history buffer does not need to be kept */
+	if (ccli->shared_buf) {
+		shared_buf = to->malloc(ring_buf_size(ccli->shared), to->data);
+		if (!shared_buf)
+			goto fail;
+	}
+
+	table_size = sizeof(*cmds) + sizeof(cmds->commands[0]) * cmds->nr_commands;
+	commands = to->malloc(table_size, to->data);
+	if (!commands)
+		goto fail;
+
+	if (cmds->nr_commands) {
+		names = to->malloc(sizeof(*names) * cmds->nr_commands, to->data);
+		if (!names)
+			goto fail;
+		memset(names, 0, sizeof(*names) * cmds->nr_commands);
+		for (i = 0; i < cmds->nr_commands; i++) {
+			names[i] = copy_str(to, cmds->commands[i].cmd);
+			if (!names[i])
+				goto fail;
+		}
+	}
+
+	if (nr_hist) {
+		history = to->malloc(sizeof(*history) * nr_hist, to->data);
+		if (!history)
+			goto fail;
+		memset(history, 0, sizeof(*history) * nr_hist);
+		for (i = 0; i < nr_hist; i++) {
+			history[i] = copy_str(to, ccli->history[i]);
+			if (ccli->history[i] && !history[i])
+				goto fail;
+		}
+	}
+
+	/* Everything is copied, now switch over */
+	memcpy(commands, cmds, table_size);
+	for (i = 0; i < cmds->nr_commands; i++) {
+		commands->commands[i].cmd = names[i];
+		from->free(cmds->commands[i].cmd, from->data);
+	}
+	if (names)
+		to->free(names, to->data);
+	from->free(cmds, from->data);
+	ccli->cmds = commands;
+
+	free_strs(from, ccli->history, nr_hist);
+	ccli->history = history;
+
+	if (ccli->prompt)
+		from->free(ccli->prompt, from->data);
+	ccli->prompt = prompt;
+
+	if (ccli->temp_line)
+		from->free(ccli->temp_line, from->data);
+	ccli->temp_line = temp;
+	ccli->temp_size = temp ? strlen(temp) + 1 : 0;
+
+	if (ccli->shared_buf)
+		from->free(ccli->shared_buf, from->data);
+	ccli->shared_buf = shared_buf;
+
+	/* The cached pool blocks belong to the old allocator */
+	for (i = 0; i < CCLI_NR_POOLS; i++)
+		pool_destroy(&ccli->pools[i]);
+
+	ccli->allocator = *to;
+	return 0;
+
+ fail:
+	if (prompt)
+		to->free(prompt, to->data);
+	if (temp)
+		to->free(temp, to->data);
+	if (shared_buf)
+		to->free(shared_buf, to->data);
+	if (commands)
+		to->free(commands, to->data);
+	free_strs(to, names, cmds->nr_commands);
+	free_strs(to, history, nr_hist);
+	errno = ENOMEM;
+	return -1;
+}
+
+/**
+ * ccli_set_allocator - Set the functions that libccli allocates memory with
+ * @ccli: The CLI descriptor to set the allocator for (NULL for global)
+ * @allocator: The allocator to use (NULL for malloc(), realloc() and free())
+ *
+ * Have all memory that libccli allocates go through the functions of
+ * @allocator. Each function is passed the data field of @allocator.
+ *
+ * If @ccli is NULL, then this sets the allocator used by ccli_alloc()
+ * for new descriptors, as well as for ccli_line_parse() and ccli_argv_free().
+ * Descriptors that already exist are not affected.
+ *
+ * If @ccli is given, then only that descriptor is affected. Everything it
+ * is currently holding on to (the commands, the history, the prompt) is
+ * copied over to @allocator and freed from the previous one. The descriptor
+ * itself is still freed by the allocator that allocated it. This can not
+ * be done from within ccli_loop() or ccli_execute(), or while other
+ * threads are using @ccli.
+ *
+ * If libccli was built with STATIC_MEMORY=1, then there is no heap to
+ * fall back to, and a NULL @allocator is one that always fails.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_set_allocator(struct ccli *ccli, const struct ccli_allocator *allocator)
+{
+	struct ccli_allocator a;
+	int ret;
+
+	if (!allocator)
+		allocator = &default_allocator;
+
+	if (!allocator->malloc || !allocator->realloc || !allocator->free) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!ccli) {
+		global_allocator = *allocator;
+		return 0;
+	}
+
+	if (ccli->line) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	a = *allocator;
+
+	/* Keep other threads from registering commands while they move */
+	pthread_mutex_lock(&ccli->cmd_lock);
+	if (ccli->retired) {
+		/* Old command tables are still being read */
+		errno = EBUSY;
+		ret = -1;
+	} else {
+		ret = migrate_allocator(ccli, &a);
+	}
+	pthread_mutex_unlock(&ccli->cmd_lock);
+
+	return ret;
+}
+
+#line 1 "src/ring.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * History that is shared between sessions.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <stdint.h>
+
+
+
+/*
+ * The shared history is a ring of fixed size slots. A line is added by
+ * atomically incrementing the head to reserve a sequence number, which
+ * maps to the slot (seq & mask). Each slot has a stamp that works as a
+ * sequence lock:
+ *
+ *   0                - Nothing was ever written to the slot
+ *   (seq + 1) << 1 | 1 - The line for seq is being written
+ *   (seq + 1) << 1   - The slot holds the line for seq
+ *
+ * Readers never block writers. They copy the line out and then check
+ * that the stamp did not change while they did so. Writers never wait
+ * on each other either. If the slot is still being written by an older
+ * line (the ring wrapped while it was being written), or a newer line
+ * already owns the slot, then the line is dropped.
+ *
+ * The text of a slot is accessed a word at a time with atomics, as
+ * readers can be copying it while it is being overwritten. The words
+ * are stored with release and loaded with acquire, so that a reader
+ * that sees any of the new text also sees the stamp that marks the
+ * slot as busy.
+ */
+struct ring_slot {
+	unsigned long		stamp;
+	unsigned long		len;
+	unsigned long		text[];
+};
+
+struct ccli_shared_history {
+	unsigned long		head;
+	unsigned long		mask;
+	int			line_max;
+	size_t			stride;
+	struct ccli_allocator	allocator;
+	char			data[] __attribute__((aligned(sizeof(long))));
+};
+
+#define WORD_SIZE	sizeof(unsigned long)
+
+static inline size_t text_words(int len)
+{
+	return (len + WORD_SIZE - 1) / WORD_SIZE;
+}
+
+static inline struct ring_slot *ring_slot(struct ccli_shared_history *hist,
+					  unsigned long seq)
+{
+	return (struct ring_slot *)(hist->data + (seq & hist->mask) * hist->stride);
+}
+
+static inline unsigned long seq_stamp(unsigned long seq)
+{
+	return (seq + 1) << 1;
+}
+
+/* The size of the buffer a session needs to read lines out of @hist */
+__hidden size_t ring_buf_size(struct ccli_shared_history *hist)
+{
+	return text_words(hist->line_max + 1) * WORD_SIZE;
+}
+
+__hidden int ring_size(struct ccli_shared_history *hist)
+{
+	return hist->mask + 1;
+}
+
+/* The sequence number the next line added will get */
+__hidden unsigned long ring_head(struct ccli_shared_history *hist)
+{
+	return __atomic_load_n(&hist->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * ring_add - add a line to the shared history
+ * @hist: The shared history to add to
+ * @line: The line to add
+ *
+ * Returns 0 on success (even if the line was dropped due to the ring
+ *   wrapping while adding it), and -1 if @line is too big for @hist.
+ */
+__hidden int ring_add(struct ccli_shared_history *hist, const char *line)
+{
+	struct ring_slot *slot;
+	unsigned long stamp;
+	unsigned long seq;
+	unsigned long old;
+	unsigned long w;
+	size_t len;
+	size_t i;
+
+	len = strlen(line);
+	if (len > hist->line_max) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	seq = __atomic_fetch_add(&hist->head, 1, __ATOMIC_RELAXED);
+	slot = ring_slot(hist, seq);
+	stamp = seq_stamp(seq);
+
+	old = __atomic_load_n(&slot->stamp, __ATOMIC_RELAXED);
+	do {
+		if ((old & 1) || old > stamp)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&slot->stamp, &old, stamp | 1,
+					      true, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	__atomic_store_n(&slot->len, len, __ATOMIC_RELEASE);
+	for (i = 0; i < text_words(len); i++) {
+		w = 0;
+		memcpy(&w, line + i * WORD_SIZE,
+		       len - i * WORD_SIZE < WORD_SIZE ? len - i * WORD_SIZE : WORD_SIZE);
+		__atomic_store_n(&slot->text[i], w, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&slot->stamp, stamp, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * ring_get - read a line from the shared history
+ * @hist: The shared history to read from
+ * @seq: The sequence number of the line to read
+ * @buf: Where to copy the line to (at least ring_buf_size() bytes)
+ *
+ * Returns @buf holding the line, or NULL if the line for @seq is not
+ *   in the ring (it was overwritten, dropped, or is still being written).
+ */
+__hidden char *ring_get(struct ccli_shared_history *hist, unsigned long seq,
+			char *buf)
+{
+	struct ring_slot *slot;
+	unsigned long stamp;
+	unsigned long w;
+	size_t len;
+	size_t i;
+
+	if (seq >= ring_head(hist))
+		return NULL;
+
+	slot = ring_slot(hist, seq);
+	stamp = seq_stamp(seq);
+
+	if (__atomic_load_n(&slot->stamp, __ATOMIC_ACQUIRE) != stamp)
+		return NULL;
+
+	len = __atomic_load_n(&slot->len, __ATOMIC_ACQUIRE);
+	if (len > hist->line_max)
+		return NULL;
+
+	for (i = 0; i < text_words(len); i++) {
+		w = __atomic_load_n(&slot->text[i], __ATOMIC_ACQUIRE);
+		memcpy(buf + i * WORD_SIZE, &w, WORD_SIZE);
+	}
+
+	if (__atomic_load_n(&slot->stamp, __ATOMIC_RELAXED) != stamp)
+		return NULL;
+
+	buf[len] = '\0';
+	return buf;
+}
+
+/**
+ * ccli_shared_history_alloc - allocate a history to share between sessions
+ * @lines: The number of lines the history holds
+ * @line_max: The longest line that can be added
+ *
+ * Allocates a history that can be given to several ccli descriptors
+ * with ccli_set_shared_history(), including ones that run in different
+ * threads. Lines that any of them enter are seen by all of them.
+ *
+ * @lines is rounded up to a power of two. Lines longer than @line_max
+ * are not added to the history.
+ *
+ * Returns the shared history (must be freed with ccli_shared_history_free())
+ *   or NULL on error.
+ */
+struct ccli_shared_history *ccli_shared_history_alloc(int lines, int line_max)
+{
+	struct ccli_shared_history *hist;
+	struct ccli_allocator a;
+	unsigned long size = 1;
+	size_t stride;
+
+	if (lines < 1 || line_max < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	while (size < lines)
+		size <<= 1;
+
+	stride = sizeof(struct ring_slot) + text_words(line_max) * WORD_SIZE;
+
+	if (size > (SIZE_MAX - sizeof(*hist)) / stride) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	get_global_allocator(&a);
+	hist = a.malloc(sizeof(*hist) + size * stride, a.data);
+	if (!hist)
+		return NULL;
+
+	memset(hist, 0, sizeof(*hist) + size * stride);
+	hist->mask = size - 1;
+	hist->line_max = line_max;
+	hist->stride = stride;
+	hist->allocator = a;
+
+	return hist;
+}
+
+/**
+ * ccli_shared_history_free - free a shared history
+ * @hist: The shared history to free
+ *
+ * Frees @hist that was allocated by ccli_shared_history_alloc().
+ * No ccli descriptor may still be using it.
+ */
+void ccli_shared_history_free(struct ccli_shared_history *hist)
+{
+	struct ccli_allocator *a;
+
+	if (!hist)
+		return;
+
+	a = &hist->allocator;
+	a->free(hist, a->data);
+}
+
+/**
+ * ccli_set_shared_history - have a ccli descriptor use a shared history
+ * @ccli: The CLI descriptor to use the shared history
+ * @hist: The shared history to use (NULL to go back to its own)
+ *
+ * Have @ccli add its lines to @hist, and navigate and search through
+ * @hist instead of its own history. Each descriptor keeps its own place
+ * in the shared history, and lines that other sessions add while it is
+ * moving through the history do not move it.
+ *
+ * Lines from the shared history that are modified are not written back
+ * to it. The history that @ccli had before is left as is, and is used
+ * again when @hist is set to NULL.
+ *
+ * This can not be done from within ccli_loop() or ccli_execute().
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_set_shared_history(struct ccli *ccli, struct ccli_shared_history *hist)
+{
+	char *buf = NULL;
+
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ccli->line) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (hist) {
+		buf = mem_alloc(ccli, ring_buf_size(hist));
+		if (!buf)
+			return -1;
+	}
+
+	mem_free(ccli, ccli->shared_buf);
+	ccli->shared_buf = buf;
+	ccli->shared = hist;
+
+	if (hist) {
+		ccli->shared_end = ring_head(hist);
+		ccli->current_line = ccli->shared_end;
+	} else {
+		ccli->current_line = ccli->history_size;
+	}
+
+	return 0;
+}
+
+#line 1 "src/signal.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Signal handling for the ccli loop.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+
+
+
+/*
+ * Registered signals are blocked and read from a signalfd in the same
+ * poll() that waits for input. The callbacks are then called from the
+ * loop itself, and not from a signal handler, so they can do anything
+ * a command can do.
+ */
+
+static int update_signalfd(struct ccli *ccli)
+{
+	int fd;
+
+	if (sigisemptyset(&ccli->sigmask)) {
+		if (ccli->sigfd >= 0)
+			close(ccli->sigfd);
+		ccli->sigfd = -1;
+		return 0;
+	}
+
+	fd = signalfd(ccli->sigfd, &ccli->sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	ccli->sigfd = fd;
+	return 0;
+}
+
+/* Block the registered signals that were not blocked to begin with */
+__hidden void signal_block(struct ccli *ccli)
+{
+	if (!sigisemptyset(&ccli->sigblocked))
+		pthread_sigmask(SIG_BLOCK, &ccli->sigblocked, NULL);
+}
+
+/* Unblock the signals that signal_block() blocked */
+__hidden void signal_unblock(struct ccli *ccli)
+{
+	if (!sigisemptyset(&ccli->sigblocked))
+		pthread_sigmask(SIG_UNBLOCK, &ccli->sigblocked, NULL);
+}
+
+__hidden void signal_cleanup(struct ccli *ccli)
+{
+	signal_unblock(ccli);
+	sigemptyset(&ccli->sigblocked);
+	sigemptyset(&ccli->sigmask);
+	update_signalfd(ccli);
+}
+
+/*
+ * Call the callbacks of the signals that are waiting on the signalfd.
+ * Returns non-zero if one of the callbacks asks to exit the loop.
+ */
+__hidden int signal_handle(struct ccli *ccli)
+{
+	struct signalfd_siginfo info;
+	struct signal_handler *handler;
+	int ret = 0;
+	int sig;
+
+	while (read(ccli->sigfd, &info, sizeof(info)) == sizeof(info)) {
+		sig = info.ssi_signo;
+
+#ifndef CCLI_NO_PAGER
+		/* The window size is read again the next time it is needed */
+		if (sig == SIGWINCH)
+			ccli->w_row = 0;
+#endif
+
+		if (sig >= NSIG)
+			continue;
+
+		handler = &ccli->signals[sig];
+		if (handler->callback)
+			ret |= handler->callback(ccli, sig, handler->data);
+	}
+
+	return ret;
+}
+
+/**
+ * ccli_register_signal - Register a callback for a signal
+ * @ccli: The CLI descriptor to register the signal for
+ * @sig: The signal to handle
+ * @callback: The function to call when @sig comes in
+ * @data: The data to pass to @callback
+ *
+ * Have @callback called from ccli_loop() when the process receives
+ * @sig. The signal is blocked, and instead of interrupting the
+ * program, it is read from a signalfd while ccli_loop() waits for
+ * input. Because @callback is not called from a signal handler, it
+ * is not limited to async-signal-safe functions. If @callback prints
+ * something, it can call ccli_line_refresh() to show the line being
+ * entered again.
+ *
+ * If @callback returns non-zero, then ccli_loop() exits.
+ *
+ * Signals that come in while a command is executing are handled
+ * after the command returns. @callback may be NULL to just have the
+ * signal ignored. When SIGWINCH comes in, the window size used by
+ * ccli_page() is updated, even if @callback is NULL.
+ *
+ * The signal is only blocked in the calling thread. For signals
+ * sent to the process, they should be blocked in all threads
+ * (or registered before any other thread is created), and only
+ * one descriptor should register them.
+ *
+ * ccli_console_release() unblocks the signals, and ccli_console_acquire()
+ * blocks them again, such that a child that is forked can release the
+ * console and get the signals that it expects.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_signal(struct ccli *ccli, int sig, ccli_signal callback,
+			 void *data)
+{
+	sigset_t mask;
+	sigset_t old;
+
+	if (!ccli || sig < 1 || sig >= NSIG ||
+	    sig == SIGKILL || sig == SIGSTOP) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!sigismember(&ccli->sigmask, sig)) {
+		sigaddset(&ccli->sigmask, sig);
+		if (update_signalfd(ccli) < 0) {
+			sigdelset(&ccli->sigmask, sig);
+			return -1;
+		}
+
+		sigemptyset(&mask);
+		sigaddset(&mask, sig);
+		pthread_sigmask(SIG_BLOCK, &mask, &old);
+		if (!sigismember(&old, sig))
+			sigaddset(&ccli->sigblocked, sig);
+	}
+
+	ccli->signals[sig].callback = callback;
+	ccli->signals[sig].data = data;
+
+	return 0;
+}
+
+/**
+ * ccli_unregister_signal - Stop handling a signal
+ * @ccli: The CLI descriptor to unregister the signal from
+ * @sig: The signal to stop handling
+ *
+ * Removes the callback for @sig that was registered with
+ * ccli_register_signal(). If the signal was not blocked before
+ * it was registered, it is unblocked.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_unregister_signal(struct ccli *ccli, int sig)
+{
+	sigset_t mask;
+
+	if (!ccli || sig < 1 || sig >= NSIG) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!sigismember(&ccli->sigmask, sig)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	sigdelset(&ccli->sigmask, sig);
+	update_signalfd(ccli);
+
+	if (sigismember(&ccli->sigblocked, sig)) {
+		sigdelset(&ccli->sigblocked, sig);
+		sigemptyset(&mask);
+		sigaddset(&mask, sig);
+		pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+	}
+
+	ccli->signals[sig].callback = NULL;
+	ccli->signals[sig].data = NULL;
+
+	return 0;
+}
+
+#line 1 "src/watch.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * The "watch" command, to run a command over and over.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <poll.h>
+#include <math.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+
+
+
+/*
+ * The command being watched has its output captured into a buffer
+ * instead of being written out. The output is then compared line by
+ * line with what the last run printed, and only the lines that changed
+ * are redrawn, by moving the cursor to them. On a slow link, a status
+ * command that prints a screen full where only a counter changes costs
+ * only the bytes of that counter.
+ */
+
+#define WATCH_DEFAULT_MS	2000
+#define WATCH_MIN_MS		100
+
+/* The rows that the header takes before the output of the command */
+#define WATCH_HEADER_ROWS	2
+
+#define WATCH_USAGE	"usage: watch [-n seconds] command [args...]\n"
+
+__hidden int capture_add(struct ccli *ccli, struct capture *cap,
+			 const char *str, int len)
+{
+	char *buf;
+	int size;
+
+	if (cap->len + len > cap->size) {
+		size = cap->size ? cap->size : 256;
+		while (size < cap->len + len)
+			size *= 2;
+		buf = mem_realloc(ccli, cap->buf, size);
+		if (!buf) {
+			cap->failed = true;
+			return -1;
+		}
+		cap->buf = buf;
+		cap->size = size;
+	}
+
+	memcpy(cap->buf + cap->len, str, len);
+	cap->len += len;
+	return len;
+}
+
+__attribute__((__format__(printf, 3, 4)))
+static void capture_printf(struct ccli *ccli, struct capture *cap,
+			   const char *fmt, ...)
+{
+	char buf[64];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	capture_add(ccli, cap, buf, len);
+}
+
+/* Get the line at @pos of @cap, and move @pos past it */
+static bool get_line(struct capture *cap, int *pos, const char **line, int *len)
+{
+	char *nl;
+
+	if (*pos >= cap->len)
+		return false;
+
+	*line = cap->buf + *pos;
+	nl = memchr(*line, '\n', cap->len - *pos);
+	*len = nl ? nl - *line : cap->len - *pos;
+	*pos += *len + (nl ? 1 : 0);
+
+	return true;
+}
+
+/*
+ * Write into @screen what it takes to turn the output of @old into
+ * the output of @new, where the output starts at @row. Lines are cut
+ * at @cols, and nothing goes past @rows (zero for no limit).
+ */
+static void repaint(struct ccli *ccli, struct capture *screen,
+		    struct capture *old, struct capture *new,
+		    int row, int rows, int cols)
+{
+	const char *oline, *nline;
+	int opos = 0, npos = 0;
+	int olen, nlen;
+	bool ohas, nhas;
+
+	for (; !rows || row <= rows; row++) {
+		ohas = get_line(old, &opos, &oline, &olen);
+		nhas = get_line(new, &npos, &nline, &nlen);
+		if (!ohas && !nhas)
+			break;
+
+		if (!ohas)
+			olen = 0;
+		if (!nhas)
+			nlen = 0;
+
+		if (cols) {
+			if (olen > cols)
+				olen = cols;
+			if (nlen > cols)
+				nlen = cols;
+		}
+
+		if (ohas && nhas && olen == nlen && !memcmp(oline, nline, nlen))
+			continue;
+
+		capture_printf(ccli, screen, "\033[%d;1H", row);
+		if (nlen)
+			capture_add(ccli, screen, nline, nlen);
+		capture_add(ccli, screen, "\033[K", 3);
+	}
+}
+
+static int count_lines(struct capture *cap)
+{
+	const char *line;
+	int pos = 0;
+	int len;
+	int cnt;
+
+	for (cnt = 0; get_line(cap, &pos, &line, &len); cnt++)
+		;
+
+	return cnt;
+}
+
+struct watch {
+	struct capture		old;
+	struct capture		new;
+	struct capture		screen;
+	const char		*cmd;
+	int			ms;
+};
+
+/* Run the command, and update the screen with what changed */
+static int watch_run(struct ccli *ccli, struct watch *watch)
+{
+	struct capture tmp;
+	struct winsize w;
+	int rows = 0;
+	int cols = 0;
+	int row;
+	int ret;
+
+	watch->new.len = 0;
+	ccli->capture = &watch->new;
+	ret = execute(ccli, watch->cmd, false);
+	ccli->capture = NULL;
+
+	if (ccli->in_tty && !ioctl(ccli->in, TIOCGWINSZ, &w)) {
+		rows = w.ws_row;
+		cols = w.ws_col;
+	}
+
+	repaint(ccli, &watch->screen, &watch->old, &watch->new,
+		WATCH_HEADER_ROWS + 1, rows, cols);
+
+	/* Leave the cursor after the output, if anything was drawn */
+	if (watch->screen.len) {
+		row = WATCH_HEADER_ROWS + 1 + count_lines(&watch->new);
+		if (rows && row > rows)
+			row = rows;
+		capture_printf(ccli, &watch->screen, "\033[%d;1H", row);
+		write_out(ccli, watch->screen.buf, watch->screen.len);
+		stat_add(ccli, redraws, 1);
+		trace_probe(redraw, watch->screen.len);
+		watch->screen.len = 0;
+	}
+
+	tmp = watch->old;
+	watch->old = watch->new;
+	watch->new = tmp;
+
+	return ret;
+}
+
+static int parse_interval(const char *str, int *ms)
+{
+	double sec;
+	char *end;
+
+	sec = strtod(str, &end);
+	if (end == str || *end || sec < 0)
+		return -1;
+
+	/* Also keep "inf", "nan" and huge values from overflowing @ms */
+	if (!isfinite(sec) || sec > INT_MAX / 1000)
+		return -1;
+
+	*ms = sec * 1000;
+	if (*ms < WATCH_MIN_MS)
+		*ms = WATCH_MIN_MS;
+
+	return 0;
+}
+
+/* Returns 1 if the user asked to stop watching, and -1 on error */
+static int watch_input(struct ccli *ccli)
+{
+	char ch;
+
+	if (read_in(ccli, &ch, 1) != 1)
+		return -1;
+
+	return ch == 'q' || ch == 3 ? 1 : 0;
+}
+
+static int watch_loop(struct ccli *ccli, struct watch *watch, int tfd)
+{
+	struct pollfd fds[3];
+	uint64_t ticks;
+	int nr;
+	int ret;
+
+	ret = watch_run(ccli, watch);
+
+	/* A timeout on watch itself stops the watching */
+	while (!ret && !ccli_cancelled(ccli)) {
+		fds[0].fd = ccli->in;
+		fds[0].events = POLLIN;
+		fds[1].fd = tfd;
+		fds[1].events = POLLIN;
+		fds[2].fd = ccli->sigfd;
+		fds[2].events = POLLIN;
+		nr = ccli->sigfd >= 0 ? 3 : 2;
+
+		if (poll(fds, nr, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (nr > 2 && (fds[2].revents & POLLIN)) {
+			ret = signal_handle(ccli);
+			if (ret)
+				break;
+		}
+
+		if (fds[0].revents) {
+			if (watch_input(ccli))
+				break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			/* Ticks that were missed while running are dropped */
+			read(tfd, &ticks, sizeof(ticks));
+			ret = watch_run(ccli, watch);
+		}
+	}
+
+	return ret;
+}
+
+static int watch_command(struct ccli *ccli, const char *command,
+			 const char *line, void *data,
+			 int argc, char **argv)
+{
+	struct itimerspec its;
+	struct watch watch;
+	int arg = 1;
+	int tfd;
+	int ret;
+
+	/* The output of the watched command is already being captured */
+	if (ccli->capture) {
+		echo_str(ccli, "watch: can not watch watch\n");
+		return 0;
+	}
+
+	/* The screen is repainted, which can not be kept for the pager */
+	if (paging(ccli)) {
+		echo_str(ccli, "watch: can not watch in the pager\n");
+		return 0;
+	}
+
+	memset(&watch, 0, sizeof(watch));
+	watch.ms = WATCH_DEFAULT_MS;
+
+	if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+		if (parse_interval(argv[2], &watch.ms) < 0)
+			goto usage;
+		arg = 3;
+	}
+
+	/* Use what was typed, so that the quoting is kept */
+	watch.cmd = line_word(line, arg);
+	if (!watch.cmd)
+		goto usage;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (tfd < 0) {
+		echo_str(ccli, "watch: can not create timer\n");
+		return 0;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = watch.ms / 1000;
+	its.it_value.tv_nsec = (watch.ms % 1000) * 1000000;
+	its.it_interval = its.it_value;
+	timerfd_settime(tfd, 0, &its, NULL);
+
+	/* Clear the screen and show the header */
+	capture_printf(ccli, &watch.screen, "\033[H\033[2JEvery %d.%ds: ",
+		       watch.ms / 1000, (watch.ms % 1000) / 100);
+	capture_add(ccli, &watch.screen, watch.cmd, strlen(watch.cmd));
+	capture_add(ccli, &watch.screen, "\n", 1);
+
+	ret = watch_loop(ccli, &watch, tfd);
+
+	echo(ccli, '\n');
+
+	close(tfd);
+	mem_free(ccli, watch.old.buf);
+	mem_free(ccli, watch.new.buf);
+	mem_free(ccli, watch.screen.buf);
+
+	return ret;
+ usage:
+	echo_str(ccli, WATCH_USAGE);
+	return 0;
+}
+
+/**
+ * ccli_register_watch - Add the "watch" command
+ * @ccli: The CLI descriptor to add the command to
+ *
+ * Registers the command "watch [-n seconds] command [args...]", which
+ * clears the screen and executes the given command every @seconds
+ * (two by default, and no less than a tenth of a second) until the
+ * user hits 'q' or Ctrl^C.
+ *
+ * The output of the command is captured, and only the lines that are
+ * different from the last time it was executed are redrawn. Only the
+ * output that the command writes with ccli_printf() and the like is
+ * captured, and not what it writes directly to the output descriptor.
+ *
+ * If the command returns non-zero, then watch stops, and returns
+ * the same, such that "watch exit" exits ccli_loop().
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_watch(struct ccli *ccli)
+{
+	return ccli_register_command(ccli, "watch", watch_command, NULL);
+}
+
+#line 1 "src/watchdog.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Deadlines for commands.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <time.h>
+
+
+
+/*
+ * Commands execute in the thread that runs the loop, so nothing in the
+ * loop can notice that one is taking too long. Once a timeout is set, a
+ * watchdog thread is started that sleeps until the deadline of the
+ * command that is executing. If the command is still executing when it
+ * wakes up, it queues a warning and sets the flag that ccli_cancelled()
+ * returns. It is up to the command to check it and return.
+ *
+ * The warning goes through the same queue as ccli_printf() from other
+ * threads, so it is written by the thread executing the command, the
+ * next time that prints or when the command returns, and never lands in
+ * the middle of its output or of a redraw.
+ *
+ * A command that executes another one (like watch) saves the deadline
+ * of the outer command and restores it when the inner one is done.
+ */
+struct watchdog {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t		thread;
+	struct ccli		*ccli;
+	const char		*cmd;
+	struct timespec		deadline;
+	int			timeout;	/* Default for all commands */
+	int			ms;		/* Timeout of the armed command */
+	bool			armed;
+	bool			cancelled;
+	bool			stop;
+};
+
+static bool deadline_passed(struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (now.tv_sec != deadline->tv_sec)
+		return now.tv_sec > deadline->tv_sec;
+	return now.tv_nsec >= deadline->tv_nsec;
+}
+
+/* Called with wd->lock held */
+static void watchdog_fire(struct watchdog *wd)
+{
+	char buf[128];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "\n%s: timed out after %d.%03ds\n",
+		       wd->cmd, wd->ms / 1000, wd->ms % 1000);
+	if (len >= sizeof(buf)) {
+		len = sizeof(buf) - 1;
+		buf[len - 1] = '\n';
+	}
+
+	/* Queued first, so that it is there when the command sees the flag */
+	queue_str(wd->ccli, buf, len);
+
+	__atomic_store_n(&wd->cancelled, true, __ATOMIC_RELEASE);
+}
+
+static void *watchdog_thread(void *arg)
+{
+	struct watchdog *wd = arg;
+
+	pthread_mutex_lock(&wd->lock);
+	while (!wd->stop) {
+		if (!wd->armed || wd->cancelled) {
+			pthread_cond_wait(&wd->cond, &wd->lock);
+			continue;
+		}
+
+		pthread_cond_timedwait(&wd->cond, &wd->lock, &wd->deadline);
+
+		/* The command may have finished, or another one armed it */
+		if (wd->armed && !wd->cancelled && deadline_passed(&wd->deadline))
+			watchdog_fire(wd);
+	}
+	pthread_mutex_unlock(&wd->lock);
+
+	return NULL;
+}
+
+/* Start the watchdog thread (under cmd_lock) */
+static struct watchdog *watchdog_create(struct ccli *ccli)
+{
+	struct watchdog *wd;
+	pthread_condattr_t attr;
+	sigset_t mask;
+	sigset_t old;
+	int ret;
+
+	wd = mem_zalloc(ccli, sizeof(*wd));
+	if (!wd)
+		return NULL;
+
+	wd->ccli = ccli;
+	pthread_mutex_init(&wd->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wd->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* Signals that the loop reads from its signalfd must not go here */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old);
+	ret = pthread_create(&wd->thread, NULL, watchdog_thread, wd);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		pthread_cond_destroy(&wd->cond);
+		pthread_mutex_destroy(&wd->lock);
+		mem_free(ccli, wd);
+		errno = ret;
+		return NULL;
+	}
+
+	__atomic_store_n(&ccli->watchdog, wd, __ATOMIC_RELEASE);
+	return wd;
+}
+
+/* Only called when nothing else can be using @ccli */
+__hidden void watchdog_free(struct ccli *ccli)
+{
+	struct watchdog *wd = ccli->watchdog;
+
+	if (!wd)
+		return;
+
+	pthread_mutex_lock(&wd->lock);
+	wd->stop = true;
+	pthread_cond_signal(&wd->cond);
+	pthread_mutex_unlock(&wd->lock);
+
+	pthread_join(wd->thread, NULL);
+
+	pthread_cond_destroy(&wd->cond);
+	pthread_mutex_destroy(&wd->lock);
+	mem_free(ccli, wd);
+	ccli->watchdog = NULL;
+}
+
+/**
+ * watchdog_arm - start the deadline of a command
+ * @ccli: The CLI descriptor the command is executing on
+ * @cmd: The name of the command (must stay valid until watchdog_disarm())
+ * @ms: The timeout of the command (0 for the default, negative for none)
+ * @save: Where to save the deadline of a command that is already armed
+ *
+ * Returns true if the command has a deadline, and watchdog_disarm()
+ *   must be called with @save when it returns.
+ */
+__hidden bool watchdog_arm(struct ccli *ccli, const char *cmd, int ms,
+			   struct watchdog_save *save)
+{
+	struct watchdog *wd;
+
+	wd = __atomic_load_n(&ccli->watchdog, __ATOMIC_ACQUIRE);
+	if (!wd)
+		return false;
+
+	if (!ms)
+		ms = __atomic_load_n(&wd->timeout, __ATOMIC_RELAXED);
+	if (ms <= 0)
+		return false;
+
+	pthread_mutex_lock(&wd->lock);
+
+	save->cmd = wd->cmd;
+	save->deadline = wd->deadline;
+	save->ms = wd->ms;
+	save->armed = wd->armed;
+	save->cancelled = wd->cancelled;
+
+	clock_gettime(CLOCK_MONOTONIC, &wd->deadline);
+	wd->deadline.tv_sec += ms / 1000;
+	wd->deadline.tv_nsec += (ms % 1000) * 1000000;
+	if (wd->deadline.tv_nsec >= 1000000000) {
+		wd->deadline.tv_sec++;
+		wd->deadline.tv_nsec -= 1000000000;
+	}
+	wd->cmd = cmd;
+	wd->ms = ms;
+	wd->armed = true;
+	__atomic_store_n(&wd->cancelled, false, __ATOMIC_RELAXED);
+
+	pthread_cond_signal(&wd->cond);
+	pthread_mutex_unlock(&wd->lock);
+
+	return true;
+}
+
+__hidden void watchdog_disarm(struct ccli *ccli, struct watchdog_save *save)
+{
+	struct watchdog *wd = ccli->watchdog;
+
+	pthread_mutex_lock(&wd->lock);
+
+	wd->cmd = save->cmd;
+	wd->deadline = save->deadline;
+	wd->ms = save->ms;
+	wd->armed = save->armed;
+	__atomic_store_n(&wd->cancelled, save->cancelled, __ATOMIC_RELAXED);
+
+	/* The outer command may have passed its deadline in the meantime */
+	if (wd->armed)
+		pthread_cond_signal(&wd->cond);
+	pthread_mutex_unlock(&wd->lock);
+
+	/* Write the warning if it fired, unless watch is capturing */
+	if (!ccli->capture)
+		output_flush(ccli);
+}
+
+/**
+ * ccli_cancelled - Test if the executing command ran out of time
+ * @ccli: The CLI descriptor the command is executing on
+ *
+ * A command that may take a long time should call this from time
+ * to time, and return when it is true. It becomes true when the
+ * command runs past the timeout set by ccli_set_timeout(), and
+ * goes back to false when the next command executes.
+ *
+ * This may be called from any thread, such as one that the command
+ * is waiting on.
+ *
+ * Returns true if the command executing on @ccli was cancelled.
+ */
+bool ccli_cancelled(struct ccli *ccli)
+{
+	struct watchdog *wd;
+
+	if (!ccli)
+		return false;
+
+	wd = __atomic_load_n(&ccli->watchdog, __ATOMIC_ACQUIRE);
+	return wd && __atomic_load_n(&wd->cancelled, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * ccli_set_timeout - Set how long commands may execute
+ * @ccli: The CLI descriptor to set the timeout for
+ * @command: The command to set the timeout of, or NULL for all commands
+ * @ms: The timeout in milliseconds
+ *
+ * When a command executes for longer than its timeout, a warning is
+ * written to the output and ccli_cancelled() returns true until the
+ * command returns. The command is not stopped, it must check
+ * ccli_cancelled() and return on its own.
+ *
+ * If @command is NULL, then @ms is the timeout of all commands that
+ * do not have their own, and zero means they have none. Otherwise
+ * it is the timeout of @command only, where zero means it uses the
+ * timeout for all commands, and a negative value means it has none,
+ * even if the others do. Replacing @command with ccli_register_command()
+ * keeps its timeout.
+ *
+ * The first time a timeout is set, a thread is created to watch
+ * over the commands. It exits when @ccli is freed.
+ *
+ * This may be called from any thread, even while another thread is
+ * running ccli_loop().
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_set_timeout(struct ccli *ccli, const char *command, int ms)
+{
+	struct command_table *cmds;
+	struct command *cmd;
+	struct watchdog *wd;
+	int ret = -1;
+
+	if (!ccli || (!command && ms < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	if (command) {
+		cmd = find_command(ccli->cmds, command);
+		if (!cmd) {
+			errno = ENOENT;
+			goto out;
+		}
+	}
+
+	wd = ccli->watchdog;
+	if (!wd && ms > 0) {
+		wd = watchdog_create(ccli);
+		if (!wd)
+			goto out;
+	}
+
+	if (!command) {
+		if (wd)
+			__atomic_store_n(&wd->timeout, ms, __ATOMIC_RELAXED);
+		ret = 0;
+		goto out;
+	}
+
+	cmds = commands_copy(ccli, 0);
+	if (!cmds)
+		goto out;
+
+	cmds->commands[cmd - ccli->cmds->commands].timeout = ms;
+	commands_publish(ccli, cmds, NULL);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&ccli->cmd_lock);
+	return ret;
+}
+
+#line 1 "src/record.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Recording what the user types.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+
+
+#ifndef CCLI_NO_RECORD
+/*
+ * A recording is the magic "CCLIREC" followed by a version byte, and
+ * then one record for every read of the input and every change of the
+ * terminal size. Each record is a type byte, the time since the last
+ * record in microseconds, and its data. Numbers are stored as unsigned
+ * LEB128 (seven bits per byte, the high bit set on all but the last).
+ *
+ *   'I' <usecs> <len> <bytes...>	Input that was read
+ *   'W' <usecs> <rows> <cols>		The size of the terminal
+ *   'O' <usecs> <len> <bytes...>	Output (only written by ccli-replay)
+ *
+ * A typed key costs about four bytes, so a day of typing is well under
+ * a megabyte.
+ */
+
+#define RECORD_ENV		"CCLI_RECORD"
+
+/* The longest a record header gets: type, usecs and len */
+#define RECORD_HDR_MAX		(1 + 10 + 5)
+
+struct recorder {
+	int			fd;
+	bool			owned;		/* Opened from CCLI_RECORD */
+	unsigned long long	last;
+	unsigned short		rows;
+	unsigned short		cols;
+};
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int put_num(unsigned char *buf, unsigned long long val)
+{
+	int len = 0;
+
+	do {
+		buf[len] = val & 0x7f;
+		val >>= 7;
+		if (val)
+			buf[len] |= 0x80;
+		len++;
+	} while (val);
+
+	return len;
+}
+
+static int put_header(struct recorder *rec, unsigned char *buf, char type)
+{
+	unsigned long long now = now_us();
+	int len = 0;
+
+	buf[len++] = type;
+	len += put_num(buf + len, now - rec->last);
+	rec->last = now;
+
+	return len;
+}
+
+static void record_write(struct ccli *ccli, const void *buf, int len)
+{
+	struct recorder *rec = ccli->recorder;
+
+	/* Give up on the recording if it can not be written */
+	if (write(rec->fd, buf, len) != len)
+		ccli_record_stop(ccli);
+}
+
+static void record_winsize(struct ccli *ccli)
+{
+	struct recorder *rec = ccli->recorder;
+	unsigned char buf[RECORD_HDR_MAX + 5];
+	struct winsize w;
+	int len;
+
+	if (!ccli->in_tty || ioctl(ccli->in, TIOCGWINSZ, &w) < 0)
+		return;
+
+	if (w.ws_row == rec->rows && w.ws_col == rec->cols)
+		return;
+
+	rec->rows = w.ws_row;
+	rec->cols = w.ws_col;
+
+	len = put_header(rec, buf, 'W');
+	len += put_num(buf + len, w.ws_row);
+	len += put_num(buf + len, w.ws_col);
+
+	record_write(ccli, buf, len);
+}
+
+/* Called by read_in() with what was read from the input */
+__hidden void record_input(struct ccli *ccli, const void *data, int size)
+{
+	unsigned char buf[RECORD_HDR_MAX + 16];
+	struct recorder *rec = ccli->recorder;
+	int len;
+
+	/* The size is checked at every read, as SIGWINCH may not be handled */
+	record_winsize(ccli);
+	if (!ccli->recorder)
+		return;
+
+	len = put_header(rec, buf, 'I');
+	len += put_num(buf + len, size);
+
+	/* Keys are short, and most records take a single write */
+	if (size <= sizeof(buf) - len) {
+		memcpy(buf + len, data, size);
+		record_write(ccli, buf, len + size);
+		return;
+	}
+
+	record_write(ccli, buf, len);
+	if (ccli->recorder)
+		record_write(ccli, data, size);
+}
+
+/* Called by ccli_loop(), to start recording if CCLI_RECORD is set */
+__hidden void record_env_start(struct ccli *ccli)
+{
+	const char *file;
+	int fd;
+
+	if (ccli->recorder)
+		return;
+
+	file = getenv(RECORD_ENV);
+	if (!file || !*file)
+		return;
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+
+	if (ccli_record_start(ccli, fd) < 0) {
+		close(fd);
+		return;
+	}
+
+	ccli->recorder->owned = true;
+}
+
+/* Called when ccli_loop() exits, to stop what record_env_start() started */
+__hidden void record_env_stop(struct ccli *ccli)
+{
+	if (ccli->recorder && ccli->recorder->owned)
+		ccli_record_stop(ccli);
+}
+
+/**
+ * ccli_record_start - Record what is typed into a file
+ * @ccli: The CLI descriptor to record the input of
+ * @fd: The file descriptor to write the recording to
+ *
+ * Writes everything that is read from the input of @ccli into @fd,
+ * along with when it was read and the size of the terminal, such
+ * that the session can be played back with ccli-replay.
+ *
+ * If the environment variable CCLI_RECORD is set to a file name when
+ * ccli_loop() starts, then it records into that file until it returns,
+ * without the application having to do anything.
+ *
+ * This can only be called from the thread that runs ccli_loop(), or
+ * when no thread is running it.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_record_start(struct ccli *ccli, int fd)
+{
+	static const char magic[8] = "CCLIREC\1";
+	struct recorder *rec;
+
+	if (!ccli || fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ccli->recorder) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (write(fd, magic, sizeof(magic)) != sizeof(magic))
+		return -1;
+
+	rec = mem_zalloc(ccli, sizeof(*rec));
+	if (!rec)
+		return -1;
+
+	rec->fd = fd;
+	rec->last = now_us();
+	ccli->recorder = rec;
+
+	record_winsize(ccli);
+
+	return 0;
+}
+
+/**
+ * ccli_record_stop - Stop recording what is typed
+ * @ccli: The CLI descriptor to stop recording
+ *
+ * Stops the recording that ccli_record_start() started. The file
+ * descriptor that was passed to it is not closed.
+ *
+ * Returns 0 on success and -1 if @ccli was not recording.
+ */
+int ccli_record_stop(struct ccli *ccli)
+{
+	struct recorder *rec;
+
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	rec = ccli->recorder;
+	if (!rec) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	ccli->recorder = NULL;
+	if (rec->owned)
+		close(rec->fd);
+	mem_free(ccli, rec);
+
+	return 0;
+}
+#else
+/* Built with CCLI_NO_RECORD */
+int ccli_record_start(struct ccli *ccli, int fd)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_record_stop(struct ccli *ccli)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
+
+#line 1 "src/simd.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * SIMD versions of the string kernels of the hot paths.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ *
+ * Each kernel has a plain C version that runs everywhere, and versions
+ * for SSE2 and AVX2 on x86_64, and NEON on arm64. The best one that the
+ * CPU supports is picked once when the library is loaded (the plain C
+ * one is used until then). Setting CCLI_SIMD to the name of a version
+ * ("scalar", "sse2", "avx2" or "neon") picks that one instead, if the
+ * CPU supports it.
+ *
+ * The strings are terminated by a NUL, and their length is not known.
+ * The vector versions read whole vectors, and may read past the NUL, but
+ * never into the next page, so that they can not fault. That is invisible
+ * to the program, but not to the sanitizers, which are turned off for
+ * them.
+ */
+#include <stdint.h>
+
+
+
+#define SIMD_ENV		"CCLI_SIMD"
+#define SIMD_PAGE_SIZE		4096
+
+/* find() of longer needles is left to strstr() */
+#define FIND_MAX_NEEDLE		256
+
+#if defined(__has_attribute)
+# if __has_attribute(no_sanitize)
+#  define __no_sanitize __attribute__((no_sanitize("address", "thread")))
+# endif
+#endif
+#ifndef __no_sanitize
+# define __no_sanitize
+#endif
+
+/* If a vector of @size bytes at @p would go into the next page */
+static inline bool page_cross(const char *p, int size)
+{
+	return ((uintptr_t)p & (SIMD_PAGE_SIZE - 1)) > SIMD_PAGE_SIZE - size;
+}
+
+/* The bytes that end a run of str_plain(): the spaces of isspace(), quotes and '\' */
+static inline bool special(unsigned char ch)
+{
+	switch (ch) {
+	case '\0':
+	case ' ':
+	case '\t': case '\n': case '\v': case '\f': case '\r':
+	case '\'':
+	case '"':
+	case '\\':
+		return true;
+	}
+	return false;
+}
+
+/* ---- Plain C ---- */
+
+static bool scalar_supported(void)
+{
+	return true;
+}
+
+static int scalar_prefix(const char *a, const char *b)
+{
+	int i;
+
+	for (i = 0; a[i] && a[i] == b[i]; i++)
+		;
+	return i;
+}
+
+static int scalar_plain(const char *s)
+{
+	int i;
+
+	for (i = 0; !special(s[i]); i++)
+		;
+	return i;
+}
+
+static const char *scalar_find(const char *hay, const char *needle, int nlen)
+{
+	return strstr(hay, needle);
+}
+
+static const struct simd_ops simd_scalar = {
+	.name		= "scalar",
+	.supported	= scalar_supported,
+	.prefix		= scalar_prefix,
+	.plain		= scalar_plain,
+	.find		= scalar_find,
+};
+
+/*
+ * The candidates of find() are where both the first and the last byte of
+ * @needle match, found a vector at a time. Each one is then compared,
+ * with strncmp() as @hay may end before @nlen. @mask has 1 << @shift
+ * bits set for each candidate of the vector at @i.
+ */
+static inline const char *find_check(const char *hay, int i, uint64_t mask,
+				     int shift, const char *needle, int nlen)
+{
+	int bit;
+
+	while (mask) {
+		bit = __builtin_ctzll(mask) >> shift;
+		if (strncmp(hay + i + bit + 1, needle + 1, nlen - 1) == 0)
+			return hay + i + bit;
+		/* Clear the bits of that byte */
+		mask &= ~(((1ULL << (1 << shift)) - 1) << (bit << shift));
+	}
+	return NULL;
+}
+
+/*
+ * Check @hay + @i one byte at a time, for where the vectors of find()
+ * would go into the next page. Returns 1 if it was found there, -1 if
+ * @hay ends there, and 0 to go on.
+ */
+static inline int find_byte(const char *hay, int i, const char *needle, int nlen)
+{
+	if (!hay[i])
+		return -1;
+	if (hay[i] == needle[0] && strncmp(hay + i + 1, needle + 1, nlen - 1) == 0)
+		return 1;
+	return 0;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/* ---- SSE2 (every x86_64 has it) ---- */
+
+static bool sse2_supported(void)
+{
+	return true;
+}
+
+static inline __m128i sse2_special(__m128i v)
+{
+	__m128i ws = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+	__m128i m;
+
+	/* '\t' to '\r' are the bytes where v - '\t' (unsigned) is at most 4 */
+	m = _mm_cmpeq_epi8(_mm_min_epu8(ws, _mm_set1_epi8(4)), ws);
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+	return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+}
+
+__no_sanitize
+static int sse2_prefix(const char *a, const char *b)
+{
+	__m128i va, vb;
+	unsigned int mask;
+	int i = 0;
+
+	for (;;) {
+		if (page_cross(a + i, 16) || page_cross(b + i, 16)) {
+			if (!a[i] || a[i] != b[i])
+				return i;
+			i++;
+			continue;
+		}
+		va = _mm_loadu_si128((const __m128i *)(a + i));
+		vb = _mm_loadu_si128((const __m128i *)(b + i));
+		/* The bytes that differ, or are the end of @a */
+		mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) |
+			_mm_movemask_epi8(_mm_cmpeq_epi8(va, _mm_setzero_si128()));
+		mask &= 0xffff;
+		if (mask)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+}
+
+__no_sanitize
+static int sse2_plain(const char *s)
+{
+	const char *p = (const char *)((uintptr_t)s & ~15UL);
+	unsigned int mask;
+
+	/* Aligned loads never cross a page. Skip what is before @s */
+	mask = _mm_movemask_epi8(sse2_special(_mm_load_si128((const __m128i *)p)));
+	mask >>= s - p;
+	if (mask)
+		return __builtin_ctz(mask);
+
+	for (;;) {
+		p += 16;
+		mask = _mm_movemask_epi8(sse2_special(_mm_load_si128((const __m128i *)p)));
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+}
+
+__no_sanitize
+static const char *sse2_find(const char *hay, const char *needle, int nlen)
+{
+	__m128i first, last, f, l;
+	unsigned int mask, end;
+	const char *p;
+	int i = 0;
+	int ret;
+
+	if (nlen < 2 || nlen > FIND_MAX_NEEDLE)
+		return strstr(hay, needle);
+
+	first = _mm_set1_epi8(needle[0]);
+	last = _mm_set1_epi8(needle[nlen - 1]);
+
+	for (;;) {
+		if (page_cross(hay + i, 16 + nlen - 1)) {
+			ret = find_byte(hay, i, needle, nlen);
+			if (ret)
+				return ret > 0 ? hay + i : NULL;
+			i++;
+			continue;
+		}
+		f = _mm_loadu_si128((const __m128i *)(hay + i));
+		l = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(f, first),
+						       _mm_cmpeq_epi8(l, last)));
+		/* Only what is before the end of @hay */
+		end = _mm_movemask_epi8(_mm_cmpeq_epi8(f, _mm_setzero_si128()));
+		if (end)
+			mask &= (end & -end) - 1;
+		p = find_check(hay, i, mask, 0, needle, nlen);
+		if (p || end)
+			return p;
+		i += 16;
+	}
+}
+
+static const struct simd_ops simd_sse2 = {
+	.name		= "sse2",
+	.supported	= sse2_supported,
+	.prefix		= sse2_prefix,
+	.plain		= sse2_plain,
+	.find		= sse2_find,
+};
+
+/* ---- AVX2 ---- */
+
+#define __avx2 __attribute__((target("avx2")))
+
+static bool avx2_supported(void)
+{
+	/* This may run before the constructor of libgcc that sets this up */
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+__avx2
+static inline __m256i avx2_special(__m256i v)
+{
+	__m256i ws = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+	__m256i m;
+
+	m = _mm256_cmpeq_epi8(_mm256_min_epu8(ws, _mm256_set1_epi8(4)), ws);
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+	return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+}
+
+__avx2 __no_sanitize
+static int avx2_prefix(const char *a, const char *b)
+{
+	__m256i va, vb;
+	unsigned int mask;
+	int i = 0;
+
+	for (;;) {
+		if (page_cross(a + i, 32) || page_cross(b + i, 32)) {
+			if (!a[i] || a[i] != b[i])
+				return i;
+			i++;
+			continue;
+		}
+		va = _mm256_loadu_si256((const __m256i *)(a + i));
+		vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) |
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, _mm256_setzero_si256()));
+		if (mask)
+			return i + __builtin_ctz(mask);
+		i += 32;
+	}
+}
+
+__avx2 __no_sanitize
+static int avx2_plain(const char *s)
+{
+	const char *p = (const char *)((uintptr_t)s & ~31UL);
+	unsigned int mask;
+
+	mask = _mm256_movemask_epi8(avx2_special(_mm256_load_si256((const __m256i *)p)));
+	mask >>= s - p;
+	if (mask)
+		return __builtin_ctz(mask);
+
+	for (;;) {
+		p += 32;
+		mask = _mm256_movemask_epi8(avx2_special(_mm256_load_si256((const __m256i *)p)));
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+}
+
+__avx2 __no_sanitize
+static const char *avx2_find(const char *hay, const char *needle, int nlen)
+{
+	__m256i first, last, f, l;
+	unsigned int mask, end;
+	const char *p;
+	int i = 0;
+	int ret;
+
+	if (nlen < 2 || nlen > FIND_MAX_NEEDLE)
+		return strstr(hay, needle);
+
+	first = _mm256_set1_epi8(needle[0]);
+	last = _mm256_set1_epi8(needle[nlen - 1]);
+
+	for (;;) {
+		if (page_cross(hay + i, 32 + nlen - 1)) {
+			ret = find_byte(hay, i, needle, nlen);
+			if (ret)
+				return ret > 0 ? hay + i : NULL;
+			i++;
+			continue;
+		}
+		f = _mm256_loadu_si256((const __m256i *)(hay + i));
+		l = _mm256_loadu_si256((const __m256i *)(hay + i + nlen - 1));
+		mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(f, first),
+							     _mm256_cmpeq_epi8(l, last)));
+		end = _mm256_movemask_epi8(_mm256_cmpeq_epi8(f, _mm256_setzero_si256()));
+		if (end)
+			mask &= (end & -end) - 1;
+		p = find_check(hay, i, mask, 0, needle, nlen);
+		if (p || end)
+			return p;
+		i += 32;
+	}
+}
+
+static const struct simd_ops simd_avx2 = {
+	.name		= "avx2",
+	.supported	= avx2_supported,
+	.prefix		= avx2_prefix,
+	.plain		= avx2_plain,
+	.find		= avx2_find,
+};
+
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+/* ---- NEON (every arm64 has it) ---- */
+
+static bool neon_supported(void)
+{
+	return true;
+}
+
+/* NEON has no movemask: narrow each byte of @eq to four bits of the result */
+static inline uint64_t neon_mask(uint8x16_t eq)
+{
+	uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+
+	return vget_lane_u64(vreinterpret_u64_u8(n), 0);
+}
+
+static inline uint8x16_t neon_special(uint8x16_t v)
+{
+	uint8x16_t m;
+
+	m = vcleq_u8(vsubq_u8(v, vdupq_n_u8('\t')), vdupq_n_u8(4));
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(0)));
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(' ')));
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\'')));
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('"')));
+	return vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\\')));
+}
+
+__no_sanitize
+static int neon_prefix(const char *a, const char *b)
+{
+	uint8x16_t va, vb;
+	uint64_t mask;
+	int i = 0;
+
+	for (;;) {
+		if (page_cross(a + i, 16) || page_cross(b + i, 16)) {
+			if (!a[i] || a[i] != b[i])
+				return i;
+			i++;
+			continue;
+		}
+		va = vld1q_u8((const uint8_t *)(a + i));
+		vb = vld1q_u8((const uint8_t *)(b + i));
+		mask = neon_mask(vorrq_u8(vmvnq_u8(vceqq_u8(va, vb)),
+					  vceqq_u8(va, vdupq_n_u8(0))));
+		if (mask)
+			return i + (__builtin_ctzll(mask) >> 2);
+		i += 16;
+	}
+}
+
+__no_sanitize
+static int neon_plain(const char *s)
+{
+	const char *p = (const char *)((uintptr_t)s & ~15UL);
+	uint64_t mask;
+
+	mask = neon_mask(neon_special(vld1q_u8((const uint8_t *)p)));
+	mask >>= (s - p) << 2;
+	if (mask)
+		return __builtin_ctzll(mask) >> 2;
+
+	for (;;) {
+		p += 16;
+		mask = neon_mask(neon_special(vld1q_u8((const uint8_t *)p)));
+		if (mask)
+			return p - s + (__builtin_ctzll(mask) >> 2);
+	}
+}
+
+__no_sanitize
+static const char *neon_find(const char *hay, const char *needle, int nlen)
+{
+	uint8x16_t first, last, f, l;
+	uint64_t mask, end;
+	const char *p;
+	int i = 0;
+	int ret;
+
+	if (nlen < 2 || nlen > FIND_MAX_NEEDLE)
+		return strstr(hay, needle);
+
+	first = vdupq_n_u8(needle[0]);
+	last = vdupq_n_u8(needle[nlen - 1]);
+
+	for (;;) {
+		if (page_cross(hay + i, 16 + nlen - 1)) {
+			ret = find_byte(hay, i, needle, nlen);
+			if (ret)
+				return ret > 0 ? hay + i : NULL;
+			i++;
+			continue;
+		}
+		f = vld1q_u8((const uint8_t *)(hay + i));
+		l = vld1q_u8((const uint8_t *)(hay + i + nlen - 1));
+		mask = neon_mask(vandq_u8(vceqq_u8(f, first), vceqq_u8(l, last)));
+		end = neon_mask(vceqq_u8(f, vdupq_n_u8(0)));
+		if (end)
+			mask &= (end & -end) - 1;
+		p = find_check(hay, i, mask, 2, needle, nlen);
+		if (p || end)
+			return p;
+		i += 16;
+	}
+}
+
+static const struct simd_ops simd_neon = {
+	.name		= "neon",
+	.supported	= neon_supported,
+	.prefix		= neon_prefix,
+	.plain		= neon_plain,
+	.find		= neon_find,
+};
+#endif
+
+/* From the slowest to the fastest */
+__hidden const struct simd_ops *simd_variants[] = {
+	&simd_scalar,
+#if defined(__x86_64__)
+	&simd_sse2,
+	&simd_avx2,
+#elif defined(__aarch64__)
+	&simd_neon,
+#endif
+	NULL,
+};
+
+__hidden const struct simd_ops *simd = &simd_scalar;
+
+__attribute__((constructor))
+static void simd_init(void)
+{
+	const struct simd_ops *best = &simd_scalar;
+	const char *name = getenv(SIMD_ENV);
+	int i;
+
+	for (i = 0; simd_variants[i]; i++) {
+		if (!simd_variants[i]->supported())
+			continue;
+		if (name && strcmp(name, simd_variants[i]->name) == 0) {
+			simd = simd_variants[i];
+			return;
+		}
+		best = simd_variants[i];
+	}
+	simd = best;
+}
+
+#line 1 "src/stats.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * The "stats" and "perf" commands, to see what the commands and the
+ * library cost from the prompt.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+
+
+/*
+ * Once ccli_register_stats() is called, every command that is executed
+ * is timed, and the time is added to a histogram for that command. The
+ * histogram has a bucket for each power of two of microseconds, which is
+ * enough to tell a command that is always slow from one that is only
+ * slow once in a while, and costs a clock read and a hash lookup for
+ * each command. The histograms are only touched by the thread that
+ * executes the commands.
+ */
+
+#define TIMING_UNKNOWN		"(unknown)"
+
+#define STATS_USAGE	"usage: stats [-r] [command]\n"
+#define PERF_USAGE	"usage: perf [on|off]\n"
+
+/* The longest a bar of the histogram of "stats command" gets */
+#define BAR_MAX			40
+
+static unsigned long long elapsed_ns(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000ULL +
+		now.tv_nsec - start->tv_nsec;
+}
+
+static unsigned int timing_hash(const char *name)
+{
+	unsigned int hash = 5381;
+
+	while (*name)
+		hash = hash * 33 + (unsigned char)*name++;
+
+	return hash & (TIMING_HASH - 1);
+}
+
+static struct timing *timing_find(struct timings *timings, const char *name)
+{
+	struct timing *t;
+
+	for (t = timings->hash[timing_hash(name)]; t; t = t->next) {
+		if (strcmp(t->name, name) == 0)
+			return t;
+	}
+	return NULL;
+}
+
+static struct timing *timing_get(struct ccli *ccli, const char *name)
+{
+	struct timings *timings = ccli->timings;
+	struct timing *t;
+	unsigned int h;
+
+	t = timing_find(timings, name);
+	if (t)
+		return t;
+
+	t = mem_zalloc(ccli, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->name = mem_strdup(ccli, name);
+	if (!t->name) {
+		mem_free(ccli, t);
+		return NULL;
+	}
+
+	h = timing_hash(name);
+	t->next = timings->hash[h];
+	timings->hash[h] = t;
+	timings->nr++;
+
+	return t;
+}
+
+/* The bucket for @ns, where bucket i is for less than 2^i microseconds */
+static int timing_bucket(unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	int b = 0;
+
+	while (us) {
+		us >>= 1;
+		b++;
+	}
+	return b < TIMING_BUCKETS ? b : TIMING_BUCKETS - 1;
+}
+
+__hidden void timing_start(struct ccli *ccli, struct timing_save *save)
+{
+	save->stats = ccli->stats;
+	clock_gettime(CLOCK_MONOTONIC, &save->start);
+}
+
+static void perf_print(struct ccli *ccli, unsigned long long ns,
+		       struct timing_save *save)
+{
+	struct ccli_stats *stats = &ccli->stats;
+
+	ccli_printf(ccli, "perf: %llu.%03llu ms, %lu reads (%lu bytes), "
+		    "%lu writes (%lu bytes), %lu allocs\n",
+		    ns / 1000000, (ns / 1000) % 1000,
+		    stats->reads - save->stats.reads,
+		    stats->bytes_read - save->stats.bytes_read,
+		    stats->writes - save->stats.writes,
+		    stats->bytes_written - save->stats.bytes_written,
+		    stats->allocs - save->stats.allocs);
+}
+
+/*
+ * Add the time since timing_start() to the histogram of @name (NULL for
+ * a command that is not registered).
+ */
+__hidden void timing_end(struct ccli *ccli, const char *name,
+			 struct timing_save *save)
+{
+	unsigned long long ns = elapsed_ns(&save->start);
+	struct timing *t;
+
+	/* The command may have been "perf on" */
+	if (ccli->timings->perf)
+		perf_print(ccli, ns, save);
+
+	t = timing_get(ccli, name ? name : TIMING_UNKNOWN);
+	if (!t)
+		return;
+
+	t->count++;
+	t->sum_ns += ns;
+	if (ns > t->max_ns)
+		t->max_ns = ns;
+	t->buckets[timing_bucket(ns)]++;
+}
+
+static void timings_reset(struct ccli *ccli)
+{
+	struct timings *timings = ccli->timings;
+	struct timing *t;
+	int i;
+
+	for (i = 0; i < TIMING_HASH; i++) {
+		while ((t = timings->hash[i])) {
+			timings->hash[i] = t->next;
+			mem_free(ccli, t->name);
+			mem_free(ccli, t);
+		}
+	}
+	timings->nr = 0;
+}
+
+/* Start timing the commands that @ccli executes */
+__hidden int timings_init(struct ccli *ccli)
+{
+	if (ccli->timings)
+		return 0;
+
+	ccli->timings = mem_zalloc(ccli, sizeof(*ccli->timings));
+	return ccli->timings ? 0 : -1;
+}
+
+__hidden void timings_free(struct ccli *ccli)
+{
+	if (!ccli->timings)
+		return;
+
+	timings_reset(ccli);
+	mem_free(ccli, ccli->timings);
+	ccli->timings = NULL;
+}
+
+/* Print @ns into @buf in a unit that keeps it short */
+static char *fmt_ns(char *buf, int size, unsigned long long ns)
+{
+	if (ns < 1000)
+		snprintf(buf, size, "%lluns", ns);
+	else if (ns < 1000000)
+		snprintf(buf, size, "%.1fus", ns / 1000.0);
+	else if (ns < 1000000000)
+		snprintf(buf, size, "%.1fms", ns / 1000000.0);
+	else
+		snprintf(buf, size, "%.2fs", ns / 1000000000.0);
+	return buf;
+}
+
+/*
+ * The time that @pct percent of the runs took no more than. This is
+ * the top of the bucket it falls in, or the longest time if that is
+ * less.
+ */
+static unsigned long long timing_pct(struct timing *t, int pct)
+{
+	unsigned long long want = (t->count * pct + 99) / 100;
+	unsigned long long sum = 0;
+	unsigned long long ns;
+	int b;
+
+	for (b = 0; b < TIMING_BUCKETS - 1; b++) {
+		sum += t->buckets[b];
+		if (sum >= want)
+			break;
+	}
+
+	ns = (1ULL << b) * 1000;
+	return b < TIMING_BUCKETS - 1 && ns < t->max_ns ? ns : t->max_ns;
+}
+
+static int cmp_timing(const void *a, const void *b)
+{
+	struct timing * const *ta = a;
+	struct timing * const *tb = b;
+
+	if ((*ta)->sum_ns != (*tb)->sum_ns)
+		return (*ta)->sum_ns < (*tb)->sum_ns ? 1 : -1;
+	return strcmp((*ta)->name, (*tb)->name);
+}
+
+/* Returns the commands that were timed, the most total time first */
+static struct timing **timings_sorted(struct ccli *ccli)
+{
+	struct timings *timings = ccli->timings;
+	struct timing **list;
+	struct timing *t;
+	int n = 0;
+	int i;
+
+	list = mem_alloc(ccli, sizeof(*list) * (timings->nr + 1));
+	if (!list)
+		return NULL;
+
+	for (i = 0; i < TIMING_HASH; i++) {
+		for (t = timings->hash[i]; t; t = t->next)
+			list[n++] = t;
+	}
+	list[n] = NULL;
+
+	qsort(list, n, sizeof(*list), cmp_timing);
+	return list;
+}
+
+static size_t commands_bytes(struct ccli *ccli, int *nr)
+{
+	struct command_table *cmds;
+	size_t bytes;
+	int i;
+
+	cmds = commands_get(ccli);
+	*nr = cmds->nr_commands;
+	bytes = sizeof(*cmds) + sizeof(struct command) * cmds->nr_commands;
+	for (i = 0; i < cmds->nr_commands; i++)
+		bytes += strlen(cmds->commands[i].cmd) + 1;
+	commands_put(ccli);
+
+	return bytes;
+}
+
+static size_t timings_bytes(struct ccli *ccli)
+{
+	struct timings *timings = ccli->timings;
+	struct timing *t;
+	size_t bytes = sizeof(*timings);
+	int i;
+
+	for (i = 0; i < TIMING_HASH; i++) {
+		for (t = timings->hash[i]; t; t = t->next)
+			bytes += sizeof(*t) + strlen(t->name) + 1;
+	}
+	return bytes;
+}
+
+static int show_counters(struct ccli *ccli, int line)
+{
+	struct ccli_stats stats;
+
+	ccli_stats(ccli, &stats);
+
+	line = ccli_page(ccli, line, "Counters:\n");
+	line = ccli_page(ccli, line, "  reads              %10lu (%lu bytes)\n",
+			 stats.reads, stats.bytes_read);
+	line = ccli_page(ccli, line, "  writes             %10lu (%lu bytes)\n",
+			 stats.writes, stats.bytes_written);
+	line = ccli_page(ccli, line, "  redraws            %10lu\n", stats.redraws);
+	line = ccli_page(ccli, line, "  allocs             %10lu\n", stats.allocs);
+	line = ccli_page(ccli, line, "  completions        %10lu\n", stats.completions);
+	line = ccli_page(ccli, line, "  history searches   %10lu\n",
+			 stats.history_searches);
+	return line;
+}
+
+static int show_memory(struct ccli *ccli, int line)
+{
+	struct ccli_pool_stats pstats;
+	size_t history;
+	size_t cached = 0;
+	size_t bytes;
+	int lines;
+	int nr;
+	int i;
+
+	pthread_mutex_lock(&ccli->history_lock);
+	history = ccli->history_bytes + sizeof(char *) * ccli->history_max;
+	lines = ccli->history_size;
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	if (ccli->shared_buf)
+		history += ring_buf_size(ccli->shared);
+
+	line = ccli_page(ccli, line, "Memory:\n");
+	line = ccli_page(ccli, line, "  history            %10zu bytes (%d lines)\n",
+			 history, lines);
+
+	bytes = commands_bytes(ccli, &nr);
+	line = ccli_page(ccli, line, "  commands           %10zu bytes (%d commands)\n",
+			 bytes, nr);
+
+	for (i = 0; i < CCLI_NR_POOLS; i++) {
+		ccli_pool_stats(ccli, i, &pstats);
+		cached += pstats.cached_bytes;
+	}
+	line = ccli_page(ccli, line, "  pool caches        %10zu bytes\n", cached);
+
+	if (ccli->line) {
+		line = ccli_page(ccli, line, "  line buffer        %10d bytes\n",
+				 ccli->line->size);
+	}
+
+	line = ccli_page(ccli, line, "  timings            %10zu bytes (%d commands)\n",
+			 timings_bytes(ccli), ccli->timings->nr);
+	return line;
+}
+
+static int show_timings(struct ccli *ccli, int line)
+{
+	struct timing **list;
+	struct timing *t;
+	char avg[16], p50[16], p99[16], max[16];
+	int i;
+
+	list = timings_sorted(ccli);
+	if (!list)
+		return -1;
+
+	line = ccli_page(ccli, line, "Commands:          %10s %9s %9s %9s %9s\n",
+			 "count", "avg", "p50", "p99", "max");
+
+	for (i = 0; line >= 0 && (t = list[i]); i++) {
+		line = ccli_page(ccli, line, "  %-16s %10lu %9s %9s %9s %9s\n",
+				 t->name, t->count,
+				 fmt_ns(avg, sizeof(avg), t->sum_ns / t->count),
+				 fmt_ns(p50, sizeof(p50), timing_pct(t, 50)),
+				 fmt_ns(p99, sizeof(p99), timing_pct(t, 99)),
+				 fmt_ns(max, sizeof(max), t->max_ns));
+	}
+
+	mem_free(ccli, list);
+	return line;
+}
+
+/* The histogram of the times of one command */
+static void show_histogram(struct ccli *ccli, struct timing *t)
+{
+	unsigned long most = 0;
+	char avg[16], max[16];
+	int first = -1, last = 0;
+	int line = 1;
+	int b;
+
+	for (b = 0; b < TIMING_BUCKETS; b++) {
+		if (!t->buckets[b])
+			continue;
+		if (first < 0)
+			first = b;
+		last = b;
+		if (t->buckets[b] > most)
+			most = t->buckets[b];
+	}
+
+	line = ccli_page(ccli, line, "%s: %lu runs, avg %s, max %s\n",
+			 t->name, t->count,
+			 fmt_ns(avg, sizeof(avg), t->sum_ns / t->count),
+			 fmt_ns(max, sizeof(max), t->max_ns));
+
+	for (b = first; line >= 0 && b <= last; b++) {
+		if (b < TIMING_BUCKETS - 1)
+			line = ccli_page(ccli, line, "  < %10lluus %10lu |",
+					 1ULL << b, t->buckets[b]);
+		else
+			line = ccli_page(ccli, line, "  >=%10lluus %10lu |",
+					 1ULL << (b - 1), t->buckets[b]);
+		ccli_printf(ccli, "%.*s\n", (int)(t->buckets[b] * BAR_MAX / most),
+			    "########################################");
+	}
+}
+
+static int stats_command(struct ccli *ccli, const char *command,
+			 const char *line_str, void *data,
+			 int argc, char **argv)
+{
+	struct timing *t;
+	int line = 1;
+
+	if (argc > 2)
+		goto usage;
+
+	if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+		ccli_stats_reset(ccli);
+		timings_reset(ccli);
+		return 0;
+	}
+
+	if (argc == 2) {
+		if (argv[1][0] == '-')
+			goto usage;
+		t = timing_find(ccli->timings, argv[1]);
+		if (!t)
+			ccli_printf(ccli, "%s has not been executed\n", argv[1]);
+		else
+			show_histogram(ccli, t);
+		return 0;
+	}
+
+	line = show_counters(ccli, line);
+	if (line >= 0)
+		line = show_memory(ccli, line);
+	if (line >= 0)
+		show_timings(ccli, line);
+
+	return 0;
+ usage:
+	echo_str(ccli, STATS_USAGE);
+	return 0;
+}
+
+static int perf_command(struct ccli *ccli, const char *command,
+			const char *line, void *data,
+			int argc, char **argv)
+{
+	struct timings *timings = ccli->timings;
+
+	if (argc == 1) {
+		ccli_printf(ccli, "perf is %s\n", timings->perf ? "on" : "off");
+		return 0;
+	}
+
+	if (argc != 2)
+		goto usage;
+
+	if (strcmp(argv[1], "on") == 0)
+		timings->perf = true;
+	else if (strcmp(argv[1], "off") == 0)
+		timings->perf = false;
+	else
+		goto usage;
+
+	return 0;
+ usage:
+	echo_str(ccli, PERF_USAGE);
+	return 0;
+}
+
+/**
+ * ccli_register_stats - Add the "stats" and "perf" commands
+ * @ccli: The CLI descriptor to add the commands to
+ *
+ * Registers the command "stats [-r] [command]", which shows the
+ * counters of ccli_stats(), the memory used by the history, the
+ * commands, the pool caches and the timings, and how long each
+ * command took to execute. With a command name, it shows a histogram
+ * of the times of that command, and with "-r" it zeros it all.
+ *
+ * Also registers "perf [on|off]", which when on, prints after each
+ * command how long it took and the reads, writes and allocations it
+ * made.
+ *
+ * From this call on, every command that is executed is timed.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_stats(struct ccli *ccli)
+{
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (timings_init(ccli) < 0)
+		return -1;
+
+	if (ccli_register_command(ccli, "stats", stats_command, NULL) < 0 ||
+	    ccli_register_command(ccli, "perf", perf_command, NULL) < 0)
+		return -1;
+
+	return 0;
+}
+
+#line 1 "src/metrics.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Export the counters and the times of the commands to a file.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+
+
+/*
+ * The file is in the text format of Prometheus, for the textfile
+ * collector of the node exporter to pick up. It is written to a new
+ * file next to it, and then renamed over it, so that the collector
+ * never sees one that is half written. This runs from the loop, when
+ * the timer fires while waiting for input, so nothing is exported while
+ * a command executes, and no other thread is needed.
+ */
+struct metrics {
+	char			*file;
+	char			*tmp;		/* Template for mkstemp() */
+	int			tfd;
+	struct capture		buf;
+};
+
+static const struct {
+	const char		*name;
+	const char		*help;
+	size_t			offset;
+} counters[] = {
+	{ "reads_total", "read() calls made on the input",
+	  offsetof(struct ccli_stats, reads) },
+	{ "read_bytes_total", "Bytes read from the input",
+	  offsetof(struct ccli_stats, bytes_read) },
+	{ "writes_total", "write() calls made on the output",
+	  offsetof(struct ccli_stats, writes) },
+	{ "written_bytes_total", "Bytes written to the output",
+	  offsetof(struct ccli_stats, bytes_written) },
+	{ "redraws_total", "Times the line was drawn again",
+	  offsetof(struct ccli_stats, redraws) },
+	{ "allocs_total", "Allocations and reallocations made",
+	  offsetof(struct ccli_stats, allocs) },
+	{ "completions_total", "Completions done",
+	  offsetof(struct ccli_stats, completions) },
+	{ "history_searches_total", "Reverse history searches done",
+	  offsetof(struct ccli_stats, history_searches) },
+};
+
+static const char *pool_names[CCLI_NR_POOLS] = {
+	[CCLI_POOL_LINE]	= "line",
+	[CCLI_POOL_ARGV]	= "argv",
+	[CCLI_POOL_COMPLETION]	= "completion",
+};
+
+__attribute__((__format__(printf, 3, 4)))
+static void buf_printf(struct ccli *ccli, struct capture *cap,
+		       const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+	int size;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (cap->len + len >= cap->size) {
+		size = cap->size ? cap->size : 4096;
+		while (size <= cap->len + len)
+			size *= 2;
+		buf = mem_realloc(ccli, cap->buf, size);
+		if (!buf) {
+			/* Sticks until metrics_write() starts over */
+			cap->failed = true;
+			return;
+		}
+		cap->buf = buf;
+		cap->size = size;
+	}
+
+	va_start(ap, fmt);
+	cap->len += vsnprintf(cap->buf + cap->len, cap->size - cap->len, fmt, ap);
+	va_end(ap);
+}
+
+/* A label value, with '\', '"' and newline escaped */
+static void buf_label(struct ccli *ccli, struct capture *cap, const char *str)
+{
+	const char *p;
+
+	for (p = str; *p; p++) {
+		switch (*p) {
+		case '\\':
+		case '"':
+			buf_printf(ccli, cap, "\\%c", *p);
+			break;
+		case '\n':
+			buf_printf(ccli, cap, "\\n");
+			break;
+		default:
+			buf_printf(ccli, cap, "%c", *p);
+		}
+	}
+}
+
+static void help(struct ccli *ccli, struct capture *cap, const char *name,
+		 const char *help, const char *type)
+{
+	buf_printf(ccli, cap, "# HELP ccli_%s %s.\n", name, help);
+	buf_printf(ccli, cap, "# TYPE ccli_%s %s\n", name, type);
+}
+
+static void export_counters(struct ccli *ccli, struct capture *cap)
+{
+	struct ccli_stats stats;
+	int i;
+
+	ccli_stats(ccli, &stats);
+
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+		help(ccli, cap, counters[i].name, counters[i].help, "counter");
+		buf_printf(ccli, cap, "ccli_%s %lu\n", counters[i].name,
+			   *(unsigned long *)((char *)&stats + counters[i].offset));
+	}
+}
+
+static void export_pools(struct ccli *ccli, struct capture *cap)
+{
+	struct ccli_pool_stats stats[CCLI_NR_POOLS];
+	int i;
+
+	for (i = 0; i < CCLI_NR_POOLS; i++)
+		ccli_pool_stats(ccli, i, &stats[i]);
+
+#define POOL_METRIC(field, type, help_str, suffix)			\
+	help(ccli, cap, "pool_" #field suffix, help_str, type);		\
+	for (i = 0; i < CCLI_NR_POOLS; i++)				\
+		buf_printf(ccli, cap, "ccli_pool_" #field suffix	\
+			   "{pool=\"%s\"} %lu\n",			\
+			   pool_names[i], stats[i].field)
+
+	POOL_METRIC(allocs, "counter", "Allocations asked of the pool", "_total");
+	POOL_METRIC(hits, "counter", "Allocations the pool had cached", "_total");
+	POOL_METRIC(cached_bytes, "gauge", "Bytes the pool has cached", "");
+#undef POOL_METRIC
+}
+
+static void export_history(struct ccli *ccli, struct capture *cap)
+{
+	int lines;
+	int bytes;
+
+	pthread_mutex_lock(&ccli->history_lock);
+	lines = ccli->history_size;
+	bytes = ccli->history_bytes;
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	help(ccli, cap, "history_lines", "Lines in the history", "gauge");
+	buf_printf(ccli, cap, "ccli_history_lines %d\n", lines);
+	help(ccli, cap, "history_bytes", "Bytes of text in the history", "gauge");
+	buf_printf(ccli, cap, "ccli_history_bytes %d\n", bytes);
+}
+
+static void export_timing(struct ccli *ccli, struct capture *cap,
+			  struct timing *t)
+{
+	unsigned long cnt = 0;
+	int b;
+
+	/* The last bucket is the same as +Inf */
+	for (b = 0; b < TIMING_BUCKETS - 1; b++) {
+		cnt += t->buckets[b];
+		buf_printf(ccli, cap, "ccli_command_duration_seconds_bucket{command=\"");
+		buf_label(ccli, cap, t->name);
+		buf_printf(ccli, cap, "\",le=\"%g\"} %lu\n",
+			   (double)(1ULL << b) / 1000000, cnt);
+	}
+
+	buf_printf(ccli, cap, "ccli_command_duration_seconds_bucket{command=\"");
+	buf_label(ccli, cap, t->name);
+	buf_printf(ccli, cap, "\",le=\"+Inf\"} %lu\n", t->count);
+
+	buf_printf(ccli, cap, "ccli_command_duration_seconds_sum{command=\"");
+	buf_label(ccli, cap, t->name);
+	buf_printf(ccli, cap, "\"} %.9f\n", t->sum_ns / 1000000000.0);
+
+	buf_printf(ccli, cap, "ccli_command_duration_seconds_count{command=\"");
+	buf_label(ccli, cap, t->name);
+	buf_printf(ccli, cap, "\"} %lu\n", t->count);
+}
+
+static void export_timings(struct ccli *ccli, struct capture *cap)
+{
+	struct timing *t;
+	int i;
+
+	help(ccli, cap, "command_duration_seconds",
+	     "Time the commands took to execute", "histogram");
+
+	for (i = 0; i < TIMING_HASH; i++) {
+		for (t = ccli->timings->hash[i]; t; t = t->next)
+			export_timing(ccli, cap, t);
+	}
+}
+
+static int metrics_write(struct ccli *ccli)
+{
+	struct metrics *metrics = ccli->metrics;
+	struct capture *cap = &metrics->buf;
+	int ret;
+	int fd;
+
+	cap->len = 0;
+	cap->failed = false;
+	export_counters(ccli, cap);
+	export_pools(ccli, cap);
+	export_history(ccli, cap);
+	if (ccli->timings)
+		export_timings(ccli, cap);
+
+	/* Better to leave the last file in place than a partial one */
+	if (cap->failed) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	strcpy(metrics->tmp + strlen(metrics->file), ".XXXXXX");
+	fd = mkstemp(metrics->tmp);
+	if (fd < 0)
+		return -1;
+
+	/* mkstemp() only lets the owner read it */
+	fchmod(fd, 0644);
+
+	ret = write(fd, cap->buf, cap->len);
+	if (ret >= 0 && ret != cap->len) {
+		errno = ENOSPC;
+		ret = -1;
+	}
+	if (close(fd) < 0)
+		ret = -1;
+	if (ret < 0)
+		goto fail;
+
+	if (rename(metrics->tmp, metrics->file) < 0)
+		goto fail;
+
+	return 0;
+ fail:
+	unlink(metrics->tmp);
+	return -1;
+}
+
+__hidden int metrics_fd(struct ccli *ccli)
+{
+	return ccli->metrics ? ccli->metrics->tfd : -1;
+}
+
+/* Called from the loop when the timer fired */
+__hidden void metrics_handle(struct ccli *ccli)
+{
+	uint64_t val;
+
+	if (read(ccli->metrics->tfd, &val, sizeof(val)) != sizeof(val))
+		return;
+
+	metrics_write(ccli);
+}
+
+__hidden void metrics_free(struct ccli *ccli)
+{
+	struct metrics *metrics = ccli->metrics;
+
+	if (!metrics)
+		return;
+
+	if (metrics->tfd >= 0)
+		close(metrics->tfd);
+	mem_free(ccli, metrics->buf.buf);
+	mem_free(ccli, metrics->tmp);
+	mem_free(ccli, metrics->file);
+	mem_free(ccli, metrics);
+	ccli->metrics = NULL;
+}
+
+/**
+ * ccli_metrics_file - Write the counters to a file every so often
+ * @ccli: The CLI descriptor to export the counters of
+ * @file: The file to write them to (NULL to stop)
+ * @ms: How often to write the file in milliseconds
+ *
+ * Write the counters of ccli_stats() and ccli_pool_stats(), the size
+ * of the history and a histogram of the times of each command (which
+ * this starts to keep) to @file, in the text format that Prometheus
+ * reads, and do so again every @ms milliseconds while ccli_loop()
+ * waits for input. The file is replaced with rename(), so that whatever
+ * reads it never sees it half written.
+ *
+ * The file is written once before this returns, to report if it can
+ * not be.
+ *
+ * The timer is polled by ccli_loop(), so this may only be called from
+ * the thread that runs it (like from a command), or while it is not
+ * running.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_metrics_file(struct ccli *ccli, const char *file, int ms)
+{
+	struct metrics *metrics;
+	struct itimerspec its;
+	int len;
+
+	if (!ccli || (file && ms <= 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The loop may be polling the timer that this closes */
+	if (other_thread(ccli)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	metrics_free(ccli);
+	if (!file)
+		return 0;
+
+	if (timings_init(ccli) < 0)
+		return -1;
+
+	metrics = mem_zalloc(ccli, sizeof(*metrics));
+	if (!metrics)
+		return -1;
+
+	ccli->metrics = metrics;
+	metrics->tfd = -1;
+
+	len = strlen(file);
+	metrics->file = mem_strdup(ccli, file);
+	metrics->tmp = mem_alloc(ccli, len + sizeof(".XXXXXX"));
+	if (!metrics->file || !metrics->tmp)
+		goto fail;
+	strcpy(metrics->tmp, file);
+
+	metrics->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (metrics->tfd < 0)
+		goto fail;
+
+	if (metrics_write(ccli) < 0)
+		goto fail;
+
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(metrics->tfd, 0, &its, NULL) < 0)
+		goto fail;
+
+	return 0;
+ fail:
+	len = errno;
+	metrics_free(ccli);
+	errno = len;
+	return -1;
+}
+
+#line 1 "src/pager.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * A pager for the output of commands, that scrolls both ways and
+ * searches.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+
+
+#ifndef CCLI_NO_PAGER
+
+/*
+ * Between ccli_pager_start() and ccli_pager_stop(), what the loop thread
+ * writes is kept in fixed size chunks, so that a large output is never
+ * copied to grow it, along with the offset of the start of each line.
+ * When it is stopped, the output is shown one screen at a time, and the
+ * user can go back and forth through it, and search it, without the
+ * command having to run again.
+ */
+
+#define PAGER_CHUNK		(16 * 1024)
+#define PAGER_PATTERN_MAX	256
+
+#define PAGE_USAGE	"usage: page command [args...]\n"
+
+#define PAGER_HELP	"q:quit space/b:page j/k:line g/G:top/end /?:search n/N:next"
+
+struct pager {
+	char			**chunks;
+	int			nr_chunks;
+	size_t			len;
+	size_t			*lines;		/* Offset of the start of each line */
+	int			nr_lines;
+	int			max_lines;
+	bool			bol;		/* The next byte starts a line */
+};
+
+/* What is shown of the pager */
+struct pager_view {
+	struct pager		*pager;
+	struct capture		screen;
+	char			*line;		/* The line from view_line() */
+	int			line_size;
+	int			rows;		/* Of output, the last one is for status */
+	int			cols;
+	int			top;
+	const char		*msg;
+	char			pattern[PAGER_PATTERN_MAX];
+	int			plen;
+	bool			backward;
+};
+
+static int index_line(struct ccli *ccli, struct pager *pager)
+{
+	size_t *lines;
+	int max;
+
+	if (pager->nr_lines == pager->max_lines) {
+		max = pager->max_lines ? pager->max_lines * 2 : 256;
+		lines = mem_realloc(ccli, pager->lines, sizeof(*lines) * max);
+		if (!lines)
+			return -1;
+		pager->lines = lines;
+		pager->max_lines = max;
+	}
+	pager->lines[pager->nr_lines++] = pager->len;
+	return 0;
+}
+
+static int copy_in(struct ccli *ccli, struct pager *pager,
+		   const char *str, int len)
+{
+	char **chunks;
+	int chunk;
+	int off;
+	int n;
+
+	while (len) {
+		chunk = pager->len / PAGER_CHUNK;
+		off = pager->len % PAGER_CHUNK;
+
+		if (chunk == pager->nr_chunks) {
+			chunks = mem_realloc(ccli, pager->chunks,
+					     sizeof(*chunks) * (chunk + 1));
+			if (!chunks)
+				return -1;
+			pager->chunks = chunks;
+			chunks[chunk] = mem_alloc(ccli, PAGER_CHUNK);
+			if (!chunks[chunk])
+				return -1;
+			pager->nr_chunks++;
+		}
+
+		n = PAGER_CHUNK - off < len ? PAGER_CHUNK - off : len;
+		memcpy(pager->chunks[chunk] + off, str, n);
+		pager->len += n;
+		str += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Keep what is written while paging, instead of writing it out */
+__hidden int pager_add(struct ccli *ccli, const char *str, int len)
+{
+	struct pager *pager = ccli->pager;
+	const char *nl;
+	int n;
+	int i;
+
+	for (i = 0; i < len; i += n) {
+		if (pager->bol) {
+			if (index_line(ccli, pager) < 0)
+				return -1;
+			pager->bol = false;
+		}
+
+		nl = memchr(str + i, '\n', len - i);
+		n = nl ? nl - (str + i) + 1 : len - i;
+		if (copy_in(ccli, pager, str + i, n) < 0)
+			return -1;
+
+		pager->bol = nl != NULL;
+	}
+	return len;
+}
+
+static void free_pager(struct ccli *ccli, struct pager *pager)
+{
+	int i;
+
+	for (i = 0; i < pager->nr_chunks; i++)
+		mem_free(ccli, pager->chunks[i]);
+	mem_free(ccli, pager->chunks);
+	mem_free(ccli, pager->lines);
+	mem_free(ccli, pager);
+}
+
+__hidden void pager_free(struct ccli *ccli)
+{
+	if (!ccli->pager)
+		return;
+
+	free_pager(ccli, ccli->pager);
+	ccli->pager = NULL;
+}
+
+/* Copy line @nr, without its newline, into view->line */
+static const char *view_line(struct ccli *ccli, struct pager_view *view,
+			    int nr, int *plen)
+{
+	struct pager *pager = view->pager;
+	size_t start = pager->lines[nr];
+	size_t end;
+	char *line;
+	int len;
+	int off;
+	int n;
+
+	end = nr + 1 < pager->nr_lines ? pager->lines[nr + 1] : pager->len;
+	len = end - start;
+
+	if (len >= view->line_size) {
+		line = mem_realloc(ccli, view->line, len + 1);
+		if (!line)
+			return NULL;
+		view->line = line;
+		view->line_size = len + 1;
+	}
+
+	/* A line may go over the end of a chunk */
+	for (off = 0; off < len; off += n) {
+		n = PAGER_CHUNK - (start + off) % PAGER_CHUNK;
+		if (n > len - off)
+			n = len - off;
+		memcpy(view->line + off,
+		       pager->chunks[(start + off) / PAGER_CHUNK] +
+		       (start + off) % PAGER_CHUNK, n);
+	}
+
+	if (len && view->line[len - 1] == '\n')
+		len--;
+	view->line[len] = '\0';
+
+	*plen = len;
+	return view->line;
+}
+
+static int last_top(struct pager_view *view)
+{
+	int top = view->pager->nr_lines - (view->rows - 1);
+
+	return top > 0 ? top : 0;
+}
+
+static void draw_view(struct ccli *ccli, struct pager_view *view)
+{
+	struct capture *screen = &view->screen;
+	struct pager *pager = view->pager;
+	const char *line;
+	char status[64];
+	int bottom;
+	int len;
+	int r;
+
+	screen->len = 0;
+	capture_add(ccli, screen, "\033[H\033[2J", 7);
+
+	for (r = 0; r < view->rows - 1; r++) {
+		if (view->top + r >= pager->nr_lines) {
+			capture_add(ccli, screen, "~\n", 2);
+			continue;
+		}
+		line = view_line(ccli, view, view->top + r, &len);
+		if (!line)
+			continue;
+		/* Long lines are cut at the width of the window */
+		if (len > view->cols)
+			len = view->cols;
+		capture_add(ccli, screen, line, len);
+		capture_add(ccli, screen, "\n", 1);
+	}
+
+	bottom = view->top + view->rows - 1;
+	if (bottom > pager->nr_lines)
+		bottom = pager->nr_lines;
+
+	if (view->msg) {
+		len = snprintf(status, sizeof(status), "%s", view->msg);
+		view->msg = NULL;
+	} else {
+		len = snprintf(status, sizeof(status), "lines %d-%d/%d%s",
+			       view->top + 1, bottom, pager->nr_lines,
+			       bottom == pager->nr_lines ? " (END)" : "");
+	}
+	if (len >= sizeof(status))
+		len = sizeof(status) - 1;
+	if (len > view->cols)
+		len = view->cols;
+
+	capture_add(ccli, screen, "\033[7m", 4);
+	capture_add(ccli, screen, status, len);
+	capture_add(ccli, screen, "\033[0m", 4);
+
+	write_out(ccli, screen->buf, screen->len);
+	stat_add(ccli, redraws, 1);
+	trace_probe(redraw, screen->len);
+}
+
+/* Read what to search for on the status line. Returns false if cancelled */
+static bool read_pattern(struct ccli *ccli, struct pager_view *view, char type)
+{
+	char pattern[PAGER_PATTERN_MAX];
+	int len = 0;
+	int ch;
+
+	write_out(ccli, "\r\033[K", 4);
+	echo(ccli, type);
+
+	for (;;) {
+		ch = read_char(ccli);
+		switch (ch) {
+		case '\n':
+		case '\r':
+			if (!len)
+				return view->plen > 0;
+			memcpy(view->pattern, pattern, len);
+			view->pattern[len] = '\0';
+			view->plen = len;
+			return true;
+		case CHAR_BACKSPACE:
+			if (!len)
+				return false;
+			len--;
+			write_out(ccli, "\b \b", 3);
+			break;
+		case CHAR_INTR:
+		case CHAR_ERROR:
+		case CHAR_EXIT:
+			return false;
+		default:
+			if (ch < ' ' || ch > '~' || len == sizeof(pattern) - 1)
+				break;
+			pattern[len++] = ch;
+			echo(ccli, ch);
+		}
+	}
+}
+
+/* Put the next line (or the one before with @backward) that matches at the top */
+static void search_view(struct ccli *ccli, struct pager_view *view, bool backward)
+{
+	const char *line;
+	int dir = backward ? -1 : 1;
+	int len;
+	int nr;
+
+	if (!view->plen) {
+		view->msg = "No previous pattern";
+		return;
+	}
+
+	for (nr = view->top + dir; nr >= 0 && nr < view->pager->nr_lines; nr += dir) {
+		line = view_line(ccli, view, nr, &len);
+		if (line && str_find(line, view->pattern, view->plen)) {
+			view->top = nr;
+			return;
+		}
+	}
+	view->msg = "Pattern not found";
+}
+
+static int show_view(struct ccli *ccli, struct pager *pager, int rows, int cols)
+{
+	struct pager_view view;
+	int page = rows - 1;
+	int ch;
+
+	memset(&view, 0, sizeof(view));
+	view.pager = pager;
+	view.rows = rows;
+	view.cols = cols;
+	view.msg = PAGER_HELP;
+
+	for (;;) {
+		if (view.top > last_top(&view))
+			view.top = last_top(&view);
+		if (view.top < 0)
+			view.top = 0;
+
+		draw_view(ccli, &view);
+
+		ch = read_char(ccli);
+		switch (ch) {
+		case 'q':
+		case 'Q':
+		case CHAR_INTR:
+		case CHAR_ERROR:
+		case CHAR_EXIT:
+			goto out;
+		case ' ':
+		case 'f':
+		case CHAR_PAGEDOWN:
+			view.top += page;
+			break;
+		case 'b':
+		case CHAR_PAGEUP:
+			view.top -= page;
+			break;
+		case 'j':
+		case '\n':
+		case '\r':
+		case CHAR_DOWN:
+			view.top++;
+			break;
+		case 'k':
+		case CHAR_UP:
+			view.top--;
+			break;
+		case 'g':
+		case '<':
+		case CHAR_HOME:
+			view.top = 0;
+			break;
+		case 'G':
+		case '>':
+		case CHAR_END:
+			view.top = last_top(&view);
+			break;
+		case '/':
+		case '?':
+			if (read_pattern(ccli, &view, ch)) {
+				view.backward = ch == '?';
+				search_view(ccli, &view, view.backward);
+			}
+			break;
+		case 'n':
+			search_view(ccli, &view, view.backward);
+			break;
+		case 'N':
+			search_view(ccli, &view, !view.backward);
+			break;
+		}
+	}
+ out:
+	/* Leave the last screen, but not the status line */
+	write_out(ccli, "\r\033[K", 4);
+
+	mem_free(ccli, view.line);
+	mem_free(ccli, view.screen.buf);
+
+	return ch == CHAR_ERROR ? -1 : 0;
+}
+
+/**
+ * ccli_pager_start - Keep the output to show it in a pager
+ * @ccli: The CLI descriptor to page the output of
+ *
+ * From now until ccli_pager_stop() is called, what is written with
+ * ccli_printf() and the other output functions of @ccli (by the thread
+ * that runs the commands) is kept, and not written out. ccli_page()
+ * does not stop at each window full, nor does it need to count the
+ * lines, as the pager does that.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_pager_start(struct ccli *ccli)
+{
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Output that is being captured (like by watch) can not be paged */
+	if (ccli->pager || ccli->capture) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	ccli->pager = mem_zalloc(ccli, sizeof(*ccli->pager));
+	if (!ccli->pager)
+		return -1;
+
+	ccli->pager->bol = true;
+	return 0;
+}
+
+/**
+ * ccli_pager_stop - Show the output kept since ccli_pager_start()
+ * @ccli: The CLI descriptor to page the output of
+ *
+ * If the input of @ccli is a terminal, and the output kept does not fit
+ * in its window, it is shown a screen at a time, where the user can
+ * scroll forward and back, jump to the top or the end, and search, until
+ * 'q' or Ctrl^C is hit. Otherwise, it is written out as is.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_pager_stop(struct ccli *ccli)
+{
+	struct pager *pager;
+	struct winsize w;
+	int ret = 0;
+	int i;
+
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pager = ccli->pager;
+	if (!pager) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* What is written from now on is written out */
+	ccli->pager = NULL;
+
+	if (ccli->in_tty && !ioctl(ccli->in, TIOCGWINSZ, &w) &&
+	    w.ws_row > 1 && w.ws_col && pager->nr_lines >= w.ws_row) {
+		ret = show_view(ccli, pager, w.ws_row, w.ws_col);
+	} else {
+		for (i = 0; i < pager->nr_chunks; i++) {
+			write_out(ccli, pager->chunks[i],
+				  i < pager->nr_chunks - 1 ? PAGER_CHUNK :
+				  pager->len - (size_t)i * PAGER_CHUNK);
+		}
+	}
+
+	free_pager(ccli, pager);
+	return ret;
+}
+
+static int page_command(struct ccli *ccli, const char *command,
+			const char *line, void *data,
+			int argc, char **argv)
+{
+	const char *cmd;
+	int ret;
+
+	/* Use what was typed, so that the quoting is kept */
+	cmd = line_word(line, 1);
+	if (!cmd) {
+		echo_str(ccli, PAGE_USAGE);
+		return 0;
+	}
+
+	if (ccli_pager_start(ccli) < 0) {
+		echo_str(ccli, "page: can not page this output\n");
+		return 0;
+	}
+
+	ret = execute(ccli, cmd, false);
+
+	ccli_pager_stop(ccli);
+
+	return ret;
+}
+
+/**
+ * ccli_register_pager - Add the "page" command
+ * @ccli: The CLI descriptor to add the command to
+ *
+ * Registers the command "page command [args...]", which executes the
+ * given command with its output kept, and then shows it with the pager
+ * of ccli_pager_stop().
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_pager(struct ccli *ccli)
+{
+	return ccli_register_command(ccli, "page", page_command, NULL);
+}
+#else
+/* Built with CCLI_NO_PAGER */
+int ccli_pager_start(struct ccli *ccli)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_pager_stop(struct ccli *ccli)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_register_pager(struct ccli *ccli)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
+
+#line 1 "src/json.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * A JSON writer that does not allocate.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+
+
+/*
+ * The writer lives on the stack of its caller, and the JSON is built in
+ * its buffer, which is written out (or added to a capture) when it is
+ * full and at json_flush(). A record that fits in the buffer is written
+ * with one write, so that a reader gets whole lines.
+ */
+
+__hidden void json_init(struct json_writer *w, struct ccli *ccli,
+			struct capture *cap)
+{
+	w->ccli = ccli;
+	w->cap = cap;
+	w->len = 0;
+	w->ret = 0;
+	w->comma = false;
+}
+
+__hidden int json_flush(struct json_writer *w)
+{
+	int ret;
+
+	if (!w->len)
+		return w->ret;
+
+	if (w->cap)
+		ret = capture_add(w->ccli, w->cap, w->buf, w->len);
+	else
+		ret = print_str(w->ccli, w->buf, w->len);
+	if (ret < 0)
+		w->ret = -1;
+
+	w->len = 0;
+	return w->ret;
+}
+
+__hidden void json_raw(struct json_writer *w, const char *str, int len)
+{
+	int n;
+
+	while (len) {
+		if (w->len == JSON_BUF)
+			json_flush(w);
+		n = JSON_BUF - w->len < len ? JSON_BUF - w->len : len;
+		memcpy(w->buf + w->len, str, n);
+		w->len += n;
+		str += n;
+		len -= n;
+	}
+}
+
+__hidden void json_string(struct json_writer *w, const char *str)
+{
+	const char *p = str;
+	char esc[8];
+	int len;
+
+	json_raw(w, "\"", 1);
+	for (; *p; p++) {
+		if (*p != '"' && *p != '\\' && (unsigned char)*p >= ' ')
+			continue;
+
+		json_raw(w, str, p - str);
+		str = p + 1;
+
+		switch (*p) {
+		case '\n':
+			json_raw(w, "\\n", 2);
+			break;
+		case '\t':
+			json_raw(w, "\\t", 2);
+			break;
+		case '\r':
+			json_raw(w, "\\r", 2);
+			break;
+		case '"':
+		case '\\':
+			esc[0] = '\\';
+			esc[1] = *p;
+			json_raw(w, esc, 2);
+			break;
+		default:
+			len = snprintf(esc, sizeof(esc), "\\u%04x", *p);
+			json_raw(w, esc, len);
+		}
+	}
+	json_raw(w, str, p - str);
+	json_raw(w, "\"", 1);
+}
+
+static inline bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/* Is @str a number as JSON has it? */
+__hidden bool json_number(const char *str)
+{
+	const char *p = str;
+
+	if (*p == '-')
+		p++;
+	if (*p == '0')
+		p++;
+	else if (is_digit(*p))
+		while (is_digit(*p))
+			p++;
+	else
+		return false;
+
+	if (*p == '.') {
+		if (!is_digit(*++p))
+			return false;
+		while (is_digit(*p))
+			p++;
+	}
+
+	if (*p == 'e' || *p == 'E') {
+		p++;
+		if (*p == '+' || *p == '-')
+			p++;
+		if (!is_digit(*p))
+			return false;
+		while (is_digit(*p))
+			p++;
+	}
+	return !*p;
+}
+
+__hidden void json_begin(struct json_writer *w)
+{
+	json_raw(w, "{", 1);
+	w->comma = false;
+}
+
+/* Ends the object, and the line it is on */
+__hidden void json_end(struct json_writer *w)
+{
+	json_raw(w, "}\n", 2);
+}
+
+__hidden void json_key(struct json_writer *w, const char *key)
+{
+	if (w->comma)
+		json_raw(w, ",", 1);
+	w->comma = true;
+
+	json_string(w, key);
+	json_raw(w, ":", 1);
+}
+
+/* A number if @str is one, null if it is NULL, and a string otherwise */
+__hidden void json_value(struct json_writer *w, const char *str)
+{
+	if (!str)
+		json_raw(w, "null", 4);
+	else if (json_number(str))
+		json_raw(w, str, strlen(str));
+	else
+		json_string(w, str);
+}
+
+#line 1 "src/table.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Output of tables, with the columns laid out for the widest cell.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+
+
+/*
+ * The cells are copied into an arena as they are added, and the width
+ * of each column is kept up to date then, so that the table is laid out
+ * without going over the cells a second time. ccli_table_end() then
+ * writes it out a window full at a time (or every TABLE_FLUSH bytes when
+ * the output is not a terminal), and hands a table that does not fit in
+ * the window to the pager.
+ */
+
+#define TABLE_FLUSH		(64 * 1024)
+
+/* The gap between two columns */
+#define TABLE_GAP		2
+
+struct table_chunk {
+	struct table_chunk	*next;
+	size_t			size;
+	size_t			used;
+	char			data[];
+};
+
+/* The first chunk, each new chunk doubles in size */
+#define TABLE_CHUNK		(BUFSIZ - sizeof(struct table_chunk))
+
+struct ccli_table {
+	struct ccli		*ccli;
+	struct table_chunk	*arena;
+	const char		**cells;	/* The headers, then each row */
+	int			nr_cells;
+	int			max_cells;
+	int			cols;
+	int			*widths;
+	unsigned char		*kinds;		/* What the cells of each column hold */
+};
+
+/* The kinds of a column */
+#define COL_NUMBER		(1 << 0)
+#define COL_TEXT		(1 << 1)
+
+static char *table_alloc(struct ccli_table *table, size_t len)
+{
+	struct table_chunk *chunk = table->arena;
+	size_t size;
+	char *p;
+
+	if (!chunk || chunk->used + len > chunk->size) {
+		size = chunk ? chunk->size * 2 : TABLE_CHUNK;
+		while (size < len)
+			size *= 2;
+		chunk = mem_alloc(table->ccli, sizeof(*chunk) + size);
+		if (!chunk)
+			return NULL;
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->next = table->arena;
+		table->arena = chunk;
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += len;
+	return p;
+}
+
+/* What is left of the current chunk */
+static size_t table_room(struct ccli_table *table, char **p)
+{
+	struct table_chunk *chunk = table->arena;
+
+	if (!chunk) {
+		*p = NULL;
+		return 0;
+	}
+	*p = chunk->data + chunk->used;
+	return chunk->size - chunk->used;
+}
+
+/* A column of numbers (empty cells aside) is right aligned */
+static bool numeric(struct ccli_table *table, int col)
+{
+	return table->kinds[col] == COL_NUMBER;
+}
+
+/* The columns @str takes up, where a UTF-8 character takes one */
+static int str_width(const char *str)
+{
+	int width = 0;
+
+	for (; *str; str++)
+		width += (*str & 0xc0) != 0x80;
+	return width;
+}
+
+/* Add @str (already in the arena) as the next cell */
+static int add_cell(struct ccli_table *table, const char *str)
+{
+	const char **cells;
+	int col = table->nr_cells % table->cols;
+	int width;
+	int max;
+
+	if (table->nr_cells == table->max_cells) {
+		max = table->max_cells * 2;
+		cells = mem_realloc(table->ccli, table->cells, sizeof(*cells) * max);
+		if (!cells)
+			return -1;
+		table->cells = cells;
+		table->max_cells = max;
+	}
+	table->cells[table->nr_cells++] = str;
+
+	width = str_width(str);
+	if (width > table->widths[col])
+		table->widths[col] = width;
+
+	/* The header and empty cells do not count */
+	if (table->nr_cells > table->cols && *str)
+		table->kinds[col] |= json_number(str) ? COL_NUMBER : COL_TEXT;
+
+	return 0;
+}
+
+static int copy_cell(struct ccli_table *table, const char *str)
+{
+	int len = strlen(str);
+	char *p;
+
+	p = table_alloc(table, len + 1);
+	if (!p)
+		return -1;
+	memcpy(p, str, len + 1);
+	return add_cell(table, p);
+}
+
+static void free_table(struct ccli_table *table)
+{
+	struct ccli *ccli = table->ccli;
+	struct table_chunk *chunk;
+
+	while (table->arena) {
+		chunk = table->arena;
+		table->arena = chunk->next;
+		mem_free(ccli, chunk);
+	}
+	mem_free(ccli, table->cells);
+	mem_free(ccli, table->widths);
+	mem_free(ccli, table->kinds);
+	mem_free(ccli, table);
+}
+
+/**
+ * ccli_table_begin - Start a table to write to the ccli output
+ * @ccli: The CLI descriptor to write the table to
+ * @header: The header of the first column, followed by the others, and NULL
+ *
+ * Start a table that has a column for each header given. The rows are
+ * added with ccli_table_row() and ccli_table_cell(), and the table is
+ * written out and freed by ccli_table_end().
+ *
+ * Returns the table on success, and NULL on error.
+ */
+struct ccli_table *ccli_table_begin(struct ccli *ccli, const char *header, ...)
+{
+	struct ccli_table *table;
+	const char *h;
+	va_list ap;
+	int cols = 0;
+
+	if (!ccli || !header) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	va_start(ap, header);
+	for (h = header; h; h = va_arg(ap, const char *))
+		cols++;
+	va_end(ap);
+
+	table = mem_zalloc(ccli, sizeof(*table));
+	if (!table)
+		return NULL;
+
+	table->ccli = ccli;
+	table->cols = cols;
+	table->max_cells = cols * 16;
+	table->cells = mem_alloc(ccli, sizeof(*table->cells) * table->max_cells);
+	table->widths = mem_zalloc(ccli, sizeof(*table->widths) * cols);
+	table->kinds = mem_zalloc(ccli, sizeof(*table->kinds) * cols);
+	if (!table->cells || !table->widths || !table->kinds)
+		goto fail;
+
+	va_start(ap, header);
+	for (h = header; h; h = va_arg(ap, const char *)) {
+		if (copy_cell(table, h) < 0)
+			break;
+	}
+	va_end(ap);
+
+	if (h)
+		goto fail;
+
+	return table;
+ fail:
+	free_table(table);
+	return NULL;
+}
+
+/* Fill what is left of a row that is not complete with empty cells */
+static int finish_row(struct ccli_table *table)
+{
+	while (table->nr_cells % table->cols) {
+		if (add_cell(table, "") < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * ccli_table_row - Add a row to a table
+ * @table: The table from ccli_table_begin()
+ * @cell: The first cell of the row, followed by the others
+ *
+ * Adds a row with a cell for each column of @table, so there must be
+ * as many strings passed in as there are columns. A NULL cell is left
+ * empty. If the last row was started by ccli_table_cell() and is not
+ * complete, the rest of its cells are left empty.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_table_row(struct ccli_table *table, const char *cell, ...)
+{
+	va_list ap;
+	int ret = 0;
+	int i;
+
+	if (!table) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (finish_row(table) < 0)
+		return -1;
+
+	va_start(ap, cell);
+	for (i = 0; i < table->cols && ret >= 0; i++) {
+		ret = copy_cell(table, cell ? cell : "");
+		if (i < table->cols - 1)
+			cell = va_arg(ap, const char *);
+	}
+	va_end(ap);
+
+	return ret;
+}
+
+/**
+ * ccli_table_cell - Add the next cell to a table
+ * @table: The table from ccli_table_begin()
+ * @fmt: A printf() like format of what goes in the cell
+ *
+ * Adds the next cell of the row being filled in, and after the last
+ * column, starts the next row. The text is formatted straight into the
+ * table, so there is no need to format it into a buffer first.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_table_cell(struct ccli_table *table, const char *fmt, ...)
+{
+	va_list ap;
+	size_t room;
+	char *p;
+	int len;
+
+	if (!table || !fmt) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	room = table_room(table, &p);
+
+	va_start(ap, fmt);
+	len = room ? vsnprintf(p, room, fmt, ap) : vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (len < 0)
+		return -1;
+
+	if (len < room) {
+		/* It fit in what was left of the arena */
+		p = table_alloc(table, len + 1);
+	} else {
+		p = table_alloc(table, len + 1);
+		if (!p)
+			return -1;
+		va_start(ap, fmt);
+		vsnprintf(p, len + 1, fmt, ap);
+		va_end(ap);
+	}
+
+	return add_cell(table, p);
+}
+
+static int table_flush(struct ccli_table *table, struct capture *out)
+{
+	int ret;
+
+	ret = print_str(table->ccli, out->buf, out->len);
+	out->len = 0;
+	return ret < 0 ? -1 : 0;
+}
+
+static void add_pad(struct ccli *ccli, struct capture *out, int pad)
+{
+	static const char spaces[] = "                                ";
+	int n;
+
+	for (; pad > 0; pad -= n) {
+		n = pad < sizeof(spaces) - 1 ? pad : sizeof(spaces) - 1;
+		capture_add(ccli, out, spaces, n);
+	}
+}
+
+static void text_row(struct ccli_table *table, struct capture *out,
+		     const char **cells)
+{
+	struct ccli *ccli = table->ccli;
+	int last = table->cols - 1;
+	int start = out->len;
+	int pad;
+	int c;
+
+	for (c = 0; c <= last; c++) {
+		pad = table->widths[c] - str_width(cells[c]);
+
+		/* Numbers are right aligned, and their header with them */
+		if (numeric(table, c))
+			add_pad(ccli, out, pad);
+
+		capture_add(ccli, out, cells[c], strlen(cells[c]));
+
+		if (c < last)
+			add_pad(ccli, out, TABLE_GAP + (numeric(table, c) ? 0 : pad));
+	}
+
+	/* Do not leave spaces at the end of the line */
+	while (out->len > start && out->buf[out->len - 1] == ' ')
+		out->len--;
+	capture_add(ccli, out, "\n", 1);
+}
+
+static void text_rule(struct ccli_table *table, struct capture *out)
+{
+	static const char dashes[] = "--------------------------------";
+	struct ccli *ccli = table->ccli;
+	int n;
+	int w;
+	int c;
+
+	for (c = 0; c < table->cols; c++) {
+		for (w = table->widths[c]; w > 0; w -= n) {
+			n = w < sizeof(dashes) - 1 ? w : sizeof(dashes) - 1;
+			capture_add(ccli, out, dashes, n);
+		}
+		if (c < table->cols - 1)
+			add_pad(ccli, out, TABLE_GAP);
+	}
+	capture_add(ccli, out, "\n", 1);
+}
+
+static void csv_cell(struct ccli *ccli, struct capture *out, const char *cell)
+{
+	const char *p;
+	const char *q;
+
+	if (!cell[strcspn(cell, ",\"\r\n")]) {
+		capture_add(ccli, out, cell, strlen(cell));
+		return;
+	}
+
+	/* Quoted, with the quotes in it doubled */
+	capture_add(ccli, out, "\"", 1);
+	for (p = cell; (q = strchr(p, '"')); p = q + 1) {
+		capture_add(ccli, out, p, q - p + 1);
+		capture_add(ccli, out, "\"", 1);
+	}
+	capture_add(ccli, out, p, strlen(p));
+	capture_add(ccli, out, "\"", 1);
+}
+
+static void csv_row(struct ccli_table *table, struct capture *out,
+		    const char **cells)
+{
+	int c;
+
+	for (c = 0; c < table->cols; c++) {
+		if (c)
+			capture_add(table->ccli, out, ",", 1);
+		csv_cell(table->ccli, out, cells[c]);
+	}
+	capture_add(table->ccli, out, "\n", 1);
+}
+
+/* An object for each row, keyed by the headers, one per line */
+static void json_row(struct ccli_table *table, struct capture *out,
+		     const char **cells)
+{
+	struct json_writer w;
+	int c;
+
+	json_init(&w, table->ccli, out);
+	json_begin(&w);
+	for (c = 0; c < table->cols; c++) {
+		json_key(&w, table->cells[c]);
+		if (numeric(table, c))
+			json_value(&w, *cells[c] ? cells[c] : NULL);
+		else
+			json_string(&w, cells[c]);
+	}
+	json_end(&w);
+	json_flush(&w);
+}
+
+static int write_table(struct ccli_table *table, enum ccli_table_format format,
+		       int rows)
+{
+	struct ccli *ccli = table->ccli;
+	struct capture out = { };
+	int lines = 0;
+	int ret = 0;
+	int r;
+
+	switch (format) {
+	case CCLI_TABLE_TEXT:
+		text_row(table, &out, table->cells);
+		text_rule(table, &out);
+		lines = 2;
+		break;
+	case CCLI_TABLE_CSV:
+		csv_row(table, &out, table->cells);
+		lines = 1;
+		break;
+	case CCLI_TABLE_JSON:
+		break;
+	}
+
+	for (r = table->cols; r < table->nr_cells; r += table->cols) {
+		switch (format) {
+		case CCLI_TABLE_TEXT:
+			text_row(table, &out, table->cells + r);
+			break;
+		case CCLI_TABLE_CSV:
+			csv_row(table, &out, table->cells + r);
+			break;
+		case CCLI_TABLE_JSON:
+			json_row(table, &out, table->cells + r);
+			break;
+		}
+
+		/* A write for each window full */
+		if (++lines == rows || out.len >= TABLE_FLUSH) {
+			if (table_flush(table, &out) < 0)
+				ret = -1;
+			lines = 0;
+		}
+	}
+
+	if (out.len && table_flush(table, &out) < 0)
+		ret = -1;
+
+	mem_free(ccli, out.buf);
+	return ret;
+}
+
+/**
+ * ccli_table_end - Write out a table and free it
+ * @table: The table from ccli_table_begin()
+ *
+ * Writes out @table, with each column as wide as its widest cell, and
+ * the columns that only have numbers right aligned. If the output is a
+ * terminal, and the table does not fit in the window, it is shown in the
+ * pager of ccli_pager_stop(). If the output is not a terminal, the table
+ * is written as set by ccli_set_table_format(), and in the JSON mode of
+ * ccli_set_output_mode() it is always written as JSON.
+ *
+ * @table is freed, even on error.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_table_end(struct ccli_table *table)
+{
+	enum ccli_table_format format = CCLI_TABLE_TEXT;
+	struct ccli *ccli;
+	struct winsize w;
+	bool page = false;
+	int rows = 0;
+	int ret;
+
+	if (!table) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ccli = table->ccli;
+
+	if (finish_row(table) < 0) {
+		free_table(table);
+		return -1;
+	}
+
+	if (ccli->output_mode == CCLI_OUTPUT_JSON)
+		format = CCLI_TABLE_JSON;
+	else if (!isatty(ccli->out))
+		format = ccli->table_format;
+
+	if (ccli->in_tty && !ioctl(ccli->in, TIOCGWINSZ, &w))
+		rows = w.ws_row;
+
+	/* The pager reads the input, which only the loop thread may do */
+	if (format == CCLI_TABLE_TEXT && rows && !paging(ccli) &&
+	    !ccli->capture && !other_thread(ccli) &&
+	    table->nr_cells / table->cols + 1 >= rows)
+		page = !ccli_pager_start(ccli);
+
+	ret = write_table(table, format, rows);
+
+	if (page && ccli_pager_stop(ccli) < 0)
+		ret = -1;
+
+	free_table(table);
+	return ret;
+}
+
+/**
+ * ccli_set_table_format - Set how tables are written when not to a terminal
+ * @ccli: The CLI descriptor to set the format of
+ * @format: The format of the tables
+ *
+ * Sets how ccli_table_end() writes tables when the output of @ccli is
+ * not a terminal. CCLI_TABLE_TEXT (the default) lays them out as they
+ * are on a terminal, CCLI_TABLE_CSV writes them as comma separated
+ * values, and CCLI_TABLE_JSON writes each row as a JSON object on a line
+ * of its own.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_set_table_format(struct ccli *ccli, enum ccli_table_format format)
+{
+	if (!ccli || format < CCLI_TABLE_TEXT || format > CCLI_TABLE_JSON) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ccli->table_format = format;
+	return 0;
+}
+
+#line 1 "src/emit.c"
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Output of records, as text for people or as JSON for scripts.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+
+
+/*
+ * A command that emits its results as records with ccli_emit_kv() and
+ * ccli_emit_record() does not need to know who reads them. In the text
+ * mode they are "key: value" lines, and in the JSON mode each record is
+ * a JSON object on a line of its own. Either way, the record is built in
+ * a json_writer on the stack and written with one write.
+ */
+
+/* Values longer than this are formatted into an allocated buffer */
+#define EMIT_VALUE		256
+
+#define OUTPUT_USAGE	"usage: output [text|json]\n"
+
+static const char *mode_names[] = {
+	[CCLI_OUTPUT_TEXT]	= "text",
+	[CCLI_OUTPUT_JSON]	= "json",
+};
+
+/**
+ * ccli_set_output_mode - Set how records are written
+ * @ccli: The CLI descriptor to set the mode of
+ * @mode: CCLI_OUTPUT_TEXT or CCLI_OUTPUT_JSON
+ *
+ * Sets how ccli_emit_kv() and ccli_emit_record() write their records.
+ * In CCLI_OUTPUT_JSON, tables of ccli_table_end() are written as JSON
+ * too, whatever ccli_set_table_format() was set to.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_set_output_mode(struct ccli *ccli, enum ccli_output_mode mode)
+{
+	if (!ccli || mode < CCLI_OUTPUT_TEXT || mode > CCLI_OUTPUT_JSON) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ccli->output_mode = mode;
+	return 0;
+}
+
+/**
+ * ccli_get_output_mode - Get how records are written
+ * @ccli: The CLI descriptor to get the mode of
+ *
+ * Returns the mode set by ccli_set_output_mode() (CCLI_OUTPUT_TEXT if
+ * it was never set), so that a command can tell who it is writing for.
+ */
+enum ccli_output_mode ccli_get_output_mode(struct ccli *ccli)
+{
+	return ccli ? ccli->output_mode : CCLI_OUTPUT_TEXT;
+}
+
+static void text_kv(struct json_writer *w, const char *key, int width,
+		    const char *val)
+{
+	static const char spaces[] = "                                ";
+	int len = strlen(key);
+	int pad;
+
+	json_raw(w, key, len);
+	json_raw(w, ":", 1);
+
+	/* Nothing after the key of an empty value */
+	if (val && *val) {
+		for (pad = width - len + 1; pad > 0; pad -= sizeof(spaces) - 1)
+			json_raw(w, spaces, pad < sizeof(spaces) - 1 ?
+				 pad : sizeof(spaces) - 1);
+		json_raw(w, val, strlen(val));
+	}
+	json_raw(w, "\n", 1);
+}
+
+/**
+ * ccli_emit_kv - Write a record of one key and value
+ * @ccli: The CLI descriptor to write to
+ * @key: The name of the value
+ * @fmt: A printf() like format of the value
+ *
+ * Writes "key: value" in the text mode, and {"key":value} in the JSON
+ * mode of ccli_set_output_mode(). A value that is a number is a JSON
+ * number, and any other is a string.
+ *
+ * Like ccli_printf(), this may be called from any thread.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_emit_kv(struct ccli *ccli, const char *key, const char *fmt, ...)
+{
+	struct json_writer w;
+	char buf[EMIT_VALUE];
+	char *alloc = NULL;
+	const char *val = buf;
+	va_list ap;
+	int ret;
+
+	if (!ccli || !key || !fmt) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	va_start(ap, fmt);
+	ret = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (ret >= (int)sizeof(buf)) {
+		va_start(ap, fmt);
+		ret = mem_vasprintf(ccli, &alloc, fmt, ap);
+		va_end(ap);
+		val = alloc;
+	}
+	if (ret < 0)
+		return -1;
+
+	json_init(&w, ccli, NULL);
+
+	if (ccli->output_mode == CCLI_OUTPUT_JSON) {
+		json_begin(&w);
+		json_key(&w, key);
+		json_value(&w, val);
+		json_end(&w);
+	} else {
+		text_kv(&w, key, strlen(key), val);
+	}
+
+	ret = json_flush(&w);
+	mem_free(ccli, alloc);
+
+	return ret;
+}
+
+/**
+ * ccli_emit_record - Write a record of keys and values
+ * @ccli: The CLI descriptor to write to
+ * @key: The name of the first value, followed by the value, then the
+ *       next key and value, and so on, ending with a NULL key
+ *
+ * Writes a record that has a value for each key. In the text mode it is
+ * a "key: value" line for each, with the values lined up, and in the
+ * JSON mode of ccli_set_output_mode() it is one JSON object on a line.
+ * A value that is a number is a JSON number, a NULL value is null, and
+ * any other is a string.
+ *
+ * The record is built without allocating, and is written with one write
+ * unless it is longer than a kilobyte.
+ *
+ * Like ccli_printf(), this may be called from any thread.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_emit_record(struct ccli *ccli, const char *key, ...)
+{
+	struct json_writer w;
+	const char *k;
+	const char *val;
+	va_list ap;
+	int width = 0;
+	int len;
+
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	json_init(&w, ccli, NULL);
+
+	if (ccli->output_mode == CCLI_OUTPUT_JSON) {
+		json_begin(&w);
+		va_start(ap, key);
+		for (k = key; k; k = va_arg(ap, const char *)) {
+			json_key(&w, k);
+			json_value(&w, va_arg(ap, const char *));
+		}
+		va_end(ap);
+		json_end(&w);
+		return json_flush(&w);
+	}
+
+	/* Line up the values after the widest key */
+	va_start(ap, key);
+	for (k = key; k; k = va_arg(ap, const char *)) {
+		len = strlen(k);
+		if (len > width)
+			width = len;
+		va_arg(ap, const char *);
+	}
+	va_end(ap);
+
+	va_start(ap, key);
+	for (k = key; k; k = va_arg(ap, const char *)) {
+		val = va_arg(ap, const char *);
+		text_kv(&w, k, width, val);
+	}
+	va_end(ap);
+
+	return json_flush(&w);
+}
+
+static int output_command(struct ccli *ccli, const char *command,
+			  const char *line, void *data,
+			  int argc, char **argv)
+{
+	int i;
+
+	if (argc == 1) {
+		ccli_emit_kv(ccli, "output", "%s", mode_names[ccli->output_mode]);
+		return 0;
+	}
+
+	for (i = 0; argc == 2 && i <= CCLI_OUTPUT_JSON; i++) {
+		if (strcmp(argv[1], mode_names[i]) == 0) {
+			ccli->output_mode = i;
+			return 0;
+		}
+	}
+
+	echo_str(ccli, OUTPUT_USAGE);
+	return 0;
+}
+
+/**
+ * ccli_register_output - Add the "output" command
+ * @ccli: The CLI descriptor to add the command to
+ *
+ * Registers the command "output [text|json]", which sets the mode of
+ * ccli_set_output_mode() for the session, so that a script that drives
+ * it can ask for JSON. Without an argument, it shows the mode.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_output(struct ccli *ccli)
+{
+	return ccli_register_command(ccli, "output", output_command, NULL);
+}
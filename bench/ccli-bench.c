@@ -0,0 +1,540 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Copyright (C) 2022, Steven Rostedt <rostedt@goodmis.org>
+ *
+ * Microbenchmarks of the paths of libccli that run on every key,
+ * command or line of output.
+ *
+ * Each benchmark prints one line of JSON with the time, the allocations
+ * and the system calls that one operation took on average:
+ *
+ *  {"bench":"find_command/1000","iterations":524288,"ns_per_op":812.4,
+ *   "allocs_per_op":0.00,"syscalls_per_op":0.00}
+ *
+ * Allocations are counted with an allocator given to ccli_set_allocator().
+ * System calls are counted by linking with --wrap for the calls libccli
+ * makes (see the Makefile), so calls that libc makes on its own behalf
+ * (like tcsetattr() calling ioctl()) are not counted.
+ */
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+
+#include "ccli-local.h"
+
+#define DEFAULT_MS		200
+
+/* How many history searches to queue up input for at a time */
+#define SEARCH_BATCH		1000
+#define SEARCH_INPUT		"zzz\n"
+
+static unsigned long nr_allocs;
+static unsigned long nr_syscalls;
+static bool counting;
+
+static inline void count_syscall(void)
+{
+	if (counting)
+		nr_syscalls++;
+}
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+	count_syscall();
+	return __real_read(fd, buf, count);
+}
+
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+	count_syscall();
+	return __real_write(fd, buf, count);
+}
+
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	count_syscall();
+	return __real_poll(fds, nfds, timeout);
+}
+
+int __real_select(int nfds, fd_set *r, fd_set *w, fd_set *e, struct timeval *t);
+int __wrap_select(int nfds, fd_set *r, fd_set *w, fd_set *e, struct timeval *t)
+{
+	count_syscall();
+	return __real_select(nfds, r, w, e, t);
+}
+
+int __real_ioctl(int fd, unsigned long req, void *arg);
+int __wrap_ioctl(int fd, unsigned long req, void *arg)
+{
+	count_syscall();
+	return __real_ioctl(fd, req, arg);
+}
+
+int __real_open(const char *path, int flags, mode_t mode);
+int __wrap_open(const char *path, int flags, mode_t mode)
+{
+	count_syscall();
+	return __real_open(path, flags, mode);
+}
+
+int __real_close(int fd);
+int __wrap_close(int fd)
+{
+	count_syscall();
+	return __real_close(fd);
+}
+
+off_t __real_lseek(int fd, off_t offset, int whence);
+off_t __wrap_lseek(int fd, off_t offset, int whence)
+{
+	count_syscall();
+	return __real_lseek(fd, offset, whence);
+}
+
+off64_t __real_lseek64(int fd, off64_t offset, int whence);
+off64_t __wrap_lseek64(int fd, off64_t offset, int whence)
+{
+	count_syscall();
+	return __real_lseek64(fd, offset, whence);
+}
+
+static void *count_malloc(size_t size, void *data)
+{
+	if (counting)
+		nr_allocs++;
+	return malloc(size);
+}
+
+static void *count_realloc(void *ptr, size_t size, void *data)
+{
+	if (counting)
+		nr_allocs++;
+	return realloc(ptr, size);
+}
+
+static void count_free(void *ptr, void *data)
+{
+	free(ptr);
+}
+
+static const struct ccli_allocator count_allocator = {
+	.malloc		= count_malloc,
+	.realloc	= count_realloc,
+	.free		= count_free,
+};
+
+struct bench_ctx {
+	struct ccli		*ccli;
+	struct line_buf		line;
+	char			**names;
+	int			nr_names;
+	int			nr_words;
+	int			in[2];
+	int			null;
+	int			fd;
+	int			queued;
+};
+
+struct bench {
+	const char		*name;
+	int			arg;
+	int			(*setup)(struct bench_ctx *ctx, int arg);
+	void			(*run)(struct bench_ctx *ctx, unsigned long i);
+};
+
+/* Nothing the benchmarks do on the side is counted */
+#define uncounted(stmt)			\
+do {					\
+	counting = false;		\
+	stmt;				\
+	counting = true;		\
+} while (0)
+
+static int dummy_command(struct ccli *ccli, const char *command,
+			 const char *line, void *data,
+			 int argc, char **argv)
+{
+	return 0;
+}
+
+static int alloc_ctx_ccli(struct bench_ctx *ctx)
+{
+	ctx->null = open("/dev/null", O_WRONLY);
+	if (ctx->null < 0)
+		return -1;
+
+	if (pipe(ctx->in) < 0)
+		return -1;
+
+	ctx->ccli = ccli_alloc("bench> ", ctx->in[0], ctx->null);
+	if (!ctx->ccli)
+		return -1;
+
+	if (line_init(&ctx->line, &ctx->ccli->pools[CCLI_POOL_LINE]) < 0)
+		return -1;
+
+	ctx->ccli->line = &ctx->line;
+	ctx->fd = -1;
+	return 0;
+}
+
+static void free_ctx(struct bench_ctx *ctx)
+{
+	int i;
+
+	if (ctx->ccli) {
+		ctx->ccli->line = NULL;
+		line_cleanup(&ctx->line);
+		ccli_free(ctx->ccli);
+	}
+
+	for (i = 0; i < ctx->nr_names; i++)
+		free(ctx->names[i]);
+	free(ctx->names);
+
+	if (ctx->fd >= 0)
+		close(ctx->fd);
+	close(ctx->in[0]);
+	close(ctx->in[1]);
+	close(ctx->null);
+}
+
+/* ---- ccli_line_parse() ---- */
+
+static int setup_line_parse(struct bench_ctx *ctx, int arg)
+{
+	return 0;
+}
+
+static void run_line_parse(struct bench_ctx *ctx, unsigned long i)
+{
+	char **argv;
+	int argc;
+
+	argc = ccli_line_parse("set option 'quoted value' \"double quoted\" escaped\\ space 42",
+			       &argv);
+	if (argc > 0)
+		ccli_argv_free(argv);
+}
+
+/* ---- find_command() ---- */
+
+static int setup_commands(struct bench_ctx *ctx, int arg)
+{
+	int i;
+
+	if (alloc_ctx_ccli(ctx) < 0)
+		return -1;
+
+	ctx->names = calloc(arg, sizeof(*ctx->names));
+	if (!ctx->names)
+		return -1;
+
+	for (i = 0; i < arg; i++) {
+		if (asprintf(&ctx->names[i], "command%d", i) < 0)
+			return -1;
+		ctx->nr_names++;
+		if (ccli_register_command(ctx->ccli, ctx->names[i],
+					  dummy_command, NULL) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void run_find_command(struct bench_ctx *ctx, unsigned long i)
+{
+	struct command_table *cmds;
+	struct command *cmd;
+
+	cmds = commands_get(ctx->ccli);
+	cmd = find_command(cmds, ctx->names[i % ctx->nr_names]);
+	commands_put(ctx->ccli);
+
+	if (!cmd)
+		abort();
+}
+
+/* ---- do_completion() ---- */
+
+static int word_completion(struct ccli *ccli, const char *command,
+			   const char *line, int word, char *match,
+			   char ***list, void *data)
+{
+	struct bench_ctx *ctx = data;
+	int cnt = 0;
+	int i;
+
+	for (i = 0; i < ctx->nr_words; i++)
+		ccli_list_add_printf(ccli, list, &cnt, "word%05d", i);
+
+	return cnt;
+}
+
+static int setup_completion(struct bench_ctx *ctx, int arg)
+{
+	if (alloc_ctx_ccli(ctx) < 0)
+		return -1;
+
+	ctx->nr_words = arg;
+	/* The completion is passed the data of the command */
+	ccli_register_command(ctx->ccli, "complete", dummy_command, ctx);
+	return ccli_register_completion(ctx->ccli, "complete", word_completion);
+}
+
+static void run_completion(struct bench_ctx *ctx, unsigned long i)
+{
+	line_replace(&ctx->line, "complete wo");
+	do_completion(ctx->ccli, &ctx->line, 0);
+}
+
+/* Hitting tab twice, which lists all the matches */
+static void run_completion_list(struct bench_ctx *ctx, unsigned long i)
+{
+	line_replace(&ctx->line, "complete wo");
+	do_completion(ctx->ccli, &ctx->line, 1);
+}
+
+/* ---- history_search() ---- */
+
+static int setup_history(struct bench_ctx *ctx, int arg)
+{
+	char buf[64];
+	int i;
+
+	if (alloc_ctx_ccli(ctx) < 0)
+		return -1;
+
+	ctx->ccli->history_max = arg;
+
+	for (i = 0; i < arg; i++) {
+		snprintf(buf, sizeof(buf), "history line number %d", i);
+		if (history_add(ctx->ccli, buf) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void queue_search_input(struct bench_ctx *ctx)
+{
+	static const char input[] = SEARCH_INPUT;
+	char buf[(sizeof(input) - 1) * SEARCH_BATCH];
+	int i;
+
+	for (i = 0; i < SEARCH_BATCH; i++)
+		memcpy(buf + i * (sizeof(input) - 1), input, sizeof(input) - 1);
+
+	if (write(ctx->in[1], buf, sizeof(buf)) != sizeof(buf))
+		abort();
+
+	ctx->queued = SEARCH_BATCH;
+}
+
+/* Search for what is not there, which goes through the whole history */
+static void run_history_search(struct bench_ctx *ctx, unsigned long i)
+{
+	int pad;
+
+	if (!ctx->queued)
+		uncounted(queue_search_input(ctx));
+	ctx->queued--;
+
+	line_reset(&ctx->line);
+	history_search(ctx->ccli, &ctx->line, &pad);
+}
+
+/* ---- ccli_history_save_fd() and ccli_history_load_fd() ---- */
+
+static int setup_history_file(struct bench_ctx *ctx, int arg)
+{
+	char file[] = "/tmp/ccli-bench.XXXXXX";
+
+	if (setup_history(ctx, arg) < 0)
+		return -1;
+
+	ctx->fd = mkstemp(file);
+	if (ctx->fd < 0)
+		return -1;
+	unlink(file);
+
+	return ccli_history_save_fd(ctx->ccli, "bench", ctx->fd) < 0 ? -1 : 0;
+}
+
+static void run_history_save(struct bench_ctx *ctx, unsigned long i)
+{
+	uncounted(ftruncate(ctx->fd, 0); lseek(ctx->fd, 0, SEEK_SET));
+	ccli_history_save_fd(ctx->ccli, "bench", ctx->fd);
+}
+
+static void run_history_load(struct bench_ctx *ctx, unsigned long i)
+{
+	uncounted(lseek(ctx->fd, 0, SEEK_SET));
+	ccli_history_load_fd(ctx->ccli, "bench", ctx->fd);
+}
+
+/* ---- ccli_printf() ---- */
+
+static int setup_printf(struct bench_ctx *ctx, int arg)
+{
+	return alloc_ctx_ccli(ctx);
+}
+
+static void run_printf(struct bench_ctx *ctx, unsigned long i)
+{
+	ccli_printf(ctx->ccli, "%-16s %8lu %s\n", "counter", i, "some status text");
+}
+
+static const struct bench benchmarks[] = {
+	{ "line_parse",		0,	setup_line_parse,	run_line_parse },
+	{ "find_command",	10,	setup_commands,		run_find_command },
+	{ "find_command",	1000,	setup_commands,		run_find_command },
+	{ "find_command",	10000,	setup_commands,		run_find_command },
+	{ "completion",		100,	setup_completion,	run_completion },
+	{ "completion",		10000,	setup_completion,	run_completion },
+	{ "completion_list",	10000,	setup_completion,	run_completion_list },
+	{ "history_search",	256,	setup_history,		run_history_search },
+	{ "history_search",	10000,	setup_history,		run_history_search },
+	{ "history_save",	256,	setup_history_file,	run_history_save },
+	{ "history_load",	256,	setup_history_file,	run_history_load },
+	{ "printf",		0,	setup_printf,		run_printf },
+	{ }
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long run_batch(const struct bench *b, struct bench_ctx *ctx,
+				    unsigned long iters)
+{
+	unsigned long long start;
+	unsigned long i;
+
+	nr_allocs = 0;
+	nr_syscalls = 0;
+
+	start = now_ns();
+	counting = true;
+	for (i = 0; i < iters; i++)
+		b->run(ctx, i);
+	counting = false;
+
+	return now_ns() - start;
+}
+
+static int run_bench(const struct bench *b, const char *name, int ms)
+{
+	struct bench_ctx ctx;
+	unsigned long long target = ms * 1000000ULL;
+	unsigned long long ns;
+	unsigned long iters = 1;
+	int ret;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.in[0] = ctx.in[1] = ctx.null = -1;
+
+	ret = b->setup(&ctx, b->arg);
+	if (ret < 0) {
+		fprintf(stderr, "%s: setup failed: %s\n", name, strerror(errno));
+		free_ctx(&ctx);
+		return -1;
+	}
+
+	/* Warm up the pools and caches */
+	run_batch(b, &ctx, 1);
+
+	/* Double the iterations until a batch takes long enough */
+	while ((ns = run_batch(b, &ctx, iters)) < target / 2)
+		iters *= 2;
+
+	printf("{\"bench\":\"%s\",\"iterations\":%lu,\"ns_per_op\":%.1f,"
+	       "\"allocs_per_op\":%.2f,\"syscalls_per_op\":%.2f}\n",
+	       name, iters, (double)ns / iters,
+	       (double)nr_allocs / iters, (double)nr_syscalls / iters);
+	fflush(stdout);
+
+	free_ctx(&ctx);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t ms] [-l] [filter...]\n"
+		"  -t ms   time to run each benchmark for (default %d)\n"
+		"  -l      list the benchmarks\n"
+		"  filter  only run the benchmarks with names that contain it\n",
+		prog, DEFAULT_MS);
+	exit(-1);
+}
+
+static bool match(const char *name, int argc, char **argv)
+{
+	int i;
+
+	if (!argc)
+		return true;
+
+	for (i = 0; i < argc; i++) {
+		if (strstr(name, argv[i]))
+			return true;
+	}
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	const struct bench *b;
+	bool list = false;
+	char name[64];
+	int ms = DEFAULT_MS;
+	int ret = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:lh")) >= 0) {
+		switch (c) {
+		case 't':
+			ms = atoi(optarg);
+			if (ms <= 0)
+				usage(argv[0]);
+			break;
+		case 'l':
+			list = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	ccli_set_allocator(NULL, &count_allocator);
+
+	for (b = benchmarks; b->name; b++) {
+		if (b->arg)
+			snprintf(name, sizeof(name), "%s/%d", b->name, b->arg);
+		else
+			snprintf(name, sizeof(name), "%s", b->name);
+
+		if (!match(name, argc - optind, argv + optind))
+			continue;
+
+		if (list) {
+			printf("%s\n", name);
+			continue;
+		}
+
+		if (run_bench(b, name, ms) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
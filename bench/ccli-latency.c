@@ -0,0 +1,556 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Copyright (C) 2022, Steven Rostedt <rostedt@goodmis.org>
+ *
+ * Measure how long it takes from a key being written to the terminal
+ * to the line being updated on it.
+ *
+ * ccli_loop() runs in a thread on the slave side of a pseudo-terminal,
+ * and scripted typing sessions are written to the master side one key
+ * at a time. After each key, the output is read until the terminal has
+ * been quiet for a while. The latency of the key is the time from the
+ * write of the key to the last byte of output that it caused.
+ *
+ * For each session, and for all of them together, one line of JSON is
+ * printed with the latency percentiles in microseconds, and the number
+ * of bytes and write() calls (from ccli_stats()) per key. The output is
+ * also drawn on the screen model of the unit tests, to count the control
+ * characters and escape sequences per key:
+ *
+ *  {"session":"typing","keys":2000,"p50_us":21.3,"p99_us":48.0,
+ *   "p999_us":95.2,"max_us":130.9,"bytes_per_key":14.62,
+ *   "writes_per_key":3.10,"controls_per_key":2.04,
+ *   "escapes_per_key":0.00,"silent_keys":0}
+ *
+ * Keys that cause no output at all are counted as silent and are not
+ * part of the percentiles.
+ *
+ * With -r, the input of a recording made with ccli_record_start() is
+ * typed as the "replay" session, one recorded read per key.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#include "ccli.h"
+#include "vt.h"
+#include "recording.h"
+
+#define PROMPT			"lat> "
+
+#define DEFAULT_REPEAT		20
+#define DEFAULT_QUIET_US	2000
+
+#define HISTORY_LINES		100
+
+#define KEY_UP			"\033[A"
+#define KEY_DOWN		"\033[B"
+#define KEY_LEFT		"\033[D"
+#define KEY_HOME		"\033[H"
+#define KEY_END			"\033[F"
+#define KEY_DEL_WORD		"\033\177"
+#define KEY_CLEAR		"\025"		/* Ctrl^u */
+
+struct keys {
+	char			**keys;
+	int			nr;
+};
+
+struct stats {
+	unsigned long long	*lat;		/* In nanoseconds */
+	int			nr;
+	int			size;
+	int			keys;
+	int			silent;
+	unsigned long		bytes;
+	unsigned long		writes;
+	unsigned long		controls;
+	unsigned long		escapes;
+};
+
+struct session {
+	const char		*name;
+	void			(*script)(struct keys *keys);
+};
+
+static int master;
+static struct recording recording;
+static struct vt *vt;
+static int quiet_us = DEFAULT_QUIET_US;
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(-1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void add_key(struct keys *keys, const char *key)
+{
+	keys->keys = realloc(keys->keys, sizeof(*keys->keys) * (keys->nr + 1));
+	if (!keys->keys)
+		die("realloc");
+	keys->keys[keys->nr] = strdup(key);
+	if (!keys->keys[keys->nr])
+		die("strdup");
+	keys->nr++;
+}
+
+/* Type @str one character at a time */
+static void add_typed(struct keys *keys, const char *str)
+{
+	char key[2] = { };
+
+	for (; *str; str++) {
+		key[0] = *str;
+		add_key(keys, key);
+	}
+}
+
+static void add_repeat(struct keys *keys, const char *key, int cnt)
+{
+	while (cnt--)
+		add_key(keys, key);
+}
+
+static void free_keys(struct keys *keys)
+{
+	int i;
+
+	for (i = 0; i < keys->nr; i++)
+		free(keys->keys[i]);
+	free(keys->keys);
+	keys->keys = NULL;
+	keys->nr = 0;
+}
+
+static void script_typing(struct keys *keys)
+{
+	add_typed(keys, "echo the quick brown fox jumps over the lazy dog");
+	add_key(keys, "\r");
+}
+
+/* A line that wraps past the width of the terminal several times */
+static void script_long_line(struct keys *keys)
+{
+	int i;
+
+	add_typed(keys, "echo ");
+	for (i = 0; i < 300; i++) {
+		char key[2] = { 'a' + i % 26 };
+
+		add_key(keys, key);
+	}
+	add_key(keys, "\r");
+}
+
+static void script_editing(struct keys *keys)
+{
+	add_typed(keys, "echo a line that is going to be edited in the middle");
+	add_repeat(keys, KEY_LEFT, 20);
+	add_typed(keys, "right ");
+	add_key(keys, KEY_DEL_WORD);
+	add_key(keys, KEY_HOME);
+	add_key(keys, KEY_END);
+	add_repeat(keys, "\177", 10);
+	add_key(keys, "\r");
+}
+
+static void script_history(struct keys *keys)
+{
+	add_repeat(keys, KEY_UP, 40);
+	add_repeat(keys, KEY_DOWN, 40);
+	add_key(keys, KEY_CLEAR);
+}
+
+static void script_completion(struct keys *keys)
+{
+	add_typed(keys, "se");
+	add_key(keys, "\t");
+	add_key(keys, "\t");
+	add_key(keys, "\t");
+	add_typed(keys, "v");
+	add_key(keys, "\t");
+	add_key(keys, "\r");
+}
+
+/* A whole line arriving in a single write */
+static void script_paste(struct keys *keys)
+{
+	char line[256];
+	int i;
+
+	strcpy(line, "echo ");
+	for (i = strlen(line); i < sizeof(line) - 1; i++)
+		line[i] = 'A' + i % 26;
+	line[i] = '\0';
+
+	add_key(keys, line);
+	add_key(keys, KEY_CLEAR);
+}
+
+static void script_replay(struct keys *keys)
+{
+	struct record *r;
+	char *key;
+	int i;
+
+	for (i = 0; i < recording.nr; i++) {
+		r = &recording.records[i];
+		if (r->type != 'I')
+			continue;
+
+		key = strndup((char *)r->data, r->len);
+		if (!key)
+			die("strndup");
+		/* Keys are strings, and a NUL would end it early */
+		if (*key)
+			add_key(keys, key);
+		free(key);
+	}
+}
+
+static const struct session sessions[] = {
+	{ "typing",	script_typing },
+	{ "long_line",	script_long_line },
+	{ "editing",	script_editing },
+	{ "history",	script_history },
+	{ "completion",	script_completion },
+	{ "paste",	script_paste },
+	{ "replay",	script_replay },
+	{ }
+};
+
+static int do_echo(struct ccli *ccli, const char *command,
+		   const char *line, void *data,
+		   int argc, char **argv)
+{
+	int i;
+
+	for (i = 1; i < argc; i++)
+		ccli_printf(ccli, "%s%s", argv[i], i < argc - 1 ? " " : "\n");
+	return 0;
+}
+
+static int do_set(struct ccli *ccli, const char *command,
+		  const char *line, void *data,
+		  int argc, char **argv)
+{
+	return 0;
+}
+
+static int do_quit(struct ccli *ccli, const char *command,
+		   const char *line, void *data,
+		   int argc, char **argv)
+{
+	return 1;
+}
+
+static int set_completion(struct ccli *ccli, const char *command,
+			  const char *line, int word, char *match,
+			  char ***list, void *data)
+{
+	static const char *options[] = {
+		"verbose", "quiet", "prompt", "history", "color", "width",
+	};
+	int cnt = 0;
+	int i;
+
+	if (word != 1)
+		return 0;
+
+	for (i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+		ccli_list_add(ccli, list, &cnt, options[i]);
+	return cnt;
+}
+
+static void *loop_thread(void *arg)
+{
+	ccli_loop(arg);
+	return NULL;
+}
+
+/*
+ * Read what the terminal writes until it is quiet for quiet_us.
+ * Returns the number of bytes read, and sets @last to when the
+ * last of them came in.
+ */
+static int drain(unsigned long long *last)
+{
+	struct pollfd pfd = { .fd = master, .events = POLLIN };
+	char buf[BUFSIZ];
+	int total = 0;
+	int r;
+
+	while (poll(&pfd, 1, quiet_us / 1000 ? quiet_us / 1000 : 1) > 0) {
+		r = read(master, buf, sizeof(buf));
+		if (r <= 0)
+			break;
+		*last = now_ns();
+		vt_write(vt, buf, r);
+		total += r;
+	}
+
+	return total;
+}
+
+static void add_sample(struct stats *stats, unsigned long long lat)
+{
+	if (stats->nr == stats->size) {
+		stats->size = stats->size ? stats->size * 2 : 1024;
+		stats->lat = realloc(stats->lat, sizeof(*stats->lat) * stats->size);
+		if (!stats->lat)
+			die("realloc");
+	}
+	stats->lat[stats->nr++] = lat;
+}
+
+static void press(struct stats *stats, struct stats *all, const char *key)
+{
+	unsigned long long start;
+	unsigned long long last;
+	int len = strlen(key);
+	int bytes;
+
+	vt_reset_counts(vt);
+
+	start = now_ns();
+	if (write(master, key, len) != len)
+		die("write");
+
+	bytes = drain(&last);
+
+	stats->controls += vt->controls;
+	all->controls += vt->controls;
+	stats->escapes += vt->escapes;
+	all->escapes += vt->escapes;
+
+	stats->keys++;
+	all->keys++;
+	stats->bytes += bytes;
+	all->bytes += bytes;
+
+	if (!bytes) {
+		stats->silent++;
+		all->silent++;
+		return;
+	}
+
+	add_sample(stats, last - start);
+	add_sample(all, last - start);
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+	const unsigned long long *x = a;
+	const unsigned long long *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+static double percentile(struct stats *stats, double p)
+{
+	int i;
+
+	if (!stats->nr)
+		return 0;
+
+	i = p * stats->nr;
+	if (i >= stats->nr)
+		i = stats->nr - 1;
+
+	return stats->lat[i] / 1000.0;
+}
+
+static void report(const char *name, struct stats *stats)
+{
+	qsort(stats->lat, stats->nr, sizeof(*stats->lat), cmp_lat);
+
+	printf("{\"session\":\"%s\",\"keys\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+	       "\"p999_us\":%.1f,\"max_us\":%.1f,\"bytes_per_key\":%.2f,"
+	       "\"writes_per_key\":%.2f,\"controls_per_key\":%.2f,"
+	       "\"escapes_per_key\":%.2f,\"silent_keys\":%d}\n",
+	       name, stats->keys, percentile(stats, 0.5),
+	       percentile(stats, 0.99), percentile(stats, 0.999),
+	       percentile(stats, 1.0),
+	       stats->keys ? (double)stats->bytes / stats->keys : 0.0,
+	       stats->keys ? (double)stats->writes / stats->keys : 0.0,
+	       stats->keys ? (double)stats->controls / stats->keys : 0.0,
+	       stats->keys ? (double)stats->escapes / stats->keys : 0.0,
+	       stats->silent);
+	fflush(stdout);
+}
+
+static int open_pty(int *slave)
+{
+	struct winsize w = { .ws_row = 24, .ws_col = 80 };
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0)
+		return -1;
+
+	if (grantpt(fd) < 0 || unlockpt(fd) < 0)
+		goto fail;
+
+	*slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+	if (*slave < 0)
+		goto fail;
+
+	ioctl(fd, TIOCSWINSZ, &w);
+	return fd;
+ fail:
+	close(fd);
+	return -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n repeat] [-q quiet_us] [-r recording] [session...]\n"
+		"  -n repeat    times to run each session (default %d)\n"
+		"  -q quiet_us  how long the terminal must be quiet for a key to be done (default %d)\n"
+		"  -r recording type the input of @recording as the \"replay\" session\n"
+		"  session      only run the given sessions\n",
+		prog, DEFAULT_REPEAT, DEFAULT_QUIET_US);
+	exit(-1);
+}
+
+static bool match(const char *name, int argc, char **argv)
+{
+	int i;
+
+	if (!argc)
+		return true;
+
+	for (i = 0; i < argc; i++) {
+		if (strcmp(name, argv[i]) == 0)
+			return true;
+	}
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	const struct session *s;
+	struct ccli_stats cstats;
+	struct stats all = { };
+	struct stats stats;
+	struct keys keys = { };
+	struct ccli *ccli;
+	unsigned long long last;
+	pthread_t thread;
+	char line[64];
+	int repeat = DEFAULT_REPEAT;
+	int slave;
+	int c;
+	int i, k;
+
+	while ((c = getopt(argc, argv, "n:q:r:h")) >= 0) {
+		switch (c) {
+		case 'n':
+			repeat = atoi(optarg);
+			if (repeat <= 0)
+				usage(argv[0]);
+			break;
+		case 'q':
+			quiet_us = atoi(optarg);
+			if (quiet_us <= 0)
+				usage(argv[0]);
+			break;
+		case 'r':
+			if (recording_load(&recording, optarg) < 0)
+				exit(-1);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	master = open_pty(&slave);
+	if (master < 0)
+		die("pty");
+
+	vt = vt_alloc(24, 80);
+	if (!vt)
+		die("vt_alloc");
+
+	ccli = ccli_alloc(PROMPT, slave, slave);
+	if (!ccli)
+		die("ccli_alloc");
+
+	ccli_register_command(ccli, "echo", do_echo, NULL);
+	ccli_register_command(ccli, "set", do_set, NULL);
+
+	/* A recorded session likely ends with "exit", which must not end this */
+	ccli_register_command(ccli, "exit", do_set, NULL);
+	ccli_register_command(ccli, "quit", do_quit, NULL);
+	ccli_register_completion(ccli, "set", set_completion);
+
+	for (i = 0; i < HISTORY_LINES; i++) {
+		snprintf(line, sizeof(line), "echo history line %d", i);
+		ccli_execute(ccli, line, true);
+	}
+	/* Nothing on the terminal is from the sessions yet */
+	drain(&last);
+
+	if (pthread_create(&thread, NULL, loop_thread, ccli))
+		die("pthread_create");
+
+	/* Wait for the prompt */
+	drain(&last);
+
+	for (s = sessions; s->name; s++) {
+		if (!match(s->name, argc - optind, argv + optind))
+			continue;
+
+		/* There is nothing to replay without a recording */
+		if (s->script == script_replay && !recording.nr)
+			continue;
+
+		memset(&stats, 0, sizeof(stats));
+		s->script(&keys);
+
+		ccli_stats_reset(ccli);
+		for (i = 0; i < repeat; i++) {
+			for (k = 0; k < keys.nr; k++)
+				press(&stats, &all, keys.keys[k]);
+		}
+		ccli_stats(ccli, &cstats);
+		stats.writes = cstats.writes;
+		all.writes += cstats.writes;
+
+		report(s->name, &stats);
+		free(stats.lat);
+		free_keys(&keys);
+	}
+
+	report("all", &all);
+	free(all.lat);
+
+	if (write(master, "quit\r", 5) != 5)
+		die("write");
+	pthread_join(thread, NULL);
+
+	ccli_free(ccli);
+	close(slave);
+	close(master);
+	vt_free(vt);
+	recording_free(&recording);
+
+	return 0;
+}
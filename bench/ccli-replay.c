@@ -0,0 +1,375 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Copyright (C) 2022, Steven Rostedt <rostedt@goodmis.org>
+ *
+ * Play back a session that was recorded with ccli_record_start() (or by
+ * running an application that called ccli_record_env() with
+ * CCLI_RECORD=file in the environment).
+ *
+ * The application is started on the slave side of a pseudo-terminal,
+ * and the recorded input is written to the master side, either with
+ * the timing it was recorded with, or as fast as the application keeps
+ * up with it (-f), where each input is written once the output of the
+ * last one has been quiet for a while. Changes of the terminal size are
+ * played back by resizing the pseudo-terminal.
+ *
+ * With -o, everything that was written and read back is saved to a
+ * trace in the same format as the recording, with 'O' records for the
+ * output. Two traces of the same recording can be compared to find
+ * regressions in what is drawn.
+ *
+ * When done, one line of JSON is printed with the latency of the input
+ * (from the write of an input to the last output before the next one)
+ * in microseconds, and the amount of output:
+ *
+ *  {"records":120,"inputs":112,"input_bytes":131,"output_bytes":2741,
+ *   "elapsed_us":5180.2,"p50_us":21.3,"p99_us":48.0,"max_us":61.9,
+ *   "silent_inputs":0}
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "recording.h"
+
+#define DEFAULT_QUIET_US	2000
+
+struct stats {
+	unsigned long long	*lat;		/* In nanoseconds */
+	int			nr;
+	int			size;
+	int			inputs;
+	int			silent;
+	unsigned long		input_bytes;
+	unsigned long		output_bytes;
+};
+
+static int master;
+static int trace_fd = -1;
+static unsigned long long trace_last;
+static int quiet_us = DEFAULT_QUIET_US;
+
+/* The output that came in since the last input was written */
+static unsigned long long input_time;
+static unsigned long long output_time;
+static int output_bytes;
+static bool hung_up;
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(-1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void trace(char type, const void *data, int len, int rows, int cols)
+{
+	unsigned char buf[32];
+	unsigned long long now;
+	int hlen;
+
+	if (trace_fd < 0)
+		return;
+
+	now = now_ns() / 1000;
+	buf[0] = type;
+	hlen = 1 + recording_put_num(buf + 1, now - trace_last);
+	trace_last = now;
+
+	if (type == 'W') {
+		hlen += recording_put_num(buf + hlen, rows);
+		hlen += recording_put_num(buf + hlen, cols);
+	} else {
+		hlen += recording_put_num(buf + hlen, len);
+	}
+
+	if (write(trace_fd, buf, hlen) != hlen ||
+	    (len && write(trace_fd, data, len) != len))
+		die("trace");
+}
+
+static void add_sample(struct stats *stats, unsigned long long lat)
+{
+	if (stats->nr == stats->size) {
+		stats->size = stats->size ? stats->size * 2 : 1024;
+		stats->lat = realloc(stats->lat, sizeof(*stats->lat) * stats->size);
+		if (!stats->lat)
+			die("realloc");
+	}
+	stats->lat[stats->nr++] = lat;
+}
+
+/* Account the output that the last input caused */
+static void input_done(struct stats *stats)
+{
+	if (!input_time)
+		return;
+
+	if (output_bytes)
+		add_sample(stats, output_time - input_time);
+	else
+		stats->silent++;
+
+	input_time = 0;
+}
+
+/*
+ * Read the output of the application until @deadline (in nanoseconds),
+ * or if @deadline is zero, until it has been quiet for quiet_us.
+ */
+static void pump(struct stats *stats, unsigned long long deadline)
+{
+	struct pollfd pfd = { .fd = master, .events = POLLIN };
+	unsigned long long now;
+	char buf[BUFSIZ];
+	int timeout;
+	int r;
+
+	while (!hung_up) {
+		if (deadline) {
+			now = now_ns();
+			if (now >= deadline)
+				break;
+			timeout = (deadline - now + 999999) / 1000000;
+		} else {
+			timeout = quiet_us / 1000 ? quiet_us / 1000 : 1;
+		}
+
+		r = poll(&pfd, 1, timeout);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			die("poll");
+		if (!r) {
+			if (!deadline)
+				break;
+			continue;
+		}
+
+		r = read(master, buf, sizeof(buf));
+		if (r <= 0) {
+			/* The application exited */
+			hung_up = true;
+			break;
+		}
+
+		output_time = now_ns();
+		output_bytes += r;
+		stats->output_bytes += r;
+		trace('O', buf, r, 0, 0);
+	}
+}
+
+static void play(struct stats *stats, struct record *r)
+{
+	struct winsize w;
+
+	switch (r->type) {
+	case 'I':
+		input_done(stats);
+		if (write(master, r->data, r->len) != r->len)
+			die("write");
+		trace('I', r->data, r->len, 0, 0);
+		input_time = now_ns();
+		output_bytes = 0;
+		stats->inputs++;
+		stats->input_bytes += r->len;
+		break;
+	case 'W':
+		/* Resizing the master sends SIGWINCH to the application */
+		memset(&w, 0, sizeof(w));
+		w.ws_row = r->rows;
+		w.ws_col = r->cols;
+		ioctl(master, TIOCSWINSZ, &w);
+		trace('W', NULL, 0, r->rows, r->cols);
+		break;
+	}
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+	const unsigned long long *x = a;
+	const unsigned long long *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+static double percentile(struct stats *stats, double p)
+{
+	int i;
+
+	if (!stats->nr)
+		return 0;
+
+	i = p * stats->nr;
+	if (i >= stats->nr)
+		i = stats->nr - 1;
+
+	return stats->lat[i] / 1000.0;
+}
+
+static pid_t spawn(char **argv, struct record *first)
+{
+	struct winsize w = { .ws_row = 24, .ws_col = 80 };
+	pid_t pid;
+	int slave;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+		die("pty");
+
+	/* Start with the size that the recording started with */
+	if (first && first->type == 'W') {
+		w.ws_row = first->rows;
+		w.ws_col = first->cols;
+	}
+	ioctl(master, TIOCSWINSZ, &w);
+
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid)
+		return pid;
+
+	setsid();
+	slave = open(ptsname(master), O_RDWR);
+	if (slave < 0)
+		die("open pty");
+	ioctl(slave, TIOCSCTTY, 0);
+	dup2(slave, 0);
+	dup2(slave, 1);
+	dup2(slave, 2);
+	if (slave > 2)
+		close(slave);
+	close(master);
+
+	/* Do not record over what is being played back */
+	unsetenv("CCLI_RECORD");
+
+	execvp(argv[0], argv);
+	perror(argv[0]);
+	_exit(127);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-f] [-s speed] [-q quiet_us] [-o trace] recording command [args...]\n"
+		"  -f           play as fast as the command keeps up\n"
+		"  -s speed     play at @speed times the recorded speed (default 1)\n"
+		"  -q quiet_us  how long the output must be quiet for an input to be done (default %d)\n"
+		"  -o trace     save the input and output to @trace\n",
+		prog, DEFAULT_QUIET_US);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	static const char magic[RECORDING_MAGIC_LEN] = RECORDING_MAGIC;
+	struct recording rec = { };
+	struct stats stats = { };
+	unsigned long long start;
+	unsigned long long elapsed;
+	const char *out = NULL;
+	double speed = 1;
+	bool fast = false;
+	int status;
+	pid_t pid;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "+fs:q:o:h")) >= 0) {
+		switch (c) {
+		case 'f':
+			fast = true;
+			break;
+		case 's':
+			speed = atof(optarg);
+			if (speed <= 0)
+				usage(argv[0]);
+			break;
+		case 'q':
+			quiet_us = atoi(optarg);
+			if (quiet_us <= 0)
+				usage(argv[0]);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind < 2)
+		usage(argv[0]);
+
+	if (recording_load(&rec, argv[optind]) < 0)
+		exit(-1);
+
+	if (out) {
+		trace_fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (trace_fd < 0 || write(trace_fd, magic, RECORDING_MAGIC_LEN) != RECORDING_MAGIC_LEN)
+			die(out);
+	}
+
+	pid = spawn(argv + optind + 1, rec.nr ? &rec.records[0] : NULL);
+
+	start = now_ns();
+	trace_last = start / 1000;
+
+	/* Wait for the prompt */
+	pump(&stats, 0);
+
+	for (i = 0; i < rec.nr && !hung_up; i++) {
+		if (rec.records[i].type == 'O')
+			continue;
+		if (fast)
+			pump(&stats, 0);
+		else
+			pump(&stats, start + rec.records[i].us * 1000 / speed);
+		play(&stats, &rec.records[i]);
+	}
+	pump(&stats, 0);
+	input_done(&stats);
+
+	elapsed = now_ns() - start;
+
+	/* Hanging up the terminal ends the application */
+	close(master);
+	if (!hung_up)
+		kill(pid, SIGHUP);
+	waitpid(pid, &status, 0);
+
+	qsort(stats.lat, stats.nr, sizeof(*stats.lat), cmp_lat);
+
+	printf("{\"records\":%d,\"inputs\":%d,\"input_bytes\":%lu,"
+	       "\"output_bytes\":%lu,\"elapsed_us\":%.1f,\"p50_us\":%.1f,"
+	       "\"p99_us\":%.1f,\"max_us\":%.1f,\"silent_inputs\":%d}\n",
+	       rec.nr, stats.inputs, stats.input_bytes, stats.output_bytes,
+	       elapsed / 1000.0, percentile(&stats, 0.5),
+	       percentile(&stats, 0.99), percentile(&stats, 1.0),
+	       stats.silent);
+
+	if (trace_fd >= 0)
+		close(trace_fd);
+	free(stats.lat);
+	recording_free(&rec);
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Copyright (C) 2022, Steven Rostedt <rostedt@goodmis.org>
+ *
+ * Reading and writing the recordings of ccli_record_start().
+ * See src/record.c for the format.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "recording.h"
+
+static int get_num(struct recording *rec, int size, int *pos,
+		   unsigned long long *val)
+{
+	int shift = 0;
+	int ch;
+
+	*val = 0;
+	do {
+		if (*pos >= size || shift > 63)
+			return -1;
+		ch = rec->buf[(*pos)++];
+		*val |= (unsigned long long)(ch & 0x7f) << shift;
+		shift += 7;
+	} while (ch & 0x80);
+
+	return 0;
+}
+
+int recording_put_num(unsigned char *buf, unsigned long long val)
+{
+	int len = 0;
+
+	do {
+		buf[len] = val & 0x7f;
+		val >>= 7;
+		if (val)
+			buf[len] |= 0x80;
+		len++;
+	} while (val);
+
+	return len;
+}
+
+static int read_file(struct recording *rec, const char *file)
+{
+	struct stat st;
+	int size;
+	int pos;
+	int fd;
+	int r;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		goto fail;
+
+	size = st.st_size;
+	rec->buf = malloc(size ? size : 1);
+	if (!rec->buf)
+		goto fail;
+
+	for (pos = 0; pos < size; pos += r) {
+		r = read(fd, rec->buf + pos, size - pos);
+		if (r <= 0)
+			goto fail;
+	}
+	close(fd);
+
+	return size;
+ fail:
+	perror(file);
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+/**
+ * recording_load - Read a recording into memory
+ * @rec: Where to load the recording (must be zeroed)
+ * @file: The file to read
+ *
+ * A recording that was cut short (like by the application crashing)
+ * is loaded up to where it was cut, with a warning.
+ *
+ * Returns 0 on success, and -1 with a message printed on error.
+ */
+int recording_load(struct recording *rec, const char *file)
+{
+	unsigned long long us = 0;
+	unsigned long long val;
+	struct record *r;
+	int size;
+	int pos;
+
+	size = read_file(rec, file);
+	if (size < 0)
+		return -1;
+
+	if (size < RECORDING_MAGIC_LEN ||
+	    memcmp(rec->buf, RECORDING_MAGIC, RECORDING_MAGIC_LEN)) {
+		fprintf(stderr, "%s: not a ccli recording\n", file);
+		return -1;
+	}
+
+	for (pos = RECORDING_MAGIC_LEN; pos < size; ) {
+		r = realloc(rec->records, sizeof(*rec->records) * (rec->nr + 1));
+		if (!r) {
+			perror("realloc");
+			return -1;
+		}
+		rec->records = r;
+		r = &rec->records[rec->nr];
+		memset(r, 0, sizeof(*r));
+
+		r->type = rec->buf[pos++];
+		if (get_num(rec, size, &pos, &val) < 0)
+			goto truncated;
+		us += val;
+		r->us = us;
+
+		switch (r->type) {
+		case 'I':
+		case 'O':
+			if (get_num(rec, size, &pos, &val) < 0 ||
+			    val > size - pos)
+				goto truncated;
+			r->data = rec->buf + pos;
+			r->len = val;
+			pos += val;
+			break;
+		case 'W':
+			if (get_num(rec, size, &pos, &val) < 0)
+				goto truncated;
+			r->rows = val;
+			if (get_num(rec, size, &pos, &val) < 0)
+				goto truncated;
+			r->cols = val;
+			break;
+		default:
+			fprintf(stderr, "%s: unknown record '%c' at offset %d\n",
+				file, r->type, pos - 1);
+			return -1;
+		}
+		rec->nr++;
+	}
+	return 0;
+
+ truncated:
+	fprintf(stderr, "%s: truncated after %d records\n", file, rec->nr);
+	return 0;
+}
+
+void recording_free(struct recording *rec)
+{
+	free(rec->records);
+	free(rec->buf);
+	rec->records = NULL;
+	rec->buf = NULL;
+	rec->nr = 0;
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+#ifndef __CCLI_RECORDING_H
+#define __CCLI_RECORDING_H
+
+/* Reading and writing the recordings of ccli_record_start() */
+
+#define RECORDING_MAGIC		"CCLIREC\1"
+#define RECORDING_MAGIC_LEN	8
+
+struct record {
+	char			type;		/* 'I', 'W' or 'O' */
+	unsigned long long	us;		/* Since the start of the recording */
+	unsigned char		*data;
+	int			len;
+	int			rows;
+	int			cols;
+};
+
+struct recording {
+	unsigned char		*buf;
+	struct record		*records;
+	int			nr;
+};
+
+int recording_load(struct recording *rec, const char *file);
+void recording_free(struct recording *rec);
+int recording_put_num(unsigned char *buf, unsigned long long val);
+
+#endif
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Copyright (C) 2022, Steven Rostedt <rostedt@goodmis.org>
+ *
+ * Fuzz ccli_history_load_fd(), which reads a history file that any
+ * session may have written. The first byte of the input picks if it
+ * is read from a file, or from a pipe that can not seek, as the two are
+ * read differently.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <stdarg.h>
+#include <ccli.h>
+
+#include "fuzz.h"
+
+#define FUZZ_TAG	"fuzz"
+
+static int input_fd(const uint8_t *data, size_t size, bool seek)
+{
+	int fds[2];
+	int fd;
+
+	if (seek) {
+		fd = memfd_create("fuzz-history", 0);
+		if (fd < 0)
+			return -1;
+		if (write(fd, data, size) != size)
+			abort();
+		lseek(fd, 0, SEEK_SET);
+		return fd;
+	}
+
+	if (pipe(fds) < 0)
+		return -1;
+	/* FUZZ_MAX_INPUT fits in the pipe, so this does not block */
+	if (write(fds[1], data, size) != size)
+		abort();
+	close(fds[1]);
+	return fds[0];
+}
+
+static void fuzz_history(const uint8_t *data, size_t size)
+{
+	struct ccli *ccli;
+	char buf[64];
+	int null;
+	int fd;
+	int i;
+
+	if (!size)
+		return;
+
+	fd = input_fd(data + 1, size - 1, data[0] & 1);
+	if (fd < 0)
+		return;
+
+	null = open("/dev/null", O_RDWR);
+	ccli = ccli_alloc("fuzz> ", null, null);
+	if (!ccli)
+		goto out;
+
+	ccli_history_load_fd(ccli, FUZZ_TAG, fd);
+
+	/* Whatever was loaded must be there to read back */
+	for (i = 1; ccli_history_copy(ccli, i, buf, sizeof(buf)) >= 0; i++)
+		;
+
+	ccli_free(ccli);
+ out:
+	close(null);
+	close(fd);
+}
+
+FUZZ_HARNESS("history", fuzz_history)
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Copyright (C) 2022, Steven Rostedt <rostedt@goodmis.org>
+ *
+ * Fuzz read_char(), which turns what the terminal sends, including its
+ * escape sequences, into keys. The input is fed to it through a pipe,
+ * as if it was typed.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ccli-local.h"
+
+#include "fuzz.h"
+
+static void fuzz_keys(const uint8_t *data, size_t size)
+{
+	struct ccli *ccli;
+	int fds[2];
+	int null;
+	int ch;
+
+	if (pipe(fds) < 0)
+		return;
+
+	null = open("/dev/null", O_WRONLY);
+
+	/* FUZZ_MAX_INPUT fits in the pipe, so this does not block */
+	if (write(fds[1], data, size) != size)
+		abort();
+	close(fds[1]);
+
+	ccli = ccli_alloc("fuzz> ", fds[0], null);
+	if (!ccli)
+		goto out;
+
+	/* It stops with CHAR_ERROR when the pipe is empty */
+	do {
+		ch = read_char(ccli);
+	} while (ch != CHAR_ERROR && ch != CHAR_EXIT);
+
+	ccli_free(ccli);
+ out:
+	close(fds[0]);
+	close(null);
+}
+
+FUZZ_HARNESS("keys", fuzz_keys)
@@ -0,0 +1,296 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Copyright (C) 2022, Steven Rostedt <rostedt@goodmis.org>
+ *
+ * The main() of the fuzz harnesses when they are not built for
+ * libFuzzer. Without arguments, it runs the one input on stdin, which
+ * is how AFL runs it. Given files or directories, it runs each file in
+ * them, which is how the corpus is replayed to check that nothing in
+ * it crashes or goes over its time budget. With -n, it also runs that
+ * many inputs made by mutating the given ones, for a quick fuzz without
+ * a fuzzer.
+ *
+ * At the end it prints one line of JSON with the throughput, and the
+ * input that used the most of its time budget (see fuzz.h):
+ *
+ *  {"fuzz":"parse","inputs":1012,"bytes":81231,"mb_per_sec":35.12,
+ *   "worst_budget_pct":1.25,"worst":"fuzz/corpus/parse/quotes"}
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fuzz.h"
+
+struct input {
+	char			*name;
+	uint8_t			*data;
+	size_t			size;
+};
+
+static struct input *inputs;
+static int nr_inputs;
+
+static unsigned long long total_ns;
+static unsigned long long total_bytes;
+static unsigned long nr_runs;
+static double worst_pct;
+static char worst[256];
+
+/* What is being run, to save when it crashes */
+static const uint8_t *cur_data;
+static size_t cur_size;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n count] [-s seed] [file|dir...]\n"
+		"  -n count  also run count mutations of the inputs\n"
+		"  -s seed   the seed of the mutations (default 1)\n"
+		"  file|dir  the inputs to run (default: one from stdin)\n"
+		"An input that crashes is saved to fuzz-%s-crash\n",
+		prog, fuzz_name);
+	exit(-1);
+}
+
+static void save_crash(int sig)
+{
+	char name[64];
+	int fd;
+
+	snprintf(name, sizeof(name), "fuzz-%s-crash", fuzz_name);
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		write(fd, cur_data, cur_size);
+		close(fd);
+	}
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static uint8_t *read_fd(int fd, size_t *psize)
+{
+	uint8_t *data = NULL;
+	size_t size = 0;
+	size_t max = 0;
+	ssize_t r;
+
+	do {
+		if (size == max) {
+			max = max ? max * 2 : 4096;
+			data = realloc(data, max);
+			if (!data)
+				return NULL;
+		}
+		r = read(fd, data + size, max - size);
+		if (r > 0)
+			size += r;
+	} while (r > 0);
+
+	*psize = size;
+	return data;
+}
+
+static void add_input(const char *name, uint8_t *data, size_t size)
+{
+	inputs = realloc(inputs, sizeof(*inputs) * (nr_inputs + 1));
+	if (!inputs) {
+		perror("realloc");
+		exit(-1);
+	}
+	inputs[nr_inputs].name = strdup(name);
+	inputs[nr_inputs].data = data;
+	inputs[nr_inputs].size = size;
+	nr_inputs++;
+}
+
+static void add_file(const char *file)
+{
+	uint8_t *data;
+	size_t size;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		perror(file);
+		exit(-1);
+	}
+	data = read_fd(fd, &size);
+	close(fd);
+	if (data)
+		add_input(file, data, size);
+}
+
+static void add_path(const char *path)
+{
+	struct dirent *dent;
+	struct stat st;
+	char *file;
+	DIR *dir;
+
+	if (stat(path, &st) < 0) {
+		perror(path);
+		exit(-1);
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		add_file(path);
+		return;
+	}
+
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	while ((dent = readdir(dir))) {
+		if (dent->d_name[0] == '.')
+			continue;
+		if (asprintf(&file, "%s/%s", path, dent->d_name) < 0)
+			break;
+		add_path(file);
+		free(file);
+	}
+	closedir(dir);
+}
+
+static void run(const char *name, const uint8_t *data, size_t size)
+{
+	unsigned long long ns;
+	double pct;
+
+	cur_data = data;
+	cur_size = size;
+
+	ns = fuzz_now();
+	LLVMFuzzerTestOneInput(data, size);
+	ns = fuzz_now() - ns;
+
+	total_ns += ns;
+	total_bytes += size;
+	nr_runs++;
+
+	pct = ns * 100.0 / fuzz_budget(size);
+	if (pct > worst_pct) {
+		worst_pct = pct;
+		snprintf(worst, sizeof(worst), "%s", name);
+	}
+}
+
+/* Flip, add, remove or repeat bytes of @data, or splice in another input */
+static size_t mutate(uint8_t *data, size_t size, size_t max, unsigned int *seed)
+{
+	struct input *other;
+	size_t pos, len;
+	int n;
+
+	for (n = 1 + rand_r(seed) % 4; n; n--) {
+		pos = size ? rand_r(seed) % size : 0;
+
+		switch (rand_r(seed) % 5) {
+		case 0:
+			if (size)
+				data[pos] ^= 1 << (rand_r(seed) % 8);
+			break;
+		case 1:
+			if (size < max) {
+				memmove(data + pos + 1, data + pos, size - pos);
+				data[pos] = rand_r(seed);
+				size++;
+			}
+			break;
+		case 2:
+			if (size) {
+				memmove(data + pos, data + pos + 1, size - pos - 1);
+				size--;
+			}
+			break;
+		case 3:
+			/* Repeat a piece many times, to find what is slow */
+			len = size - pos < 16 ? size - pos : 16;
+			while (len && size + len <= max && rand_r(seed) % 64) {
+				memmove(data + pos + len, data + pos, size - pos);
+				size += len;
+			}
+			break;
+		case 4:
+			other = &inputs[rand_r(seed) % nr_inputs];
+			len = other->size < max - pos ? other->size : max - pos;
+			memcpy(data + pos, other->data, len);
+			if (pos + len > size)
+				size = pos + len;
+			break;
+		}
+	}
+	return size;
+}
+
+int main(int argc, char **argv)
+{
+	struct input *in;
+	unsigned int seed = 1;
+	unsigned long count = 0;
+	unsigned long i;
+	uint8_t *buf;
+	size_t size;
+	char name[64];
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:h")) >= 0) {
+		switch (c) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	signal(SIGABRT, save_crash);
+	signal(SIGSEGV, save_crash);
+
+	if (optind == argc) {
+		buf = read_fd(STDIN_FILENO, &size);
+		if (buf)
+			add_input("stdin", buf, size);
+	}
+
+	for (; optind < argc; optind++)
+		add_path(argv[optind]);
+
+	if (!nr_inputs)
+		usage(argv[0]);
+
+	for (i = 0; i < nr_inputs; i++)
+		run(inputs[i].name, inputs[i].data, inputs[i].size);
+
+	buf = malloc(FUZZ_MAX_INPUT);
+	if (!buf)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		in = &inputs[rand_r(&seed) % nr_inputs];
+		size = in->size < FUZZ_MAX_INPUT ? in->size : FUZZ_MAX_INPUT;
+		memcpy(buf, in->data, size);
+		size = mutate(buf, size, FUZZ_MAX_INPUT, &seed);
+		snprintf(name, sizeof(name), "mutation %lu of %s", i,
+			 strrchr(in->name, '/') ? strrchr(in->name, '/') + 1 : in->name);
+		run(name, buf, size);
+	}
+	free(buf);
+
+	printf("{\"fuzz\":\"%s\",\"inputs\":%lu,\"bytes\":%llu,"
+	       "\"mb_per_sec\":%.2f,\"worst_budget_pct\":%.2f,\"worst\":\"%s\"}\n",
+	       fuzz_name, nr_runs, total_bytes,
+	       total_ns ? total_bytes * 1000.0 / total_ns : 0.0,
+	       worst_pct, worst);
+
+	return 0;
+}
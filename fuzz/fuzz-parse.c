@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Copyright (C) 2022, Steven Rostedt <rostedt@goodmis.org>
+ *
+ * Fuzz ccli_line_parse(), which splits every line that is entered into
+ * its words, with quotes and backslashes.
+ */
+#include <string.h>
+#include <stdarg.h>
+
+#include <ccli.h>
+
+#include "fuzz.h"
+
+static void fuzz_parse(const uint8_t *data, size_t size)
+{
+	char **argv;
+	char *line;
+	int argc;
+	int i;
+
+	/* The line is a string, and stops at the first NUL */
+	line = malloc(size + 1);
+	if (!line)
+		return;
+	memcpy(line, data, size);
+	line[size] = '\0';
+
+	argc = ccli_line_parse(line, &argv);
+
+	/* The words only get shorter than the line, and end with NULL */
+	for (i = 0; i < argc; i++) {
+		if (strlen(argv[i]) > size)
+			abort();
+	}
+	if (argc > 0 && argv[argc])
+		abort();
+
+	if (argc > 0)
+		ccli_argv_free(argv);
+	free(line);
+}
+
+FUZZ_HARNESS("parse", fuzz_parse)
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+/*
+ * Copyright (C) 2022, Steven Rostedt <rostedt@goodmis.org>
+ *
+ * What the fuzz harnesses share. Each harness has a function that takes
+ * one input, and FUZZ_HARNESS() turns it into LLVMFuzzerTestOneInput()
+ * for libFuzzer, or for fuzz-main.c to call for AFL and for replaying
+ * the corpus.
+ *
+ * An input that takes longer than its time budget aborts, so that the
+ * fuzzer saves it like a crash. The budget is FUZZ_BASE_NS plus
+ * FUZZ_NS_PER_BYTE for each byte of the input, which is far more than a
+ * parser that is linear in its input ever needs, even under ASan. Both
+ * can be changed with the CCLI_FUZZ_BASE_NS and CCLI_FUZZ_NS_PER_BYTE
+ * environment variables.
+ */
+#ifndef __CCLI_FUZZ_H
+#define __CCLI_FUZZ_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define FUZZ_BASE_NS		20000000ULL
+#define FUZZ_NS_PER_BYTE	20000ULL
+
+/* The largest input that is used, the rest is cut off */
+#define FUZZ_MAX_INPUT		(32 * 1024)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/* The name of the harness, for the messages */
+extern const char *fuzz_name;
+
+static inline unsigned long long fuzz_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned long long fuzz_env(const char *name,
+					  unsigned long long def)
+{
+	const char *val = getenv(name);
+
+	return val && *val ? strtoull(val, NULL, 0) : def;
+}
+
+static inline unsigned long long fuzz_budget(size_t size)
+{
+	static unsigned long long base, per_byte;
+
+	if (!base) {
+		base = fuzz_env("CCLI_FUZZ_BASE_NS", FUZZ_BASE_NS);
+		per_byte = fuzz_env("CCLI_FUZZ_NS_PER_BYTE", FUZZ_NS_PER_BYTE);
+	}
+	return base + per_byte * size;
+}
+
+static inline void fuzz_check(unsigned long long ns, size_t size)
+{
+	if (ns <= fuzz_budget(size))
+		return;
+
+	fprintf(stderr, "%s: %zu bytes took %llu ns (%llu ns per byte), "
+		"over the budget of %llu ns\n", fuzz_name, size, ns,
+		size ? ns / size : ns, fuzz_budget(size));
+	abort();
+}
+
+#define FUZZ_HARNESS(name, func)					\
+	const char *fuzz_name = name;					\
+	int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)	\
+	{								\
+		unsigned long long start = fuzz_now();			\
+									\
+		if (size > FUZZ_MAX_INPUT)				\
+			size = FUZZ_MAX_INPUT;				\
+		func(data, size);					\
+		fuzz_check(fuzz_now() - start, size);			\
+		return 0;						\
+	}
+
+#endif
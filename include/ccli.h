@@ -8,10 +8,65 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #define CCLI_NOSPACE	1
 
 struct ccli;
+struct ccli_shared_history;
+struct ccli_table;
+
+enum ccli_pool_type {
+	CCLI_POOL_LINE,
+	CCLI_POOL_ARGV,
+	CCLI_POOL_COMPLETION,
+	CCLI_NR_POOLS,
+};
+
+enum ccli_table_format {
+	CCLI_TABLE_TEXT,
+	CCLI_TABLE_CSV,
+	CCLI_TABLE_JSON,
+};
+
+enum ccli_output_mode {
+	CCLI_OUTPUT_TEXT,
+	CCLI_OUTPUT_JSON,
+};
+
+struct ccli_allocator {
+	void			*(*malloc)(size_t size, void *data);
+	void			*(*realloc)(void *ptr, size_t size, void *data);
+	void			(*free)(void *ptr, void *data);
+	void			*data;
+};
+
+struct ccli_pool_stats {
+	unsigned long		allocs;
+	unsigned long		hits;
+	unsigned long		misses;
+	unsigned long		releases;
+	unsigned long		cached;
+	unsigned long		cached_bytes;
+};
+
+struct ccli_stats {
+	unsigned long		writes;
+	unsigned long		bytes_written;
+	unsigned long		reads;
+	unsigned long		bytes_read;
+	unsigned long		redraws;
+	unsigned long		allocs;
+	unsigned long		completions;
+	unsigned long		history_searches;
+};
+
+struct ccli_limits {
+	int			line_max;
+	int			history_bytes;
+	int			commands_max;
+	int			completions_max;
+};
 
 typedef int (*ccli_command_callback)(struct ccli *ccli, const char *command,
 				     const char *line, void *data,
@@ -24,7 +79,12 @@ typedef int (*ccli_completion)(struct ccli *ccli, const char *command,
 typedef int (*ccli_interrupt)(struct ccli *ccli, const char *line,
 			      int pos, void *data);
 
+typedef int (*ccli_signal)(struct ccli *ccli, int sig, void *data);
+
 struct ccli *ccli_alloc(const char *prompt, int in, int out);
+struct ccli *ccli_alloc_static(const char *prompt, int in, int out,
+			       void *mem, size_t size,
+			       const struct ccli_limits *limits);
 void ccli_free(struct ccli *ccli);
 
 int ccli_in(struct ccli *ccli);
@@ -39,6 +99,19 @@ int ccli_vprintf(struct ccli *ccli, const char *fmt, va_list ap);
 __attribute__((__format__(printf, 3, 4)))
 int ccli_page(struct ccli *ccli, int line, const char *fmt, ...);
 
+struct ccli_table *ccli_table_begin(struct ccli *ccli, const char *header, ...);
+int ccli_table_row(struct ccli_table *table, const char *cell, ...);
+__attribute__((__format__(printf, 2, 3)))
+int ccli_table_cell(struct ccli_table *table, const char *fmt, ...);
+int ccli_table_end(struct ccli_table *table);
+int ccli_set_table_format(struct ccli *ccli, enum ccli_table_format format);
+
+int ccli_set_output_mode(struct ccli *ccli, enum ccli_output_mode mode);
+enum ccli_output_mode ccli_get_output_mode(struct ccli *ccli);
+__attribute__((__format__(printf, 3, 4)))
+int ccli_emit_kv(struct ccli *ccli, const char *key, const char *fmt, ...);
+int ccli_emit_record(struct ccli *ccli, const char *key, ...);
+
 int ccli_loop(struct ccli *ccli);
 int ccli_register_command(struct ccli *ccli, const char *command_name,
 			  ccli_command_callback callback, void *data);
@@ -60,6 +133,25 @@ int ccli_register_interrupt(struct ccli *ccli, ccli_interrupt callback,
 
 int ccli_unregister_command(struct ccli *ccli, const char *command);
 
+int ccli_register_watch(struct ccli *ccli);
+int ccli_register_stats(struct ccli *ccli);
+int ccli_register_pager(struct ccli *ccli);
+int ccli_register_output(struct ccli *ccli);
+
+int ccli_pager_start(struct ccli *ccli);
+int ccli_pager_stop(struct ccli *ccli);
+
+int ccli_set_timeout(struct ccli *ccli, const char *command, int ms);
+bool ccli_cancelled(struct ccli *ccli);
+
+int ccli_record_start(struct ccli *ccli, int fd);
+int ccli_record_stop(struct ccli *ccli);
+int ccli_record_env(struct ccli *ccli, bool enable);
+
+int ccli_register_signal(struct ccli *ccli, int sig, ccli_signal callback,
+			 void *data);
+int ccli_unregister_signal(struct ccli *ccli, int sig);
+
 int ccli_line_parse(const char *line, char ***argv);
 void ccli_argv_free(char **argv);
 
@@ -69,6 +161,7 @@ int ccli_line_inject(struct ccli *ccli, const char *str, int pos);
 void ccli_line_refresh(struct ccli *ccli);
 
 const char *ccli_history(struct ccli *ccli, int past);
+int ccli_history_copy(struct ccli *ccli, int past, char *buf, size_t size);
 int ccli_history_save_fd(struct ccli *ccli, const char *name, int fd);
 
 int ccli_getchar(struct ccli *ccli);
@@ -90,6 +183,19 @@ int ccli_history_save_file(struct ccli *ccli, const char *tag, const char *file)
 int ccli_history_load_fd(struct ccli *ccli, const char *tag, int fd);
 int ccli_history_save_fd(struct ccli *ccli, const char *tag, int fd);
 
+struct ccli_shared_history *ccli_shared_history_alloc(int lines, int line_max);
+void ccli_shared_history_free(struct ccli_shared_history *hist);
+int ccli_set_shared_history(struct ccli *ccli, struct ccli_shared_history *hist);
+
+int ccli_set_allocator(struct ccli *ccli, const struct ccli_allocator *allocator);
+
+int ccli_pool_stats(struct ccli *ccli, enum ccli_pool_type type,
+		    struct ccli_pool_stats *stats);
+
+int ccli_stats(struct ccli *ccli, struct ccli_stats *stats);
+void ccli_stats_reset(struct ccli *ccli);
+int ccli_metrics_file(struct ccli *ccli, const char *file, int ms);
+
 int ccli_file_completion(struct ccli *ccli, char ***list, int *cnt, char *match,
                          int mode, const char **ext, const char *PATH);
 
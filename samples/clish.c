@@ -149,6 +149,21 @@ static void sig_handle(int sig)
 	/* do nothing */
 }
 
+/* Exit the loop (which saves the history) when asked to terminate */
+static int do_sigterm(struct ccli *ccli, int sig, void *data)
+{
+	ccli_printf(ccli, "\nTerminated\n");
+	return 1;
+}
+
+/* Reap any children that were left behind */
+static int do_sigchld(struct ccli *ccli, int sig, void *data)
+{
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+	return 0;
+}
+
 int main (int argc, char **argv)
 {
 	struct sigaction act = { .sa_handler = sig_handle };
@@ -173,6 +188,14 @@ int main (int argc, char **argv)
 	/* Handle SIGINT */
 	sigaction(SIGINT, &act, NULL);
 
+	/*
+	 * These are handled by the loop. The children get them back
+	 * when they call ccli_console_release().
+	 */
+	ccli_register_signal(ccli, SIGTERM, do_sigterm, NULL);
+	ccli_register_signal(ccli, SIGCHLD, do_sigchld, NULL);
+	ccli_register_signal(ccli, SIGWINCH, NULL, NULL);
+
 	ccli_loop(ccli);
 
 	ccli_history_save(ccli, CLISH_TAG);
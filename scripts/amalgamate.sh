@@ -0,0 +1,64 @@
+#!/bin/sh
+# SPDX-License-Identifier: LGPL-2.1
+#
+# Generate the single file build of libccli: amalgamate.sh srcdir outdir
+#
+# Writes outdir/ccli.h (the public header) and outdir/ccli.c, which is
+# the headers of src/ followed by every file of src/ in the order the
+# Makefile builds them. With all of the library in one translation unit, the
+# compiler can inline across what used to be separate files, without LTO.
+# The #line markers keep warnings and debug info pointing at src/.
+
+if [ $# -ne 2 ]; then
+	echo "usage: $0 srcdir outdir" >&2
+	exit 1
+fi
+
+src=$1
+out=$2
+
+mkdir -p "$out" || exit 1
+
+files=`sed -n 's/^OBJS += \(.*\)\.o$/\1.c/p' "$src/src/Makefile"`
+if [ -z "$files" ]; then
+	echo "$0: no sources found in $src/src/Makefile" >&2
+	exit 1
+fi
+
+cp "$src/include/ccli.h" "$out/ccli.h" || exit 1
+
+tmp="$out/ccli.c.tmp"
+
+{
+	cat <<EOT
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * libccli as a single file, generated by scripts/amalgamate.sh.
+ * Do not edit, change the files in src/ instead.
+ *
+ * Build it with the ccli.h next to it, and link with -lpthread.
+ * Define HAVE_SDT to have the USDT probes (needs sys/sdt.h).
+ */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+EOT
+	echo "#line 1 \"src/simd.h\""
+	cat "$src/src/simd.h"
+
+	echo
+	echo "#line 1 \"src/ccli-local.h\""
+	sed -e 's/^#include <ccli.h>$/#include "ccli.h"/' \
+	    -e 's/^#include "simd.h"$//' "$src/src/ccli-local.h"
+
+	for f in $files; do
+		echo
+		echo "#line 1 \"src/$f\""
+		# Keep the line numbers: blank out the include instead of dropping it
+		sed -e 's/^#include "ccli-local.h"$//' \
+		    -e 's/^#include <ccli.h>$/#include "ccli.h"/' "$src/src/$f"
+	done
+} > "$tmp" || exit 1
+
+mv -f "$tmp" "$out/ccli.c"
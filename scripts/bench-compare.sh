@@ -0,0 +1,34 @@
+#!/bin/sh
+# SPDX-License-Identifier: LGPL-2.1
+#
+# Compare two runs of ccli-bench: bench-compare.sh base.json new.json
+#
+# Prints the time per operation of each benchmark in both runs, and how
+# much faster (above 1.00) or slower the new one is.
+
+if [ $# -ne 2 ]; then
+	echo "usage: $0 base.json new.json" >&2
+	exit 1
+fi
+
+# Pull "bench" and "ns_per_op" out of each JSON line
+extract() {
+	sed -n 's/.*"bench":"\([^"]*\)".*"ns_per_op":\([0-9.]*\).*/\1 \2/p' "$1"
+}
+
+extract "$2" > "$2.ns" || exit 1
+extract "$1" | awk -v new="$2.ns" '
+BEGIN {
+	while ((getline line < new) > 0) {
+		split(line, f, " ");
+		ns[f[1]] = f[2];
+	}
+	printf("%-28s %12s %12s %8s\n", "bench", "base ns/op", "new ns/op", "speedup");
+}
+{
+	if (!($1 in ns))
+		next;
+	printf("%-28s %12.1f %12.1f %8.2f\n", $1, $2, ns[$1],
+	       ns[$1] > 0 ? $2 / ns[$1] : 0);
+}'
+rm -f "$2.ns"
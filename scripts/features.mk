@@ -35,3 +35,23 @@ int main (void)
 	return ret;
 }
 endef
+
+# Subsystems that can be left out of libccli, for a smaller library and
+# struct ccli. Build with "make CCLI_NO_PAGER=1" (and so on), or define
+# them when compiling the amalgamation. "make size" shows what is saved.
+#
+#  CCLI_NO_FILE_COMPLETION  ccli_file_completion()
+#  CCLI_NO_HISTORY_FILE     ccli_history_load() and ccli_history_save(),
+#                           and their _file() and _fd() versions
+#  CCLI_NO_PAGER            stopping at each window full in ccli_page()
+#                           and in the list of completions, and
+#                           ccli_pager_start(), ccli_pager_stop() and
+#                           ccli_register_pager()
+#  CCLI_NO_RECORD           ccli_record_start(), ccli_record_stop() and
+#                           ccli_record_env()
+#
+# The functions that are left out fail with errno set to ENOTSUP.
+CCLI_FEATURES = CCLI_NO_FILE_COMPLETION CCLI_NO_HISTORY_FILE \
+		CCLI_NO_PAGER CCLI_NO_RECORD
+
+FEATURE_CFLAGS := $(foreach f,$(CCLI_FEATURES),$(if $(filter 1,$($(f))),-D$(f)))
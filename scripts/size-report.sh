@@ -0,0 +1,39 @@
+#!/bin/sh
+# SPDX-License-Identifier: LGPL-2.1
+#
+# Print the size of libccli: size-report.sh srcdir libccli.a
+#
+# Shows the text, data and bss of every object of the library with their
+# total, and the size of struct ccli. CC, CFLAGS, SIZE and NM are taken
+# from the environment. The size of the struct is read from the symbol
+# table of an object instead of running a program, so that it also works
+# when cross compiling.
+
+if [ $# -ne 2 ]; then
+	echo "usage: $0 srcdir libccli.a" >&2
+	exit 1
+fi
+
+src=$1
+lib=$2
+
+CC=${CC:-gcc}
+SIZE=${SIZE:-size}
+NM=${NM:-nm}
+
+$SIZE -t "$lib" || exit 1
+
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+printf '#include "ccli-local.h"\nchar ccli_struct_size[sizeof(struct ccli)];\n' > "$tmp/size.c"
+$CC $CFLAGS -fno-lto -fno-common -I"$src/src" -c "$tmp/size.c" -o "$tmp/size.o" || exit 1
+
+size=`$NM -S "$tmp/size.o" | awk '$4 == "ccli_struct_size" { print $2 }'`
+if [ -z "$size" ]; then
+	echo "$0: cannot find the size of struct ccli" >&2
+	exit 1
+fi
+
+echo
+printf 'sizeof(struct ccli): %d\n' "0x$size"
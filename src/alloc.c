@@ -0,0 +1,613 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Memory allocation for libccli.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <stdarg.h>
+
+#include "ccli-local.h"
+
+#ifdef CCLI_STATIC_MEMORY
+/*
+ * Built to never touch the heap. Memory must come from the buffer given
+ * to ccli_alloc_static(), or from an allocator set by ccli_set_allocator().
+ */
+static void *default_malloc(size_t size, void *data)
+{
+	errno = ENOMEM;
+	return NULL;
+}
+
+static void *default_realloc(void *ptr, size_t size, void *data)
+{
+	errno = ENOMEM;
+	return NULL;
+}
+
+static void default_free(void *ptr, void *data)
+{
+}
+#else
+static void *default_malloc(size_t size, void *data)
+{
+	return malloc(size);
+}
+
+static void *default_realloc(void *ptr, size_t size, void *data)
+{
+	return realloc(ptr, size);
+}
+
+static void default_free(void *ptr, void *data)
+{
+	free(ptr);
+}
+#endif
+
+static const struct ccli_allocator default_allocator = {
+	.malloc		= default_malloc,
+	.realloc	= default_realloc,
+	.free		= default_free,
+};
+
+/* Used by ccli_alloc() and for anything done without a descriptor */
+static struct ccli_allocator global_allocator = {
+	.malloc		= default_malloc,
+	.realloc	= default_realloc,
+	.free		= default_free,
+};
+
+/*
+ * The region allocator hands out memory from a single buffer that the
+ * application gave to ccli_alloc_static(). It is a first fit allocator
+ * that keeps its free list in address order, so that a freed block can
+ * be merged with the free blocks on either side of it. Other threads may
+ * print or register commands while the loop runs, so it is protected by
+ * a spin lock that is only held while walking the free list.
+ */
+#define REGION_ALIGN		16
+#define REGION_HDR		REGION_ALIGN
+#define REGION_MIN		(REGION_HDR + REGION_ALIGN)
+
+struct region_block {
+	size_t			size;	/* Includes the header */
+	struct region_block	*next;	/* Only used when free */
+};
+
+struct region {
+	struct region_block	*free;
+	size_t			size;
+	bool			lock;
+};
+
+static inline size_t region_round(size_t size)
+{
+	return (size + REGION_ALIGN - 1) & ~((size_t)REGION_ALIGN - 1);
+}
+
+static inline struct region_block *region_block(void *ptr)
+{
+	return ptr - REGION_HDR;
+}
+
+static inline size_t region_need(size_t size)
+{
+	size = region_round(size) + REGION_HDR;
+	return size < REGION_MIN ? REGION_MIN : size;
+}
+
+/*
+ * Take @need bytes from the start of the free block that @pblk points to.
+ * If what is left over is too small to be a block, all of it is taken.
+ * Returns the number of bytes taken.
+ */
+static size_t region_take(struct region_block **pblk, size_t need)
+{
+	struct region_block *blk = *pblk;
+	struct region_block *split;
+
+	if (blk->size - need < REGION_MIN) {
+		*pblk = blk->next;
+		return blk->size;
+	}
+
+	split = (void *)blk + need;
+	split->size = blk->size - need;
+	split->next = blk->next;
+	blk->size = need;
+	*pblk = split;
+	return need;
+}
+
+static void region_lock(struct region *region)
+{
+	while (__atomic_test_and_set(&region->lock, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void region_unlock(struct region *region)
+{
+	__atomic_clear(&region->lock, __ATOMIC_RELEASE);
+}
+
+static void *__region_malloc(struct region *region, size_t size)
+{
+	struct region_block **pblk;
+	struct region_block *blk;
+	size_t need;
+
+	if (size >= region->size)
+		goto nomem;
+
+	need = region_need(size);
+
+	for (pblk = &region->free; (blk = *pblk); pblk = &blk->next) {
+		if (blk->size < need)
+			continue;
+		region_take(pblk, need);
+		return (void *)blk + REGION_HDR;
+	}
+ nomem:
+	errno = ENOMEM;
+	return NULL;
+}
+
+static void __region_free(struct region *region, void *ptr)
+{
+	struct region_block **pblk;
+	struct region_block *prev = NULL;
+	struct region_block *next;
+	struct region_block *blk;
+
+	if (!ptr)
+		return;
+
+	blk = region_block(ptr);
+
+	for (pblk = &region->free; (next = *pblk) && next < blk; pblk = &next->next)
+		prev = next;
+
+	if (next && (void *)blk + blk->size == (void *)next) {
+		blk->size += next->size;
+		blk->next = next->next;
+	} else {
+		blk->next = next;
+	}
+
+	if (prev && (void *)prev + prev->size == (void *)blk) {
+		prev->size += blk->size;
+		prev->next = blk->next;
+	} else {
+		*pblk = blk;
+	}
+}
+
+static void *__region_realloc(struct region *region, void *ptr, size_t size)
+{
+	struct region_block **pblk;
+	struct region_block *next;
+	struct region_block *blk;
+	void *end;
+	size_t need;
+	void *p;
+
+	if (!ptr)
+		return __region_malloc(region, size);
+
+	if (size >= region->size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	blk = region_block(ptr);
+	need = region_need(size);
+	if (need <= blk->size)
+		return ptr;
+
+	/* Try to grow into the free block that follows it */
+	end = (void *)blk + blk->size;
+	for (pblk = &region->free; (next = *pblk) && (void *)next < end;
+	     pblk = &next->next)
+		;
+
+	if ((void *)next == end && blk->size + next->size >= need) {
+		blk->size += region_take(pblk, need - blk->size);
+		return ptr;
+	}
+
+	p = __region_malloc(region, size);
+	if (!p)
+		return NULL;
+
+	memcpy(p, ptr, blk->size - REGION_HDR);
+	__region_free(region, ptr);
+	return p;
+}
+
+static void *region_malloc(size_t size, void *data)
+{
+	struct region *region = data;
+	void *p;
+
+	region_lock(region);
+	p = __region_malloc(region, size);
+	region_unlock(region);
+
+	return p;
+}
+
+static void region_free(void *ptr, void *data)
+{
+	struct region *region = data;
+
+	region_lock(region);
+	__region_free(region, ptr);
+	region_unlock(region);
+}
+
+static void *region_realloc(void *ptr, size_t size, void *data)
+{
+	struct region *region = data;
+	void *p;
+
+	region_lock(region);
+	p = __region_realloc(region, ptr, size);
+	region_unlock(region);
+
+	return p;
+}
+
+/**
+ * region_init - Set up an allocator that uses only the given memory
+ * @allocator: The allocator to initialize
+ * @mem: The memory to allocate from
+ * @size: The size of @mem
+ *
+ * The bookkeeping of the region lives at the start of @mem, so
+ * @mem must stay around for as long as @allocator is used.
+ *
+ * Returns 0 on success and -1 if @mem is too small.
+ */
+__hidden int region_init(struct ccli_allocator *allocator, void *mem, size_t size)
+{
+	struct region *region;
+	struct region_block *blk;
+	void *start;
+	void *end;
+
+	start = (void *)region_round((unsigned long)mem);
+	end = (void *)(((unsigned long)mem + size) & ~((unsigned long)REGION_ALIGN - 1));
+
+	if (end < start ||
+	    end - start < region_round(sizeof(*region)) + REGION_MIN) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	region = start;
+	blk = start + region_round(sizeof(*region));
+	blk->size = end - (void *)blk;
+	blk->next = NULL;
+	region->free = blk;
+	region->size = blk->size;
+	region->lock = false;
+
+	allocator->malloc = region_malloc;
+	allocator->realloc = region_realloc;
+	allocator->free = region_free;
+	allocator->data = region;
+
+	return 0;
+}
+
+static inline struct ccli_allocator *get_allocator(struct ccli *ccli)
+{
+	return ccli ? &ccli->allocator : &global_allocator;
+}
+
+__hidden void get_global_allocator(struct ccli_allocator *allocator)
+{
+	*allocator = global_allocator;
+}
+
+__hidden void *mem_alloc(struct ccli *ccli, size_t size)
+{
+	struct ccli_allocator *a = get_allocator(ccli);
+
+	if (ccli)
+		stat_add(ccli, allocs, 1);
+	return a->malloc(size, a->data);
+}
+
+__hidden void *mem_zalloc(struct ccli *ccli, size_t size)
+{
+	void *ptr;
+
+	ptr = mem_alloc(ccli, size);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+__hidden void *mem_realloc(struct ccli *ccli, void *ptr, size_t size)
+{
+	struct ccli_allocator *a = get_allocator(ccli);
+
+	if (ccli)
+		stat_add(ccli, allocs, 1);
+	return a->realloc(ptr, size, a->data);
+}
+
+__hidden void mem_free(struct ccli *ccli, void *ptr)
+{
+	struct ccli_allocator *a = get_allocator(ccli);
+
+	if (ptr)
+		a->free(ptr, a->data);
+}
+
+__hidden char *mem_strdup(struct ccli *ccli, const char *str)
+{
+	char *p;
+	int len;
+
+	len = strlen(str) + 1;
+	p = mem_alloc(ccli, len);
+	if (p)
+		memcpy(p, str, len);
+	return p;
+}
+
+__hidden int mem_vasprintf(struct ccli *ccli, char **strp, const char *fmt, va_list ap)
+{
+	va_list ap2;
+	char *str;
+	int len;
+
+	*strp = NULL;
+
+	va_copy(ap2, ap);
+	len = vsnprintf(NULL, 0, fmt, ap2);
+	va_end(ap2);
+	if (len < 0)
+		return -1;
+
+	str = mem_alloc(ccli, len + 1);
+	if (!str)
+		return -1;
+
+	vsnprintf(str, len + 1, fmt, ap);
+	*strp = str;
+	return len;
+}
+
+__hidden int mem_asprintf(struct ccli *ccli, char **strp, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = mem_vasprintf(ccli, strp, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+static char *copy_str(struct ccli_allocator *a, const char *str)
+{
+	char *p;
+	int len;
+
+	if (!str)
+		return NULL;
+
+	len = strlen(str) + 1;
+	p = a->malloc(len, a->data);
+	if (p)
+		memcpy(p, str, len);
+	return p;
+}
+
+static void free_strs(struct ccli_allocator *a, char **strs, int cnt)
+{
+	int i;
+
+	if (!strs)
+		return;
+
+	for (i = 0; i < cnt; i++) {
+		if (strs[i])
+			a->free(strs[i], a->data);
+	}
+	a->free(strs, a->data);
+}
+
+/*
+ * Everything that the ccli descriptor holds on to between commands
+ * must be freed by the allocator that allocated it. When the allocator
+ * of a descriptor is changed, copy it all over to the new one.
+ */
+static int migrate_allocator(struct ccli *ccli, struct ccli_allocator *to)
+{
+	struct ccli_allocator *from = &ccli->allocator;
+	struct command_table *cmds = ccli->cmds;
+	struct command_table *commands = NULL;
+	size_t table_size;
+	char **history = NULL;
+	char **names = NULL;
+	char *shared_buf = NULL;
+	char *prompt = NULL;
+	char *temp = NULL;
+	int nr_hist;
+	int i;
+
+	nr_hist = ccli->history_size;
+	if (nr_hist > ccli->history_max)
+		nr_hist = ccli->history_max;
+
+	if (ccli->prompt) {
+		prompt = copy_str(to, ccli->prompt);
+		if (!prompt)
+			goto fail;
+	}
+
+	if (ccli->temp_line) {
+		temp = copy_str(to, ccli->temp_line);
+		if (!temp)
+			goto fail;
+	}
+
+	/* What is in the shared history buffer does not need to be kept */
+	if (ccli->shared_buf) {
+		shared_buf = to->malloc(ring_buf_size(ccli->shared), to->data);
+		if (!shared_buf)
+			goto fail;
+	}
+
+	table_size = sizeof(*cmds) + sizeof(cmds->commands[0]) * cmds->nr_commands;
+	commands = to->malloc(table_size, to->data);
+	if (!commands)
+		goto fail;
+
+	if (cmds->nr_commands) {
+		names = to->malloc(sizeof(*names) * cmds->nr_commands, to->data);
+		if (!names)
+			goto fail;
+		memset(names, 0, sizeof(*names) * cmds->nr_commands);
+		for (i = 0; i < cmds->nr_commands; i++) {
+			names[i] = copy_str(to, cmds->commands[i].cmd);
+			if (!names[i])
+				goto fail;
+		}
+	}
+
+	if (nr_hist) {
+		history = to->malloc(sizeof(*history) * nr_hist, to->data);
+		if (!history)
+			goto fail;
+		memset(history, 0, sizeof(*history) * nr_hist);
+		for (i = 0; i < nr_hist; i++) {
+			history[i] = copy_str(to, ccli->history[i]);
+			if (ccli->history[i] && !history[i])
+				goto fail;
+		}
+	}
+
+	/* Everything is copied, now switch over */
+	memcpy(commands, cmds, table_size);
+	for (i = 0; i < cmds->nr_commands; i++) {
+		commands->commands[i].cmd = names[i];
+		from->free(cmds->commands[i].cmd, from->data);
+	}
+	if (names)
+		to->free(names, to->data);
+	from->free(cmds, from->data);
+	ccli->cmds = commands;
+
+	free_strs(from, ccli->history, nr_hist);
+	ccli->history = history;
+
+	if (ccli->prompt)
+		from->free(ccli->prompt, from->data);
+	ccli->prompt = prompt;
+
+	if (ccli->temp_line)
+		from->free(ccli->temp_line, from->data);
+	ccli->temp_line = temp;
+	ccli->temp_size = temp ? strlen(temp) + 1 : 0;
+
+	if (ccli->shared_buf)
+		from->free(ccli->shared_buf, from->data);
+	ccli->shared_buf = shared_buf;
+
+	/* The cached pool blocks belong to the old allocator */
+	for (i = 0; i < CCLI_NR_POOLS; i++)
+		pool_destroy(&ccli->pools[i]);
+
+	ccli->allocator = *to;
+	return 0;
+
+ fail:
+	if (prompt)
+		to->free(prompt, to->data);
+	if (temp)
+		to->free(temp, to->data);
+	if (shared_buf)
+		to->free(shared_buf, to->data);
+	if (commands)
+		to->free(commands, to->data);
+	free_strs(to, names, cmds->nr_commands);
+	free_strs(to, history, nr_hist);
+	errno = ENOMEM;
+	return -1;
+}
+
+/**
+ * ccli_set_allocator - Set the functions that libccli allocates memory with
+ * @ccli: The CLI descriptor to set the allocator for (NULL for global)
+ * @allocator: The allocator to use (NULL for malloc(), realloc() and free())
+ *
+ * Have all memory that libccli allocates go through the functions of
+ * @allocator. Each function is passed the data field of @allocator.
+ *
+ * If @ccli is NULL, then this sets the allocator used by ccli_alloc()
+ * for new descriptors, as well as for ccli_line_parse() and ccli_argv_free().
+ * Descriptors that already exist are not affected.
+ *
+ * If @ccli is given, then only that descriptor is affected. Everything it
+ * is currently holding on to (the commands, the history, the prompt) is
+ * copied over to @allocator and freed from the previous one. The descriptor
+ * itself is still freed by the allocator that allocated it. This can not
+ * be done from within ccli_loop() or ccli_execute(), or while other
+ * threads are using @ccli.
+ *
+ * If libccli was built with STATIC_MEMORY=1, then there is no heap to
+ * fall back to, and a NULL @allocator is one that always fails.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_set_allocator(struct ccli *ccli, const struct ccli_allocator *allocator)
+{
+	struct ccli_allocator a;
+	int ret;
+
+	if (!allocator)
+		allocator = &default_allocator;
+
+	if (!allocator->malloc || !allocator->realloc || !allocator->free) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!ccli) {
+		global_allocator = *allocator;
+		return 0;
+	}
+
+	if (ccli->line) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	a = *allocator;
+
+	/* Keep other threads from registering commands while they move */
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	/*
+	 * The last reader frees the retired tables only if it gets the lock,
+	 * so they may still be around when nothing reads them.
+	 */
+	commands_reclaim(ccli);
+	if (ccli->retired) {
+		/* Old command tables are still being read */
+		errno = EBUSY;
+		ret = -1;
+	} else {
+		ret = migrate_allocator(ccli, &a);
+	}
+	pthread_mutex_unlock(&ccli->cmd_lock);
+
+	return ret;
+}
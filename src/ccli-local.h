@@ -3,11 +3,15 @@
 #define __CCLI_LOCAL_H
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <termios.h>
+#include <time.h>
 
 #include <ccli.h>
 
@@ -15,22 +19,74 @@
 
 #define ISSPACE(c) isspace((unsigned char)(c))
 
+#include "simd.h"
+
+/*
+ * The counters of ccli_stats() are plain loads and stores, and not an
+ * atomic add, so that counting costs nothing on the hot path. A count
+ * may be lost when another thread adds to it at the same time.
+ */
+#define stat_read(ccli, field)					\
+	__atomic_load_n(&(ccli)->stats.field, __ATOMIC_RELAXED)
+
+#define stat_add(ccli, field, val)					\
+	__atomic_store_n(&(ccli)->stats.field,				\
+			 __atomic_load_n(&(ccli)->stats.field,		\
+					 __ATOMIC_RELAXED) + (val),	\
+			 __ATOMIC_RELAXED)
+
+/*
+ * Static tracepoints (USDT) for perf, bpftrace and systemtap, under the
+ * provider "libccli". With sys/sdt.h, each one is a single nop until a
+ * tracer attaches to it. Without it, they compile to nothing.
+ *
+ *  command__start(name, argc)	command__end(name, ret)
+ *  completion__start(line)	completion__end(candidates, matched)
+ *  history__search__start()	history__search__end(found)
+ *  redraw(bytes)			input__read(bytes)
+ */
+#ifdef HAVE_SDT
+# include <sys/sdt.h>
+# define trace_probe(name, ...)	STAP_PROBEV(libccli, name, ##__VA_ARGS__)
+#else
+static inline void trace_probe_nop(int x, ...) { }
+# define trace_probe(name, ...)	trace_probe_nop(0, ##__VA_ARGS__)
+#endif
+
+struct pool_block;
+
+/* Per session cache of freed blocks, handed back out before using malloc */
+struct pool {
+	struct ccli		*ccli;
+	struct pool_block	*free;
+	struct ccli_pool_stats	stats;
+};
+
 struct line_buf {
 	char *line;
+	struct pool *pool;	/* Where line came from (NULL for malloc) */
+	int max;	/* Longest the line may get (0 for no limit) */
 	int size;
 	int len;
 	int pos;
 	int start;	/* used for \ newline */
 };
 
+struct arena_chunk;
+
 #define DEFAULT_HISTORY_MAX	256
 #define DEFAULT_PAGE_SCROLL	24
 
 #define READ_BUF		256
 
+#define POOL_MAX_FREE		8
+/* Blocks bigger than this are not kept, so one huge line does not pin it */
+#define POOL_MAX_BLOCK		(16 * 1024)
+
 enum {
 	CHAR_ERROR		= -1,
 	CHAR_INTR		= -2,
+	CHAR_EXIT		= -3,
 	CHAR_IGNORE_END		= -10,
 	CHAR_DEL		= -12,
 	CHAR_UP			= -13,
@@ -50,6 +106,7 @@ enum {
 	CHAR_IGNORE_START	= -27,
 	CHAR_INSERT		= -28,
 	CHAR_DEL_BEGINNING	= -29,
+	CHAR_RESIZE		= -30,
 	/* CHAR_NEWLINE is to tell line_insert() a "\ and newline" was hit */
 	CHAR_NEWLINE		= -128,
 };
@@ -59,31 +116,165 @@ struct command {
 	ccli_command_callback	callback;
 	ccli_completion		completion;
 	void			*data;
+	int			timeout;	/* In ms, see ccli_set_timeout() */
+};
+
+/*
+ * The registered commands and callbacks. A table is never modified once
+ * it is published in ccli->cmds, see commands.c.
+ */
+struct command_table {
+	struct command_table	*next;	/* On the retired list */
+	char			*dead;	/* A name that newer tables do not have */
+	struct command		enter;
+	struct command		unknown;
+	ccli_completion		default_completion;
+	void			*default_completion_data;
+	ccli_interrupt		interrupt;
+	void			*interrupt_data;
+	int			nr_commands;
+	struct command		commands[];
+};
+
+/* Output from other threads, waiting for the loop to write it */
+struct output {
+	struct output		*next;
+	int			len;
+	char			buf[];
+};
+
+/* A ccli_line_inject() from another thread */
+struct inject {
+	int			pos;
+	char			str[];
+};
+
+/* Output that is collected instead of written out (see watch.c) */
+struct capture {
+	char			*buf;
+	int			len;
+	int			size;
+	bool			failed;		/* Something did not fit in buf */
+};
+
+#define JSON_BUF		1024
+
+/* Builds JSON on the stack, to write it to the output or a capture */
+struct json_writer {
+	struct ccli		*ccli;
+	struct capture		*cap;		/* NULL to write to the output */
+	int			len;
+	int			ret;
+	bool			comma;
+	char			buf[JSON_BUF];
+};
+
+struct watchdog;
+struct recorder;
+struct metrics;
+struct pager;
+
+/* The deadline of an outer command while a nested one executes */
+struct watchdog_save {
+	const char		*cmd;
+	struct timespec		deadline;
+	int			ms;
+	bool			armed;
+	bool			cancelled;
+};
+
+/* The times of one command, see stats.c */
+#define TIMING_BUCKETS		26	/* Under 1us, then a power of 2 of us each */
+#define TIMING_HASH		64
+
+struct timing {
+	struct timing		*next;
+	char			*name;
+	unsigned long		count;
+	unsigned long long	sum_ns;
+	unsigned long long	max_ns;
+	unsigned long		buckets[TIMING_BUCKETS];
+};
+
+struct timings {
+	struct timing		*hash[TIMING_HASH];
+	int			nr;
+	bool			perf;	/* Print the cost of each command */
+};
+
+/* The start of a command that is timed */
+struct timing_save {
+	struct timespec		start;
+	struct ccli_stats	stats;
+};
+
+struct signal_handler {
+	ccli_signal		callback;
+	void			*data;
 };
 
 struct ccli {
+	struct ccli_allocator	allocator;
+	struct ccli_allocator	self_allocator;
+	struct ccli_limits	limits;
 	struct termios		savein;
 	struct termios		saveout;
 	struct line_buf		*line;
 	char			*temp_line;
+	int			temp_size;
+	bool			temp_saved;
 	int			history_max;
 	int			history_size;
-	int			current_line;
+	int			history_start;
+	int			history_bytes;
+	unsigned long		current_line;
 	bool			in_tty;
+	bool			in_completion;
 	int			in;
 	int			out;
+#ifndef CCLI_NO_PAGER
 	int			w_row;
-	int			nr_commands;
+	struct pager		*pager;
+	bool			viewing;	/* The pager owns the screen */
+#endif
+#ifndef CCLI_NO_FILE_COMPLETION
 	int			display_index;
-	struct command		*commands;
-	struct command		enter;
-	struct command		unknown;
-	ccli_completion		default_completion;
-	void			*default_completion_data;
-	ccli_interrupt		interrupt;
-	void			*interrupt_data;
+#endif
+	struct command_table	*cmds;
+	struct command_table	*retired;
+	int			cmd_readers;
+	pthread_mutex_t		cmd_lock;
+	pthread_mutex_t		history_lock;
+	pthread_mutex_t		out_lock;	/* Held while writing to out */
+	struct output		*output;
+	struct inject		*inject;
+	int			wakefd;
+	pthread_t		loop_thread;
+	bool			looping;
+	bool			at_prompt;
+	struct capture		*capture;
+	struct watchdog		*watchdog;
+#ifndef CCLI_NO_RECORD
+	struct recorder		*recorder;
+	bool			record_env;
+#endif
+	struct ccli_stats	stats;
+	struct timings		*timings;
+	struct metrics		*metrics;
+	enum ccli_table_format	table_format;
+	enum ccli_output_mode	output_mode;
 	char			*prompt;
 	char			**history;
+	struct ccli_shared_history *shared;
+	char			*shared_buf;
+	unsigned long		shared_end;
+	char			**comp_list;
+	struct arena_chunk	*comp_arena;
+	struct pool		pools[CCLI_NR_POOLS];
+	int			sigfd;
+	sigset_t		sigmask;
+	sigset_t		sigblocked;
+	struct signal_handler	signals[NSIG];
 	unsigned char		read_start;
 	unsigned char		read_end;
 	char			read_buf[READ_BUF];
@@ -94,20 +285,85 @@ extern int execute(struct ccli *ccli, const char *line, bool hist);
 extern void clear_line(struct ccli *ccli, struct line_buf *line);
 extern int read_char(struct ccli *ccli);
 
+extern int write_out(struct ccli *ccli, const char *buf, int len);
+extern int write_now(struct ccli *ccli, const char *str, int len);
+extern int read_in(struct ccli *ccli, void *buf, int len);
 extern void echo(struct ccli *ccli, char ch);
 extern int echo_str(struct ccli *ccli, char *str);
 extern void echo_str_len(struct ccli *ccli, char *str, int len);
+extern int print_str(struct ccli *ccli, const char *str, int len);
+extern void output_flush(struct ccli *ccli);
+extern bool other_thread(struct ccli *ccli);
 extern void echo_prompt(struct ccli *ccli);
 
-extern struct command *find_command(struct ccli *ccli, const char *cmd);
+extern struct command *find_command(struct command_table *cmds, const char *cmd);
+extern struct command_table *commands_get(struct ccli *ccli);
+extern void commands_put(struct ccli *ccli);
+extern void commands_reclaim(struct ccli *ccli);
+extern struct command_table *commands_copy(struct ccli *ccli, int extra);
+extern void commands_publish(struct ccli *ccli, struct command_table *cmds,
+			     char *dead);
+extern int commands_init(struct ccli *ccli);
+extern void commands_free(struct ccli *ccli);
 
 extern bool check_for_ctrl_c(struct ccli *ccli);
+#ifndef CCLI_NO_PAGER
 extern char page_stop(struct ccli *ccli);
+extern int pager_add(struct ccli *ccli, const char *str, int len);
+extern void pager_free(struct ccli *ccli);
+
+/* Between ccli_pager_start() and ccli_pager_stop() */
+static inline bool paging(struct ccli *ccli)
+{
+	return ccli->pager != NULL;
+}
+
+/* Paging, or showing what was paged */
+static inline bool pager_active(struct ccli *ccli)
+{
+	return ccli->pager || ccli->viewing;
+}
+
+/* SIGWINCH came in while the pager shows the output */
+static inline bool view_resized(struct ccli *ccli)
+{
+	return ccli->viewing && !ccli->w_row;
+}
+#else
+/* Without the pager, answer "continue without paging" */
+static inline char page_stop(struct ccli *ccli) { return 'c'; }
+static inline int pager_add(struct ccli *ccli, const char *str, int len) { return len; }
+static inline void pager_free(struct ccli *ccli) { }
+static inline bool paging(struct ccli *ccli) { return false; }
+static inline bool pager_active(struct ccli *ccli) { return false; }
+static inline bool view_resized(struct ccli *ccli) { return false; }
+#endif
 
 extern void line_refresh(struct ccli *ccli, struct line_buf *line, int pad);
+extern void line_refresh_tail(struct ccli *ccli, struct line_buf *line,
+			      int from, int back, int pad);
+
+extern void get_global_allocator(struct ccli_allocator *allocator);
+extern int region_init(struct ccli_allocator *allocator, void *mem, size_t size);
+extern void *mem_alloc(struct ccli *ccli, size_t size);
+extern void *mem_zalloc(struct ccli *ccli, size_t size);
+extern void *mem_realloc(struct ccli *ccli, void *ptr, size_t size);
+extern void mem_free(struct ccli *ccli, void *ptr);
+extern char *mem_strdup(struct ccli *ccli, const char *str);
+extern int mem_vasprintf(struct ccli *ccli, char **strp, const char *fmt, va_list ap);
+__attribute__((__format__(printf, 3, 4)))
+extern int mem_asprintf(struct ccli *ccli, char **strp, const char *fmt, ...);
 
-extern int line_init(struct line_buf *line);
-extern int line_init_str(struct line_buf *line, const char *str);
+extern void *pool_alloc(struct pool *pool, size_t size);
+extern void *pool_zalloc(struct pool *pool, size_t size);
+extern void *pool_realloc(struct pool *pool, void *ptr, size_t size);
+extern size_t pool_size(void *ptr);
+extern void pool_free(struct pool *pool, void *ptr);
+extern void pool_destroy(struct pool *pool);
+
+extern int line_init(struct line_buf *line, struct pool *pool);
+extern int line_init_str(struct line_buf *line, const char *str,
+			 struct pool *pool);
 extern void line_reset(struct line_buf *line);
 extern void line_cleanup(struct line_buf *line);
 extern int line_insert(struct line_buf *line, char ch);
@@ -123,9 +379,18 @@ extern void line_del(struct line_buf *line);
 extern int line_del_word(struct line_buf *line);
 extern int line_del_beginning(struct line_buf *line);
 extern int line_copy(struct line_buf *dst, struct line_buf *src, int len);
-extern int line_parse(const char *line, char ***pargv);
+extern int line_parse(struct ccli *ccli, const char *line, char ***pargv);
+extern const char *line_word(const char *line, int n);
+extern void line_argv_free(struct ccli *ccli, char **argv);
 extern void line_replace(struct line_buf *line, char *str);
 
+extern size_t ring_buf_size(struct ccli_shared_history *hist);
+extern int ring_size(struct ccli_shared_history *hist);
+extern unsigned long ring_head(struct ccli_shared_history *hist);
+extern int ring_add(struct ccli_shared_history *hist, const char *line);
+extern char *ring_get(struct ccli_shared_history *hist, unsigned long seq,
+		      char *buf);
+
 extern int history_add(struct ccli *ccli, const char *line);
 extern int history_up(struct ccli *ccli, struct line_buf *line, int cnt);
 extern int history_down(struct ccli *ccli, struct line_buf *line, int cnt);
@@ -133,6 +398,53 @@ extern int history_search(struct ccli *ccli, struct line_buf *line, int *pad);
 
 extern void free_argv(int argc, char **argv);
 
+extern int signal_handle(struct ccli *ccli);
+extern void signal_block(struct ccli *ccli);
+extern void signal_unblock(struct ccli *ccli);
+extern void signal_cleanup(struct ccli *ccli);
+
+extern bool watchdog_arm(struct ccli *ccli, const char *cmd, int ms,
+			 struct watchdog_save *save);
+extern void watchdog_disarm(struct ccli *ccli, struct watchdog_save *save);
+extern void watchdog_free(struct ccli *ccli);
+
+#ifndef CCLI_NO_RECORD
+static inline bool recording(struct ccli *ccli) { return ccli->recorder; }
+extern void record_input(struct ccli *ccli, const void *data, int size);
+extern void record_env_start(struct ccli *ccli);
+extern void record_env_stop(struct ccli *ccli);
+#else
+static inline bool recording(struct ccli *ccli) { return false; }
+static inline void record_input(struct ccli *ccli, const void *data, int size) { }
+static inline void record_env_start(struct ccli *ccli) { }
+static inline void record_env_stop(struct ccli *ccli) { }
+#endif
+
+extern void timing_start(struct ccli *ccli, struct timing_save *save);
+extern void timing_end(struct ccli *ccli, const char *name,
+		       struct timing_save *save);
+extern int timings_init(struct ccli *ccli);
+extern void timings_free(struct ccli *ccli);
+
+extern int metrics_fd(struct ccli *ccli);
+extern void metrics_handle(struct ccli *ccli);
+extern void metrics_free(struct ccli *ccli);
+
+extern void set_capture(struct ccli *ccli, struct capture *cap);
+extern int capture_add(struct ccli *ccli, struct capture *cap,
+		       const char *str, int len);
+
+extern void json_init(struct json_writer *w, struct ccli *ccli,
+		      struct capture *cap);
+extern int json_flush(struct json_writer *w);
+extern void json_raw(struct json_writer *w, const char *str, int len);
+extern void json_string(struct json_writer *w, const char *str);
+extern bool json_number(const char *str);
+extern void json_begin(struct json_writer *w);
+extern void json_end(struct json_writer *w);
+extern void json_key(struct json_writer *w, const char *key);
+extern void json_value(struct json_writer *w, const char *str, bool number);
+
 extern void do_completion(struct ccli *ccli, struct line_buf *line, int tab);
 
 #endif
@@ -5,8 +5,11 @@
  * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
  */
 #include <stdarg.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
@@ -39,12 +42,16 @@ static void cleanup(struct ccli *ccli)
  * child needs the original terminal. The ccli_console_release()
  * is called, and when done, ccli_console_acquire() puts it
  * back for ccli processing.
+ *
+ * This also unblocks the signals that were blocked by
+ * ccli_register_signal().
  */
 void ccli_console_release(struct ccli *ccli)
 {
 	if (!ccli)
 		return;
 	cleanup(ccli);
+	signal_unblock(ccli);
 }
 
 /**
@@ -58,6 +65,9 @@ void ccli_console_release(struct ccli *ccli)
  * child needs the original terminal. The ccli_console_release()
  * is called, and when done, ccli_console_acquire() puts it
  * back for ccli processing.
+ *
+ * This also blocks the signals registered with ccli_register_signal()
+ * again.
  */
 void ccli_console_acquire(struct ccli *ccli)
 {
@@ -68,6 +78,8 @@ void ccli_console_acquire(struct ccli *ccli)
 	ttyin.c_lflag &= ~ICANON;
 	ttyin.c_lflag &= ~(ECHO | ECHONL | ISIG);
 	tcsetattr(ccli->in, TCSANOW, (void*)&ttyin);
+
+	signal_block(ccli);
 }
 
 static void inc_read_buf_start(struct ccli *ccli)
@@ -98,19 +110,70 @@ static bool read_buf_full(struct ccli *ccli)
 	return ccli->read_end == READ_BUF - 1;
 }
 
+/* All writes to the output and reads from the input go through these */
+static int __write_out(struct ccli *ccli, const char *buf, int len)
+{
+	int ret;
+
+	ret = write(ccli->out, buf, len);
+	stat_add(ccli, writes, 1);
+	if (ret > 0)
+		stat_add(ccli, bytes_written, ret);
+	return ret;
+}
+
+/* The watchdog may write a warning at any time, see write_now() */
+__hidden int write_out(struct ccli *ccli, const char *buf, int len)
+{
+	int ret;
+
+	pthread_mutex_lock(&ccli->out_lock);
+	ret = __write_out(ccli, buf, len);
+	pthread_mutex_unlock(&ccli->out_lock);
+	return ret;
+}
+
+__hidden int read_in(struct ccli *ccli, void *buf, int len)
+{
+	int ret;
+
+	ret = read(ccli->in, buf, len);
+	stat_add(ccli, reads, 1);
+	if (ret > 0) {
+		stat_add(ccli, bytes_read, ret);
+		if (recording(ccli))
+			record_input(ccli, buf, ret);
+	}
+	trace_probe(input__read, ret);
+	return ret;
+}
+
 __hidden void echo(struct ccli *ccli, char ch)
 {
-	write(ccli->out, &ch, 1);
+	echo_str_len(ccli, &ch, 1);
 }
 
 __hidden int echo_str(struct ccli *ccli, char *str)
 {
-	return write(ccli->out, str, strlen(str));
+	int len = strlen(str);
+
+	if (ccli->capture)
+		return capture_add(ccli, ccli->capture, str, len);
+
+	if (paging(ccli))
+		return pager_add(ccli, str, len);
+
+	return write_out(ccli, str, len);
 }
 
 __hidden void echo_str_len(struct ccli *ccli, char *str, int len)
 {
-	write(ccli->out, str, len);
+	if (ccli->capture)
+		capture_add(ccli, ccli->capture, str, len);
+	else if (paging(ccli))
+		pager_add(ccli, str, len);
+	else
+		write_out(ccli, str, len);
 }
 
 __hidden void echo_prompt(struct ccli *ccli)
@@ -136,6 +199,211 @@ __hidden void clear_line(struct ccli *ccli, struct line_buf *line)
 		echo(ccli, ' ');
 }
 
+/*
+ * Other threads may call ccli_printf() and ccli_line_inject() while
+ * ccli_loop() is running. They can not write to the output themselves,
+ * as that would mix with what the loop is echoing, and they can not
+ * touch the line being edited. Instead, the output is pushed onto a
+ * lock-free stack, and an inject replaces the one pending request.
+ * Then the loop is woken up through the wakefd eventfd, and it writes
+ * out the output and injects the string itself.
+ */
+
+/* True if called from a thread other than the one running ccli_loop() */
+__hidden bool other_thread(struct ccli *ccli)
+{
+	return __atomic_load_n(&ccli->looping, __ATOMIC_SEQ_CST) &&
+		!pthread_equal(ccli->loop_thread, pthread_self());
+}
+
+static void wake_loop(struct ccli *ccli)
+{
+	uint64_t val = 1;
+
+	write(ccli->wakefd, &val, sizeof(val));
+}
+
+/* Write out what other threads printed, oldest first */
+__hidden void output_flush(struct ccli *ccli)
+{
+	struct output *list;
+	struct output *next;
+	struct output *rev = NULL;
+
+	if (!__atomic_load_n(&ccli->output, __ATOMIC_RELAXED))
+		return;
+
+	list = __atomic_exchange_n(&ccli->output, NULL, __ATOMIC_SEQ_CST);
+
+	/* The stack has the newest first */
+	for (; list; list = next) {
+		next = list->next;
+		list->next = rev;
+		rev = list;
+	}
+
+	for (; rev; rev = next) {
+		next = rev->next;
+		echo_str_len(ccli, rev->buf, rev->len);
+		mem_free(ccli, rev);
+	}
+}
+
+static void output_add(struct ccli *ccli, struct output *out)
+{
+	out->next = __atomic_load_n(&ccli->output, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&ccli->output, &out->next, out,
+					    true, __ATOMIC_SEQ_CST,
+					    __ATOMIC_RELAXED))
+		;
+
+	wake_loop(ccli);
+}
+
+static void output_push(struct ccli *ccli, struct output *out)
+{
+	output_add(ccli, out);
+
+	/* The loop may have exited before it could see it */
+	if (!__atomic_load_n(&ccli->looping, __ATOMIC_SEQ_CST))
+		output_flush(ccli);
+}
+
+static void output_free(struct ccli *ccli)
+{
+	struct output *next;
+	struct output *out;
+
+	for (out = ccli->output; out; out = next) {
+		next = out->next;
+		mem_free(ccli, out);
+	}
+	ccli->output = NULL;
+}
+
+static int inject_str(struct line_buf *line, const char *str, int pos)
+{
+	int ret = 0;
+	int i;
+
+	if (pos >= 0)
+		line->pos = pos > line->len ? line->len : pos;
+
+	for (i = 0; i < strlen(str); i++)
+		ret |= line_insert(line, str[i]);
+
+	return ret;
+}
+
+static int inject_request(struct ccli *ccli, const char *str, int pos)
+{
+	struct inject *inject;
+	struct inject *old;
+	int len = strlen(str);
+
+	inject = mem_alloc(ccli, sizeof(*inject) + len + 1);
+	if (!inject)
+		return -1;
+
+	inject->pos = pos;
+	memcpy(inject->str, str, len + 1);
+
+	/* A request that the loop did not get to yet is replaced */
+	old = __atomic_exchange_n(&ccli->inject, inject, __ATOMIC_ACQ_REL);
+	mem_free(ccli, old);
+
+	wake_loop(ccli);
+	return 0;
+}
+
+/* Do what other threads asked for while the loop waits at the prompt */
+static void handle_requests(struct ccli *ccli)
+{
+	struct line_buf *line = ccli->line;
+	struct inject *inject = NULL;
+	bool output;
+
+	output = __atomic_load_n(&ccli->output, __ATOMIC_RELAXED) != NULL;
+	if (__atomic_load_n(&ccli->inject, __ATOMIC_RELAXED))
+		inject = __atomic_exchange_n(&ccli->inject, NULL, __ATOMIC_ACQUIRE);
+
+	if (!output && !inject)
+		return;
+
+	/* Print the output where the line is, and then show the line again */
+	if (output) {
+		clear_line(ccli, line);
+		echo(ccli, '\r');
+		output_flush(ccli);
+	}
+
+	if (inject) {
+		inject_str(line, inject->str, inject->pos);
+		mem_free(ccli, inject);
+	}
+
+	line_refresh(ccli, line, 0);
+}
+
+/*
+ * Wait for input, while handling signals and the requests of other
+ * threads. Returns 0 when there is input to read, 1 if a signal
+ * callback asked to exit, 2 if the pager has to redraw for a new
+ * window size, and -1 on error.
+ */
+static int wait_input(struct ccli *ccli)
+{
+	struct pollfd fds[4];
+	uint64_t val;
+	int nr;
+	int ret;
+
+	for (;;) {
+		if (ccli->at_prompt)
+			handle_requests(ccli);
+		else
+			output_flush(ccli);
+
+		fds[0].fd = ccli->in;
+		fds[0].events = POLLIN;
+		fds[1].fd = ccli->wakefd;
+		fds[1].events = POLLIN;
+		fds[2].fd = ccli->sigfd;
+		fds[2].events = POLLIN;
+		fds[3].fd = metrics_fd(ccli);
+		fds[3].events = POLLIN;
+		/* poll() skips the negative ones */
+		nr = fds[3].fd >= 0 ? 4 : ccli->sigfd >= 0 ? 3 : 2;
+
+		ret = poll(fds, nr, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (nr > 2 && (fds[2].revents & POLLIN)) {
+			if (signal_handle(ccli))
+				return 1;
+			if (view_resized(ccli))
+				return 2;
+		}
+
+		if (nr > 3 && (fds[3].revents & POLLIN))
+			metrics_handle(ccli);
+
+		/* Handle the requests before reading more input */
+		if (fds[1].revents & POLLIN) {
+			read(ccli->wakefd, &val, sizeof(val));
+			continue;
+		}
+
+		/* Let read() report hang ups and errors */
+		if (fds[0].revents)
+			return 0;
+	}
+}
+
 __hidden int read_char(struct ccli *ccli)
 {
 	bool bracket = false;
@@ -151,7 +419,11 @@ __hidden int read_char(struct ccli *ccli)
 			ch = ccli->read_buf[ccli->read_start];
 			inc_read_buf_start(ccli);
 		} else {
-			r = read(ccli->in, &ch, 1);
+			r = wait_input(ccli);
+			if (r)
+				return r > 1 ? CHAR_RESIZE :
+					r > 0 ? CHAR_EXIT : CHAR_ERROR;
+			r = read_in(ccli, &ch, 1);
 			if (r <= 0)
 				return CHAR_ERROR;
 		}
@@ -334,28 +606,45 @@ static int interrupt_default(struct ccli *ccli, const char *line,
 	return 1;
 }
 
-/**
- * ccli_alloc - Allocate a new ccli descriptor.
- * @prompt: The prompt to display (NULL for none)
- * @in: The input file descriptor.
- * @out: The output file descriptor.
- *
- * Allocates the comand line interface descriptor, taking
- * over control of the @in and @out file descriptors.
- *
- * Returns the allocated descriptor on success (must be freed with
- *   ccli_free(), and NULL on error.
- */
-struct ccli *ccli_alloc(const char *prompt, int in, int out)
+static struct ccli *alloc_ccli(const char *prompt, int in, int out,
+			       const struct ccli_allocator *allocator,
+			       const struct ccli_limits *limits)
 {
 	struct ccli *ccli;
+	int i;
 
-	ccli = calloc(1, sizeof(*ccli));
+	ccli = allocator->malloc(sizeof(*ccli), allocator->data);
 	if (!ccli)
 		return NULL;
 
+	memset(ccli, 0, sizeof(*ccli));
+
+	ccli->allocator = *allocator;
+	ccli->self_allocator = *allocator;
+
+	if (limits)
+		ccli->limits = *limits;
+
+	for (i = 0; i < CCLI_NR_POOLS; i++)
+		ccli->pools[i].ccli = ccli;
+
+	pthread_mutex_init(&ccli->cmd_lock, NULL);
+	pthread_mutex_init(&ccli->history_lock, NULL);
+	pthread_mutex_init(&ccli->out_lock, NULL);
+
+	ccli->sigfd = -1;
+	sigemptyset(&ccli->sigmask);
+	sigemptyset(&ccli->sigblocked);
+
+	ccli->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ccli->wakefd < 0)
+		goto free;
+
+	if (commands_init(ccli) < 0)
+		goto free;
+
 	if (prompt) {
-		ccli->prompt = strdup(prompt);
+		ccli->prompt = mem_strdup(ccli, prompt);
 		if (!ccli->prompt)
 			goto free;
 	}
@@ -374,10 +663,11 @@ struct ccli *ccli_alloc(const char *prompt, int in, int out)
 
 	ccli_console_acquire(ccli);
 
+	/* Nothing else can see the commands yet */
+	ccli->cmds->unknown.callback = unknown_default;
+	ccli->cmds->enter.callback = enter_default;
+	ccli->cmds->interrupt = interrupt_default;
 	ccli_register_command(ccli, "exit", exec_exit, NULL);
-	ccli->unknown.callback = unknown_default;
-	ccli->enter.callback = enter_default;
-	ccli->interrupt = interrupt_default;
 
 	return ccli;
 
@@ -386,6 +676,79 @@ struct ccli *ccli_alloc(const char *prompt, int in, int out)
 	return NULL;
 }
 
+/**
+ * ccli_alloc - Allocate a new ccli descriptor.
+ * @prompt: The prompt to display (NULL for none)
+ * @in: The input file descriptor.
+ * @out: The output file descriptor.
+ *
+ * Allocates the comand line interface descriptor, taking
+ * over control of the @in and @out file descriptors.
+ *
+ * Returns the allocated descriptor on success (must be freed with
+ *   ccli_free(), and NULL on error.
+ */
+struct ccli *ccli_alloc(const char *prompt, int in, int out)
+{
+	struct ccli_allocator allocator;
+
+	/* The descriptor gets its own copy of the global allocator */
+	get_global_allocator(&allocator);
+
+	return alloc_ccli(prompt, in, out, &allocator, NULL);
+}
+
+/**
+ * ccli_alloc_static - Allocate a ccli descriptor that never uses the heap
+ * @prompt: The prompt to display (NULL for none)
+ * @in: The input file descriptor.
+ * @out: The output file descriptor.
+ * @mem: The memory to use for everything the descriptor allocates
+ * @size: The size of @mem
+ * @limits: Limits on what the descriptor may hold (NULL for none)
+ *
+ * Like ccli_alloc(), but the descriptor itself and everything it
+ * allocates afterward comes out of @mem. Nothing is allocated from
+ * the heap. When @mem runs out, the operation that needed the memory
+ * fails with ENOMEM.
+ *
+ * The @limits bound how much of @mem can be used, so that running
+ * out of memory can be made impossible. A field that is zero has
+ * no limit.
+ *
+ *  line_max - The longest line that can be typed, or executed by
+ *             ccli_execute(). Going past it fails with E2BIG.
+ *  history_bytes - The most bytes of text kept in the history. The
+ *             oldest lines are dropped to make room for new ones.
+ *             A line longer than this is not added (ENOSPC).
+ *  commands_max - The most commands that can be registered, which
+ *             includes the builtin "exit" command (ENOSPC).
+ *  completions_max - The most words a completion list can hold.
+ *             Words added past it are dropped (ENOSPC).
+ *
+ * @mem must stay around until after ccli_free() is called on the
+ * returned descriptor.
+ *
+ * Returns the allocated descriptor on success (must be freed with
+ *   ccli_free(), and NULL on error.
+ */
+struct ccli *ccli_alloc_static(const char *prompt, int in, int out,
+			       void *mem, size_t size,
+			       const struct ccli_limits *limits)
+{
+	struct ccli_allocator allocator;
+
+	if (!mem) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (region_init(&allocator, mem, size) < 0)
+		return NULL;
+
+	return alloc_ccli(prompt, in, out, &allocator, limits);
+}
+
 /**
  * ccli_free - Free an allocated ccli descriptor.
  * @ccli: The descriptor to free.
@@ -394,25 +757,46 @@ struct ccli *ccli_alloc(const char *prompt, int in, int out)
  */
 void ccli_free(struct ccli *ccli)
 {
+	struct ccli_allocator *a;
 	int i;
 
 	if (!ccli)
 		return;
 
 	cleanup(ccli);
+	signal_cleanup(ccli);
+	watchdog_free(ccli);
+	metrics_free(ccli);
+	timings_free(ccli);
+	pager_free(ccli);
+	if (recording(ccli))
+		ccli_record_stop(ccli);
 
-	free(ccli->prompt);
+	mem_free(ccli, ccli->prompt);
 
-	for (i = 0; i < ccli->nr_commands; i++)
-		free(ccli->commands[i].cmd);
+	commands_free(ccli);
 
-	for (i = 0; i < ccli->history_size; i++)
-		free(ccli->history[i]);
-	free(ccli->history);
+	for (i = 0; i < ccli->history_size && i < ccli->history_max; i++)
+		mem_free(ccli, ccli->history[i]);
+	mem_free(ccli, ccli->history);
 
-	free(ccli->commands);
-	free(ccli->temp_line);
-	free(ccli);
+	mem_free(ccli, ccli->temp_line);
+	mem_free(ccli, ccli->shared_buf);
+
+	output_free(ccli);
+	mem_free(ccli, ccli->inject);
+	if (ccli->wakefd >= 0)
+		close(ccli->wakefd);
+
+	pthread_mutex_destroy(&ccli->cmd_lock);
+	pthread_mutex_destroy(&ccli->history_lock);
+	pthread_mutex_destroy(&ccli->out_lock);
+
+	for (i = 0; i < CCLI_NR_POOLS; i++)
+		pool_destroy(&ccli->pools[i]);
+
+	a = &ccli->self_allocator;
+	a->free(ccli, a->data);
 }
 
 /**
@@ -447,34 +831,117 @@ int ccli_out(struct ccli *ccli)
  *
  * Writes to the output descriptor of @ccli the content passed in.
  *
+ * This may be called from any thread. If another thread is running
+ * ccli_loop(), then the output is handed to the loop to write out
+ * above the line being entered, and this returns without waiting
+ * for it to be written.
+ *
  * Returns the number of characters written on success, and
  *   -1 on error.
  */
 int ccli_vprintf(struct ccli *ccli, const char *fmt, va_list ap)
 {
+	struct output *out = NULL;
 	va_list ap2;
-	char *buf = NULL;
 	int len;
 
 	va_copy(ap2, ap);
 	len = vsnprintf(NULL, 0, fmt, ap);
-
 	if (len > 0) {
-		buf = malloc(len + 1);
-		if (buf)
-			len = vsnprintf(buf, len + 1, fmt, ap2);
+		out = mem_alloc(ccli, sizeof(*out) + len + 1);
+		if (out)
+			len = vsnprintf(out->buf, len + 1, fmt, ap2);
 		else
 			len = -1;
 	}
 	va_end(ap2);
 
-	if (len > 0)
-		echo_str(ccli, buf);
-	free(buf);
+	if (len <= 0) {
+		mem_free(ccli, out);
+		return len;
+	}
+
+	out->len = len;
+
+	if (other_thread(ccli)) {
+		output_push(ccli, out);
+		return len;
+	}
+
+	/* Keep what other threads printed before this in order */
+	if (!ccli->capture)
+		output_flush(ccli);
+
+	echo_str_len(ccli, out->buf, len);
+	mem_free(ccli, out);
+
+	return len;
+}
+
+/* Write @str like ccli_printf() does, without formatting it */
+__hidden int print_str(struct ccli *ccli, const char *str, int len)
+{
+	struct output *out;
+
+	if (len <= 0)
+		return len;
+
+	if (other_thread(ccli)) {
+		out = mem_alloc(ccli, sizeof(*out) + len);
+		if (!out)
+			return -1;
+		memcpy(out->buf, str, len);
+		out->len = len;
+		output_push(ccli, out);
+		return len;
+	}
+
+	if (!ccli->capture)
+		output_flush(ccli);
+
+	echo_str_len(ccli, (char *)str, len);
+
+	return len;
+}
+
+/*
+ * Queue @str for the thread that executes commands to write, even if it
+ * is not running ccli_loop().
+ */
+static int queue_str(struct ccli *ccli, const char *str, int len)
+{
+	struct output *out;
+
+	out = mem_alloc(ccli, sizeof(*out) + len);
+	if (!out)
+		return -1;
+	memcpy(out->buf, str, len);
+	out->len = len;
+	output_add(ccli, out);
 
 	return len;
 }
 
+/*
+ * Write @str from another thread (the watchdog) right away, between two
+ * writes of the thread executing commands. If that thread is capturing
+ * or paging its output, or the pager is showing it, writing now would
+ * land in the wrong place, and @str is queued for it to write instead.
+ */
+__hidden int write_now(struct ccli *ccli, const char *str, int len)
+{
+	int ret;
+
+	pthread_mutex_lock(&ccli->out_lock);
+	if (ccli->capture || pager_active(ccli))
+		ret = queue_str(ccli, str, len);
+	else
+		ret = __write_out(ccli, str, len);
+	pthread_mutex_unlock(&ccli->out_lock);
+
+	return ret;
+}
+
 /**
  * ccli_printf - Write to the output descriptor of ccli
  * @ccli: The CLI descriptor to write to.
@@ -497,16 +964,116 @@ int ccli_printf(struct ccli *ccli, const char *fmt, ...)
 	return len;
 }
 
+#define NR_STATS	(sizeof(struct ccli_stats) / sizeof(unsigned long))
+
+/**
+ * ccli_stats - read the counters of a ccli descriptor
+ * @ccli: The CLI descriptor to read the counters of
+ * @stats: Where to store the counters
+ *
+ * Each descriptor counts the read() and write() calls it makes on its
+ * input and output along with the bytes they transferred, the times it
+ * redrew the line being entered, the allocations it made, and the
+ * completions and history searches that were done. This is cheap enough
+ * to always be on, and is meant to see what a change to how the line is
+ * drawn does on real terminals.
+ *
+ * This may be called from any thread, but the counters are not read
+ * all at once, and may be a little behind what another thread does.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_stats(struct ccli *ccli, struct ccli_stats *stats)
+{
+	unsigned long *src;
+	unsigned long *dst;
+	int i;
+
+	if (!ccli || !stats) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	src = (unsigned long *)&ccli->stats;
+	dst = (unsigned long *)stats;
+
+	for (i = 0; i < NR_STATS; i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/**
+ * ccli_stats_reset - zero the counters of a ccli descriptor
+ * @ccli: The CLI descriptor to zero the counters of
+ *
+ * Set all the counters that ccli_stats() reads back to zero.
+ */
+void ccli_stats_reset(struct ccli *ccli)
+{
+	unsigned long *cnt;
+	int i;
+
+	if (!ccli)
+		return;
+
+	cnt = (unsigned long *)&ccli->stats;
+
+	for (i = 0; i < NR_STATS; i++)
+		__atomic_store_n(&cnt[i], 0, __ATOMIC_RELAXED);
+}
+
+#ifndef CCLI_NO_PAGER
 __hidden char page_stop(struct ccli *ccli)
 {
 	char ans;
 
 	echo_str(ccli, "--Type <RET> for more, q to quit, c to continue without paging--");
-	read(ccli->in, &ans, 1);
+	read_in(ccli, &ans, 1);
 	echo(ccli, '\n');
 	return ans;
 }
 
+/*
+ * Stop at every window full of lines of ccli_page(). Returns the line
+ * count to continue with, or -1 if the user asked to quit.
+ */
+static int page_next(struct ccli *ccli, int line)
+{
+	struct winsize w;
+	int ret;
+
+	/* The pager of ccli_pager_start() does the paging */
+	if (paging(ccli))
+		return line;
+
+	if (line == 1 || !ccli->w_row) {
+		ret = ioctl(ccli->in, TIOCGWINSZ, &w);
+		if (ret < 0)
+			return 0;
+		ccli->w_row = w.ws_row;
+		if (line == 1)
+			return line;
+	}
+
+	if (!(line % ccli->w_row)) {
+		switch (page_stop(ccli)) {
+		case 'q':
+			return -1;
+		case 'c':
+			return 0;
+		}
+	}
+	return line;
+}
+#else
+/* Built with CCLI_NO_PAGER: ccli_page() never stops */
+static int page_next(struct ccli *ccli, int line)
+{
+	return line;
+}
+#endif
+
 __hidden bool check_for_ctrl_c(struct ccli *ccli)
 {
 	struct timeval tv;
@@ -518,7 +1085,7 @@ __hidden bool check_for_ctrl_c(struct ccli *ccli)
 	FD_ZERO(&rfds);
 	FD_SET(ccli->in, &rfds);
 	if (select(ccli->in + 1, &rfds, NULL, NULL, &tv) > 0) {
-		ret = read(ccli->in, &ch, 1);
+		ret = read_in(ccli, &ch, 1);
 		if (ret == 1) {
 			if (ch == 3)
 				return true;
@@ -545,7 +1112,9 @@ __hidden bool check_for_ctrl_c(struct ccli *ccli)
  * When @line matches the window size, the prompt will be displayed.
  * Note, the window size is only calculated when @line is zero.
  *
- * If @line is less than zero, no prompt will be displayed.
+ * If @line is less than zero, no prompt will be displayed. Nor is it
+ * between ccli_pager_start() and ccli_pager_stop(), as the pager does
+ * the paging.
  *
  * Return -1 on error (with ERRNO set) or if the user asks to quit.
  *         1 for another screen full.
@@ -554,46 +1123,20 @@ __hidden bool check_for_ctrl_c(struct ccli *ccli)
  */
 int ccli_page(struct ccli *ccli, int line, const char *fmt, ...)
 {
-	struct winsize w;
 	va_list ap;
-	char ans;
 	int len;
-	int ret;
 
 	switch (line) {
 	case 0:
 		if (check_for_ctrl_c(ccli))
 			return -1;
 		break;
-	case 1:
-		ret = ioctl(ccli->in, TIOCGWINSZ, &w);
-		if (ret < 0) {
-			line = 0;
-			break;
-		}
-		ccli->w_row = w.ws_row;
-		break;
 	default:
 		if (line < 0)
 			return line;
-		if (!ccli->w_row) {
-			ret = ioctl(ccli->in, TIOCGWINSZ, &w);
-			if (ret < 0) {
-				line = 0;
-				break;
-			}
-			ccli->w_row = w.ws_row;
-		}
-		if (!(line % ccli->w_row)) {
-			ans = page_stop(ccli);
-			switch (ans) {
-			case 'q':
-				return -1;
-			case 'c':
-				line = 0;
-				break;
-			}
-		}
+		line = page_next(ccli, line);
+		if (line < 0)
+			return -1;
 	}
 
 	va_start(ap, fmt);
@@ -631,28 +1174,30 @@ void ccli_line_clear(struct ccli *ccli)
  * of line->pos. If @pos is greater than the length of line->line,
  * then it will simply append the string to the line.
  *
+ * This may be called from another thread while ccli_loop() is running.
+ * Then the loop is asked to inject @str the next time it waits for
+ * input at the prompt, and the line is redisplayed with it. If the
+ * loop has not gotten to an earlier request yet, that request is
+ * replaced by this one.
+ *
  * Returns 0 on success or -1 on failure.
  */
 int ccli_line_inject(struct ccli *ccli, const char *str, int pos)
 {
-	struct line_buf *line;
-	int ret = 0;
-	int i;
-
-	if (!ccli || !ccli->line || !str) {
+	if (!ccli || !str) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	line = ccli->line;
+	if (other_thread(ccli))
+		return inject_request(ccli, str, pos);
 
-	if (pos >= 0)
-		line->pos = pos > line->len ? line->len : pos;
-
-	for (i = 0; i < strlen(str); i++)
-		ret |= line_insert(line, str[i]);
+	if (!ccli->line) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	return ret;
+	return inject_str(ccli->line, str, pos);
 }
 
 /**
@@ -678,26 +1223,38 @@ void ccli_line_refresh(struct ccli *ccli)
  * This reads the input descriptor of @ccli and lets the user
  * execute shell like commands on the command line.
  *
+ * While the loop runs, other threads may register and unregister
+ * commands, print with ccli_printf() and inject into the line with
+ * ccli_line_inject().
+ *
  * Returns 0 on success (when one of the commands exits the loop)
  *  or -1 on error.
  */
 int ccli_loop(struct ccli *ccli)
 {
+	struct command_table *cmds;
 	struct line_buf line;
+	ccli_interrupt interrupt;
+	void *data;
 	char ch;
 	int tab = 0;
 	int ret = 0;
 	int pad;
 
-	if (line_init(&line))
+	if (line_init(&line, &ccli->pools[CCLI_POOL_LINE]))
 		return -1;
 
 	ccli->line = &line;
+	ccli->loop_thread = pthread_self();
+	__atomic_store_n(&ccli->looping, true, __ATOMIC_SEQ_CST);
 
+	record_env_start(ccli);
 	echo_prompt(ccli);
 
 	while (!ret) {
+		ccli->at_prompt = true;
 		ch = read_char(ccli);
+		ccli->at_prompt = false;
 		if (ch == CHAR_ERROR)
 			break;
 
@@ -723,8 +1280,15 @@ int ccli_loop(struct ccli *ccli)
 			do_completion(ccli, &line, tab++);
 			break;
 		case CHAR_INTR:
-			ret = ccli->interrupt(ccli, line.line,
-					      line.pos, ccli->interrupt_data);
+			cmds = commands_get(ccli);
+			interrupt = cmds->interrupt;
+			data = cmds->interrupt_data;
+			commands_put(ccli);
+			ret = interrupt(ccli, line.line, line.pos, data);
+			break;
+		case CHAR_EXIT:
+			/* A signal callback asked to exit */
+			ret = 1;
 			break;
 		case CHAR_REVERSE:
 			clear_line(ccli, &line);
@@ -735,12 +1299,16 @@ int ccli_loop(struct ccli *ccli)
 				goto again;
 			break;
 		case CHAR_BACKSPACE:
+			if (line.pos == line.start)
+				break;
 			line_backspace(&line);
-			line_refresh(ccli, &line, 0);
+			line_refresh_tail(ccli, &line, line.pos, 1, 1);
 			break;
 		case CHAR_DEL:
+			if (line.pos == line.len)
+				break;
 			line_del(&line);
-			line_refresh(ccli, &line, 0);
+			line_refresh_tail(ccli, &line, line.pos, 0, 1);
 			break;
 		case CHAR_DELWORD:
 			pad = line_del_word(&line);
@@ -794,15 +1362,25 @@ int ccli_loop(struct ccli *ccli)
 			/* Todo */
 			break;
 		default:
-			if (ch == CHAR_NEWLINE || isprint(ch)) {
+			if (ch == CHAR_NEWLINE) {
 				line_insert(&line, ch);
 				line_refresh(ccli, &line, 0);
 				break;
 			}
+			if (isprint(ch)) {
+				if (!line_insert(&line, ch))
+					line_refresh_tail(ccli, &line, line.pos - 1, 0, 0);
+				break;
+			}
 			dprint("unknown char '%d'\n", ch);
 		}
 	}
 
+	__atomic_store_n(&ccli->looping, false, __ATOMIC_SEQ_CST);
+	output_flush(ccli);
+	record_env_stop(ccli);
+	mem_free(ccli, __atomic_exchange_n(&ccli->inject, NULL, __ATOMIC_ACQUIRE));
+
 	line_cleanup(&line);
 	ccli->line = NULL;
 	return 0;
@@ -4,15 +4,152 @@
  *
  * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
  */
+#include <stddef.h>
+
 #include "ccli-local.h"
 
-__hidden struct command *find_command(struct ccli *ccli, const char *cmd)
+/*
+ * The commands, along with the other registered callbacks, are kept in
+ * a table that is never modified once it is published in ccli->cmds.
+ * Registering a command makes a copy of the table with the change and
+ * swaps it in. That way ccli_loop() never has to take a lock to look up
+ * a command, and other threads can register and unregister commands
+ * while it runs. The writers are serialized by cmd_lock.
+ *
+ * A table that was swapped out may still be in use by a reader, so it
+ * is put on the retired list, and freed once there are no readers. A
+ * reader increments cmd_readers before reading ccli->cmds, and a writer
+ * reads cmd_readers after swapping ccli->cmds. Both are sequentially
+ * consistent, so when a writer sees no readers, any reader that comes
+ * after it will see the new table.
+ */
+
+static inline size_t table_size(int nr)
+{
+	return sizeof(struct command_table) + sizeof(struct command) * nr;
+}
+
+/* Free the retired tables if nothing is reading them (under cmd_lock) */
+__hidden void commands_reclaim(struct ccli *ccli)
+{
+	struct command_table *cmds;
+
+	if (__atomic_load_n(&ccli->cmd_readers, __ATOMIC_SEQ_CST))
+		return;
+
+	while ((cmds = ccli->retired)) {
+		__atomic_store_n(&ccli->retired, cmds->next, __ATOMIC_RELAXED);
+		mem_free(ccli, cmds->dead);
+		mem_free(ccli, cmds);
+	}
+}
+
+/**
+ * commands_get - get the current command table to read
+ * @ccli: The CLI descriptor to get the commands of
+ *
+ * The table is valid until commands_put() is called. Nothing may
+ * wait on another thread while holding it.
+ */
+__hidden struct command_table *commands_get(struct ccli *ccli)
+{
+	__atomic_fetch_add(&ccli->cmd_readers, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ccli->cmds, __ATOMIC_SEQ_CST);
+}
+
+__hidden void commands_put(struct ccli *ccli)
+{
+	if (__atomic_sub_fetch(&ccli->cmd_readers, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	/* The last reader out frees what the writers could not */
+	if (__atomic_load_n(&ccli->retired, __ATOMIC_RELAXED) &&
+	    !pthread_mutex_trylock(&ccli->cmd_lock)) {
+		commands_reclaim(ccli);
+		pthread_mutex_unlock(&ccli->cmd_lock);
+	}
+}
+
+/**
+ * commands_copy - copy the current command table (under cmd_lock)
+ * @ccli: The CLI descriptor to copy the commands of
+ * @extra: The number of commands to make room for
+ *
+ * The new commands past the end of the copy are left uninitialized.
+ *
+ * Returns the copy, or NULL on error.
+ */
+__hidden struct command_table *commands_copy(struct ccli *ccli, int extra)
+{
+	struct command_table *old = ccli->cmds;
+	struct command_table *cmds;
+	int nr = old ? old->nr_commands : 0;
+
+	cmds = mem_alloc(ccli, table_size(nr + extra));
+	if (!cmds)
+		return NULL;
+
+	if (old)
+		memcpy(cmds, old, table_size(nr));
+	else
+		memset(cmds, 0, sizeof(*cmds));
+
+	cmds->next = NULL;
+	cmds->dead = NULL;
+
+	return cmds;
+}
+
+/**
+ * commands_publish - replace the command table (under cmd_lock)
+ * @ccli: The CLI descriptor to set the commands of
+ * @cmds: The table to use from now on
+ * @dead: A command name that is no longer used by @cmds, to free with the old one
+ */
+__hidden void commands_publish(struct ccli *ccli, struct command_table *cmds,
+			       char *dead)
 {
+	struct command_table *old;
+
+	old = __atomic_exchange_n(&ccli->cmds, cmds, __ATOMIC_SEQ_CST);
+	if (old) {
+		old->dead = dead;
+		old->next = ccli->retired;
+		__atomic_store_n(&ccli->retired, old, __ATOMIC_RELAXED);
+	}
+
+	commands_reclaim(ccli);
+}
+
+__hidden int commands_init(struct ccli *ccli)
+{
+	ccli->cmds = commands_copy(ccli, 0);
+	return ccli->cmds ? 0 : -1;
+}
+
+/* Only called when nothing else can be using @ccli */
+__hidden void commands_free(struct ccli *ccli)
+{
+	struct command_table *cmds = ccli->cmds;
 	int i;
 
-	for (i = 0; i < ccli->nr_commands; i++) {
-		if (strcmp(cmd, ccli->commands[i].cmd) == 0)
-			return &ccli->commands[i];
+	if (cmds) {
+		for (i = 0; i < cmds->nr_commands; i++)
+			mem_free(ccli, cmds->commands[i].cmd);
+		mem_free(ccli, cmds);
+		ccli->cmds = NULL;
+	}
+
+	commands_reclaim(ccli);
+}
+
+__hidden struct command *find_command(struct command_table *cmds, const char *cmd)
+{
+	int i;
+
+	for (i = 0; i < cmds->nr_commands; i++) {
+		if (strcmp(cmd, cmds->commands[i].cmd) == 0)
+			return &cmds->commands[i];
 	}
 
 	return NULL;
@@ -25,34 +162,49 @@ __hidden struct command *find_command(struct ccli *ccli, const char *cmd)
  *
  * Removes the registered command named @command_name from @ccli.
  *
+ * This may be called from any thread, even while another thread is
+ * running ccli_loop().
+ *
  * Returns 0 on successful removal, or -1 on error or @command_name not found.
  *   ERRNO will only be set for error and will not be touched if the
  *  @command_name was not found.
  */
 int ccli_unregister_command(struct ccli *ccli, const char *command_name)
 {
-	struct command *commands;
+	struct command_table *cmds;
+	struct command *cmd;
+	int ret = -1;
 	int cnt;
+	int i;
 
 	if (!ccli || !command_name) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	commands = find_command(ccli, command_name);
-	if (!commands)
-		return -1;
+	pthread_mutex_lock(&ccli->cmd_lock);
 
-	free(commands->cmd);
+	cmd = find_command(ccli->cmds, command_name);
+	if (!cmd)
+		goto out;
 
-	cnt = (ccli->nr_commands - (commands - ccli->commands)) - 1;
-	if (cnt)
-		memmove(commands, commands + 1, cnt * sizeof(*commands));
-	ccli->nr_commands--;
-	commands = &ccli->commands[ccli->nr_commands];
-	memset(commands, 0, sizeof(*commands));
+	cmds = commands_copy(ccli, 0);
+	if (!cmds)
+		goto out;
 
-	return 0;
+	i = cmd - ccli->cmds->commands;
+	cnt = (cmds->nr_commands - i) - 1;
+	if (cnt)
+		memmove(&cmds->commands[i], &cmds->commands[i + 1],
+			cnt * sizeof(*cmd));
+	cmds->nr_commands--;
+
+	/* Readers of the old table may still be looking at the name */
+	commands_publish(ccli, cmds, cmd->cmd);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&ccli->cmd_lock);
+	return ret;
 }
 
 /**
@@ -66,47 +218,88 @@ int ccli_unregister_command(struct ccli *ccli, const char *command_name)
  * that command, it will trigger the @callback which will be passed
  * the arguments that the user typed, along with the @data pointer.
  *
+ * This may be called from any thread, even while another thread is
+ * running ccli_loop(). A command that is already executing when it
+ * is replaced finishes with the @callback and @data it started with.
+ *
  * Returns 0 on success and -1 on error.
  */
 int ccli_register_command(struct ccli *ccli, const char *command_name,
 			  ccli_command_callback callback, void *data)
 {
-	struct command *commands;
-	char *cmd;
+	struct command_table *cmds;
+	struct command *old;
+	struct command *cmd;
+	char *name = NULL;
+	int ret = -1;
 
 	if (!ccli || !command_name || !callback) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	commands = find_command(ccli, command_name);
-	if (commands) {
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	old = find_command(ccli->cmds, command_name);
+	if (!old) {
+		if (ccli->limits.commands_max &&
+		    ccli->cmds->nr_commands >= ccli->limits.commands_max) {
+			errno = ENOSPC;
+			goto out;
+		}
+
+		name = mem_strdup(ccli, command_name);
+		if (!name)
+			goto out;
+	}
+
+	cmds = commands_copy(ccli, old ? 0 : 1);
+	if (!cmds) {
+		mem_free(ccli, name);
+		goto out;
+	}
+
+	if (old) {
 		/* override it with this one */
-		commands->callback = callback;
-		commands->data = data;
-		return 0;
+		cmd = &cmds->commands[old - ccli->cmds->commands];
+	} else {
+		cmd = &cmds->commands[cmds->nr_commands++];
+		memset(cmd, 0, sizeof(*cmd));
+		cmd->cmd = name;
 	}
 
-	cmd = strdup(command_name);
-	if (!cmd)
-		return -1;
+	cmd->callback = callback;
+	cmd->data = data;
 
-	commands = realloc(ccli->commands,
-			   sizeof(*commands) * (ccli->nr_commands + 1));
-	if (!commands) {
-		free(cmd);
+	commands_publish(ccli, cmds, NULL);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&ccli->cmd_lock);
+	return ret;
+}
+
+/* Replace one of the special callbacks held in the command table */
+static int register_special(struct ccli *ccli, size_t offset,
+			    ccli_command_callback callback, void *data)
+{
+	struct command_table *cmds;
+	struct command *cmd;
+
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	cmds = commands_copy(ccli, 0);
+	if (!cmds) {
+		pthread_mutex_unlock(&ccli->cmd_lock);
 		return -1;
 	}
 
-	memset(&commands[ccli->nr_commands], 0, sizeof(commands[0]));
+	cmd = (void *)cmds + offset;
+	cmd->callback = callback;
+	cmd->data = data;
 
-	commands[ccli->nr_commands].cmd = cmd;
-	commands[ccli->nr_commands].callback = callback;
-	commands[ccli->nr_commands].data = data;
-
-	ccli->commands = commands;
-	ccli->nr_commands++;
+	commands_publish(ccli, cmds, NULL);
 
+	pthread_mutex_unlock(&ccli->cmd_lock);
 	return 0;
 }
 
@@ -130,10 +323,8 @@ int ccli_register_default(struct ccli *ccli,
 		return -1;
 	}
 
-	ccli->enter.callback = callback;
-	ccli->enter.data = data;
-
-	return 0;
+	return register_special(ccli, offsetof(struct command_table, enter),
+				callback, data);
 }
 
 /**
@@ -156,10 +347,8 @@ int ccli_register_unknown(struct ccli *ccli,
 		return -1;
 	}
 
-	ccli->unknown.callback = callback;
-	ccli->unknown.data = data;
-
-	return 0;
+	return register_special(ccli, offsetof(struct command_table, unknown),
+				callback, data);
 }
 
 /**
@@ -178,47 +367,84 @@ int ccli_register_unknown(struct ccli *ccli,
 int ccli_register_interrupt(struct ccli *ccli, ccli_interrupt callback,
 			    void *data)
 {
+	struct command_table *cmds;
+
 	if (!ccli || !callback) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	ccli->interrupt = callback;
-	ccli->interrupt_data = data;
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	cmds = commands_copy(ccli, 0);
+	if (!cmds) {
+		pthread_mutex_unlock(&ccli->cmd_lock);
+		return -1;
+	}
+
+	cmds->interrupt = callback;
+	cmds->interrupt_data = data;
+	commands_publish(ccli, cmds, NULL);
+
+	pthread_mutex_unlock(&ccli->cmd_lock);
 	return 0;
 }
 
 __hidden int execute(struct ccli *ccli, const char *line, bool hist)
 {
-	struct command *cmd;
+	struct watchdog_save save;
+	struct timing_save tsave;
+	struct command_table *cmds;
+	struct command *found = NULL;
+	struct command cmd;
+	bool armed;
 	char **argv;
 	int argc;
 	int ret = 0;
 
-	argc = line_parse(line, &argv);
+	argc = line_parse(ccli, line, &argv);
 	if (argc < 0) {
 		echo_str(ccli, "Error parsing command\n");
 		return 0;
 	}
 
-	if (!argc)
-		return ccli->enter.callback(ccli, "", line,
-					    ccli->enter.data,
-					    0, NULL);
-
-	cmd = find_command(ccli, argv[0]);
-
-	if (cmd) {
-		ret = cmd->callback(ccli, cmd->cmd,
-				    line, cmd->data,
-				    argc, argv);
+	/*
+	 * The command is copied out of the table, as the table is not
+	 * held while the command executes. The name passed to it is
+	 * argv[0] which is the same string.
+	 */
+	cmds = commands_get(ccli);
+	if (!argc) {
+		cmd = cmds->enter;
 	} else {
-		ret = ccli->unknown.callback(ccli, argv[0], line,
-					     ccli->unknown.data,
-					     argc, argv);
+		found = find_command(cmds, argv[0]);
+		cmd = found ? *found : cmds->unknown;
+	}
+	commands_put(ccli);
+
+	if (!argc) {
+		line_argv_free(ccli, argv);
+		trace_probe(command__start, "", 0);
+		armed = watchdog_arm(ccli, "", cmd.timeout, &save);
+		ret = cmd.callback(ccli, "", line, cmd.data, 0, NULL);
+		if (armed)
+			watchdog_disarm(ccli, &save);
+		trace_probe(command__end, "", ret);
+		return ret;
 	}
 
-	free_argv(argc, argv);
+	trace_probe(command__start, argv[0], argc);
+	if (ccli->timings)
+		timing_start(ccli, &tsave);
+	armed = watchdog_arm(ccli, argv[0], cmd.timeout, &save);
+	ret = cmd.callback(ccli, argv[0], line, cmd.data, argc, argv);
+	if (armed)
+		watchdog_disarm(ccli, &save);
+	if (ccli->timings)
+		timing_end(ccli, found ? argv[0] : NULL, &tsave);
+	trace_probe(command__end, argv[0], ret);
+
+	line_argv_free(ccli, argv);
 
 	if (hist)
 		history_add(ccli, line);
@@ -240,6 +466,9 @@ __hidden int execute(struct ccli *ccli, const char *line, bool hist)
  * If @hist is true, then the command is added to the history,
  * otherwise it is not.
  *
+ * This must not be called while another thread is running ccli_loop()
+ * on @ccli, as the command would be executed on that loop's line.
+ *
  * Returns whatever the command being executed would return.
  *  If a memory allocation happens, -1 is returned and ERRNO is set.
  */
@@ -249,7 +478,7 @@ int ccli_execute(struct ccli *ccli, const char *line_str, bool hist)
 	struct line_buf line;
 	int ret;
 
-	ret = line_init_str(&line, line_str);
+	ret = line_init_str(&line, line_str, &ccli->pools[CCLI_POOL_LINE]);
 	if (ret < 0)
 		return ret;
 
@@ -23,21 +23,33 @@
 int ccli_register_completion(struct ccli *ccli, const char *command_name,
 			     ccli_completion completion)
 {
+	struct command_table *cmds;
 	struct command *cmd;
+	int ret = -1;
 
 	if (!ccli || !command_name || !completion) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	cmd = find_command(ccli, command_name);
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	cmd = find_command(ccli->cmds, command_name);
 	if (!cmd) {
 		errno = ENODEV;
-		return -1;
+		goto out;
 	}
 
-	cmd->completion = completion;
-	return 0;
+	cmds = commands_copy(ccli, 0);
+	if (!cmds)
+		goto out;
+
+	cmds->commands[cmd - ccli->cmds->commands].completion = completion;
+	commands_publish(ccli, cmds, NULL);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&ccli->cmd_lock);
+	return ret;
 }
 
 /**
@@ -54,29 +66,63 @@ int ccli_register_completion(struct ccli *ccli, const char *command_name,
 int ccli_register_default_completion(struct ccli *ccli, ccli_completion completion,
 				     void *data)
 {
-	ccli->default_completion = completion;
-	ccli->default_completion_data = data;
+	struct command_table *cmds;
+
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	cmds = commands_copy(ccli, 0);
+	if (!cmds) {
+		pthread_mutex_unlock(&ccli->cmd_lock);
+		return -1;
+	}
+
+	cmds->default_completion = completion;
+	cmds->default_completion_data = data;
+	commands_publish(ccli, cmds, NULL);
+
+	pthread_mutex_unlock(&ccli->cmd_lock);
 	return 0;
 }
 
+/* If @str starts with @match, that is @mlen long */
+static inline bool has_prefix(const char *str, const char *match, int mlen)
+{
+	return str_prefix(str, match) == mlen;
+}
+
 static void print_completion_flat(struct ccli *ccli, const char *match,
 				  int len, int nr_str, char **strings, int index)
 {
 	int i;
 
 	for (i = 0; i < nr_str; i++) {
-		if (strncmp(match, strings[i], len) == 0) {
+		if (has_prefix(strings[i], match, len)) {
 			echo_str(ccli, strings[i] + index);
 			echo(ccli, '\n');
 		}
 	}
 }
 
+static void echo_spaces(struct ccli *ccli, int cnt)
+{
+	static const char spaces[] = "                                ";
+	int len;
+
+	for (; cnt > 0; cnt -= len) {
+		len = cnt < sizeof(spaces) - 1 ? cnt : sizeof(spaces) - 1;
+		echo_str_len(ccli, (char *)spaces, len);
+	}
+}
+
 static void print_completion(struct ccli *ccli, const char *match,
 			     int len, int nr_str, char **strings, int index)
 {
 	struct winsize w;
-	char *spaces;
 	char *str;
 	int max_len = 0;
 	int cols, rows;
@@ -97,7 +143,7 @@ static void print_completion(struct ccli *ccli, const char *match,
 	cols = w.ws_col;
 
 	for (i = 0, x = 0; i < nr_str; i++) {
-		if (strncmp(match, strings[i], len) == 0) {
+		if (has_prefix(strings[i], match, len)) {
 			if (strlen(strings[i]) > max_len)
 				max_len = strlen(strings[i]);
 			if (i != x) {
@@ -114,9 +160,6 @@ static void print_completion(struct ccli *ccli, const char *match,
 
 	max_len -= index;
 
-	spaces = malloc(max_len);
-	memset(spaces, ' ', max_len);
-
 	nr_str = x;
 
 	cols = cols / (max_len + 2);
@@ -150,42 +193,27 @@ static void print_completion(struct ccli *ccli, const char *match,
 			str = strings[x * rows + i];
 			str += index;
 			echo_str(ccli, str);
-			if (strlen(str) < max_len)
-				echo_str_len(ccli, spaces, max_len - strlen(str));
+			echo_spaces(ccli, max_len - strlen(str));
 		}
 		echo(ccli, '\n');
 	}
-	free(spaces);
 }
 
-/*
- * return the number of characters that match between @a and @b.
- */
-static int match_chars(const char *a, const char *b)
-{
-	int i;
-
-	for (i = 0; a[i] && b[i]; i++) {
-		if (a[i] != b[i])
-			break;
-	}
-	return i;
-}
 
 static int find_matches(const char *match, int mlen, char **list, int cnt,
 			int *last_match, int *max)
 {
 	int max_match = -1;
 	int matched = 0;
-	int i, x, l, m = -1;
+	int i, x, l = -1, m = -1;
 
 	for (i = 0; i < cnt; i++) {
 		/* If list[i] failed to allocate, we need to handle that */
 		if (!list[i])
 			continue;
-		if (!mlen || strncmp(list[i], match, mlen) == 0) {
+		if (has_prefix(list[i], match, mlen)) {
 			if (m >= 0) {
-				x = match_chars(list[m], list[i]);
+				x = str_prefix(list[m], list[i]);
 				if (max_match < 0 || x < max_match)
 					max_match = x;
 			} else {
@@ -200,11 +228,100 @@ static int find_matches(const char *match, int mlen, char **list, int cnt,
 	return matched;
 }
 
-static int do_strcmp(const void *A, const void *B)
+/*
+ * The words of the list that do_completion() hands to the completion
+ * callbacks are copied into an arena instead of being allocated one
+ * at a time. The arena chunks come from the completion pool, so once
+ * the pool is warmed up, hitting tab does not need to allocate.
+ */
+struct arena_chunk {
+	struct arena_chunk	*next;
+	size_t			size;
+	size_t			used;
+	char			data[];
+};
+
+/* The first arena chunk, each new chunk doubles in size */
+#define ARENA_CHUNK	(BUFSIZ - sizeof(struct arena_chunk))
+
+static char *arena_alloc(struct ccli *ccli, size_t len)
+{
+	struct arena_chunk *chunk = ccli->comp_arena;
+	size_t size;
+	char *p;
+
+	if (!chunk || chunk->used + len > chunk->size) {
+		size = chunk ? chunk->size * 2 : ARENA_CHUNK;
+		while (size < len)
+			size *= 2;
+		chunk = pool_alloc(&ccli->pools[CCLI_POOL_COMPLETION],
+				   sizeof(*chunk) + size);
+		if (!chunk)
+			return NULL;
+		/* The pool may have given us more than we asked for */
+		chunk->size = pool_size(chunk) - sizeof(*chunk);
+		chunk->used = 0;
+		chunk->next = ccli->comp_arena;
+		ccli->comp_arena = chunk;
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += len;
+	return p;
+}
+
+static bool arena_owns(struct ccli *ccli, const char *word)
 {
-	char * const *a = A;
-	char * const *b = B;
+	struct arena_chunk *chunk;
 
+	for (chunk = ccli->comp_arena; chunk; chunk = chunk->next) {
+		if (word >= chunk->data && word < chunk->data + chunk->size)
+			return true;
+	}
+	return false;
+}
+
+static void arena_release(struct ccli *ccli)
+{
+	struct arena_chunk *chunk;
+
+	while (ccli->comp_arena) {
+		chunk = ccli->comp_arena;
+		ccli->comp_arena = chunk->next;
+		pool_free(&ccli->pools[CCLI_POOL_COMPLETION], chunk);
+	}
+}
+
+/* Is @list the list that do_completion() allocated from the pool? */
+static bool is_comp_list(struct ccli *ccli, char **list)
+{
+	return ccli && list && list == ccli->comp_list;
+}
+
+static char *list_strdup(struct ccli *ccli, char **list, const char *word)
+{
+	char *str;
+	int len;
+
+	if (!is_comp_list(ccli, list))
+		return mem_strdup(ccli, word);
+
+	len = strlen(word) + 1;
+	str = arena_alloc(ccli, len);
+	if (str)
+		memcpy(str, word, len);
+	return str;
+}
+
+static void list_word_free(struct ccli *ccli, char *word)
+{
+	if (ccli && arena_owns(ccli, word))
+		return;
+	mem_free(ccli, word);
+}
+
+static int do_strcmp(char * const *a, char * const *b)
+{
 	/* Handle NULLs (they go at the end) */
 	if (!*a || !*b) {
 		if (*a)
@@ -215,12 +332,53 @@ static int do_strcmp(const void *A, const void *B)
 	return strcmp(*a, *b);
 }
 
-static int sort_unique(char **list, int cnt)
+static void swap_words(char **list, int a, int b)
+{
+	char *tmp = list[a];
+
+	list[a] = list[b];
+	list[b] = tmp;
+}
+
+static void sift_down(char **list, int start, int cnt)
+{
+	int child;
+
+	while ((child = start * 2 + 1) < cnt) {
+		if (child + 1 < cnt &&
+		    do_strcmp(&list[child], &list[child + 1]) < 0)
+			child++;
+		if (do_strcmp(&list[start], &list[child]) >= 0)
+			break;
+		swap_words(list, start, child);
+		start = child;
+	}
+}
+
+/*
+ * qsort() may allocate memory for a merge sort, and completions must
+ * work without the heap (see ccli_alloc_static()). Use a heap sort,
+ * as that is done in place.
+ */
+static void sort_words(char **list, int cnt)
+{
+	int i;
+
+	for (i = cnt / 2 - 1; i >= 0; i--)
+		sift_down(list, i, cnt);
+
+	for (i = cnt - 1; i > 0; i--) {
+		swap_words(list, 0, i);
+		sift_down(list, 0, i);
+	}
+}
+
+static int sort_unique(struct ccli *ccli, char **list, int cnt)
 {
 	int l;
 	int i;
 
-	qsort(list, cnt, sizeof(char *), do_strcmp);
+	sort_words(list, cnt);
 
 	for (l = 0, i = 0; i < cnt && list[i]; i++) {
 		if (!i)
@@ -228,7 +386,7 @@ static int sort_unique(char **list, int cnt)
 		if (strcmp(list[l], list[i]) != 0) {
 			l++;
 			if (l != i) {
-				free(list[l]);
+				list_word_free(ccli, list[l]);
 				list[l] = list[i];
 				list[i] = NULL;
 			}
@@ -239,7 +397,7 @@ static int sort_unique(char **list, int cnt)
 		l++;
 
 	for (i = l; i < cnt; i++) {
-		free(list[i]);
+		list_word_free(ccli, list[i]);
 		list[i] = NULL;
 	}
 
@@ -255,19 +413,48 @@ static void insert_word(struct ccli *ccli, struct line_buf *line,
 		line_insert(line, word[i]);
 }
 
-/* Allocate new lists in 64 word blocks */
+/*
+ * Lists start with 64 words and double each time they fill up, so that
+ * a long list is only reallocated (and copied) a few times.
+ */
 #define LIST_BLK	64
-#define LIST_MASK	(LIST_BLK - 1)
 
-static char **update_list(char ***list, int size)
+static inline bool list_full(int size)
 {
+	return !size || (size >= LIST_BLK && !(size & (size - 1)));
+}
+
+static char **update_list(struct ccli *ccli, char ***list, int size)
+{
+	struct pool *pool;
 	char **words = *list;
 
-	if (!(size & LIST_MASK)) {
-		/* (size + 1 + LIST_BLK - 1) & ~(LIST_MASK) */
-		size = (size + LIST_BLK) & ~(LIST_MASK);
-		/* Add two to be on the safe side */
-		words = realloc(words, sizeof(*words) * (size + 2));
+	if (ccli && ccli->limits.completions_max &&
+	    size >= ccli->limits.completions_max) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	if (list_full(size)) {
+		size = size ? size * 2 : LIST_BLK;
+
+		/*
+		 * The first list created while doing a completion
+		 * comes from the completion pool.
+		 */
+		if (ccli && ccli->in_completion && !words && !ccli->comp_list) {
+			pool = &ccli->pools[CCLI_POOL_COMPLETION];
+			words = pool_alloc(pool, sizeof(*words) * (size + 2));
+			ccli->comp_list = words;
+		} else if (is_comp_list(ccli, words)) {
+			pool = &ccli->pools[CCLI_POOL_COMPLETION];
+			words = pool_realloc(pool, words, sizeof(*words) * (size + 2));
+			if (words)
+				ccli->comp_list = words;
+		} else {
+			/* Add two to be on the safe side */
+			words = mem_realloc(ccli, words, sizeof(*words) * (size + 2));
+		}
 		if (!words)
 			return NULL;
 		*list = words;
@@ -286,6 +473,10 @@ static char **update_list(char ***list, int size)
  * @word. If it fails the allocation of the copy, it will continue as
  * the list can handle NULL entries.
  *
+ * When adding to the list passed to a completion callback, the copy
+ * comes from the completion pool of @ccli, and must only be freed
+ * with ccli_list_free().
+ *
  * The @cnt must be initialized to zero, and not touched by the application.
  * The only modifications to @cnt should be done by one of the list
  * helper functions.
@@ -300,11 +491,11 @@ int ccli_list_add(struct ccli *ccli, char ***list, int *cnt, const char *word)
 	char **words;
 	int size = *cnt;
 
-	words = update_list(list, size);
+	words = update_list(ccli, list, size);
 	if (!words)
 		return -1;
 
-	words[size] = strdup(word);
+	words[size] = list_strdup(ccli, words, word);
 	/* It's OK if it fails, we can handle it. */
 
 	*cnt = size + 1;
@@ -323,7 +514,8 @@ int ccli_list_add(struct ccli *ccli, char ***list, int *cnt, const char *word)
  * ccli_list_add() will allocate a copy of @word, where this will use
  * @word itself to add to the list.
  *
- * Note, @word will be freed when the list is freed.
+ * Note, @word will be freed when the list is freed. If an allocator was
+ * set with ccli_set_allocator(), then @word must come from it.
  *
  * The @cnt must be initialized to zero, and not touched by the application.
  * The only modifications to @cnt should be done by one of the list
@@ -337,7 +529,7 @@ int ccli_list_insert(struct ccli *ccli, char ***list, int *cnt, char *word)
 	char **words;
 	int size = *cnt;
 
-	words = update_list(list, size);
+	words = update_list(ccli, list, size);
 	if (!words)
 		return -1;
 
@@ -370,14 +562,29 @@ int ccli_list_add_printf(struct ccli *ccli, char ***list, int *cnt, const char *
 {
 	va_list ap;
 	char **words;
+	char *str;
 	int size = *cnt;
+	int len;
 
-	words = update_list(list, size);
+	words = update_list(ccli, list, size);
 	if (!words)
 		return -1;
 
 	va_start(ap, fmt);
-	vasprintf(words + size, fmt, ap);
+	if (is_comp_list(ccli, words)) {
+		va_list ap2;
+
+		va_copy(ap2, ap);
+		len = vsnprintf(NULL, 0, fmt, ap2);
+		va_end(ap2);
+		str = len >= 0 ? arena_alloc(ccli, len + 1) : NULL;
+		if (str)
+			vsnprintf(str, len + 1, fmt, ap);
+		words[size] = str;
+	} else {
+		mem_vasprintf(ccli, &str, fmt, ap);
+		words[size] = str;
+	}
 	va_end(ap);
 	/* It's OK if it fails, we can handle it. */
 
@@ -402,13 +609,38 @@ void ccli_list_free(struct ccli *ccli, char ***list, int cnt)
 		return;
 
 	for (i = 0; i < cnt; i++)
-		free(words[i]);
-	free(words);
+		list_word_free(ccli, words[i]);
+
+	if (is_comp_list(ccli, words)) {
+		pool_free(&ccli->pools[CCLI_POOL_COMPLETION], words);
+		ccli->comp_list = NULL;
+	} else {
+		mem_free(ccli, words);
+	}
 	*list = NULL;
 }
 
+static void release_list(struct ccli *ccli, char **list, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		list_word_free(ccli, list[i]);
+
+	if (is_comp_list(ccli, list))
+		list = NULL;
+	mem_free(ccli, list);
+
+	/* The callback may have replaced the list that came from the pool */
+	pool_free(&ccli->pools[CCLI_POOL_COMPLETION], ccli->comp_list);
+	ccli->comp_list = NULL;
+
+	arena_release(ccli);
+}
+
 __hidden void do_completion(struct ccli *ccli, struct line_buf *line, int tab)
 {
+	struct command_table *cmds;
 	struct command *cmd = NULL;
 	struct line_buf copy;
 	char **list = NULL;
@@ -417,7 +649,7 @@ __hidden void do_completion(struct ccli *ccli, struct line_buf *line, int tab)
 	char *match;
 	char delim;
 	int matched = 0;
-	int index;
+	int index = 0;
 	int word;
 	int argc;
 	int mlen;
@@ -428,14 +660,20 @@ __hidden void do_completion(struct ccli *ccli, struct line_buf *line, int tab)
 	int ret;
 	int i;
 
+	stat_add(ccli, completions, 1);
+
 	ret = line_copy(&copy, line, line->pos);
 	if (ret < 0)
 		return;
 
-	argc = line_parse(copy.line, &argv);
+	trace_probe(completion__start, copy.line);
+
+	argc = line_parse(ccli, copy.line, &argv);
 	if (argc < 0)
 		goto out;
 
+	ccli->in_completion = true;
+
 	word = argc - 1;
 
 	/* If the cursor is on a space, there's no word to match */
@@ -448,9 +686,11 @@ __hidden void do_completion(struct ccli *ccli, struct line_buf *line, int tab)
 
 	mlen = strlen(match);
 
+	cmds = commands_get(ccli);
+
 	/* Do the registered completions first */
 	if (word) {
-		cmd = find_command(ccli, argv[0]);
+		cmd = find_command(cmds, argv[0]);
 		if (cmd && cmd->completion)
 			cnt = cmd->completion(ccli, cmd->cmd, copy.line, word,
 					      match, &list, cmd->data);
@@ -460,10 +700,10 @@ __hidden void do_completion(struct ccli *ccli, struct line_buf *line, int tab)
 	 * Next do the default completion operation
 	 * if command completion was not done
 	 */
-	if ((!cmd || !cmd->completion) && ccli->default_completion)
-		cnt = ccli->default_completion(ccli, NULL, copy.line, word,
+	if ((!cmd || !cmd->completion) && cmds->default_completion)
+		cnt = cmds->default_completion(ccli, NULL, copy.line, word,
 					       match, &list,
-					       ccli->default_completion_data);
+					       cmds->default_completion_data);
 	delim = match[mlen];
 	match[mlen] = '\0';
 	if (!delim)
@@ -472,18 +712,30 @@ __hidden void do_completion(struct ccli *ccli, struct line_buf *line, int tab)
 	/* If nothing was matched yet */
 	if (cnt >= 0 && !word) {
 		/* Try matching with the list of commands */
-		for (i = 0; i < ccli->nr_commands; i++)
-			ccli_list_add(ccli, &list, &cnt, ccli->commands[i].cmd);
+		for (i = 0; i < cmds->nr_commands; i++) {
+			/* No need to add what will not match */
+			if (!has_prefix(cmds->commands[i].cmd, match, mlen))
+				continue;
+			ccli_list_add(ccli, &list, &cnt, cmds->commands[i].cmd);
+		}
 	}
 
-	if (cnt < 0)
-		goto free_args;
+	commands_put(ccli);
+
+	if (cnt < 0) {
+		cnt = 0;
+		goto free_list;
+	}
 
+#ifndef CCLI_NO_FILE_COMPLETION
 	index = ccli->display_index;
+#endif
 
-	cnt = sort_unique(list, cnt);
+	cnt = sort_unique(ccli, list, cnt);
 	matched = find_matches(match, mlen, list, cnt, &last, &max);
 
+	trace_probe(completion__end, cnt, matched);
+
 	if (matched == 1) {
 		len = strlen(list[last]);
 		insert_word(ccli, line, list[last] + mlen, len - mlen);
@@ -500,14 +752,14 @@ __hidden void do_completion(struct ccli *ccli, struct line_buf *line, int tab)
 	}
 	line_refresh(ccli, line, 0);
 
-	for (i = 0; i < cnt; i++)
-		free(list[i]);
-	free(list);
-
- free_args:
-	free_argv(argc, argv);
+ free_list:
+	release_list(ccli, list, cnt);
+	ccli->in_completion = false;
+	line_argv_free(ccli, argv);
  out:
+#ifndef CCLI_NO_FILE_COMPLETION
 	ccli->display_index = 0;
+#endif
 	line_cleanup(&copy);
 	line_refresh(ccli, ccli->line, 0);
 }
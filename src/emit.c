@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Output of records, as text for people or as JSON for scripts.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include "ccli-local.h"
+
+/*
+ * A command that emits its results as records with ccli_emit_kv() and
+ * ccli_emit_record() does not need to know who reads them. In the text
+ * mode they are "key: value" lines, and in the JSON mode each record is
+ * a JSON object on a line of its own. Either way, the record is built in
+ * a json_writer on the stack and written with one write.
+ */
+
+/* Values longer than this are formatted into an allocated buffer */
+#define EMIT_VALUE		256
+
+#define OUTPUT_USAGE	"usage: output [text|json]"
+
+static const char *mode_names[] = {
+	[CCLI_OUTPUT_TEXT]	= "text",
+	[CCLI_OUTPUT_JSON]	= "json",
+};
+
+/**
+ * ccli_set_output_mode - Set how records are written
+ * @ccli: The CLI descriptor to set the mode of
+ * @mode: CCLI_OUTPUT_TEXT or CCLI_OUTPUT_JSON
+ *
+ * Sets how ccli_emit_kv() and ccli_emit_record() write their records.
+ * In CCLI_OUTPUT_JSON, tables of ccli_table_end() are written as JSON
+ * too, whatever ccli_set_table_format() was set to.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_set_output_mode(struct ccli *ccli, enum ccli_output_mode mode)
+{
+	if (!ccli || mode < CCLI_OUTPUT_TEXT || mode > CCLI_OUTPUT_JSON) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ccli->output_mode = mode;
+	return 0;
+}
+
+/**
+ * ccli_get_output_mode - Get how records are written
+ * @ccli: The CLI descriptor to get the mode of
+ *
+ * Returns the mode set by ccli_set_output_mode() (CCLI_OUTPUT_TEXT if
+ * it was never set), so that a command can tell who it is writing for.
+ */
+enum ccli_output_mode ccli_get_output_mode(struct ccli *ccli)
+{
+	return ccli ? ccli->output_mode : CCLI_OUTPUT_TEXT;
+}
+
+/* Is @fmt a single conversion of a number, like "%d", "%lu" or "%.2f"? */
+static bool number_format(const char *fmt)
+{
+	const char *p = fmt;
+
+	if (*p++ != '%')
+		return false;
+
+	p += strspn(p, "-+ #0'");
+	p += strspn(p, "0123456789*");
+	if (*p == '.') {
+		p++;
+		p += strspn(p, "0123456789*");
+	}
+	p += strspn(p, "hljztLq");
+
+	return *p && strchr("diufFeEgG", *p) && !p[1];
+}
+
+static void text_kv(struct json_writer *w, const char *key, int width,
+		    const char *val)
+{
+	static const char spaces[] = "                                ";
+	int len = strlen(key);
+	int pad;
+
+	json_raw(w, key, len);
+	json_raw(w, ":", 1);
+
+	/* Nothing after the key of an empty value */
+	if (val && *val) {
+		for (pad = width - len + 1; pad > 0; pad -= sizeof(spaces) - 1)
+			json_raw(w, spaces, pad < sizeof(spaces) - 1 ?
+				 pad : sizeof(spaces) - 1);
+		json_raw(w, val, strlen(val));
+	}
+	json_raw(w, "\n", 1);
+}
+
+/**
+ * ccli_emit_kv - Write a record of one key and value
+ * @ccli: The CLI descriptor to write to
+ * @key: The name of the value
+ * @fmt: A printf() like format of the value
+ *
+ * Writes "key: value" in the text mode, and {"key":value} in the JSON
+ * mode of ccli_set_output_mode(). If @fmt is a single conversion of a
+ * number (like "%d", "%lu" or "%.3f") the value is a JSON number, unless
+ * what it formats is not one as JSON has it (like "inf" or "+1"). Any
+ * other value, even "%s" of "42", is a string.
+ *
+ * Like ccli_printf(), this may be called from any thread.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_emit_kv(struct ccli *ccli, const char *key, const char *fmt, ...)
+{
+	struct json_writer w;
+	char buf[EMIT_VALUE];
+	char *alloc = NULL;
+	const char *val = buf;
+	va_list ap;
+	int ret;
+
+	if (!ccli || !key || !fmt) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	va_start(ap, fmt);
+	ret = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (ret >= (int)sizeof(buf)) {
+		va_start(ap, fmt);
+		ret = mem_vasprintf(ccli, &alloc, fmt, ap);
+		va_end(ap);
+		val = alloc;
+	}
+	if (ret < 0)
+		return -1;
+
+	json_init(&w, ccli, NULL);
+
+	if (ccli->output_mode == CCLI_OUTPUT_JSON) {
+		json_begin(&w);
+		json_key(&w, key);
+		json_value(&w, val, number_format(fmt));
+		json_end(&w);
+	} else {
+		text_kv(&w, key, strlen(key), val);
+	}
+
+	ret = json_flush(&w);
+	mem_free(ccli, alloc);
+
+	return ret;
+}
+
+/**
+ * ccli_emit_record - Write a record of keys and values
+ * @ccli: The CLI descriptor to write to
+ * @key: The name of the first value, followed by the value, then the
+ *       next key and value, and so on, ending with a NULL key
+ *
+ * Writes a record that has a value for each key. In the text mode it is
+ * a "key: value" line for each, with the values lined up, and in the
+ * JSON mode of ccli_set_output_mode() it is one JSON object on a line.
+ * The values are JSON strings, even the ones that look like numbers, and
+ * a NULL value is null. Use ccli_emit_kv() with a number format for a
+ * value that is a number.
+ *
+ * The record is built without allocating, and is written with one write
+ * unless it is longer than a kilobyte.
+ *
+ * Like ccli_printf(), this may be called from any thread.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_emit_record(struct ccli *ccli, const char *key, ...)
+{
+	struct json_writer w;
+	const char *k;
+	const char *val;
+	va_list ap;
+	int width = 0;
+	int len;
+
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	json_init(&w, ccli, NULL);
+
+	if (ccli->output_mode == CCLI_OUTPUT_JSON) {
+		json_begin(&w);
+		va_start(ap, key);
+		for (k = key; k; k = va_arg(ap, const char *)) {
+			json_key(&w, k);
+			json_value(&w, va_arg(ap, const char *), false);
+		}
+		va_end(ap);
+		json_end(&w);
+		return json_flush(&w);
+	}
+
+	/* Line up the values after the widest key */
+	va_start(ap, key);
+	for (k = key; k; k = va_arg(ap, const char *)) {
+		len = strlen(k);
+		if (len > width)
+			width = len;
+		va_arg(ap, const char *);
+	}
+	va_end(ap);
+
+	va_start(ap, key);
+	for (k = key; k; k = va_arg(ap, const char *)) {
+		val = va_arg(ap, const char *);
+		text_kv(&w, k, width, val);
+	}
+	va_end(ap);
+
+	return json_flush(&w);
+}
+
+static int output_command(struct ccli *ccli, const char *command,
+			  const char *line, void *data,
+			  int argc, char **argv)
+{
+	int i;
+
+	if (argc == 1) {
+		ccli_emit_kv(ccli, "output", "%s", mode_names[ccli->output_mode]);
+		return 0;
+	}
+
+	for (i = 0; argc == 2 && i <= CCLI_OUTPUT_JSON; i++) {
+		if (strcmp(argv[1], mode_names[i]) == 0) {
+			ccli->output_mode = i;
+			return 0;
+		}
+	}
+
+	/* A script that asked for JSON gets the error as JSON */
+	if (ccli->output_mode == CCLI_OUTPUT_JSON)
+		ccli_emit_kv(ccli, "error", "%s", OUTPUT_USAGE);
+	else
+		echo_str(ccli, OUTPUT_USAGE "\n");
+	return 0;
+}
+
+/**
+ * ccli_register_output - Add the "output" command
+ * @ccli: The CLI descriptor to add the command to
+ *
+ * Registers the command "output [text|json]", which sets the mode of
+ * ccli_set_output_mode() for the session, so that a script that drives
+ * it can ask for JSON. Without an argument, it shows the mode.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_output(struct ccli *ccli)
+{
+	return ccli_register_command(ccli, "output", output_command, NULL);
+}
@@ -9,6 +9,7 @@
 
 #include "ccli-local.h"
 
+#ifndef CCLI_NO_FILE_COMPLETION
 static int file_completion(struct ccli *ccli, char ***list,
 			   int *cnt, int mode, const char **ext, char *match,
 			   const char *dirname)
@@ -28,7 +29,7 @@ static int file_completion(struct ccli *ccli, char ***list,
 
 	mlen = strlen(match);
 
-	m = strdup(match);
+	m = mem_strdup(ccli, match);
 	if (!m)
 		return -1;
 
@@ -67,7 +68,7 @@ static int file_completion(struct ccli *ccli, char ***list,
 	else
 		dir = opendir(dname);
 	if (!dir) {
-		free(m);
+		mem_free(ccli, m);
 		return -1;
 	}
 
@@ -139,7 +140,7 @@ static int file_completion(struct ccli *ccli, char ***list,
 	}
 	closedir(dir);
 
-	free(m);
+	mem_free(ccli, m);
 
 	return ret;
 }
@@ -180,7 +181,7 @@ int ccli_file_completion(struct ccli *ccli, char ***list, int *cnt, char *match,
 	if (!PATH)
 		return file_completion(ccli, list, cnt, S_IFDIR, ext, match, NULL);
 
-	P = strdup(PATH);
+	P = mem_strdup(ccli, PATH);
 	if (!P)
 		return -1;
 
@@ -194,10 +195,19 @@ int ccli_file_completion(struct ccli *ccli, char ***list, int *cnt, char *match,
 			delim = match[mlen];
 		match[mlen] = '\0';
 	}
-	free(P);
+	mem_free(ccli, P);
 
 	/* Update the delim part of match */
 	if (delim != '\0')
 		match[mlen] = delim;
 	return ret;
 }
+#else
+/* Built with CCLI_NO_FILE_COMPLETION */
+int ccli_file_completion(struct ccli *ccli, char ***list, int *cnt, char *match,
+                         int mode, const char **ext, const char *PATH)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
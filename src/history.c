@@ -16,120 +16,289 @@
 #define CCLI_HISTORY_LINE_END \
 	"%%%%---ccli---%%%%"
 
-static inline int history_idx(struct ccli *ccli, int idx)
+static inline int history_idx(struct ccli *ccli, unsigned long idx)
 {
 	return idx % ccli->history_max;
 }
 
-__hidden int history_add(struct ccli *ccli, const char *line)
+/*
+ * The sequence number that follows the newest line in the history. The
+ * sequence of a shared history is that of its ring, which is an unsigned
+ * long so that it does not wrap after 2^31 lines.
+ */
+static inline unsigned long history_end(struct ccli *ccli)
+{
+	if (ccli->shared)
+		return ccli->shared_end;
+	return ccli->history_size;
+}
+
+/* The oldest line in the history that may still be around */
+static inline unsigned long history_first(struct ccli *ccli)
+{
+	unsigned long size;
+	int first;
+
+	if (ccli->shared) {
+		size = ring_size(ccli->shared);
+		return ccli->shared_end > size ? ccli->shared_end - size : 0;
+	}
+
+	first = ccli->history_size - ccli->history_max;
+	if (first < ccli->history_start)
+		first = ccli->history_start;
+	return first;
+}
+
+/*
+ * Return the line at @seq, or NULL if a shared history no longer has it.
+ * The lines of a shared history are copied into @buf.
+ */
+static char *history_get(struct ccli *ccli, unsigned long seq, char *buf)
 {
+	if (ccli->shared)
+		return ring_get(ccli->shared, seq, buf);
+	return ccli->history[history_idx(ccli, seq)];
+}
+
+/*
+ * Other sessions may have added to a shared history. Unless this session
+ * is in the middle of moving through it, catch up to the newest line.
+ */
+static void history_refresh(struct ccli *ccli)
+{
+	if (!ccli->shared || ccli->current_line < ccli->shared_end)
+		return;
+
+	ccli->shared_end = ring_head(ccli->shared);
+	ccli->current_line = ccli->shared_end;
+}
+
+/* Replace the string at @idx with @str, keeping track of the bytes used */
+static void history_set(struct ccli *ccli, int idx, char *str)
+{
+	if (ccli->history[idx]) {
+		ccli->history_bytes -= strlen(ccli->history[idx]) + 1;
+		mem_free(ccli, ccli->history[idx]);
+	}
+
+	ccli->history[idx] = str;
+
+	if (str)
+		ccli->history_bytes += strlen(str) + 1;
+}
+
+static int __history_add(struct ccli *ccli, const char *line)
+{
+	int limit = ccli->limits.history_bytes;
 	char **lines;
-	int idx;
+	char *str;
+	int first;
+
+	if (ccli->shared) {
+		if (ring_add(ccli->shared, line) < 0)
+			return -1;
+		ccli->shared_end = ring_head(ccli->shared);
+		ccli->current_line = ccli->shared_end;
+		return 0;
+	}
+
+	if (limit && strlen(line) + 1 > limit) {
+		errno = ENOSPC;
+		return -1;
+	}
 
 	if (ccli->history_size < ccli->history_max) {
-		lines = realloc(ccli->history, sizeof(*lines) * (ccli->history_size + 1));
+		lines = mem_realloc(ccli, ccli->history,
+				    sizeof(*lines) * (ccli->history_size + 1));
 		if (!lines)
 			return -1;
 		lines[ccli->history_size] = NULL;
 		ccli->history = lines;
 	}
 
-	idx = history_idx(ccli, ccli->history_size);
-
-	free(ccli->history[idx]);
-	ccli->history[idx] = strdup(line);
-	if (!ccli->history[idx])
+	str = mem_strdup(ccli, line);
+	if (!str)
 		return -1;
 
+	history_set(ccli, history_idx(ccli, ccli->history_size), str);
+
 	ccli->history_size++;
 	ccli->current_line = ccli->history_size;
 
+	/* Drop the oldest lines until the history fits in its limit */
+	while (limit && ccli->history_bytes > limit) {
+		first = history_first(ccli);
+		history_set(ccli, history_idx(ccli, first), NULL);
+		ccli->history_start = first + 1;
+	}
+
 	return 0;
 }
 
-static void save_current(struct ccli *ccli, int current)
+/*
+ * The history_lock protects the history from other threads that load
+ * it or read it with ccli_history_copy() while the loop is moving
+ * through it. It is never held while waiting for input.
+ */
+__hidden int history_add(struct ccli *ccli, const char *line)
 {
+	int ret;
+
+	pthread_mutex_lock(&ccli->history_lock);
+	ret = __history_add(ccli, line);
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	return ret;
+}
+
+/* Store the current line into the history in case it was modified */
+static void history_update(struct ccli *ccli, unsigned long current)
+{
+	int limit = ccli->limits.history_bytes;
 	char *str;
+	int len;
 	int idx;
 
-	/* Store the current line in case it was modifed */
-	str = strdup(ccli->line->line);
-	if (str) {
-		if (current >= ccli->history_size) {
-			free(ccli->temp_line);
-			ccli->temp_line = str;
-		} else {
-			idx = history_idx(ccli, current);
-			free(ccli->history[idx]);
-			ccli->history[idx] = str;
-		}
+	/* The lines of a shared history are never modified */
+	if (ccli->shared)
+		return;
+
+	idx = history_idx(ccli, current);
+	str = ccli->history[idx];
+	len = strlen(str);
+
+	/* Moving over a line without changing it costs nothing */
+	if (strcmp(str, ccli->line->line) == 0)
+		return;
+
+	/* A line that got shorter still fits where it is */
+	if (strlen(ccli->line->line) < len) {
+		strcpy(str, ccli->line->line);
+		ccli->history_bytes -= len - strlen(str);
+		return;
+	}
+
+	/* Keep the original if the modified line would not fit */
+	if (limit && ccli->history_bytes - strlen(ccli->history[idx]) +
+	    ccli->line->len > limit)
+		return;
+
+	str = mem_strdup(ccli, ccli->line->line);
+	if (str)
+		history_set(ccli, idx, str);
+}
+
+static void save_current(struct ccli *ccli, unsigned long current)
+{
+	int len = strlen(ccli->line->line);
+	char *str;
+
+	if (current < history_end(ccli)) {
+		history_update(ccli, current);
+		return;
 	}
+
+	/*
+	 * Store the current line in case it was modifed. The buffer is
+	 * kept, and made as big as the line buffer so that it is only
+	 * allocated again when that grows.
+	 */
+	if (len >= ccli->temp_size) {
+		str = mem_realloc(ccli, ccli->temp_line, ccli->line->size);
+		if (!str)
+			return;
+		ccli->temp_line = str;
+		ccli->temp_size = ccli->line->size;
+	}
+	memcpy(ccli->temp_line, ccli->line->line, len + 1);
+	ccli->temp_saved = true;
 }
 
 __hidden int history_up(struct ccli *ccli, struct line_buf *line, int cnt)
 {
-	int current = ccli->current_line;
-	int idx;
+	unsigned long current;
+	unsigned long first;
+	unsigned long seq;
+	char *str = NULL;
+	int ret = 1;
+
+	pthread_mutex_lock(&ccli->history_lock);
 
-	if (ccli->current_line > cnt)
-		ccli->current_line -= cnt;
-	else
-		ccli->current_line = 0;
+	history_refresh(ccli);
 
-	if (ccli->history_size > ccli->history_max &&
-	    ccli->current_line <= ccli->history_size - ccli->history_max)
-		ccli->current_line = (ccli->history_size - ccli->history_max) + 1;
-	if (current == ccli->current_line)
-		return 1;
+	current = ccli->current_line;
+	first = history_first(ccli);
+
+	seq = current > first && current - first > cnt ? current - cnt : first;
+
+	/* Skip lines that a shared history no longer has */
+	for (; seq < current; seq++) {
+		str = history_get(ccli, seq, ccli->shared_buf);
+		if (str)
+			break;
+	}
+
+	if (seq >= current)
+		goto out;
 
 	clear_line(ccli, line);
 	save_current(ccli, current);
 
-	idx = history_idx(ccli, ccli->current_line);
-	line_replace(line, ccli->history[idx]);
-	return 0;
+	ccli->current_line = seq;
+	line_replace(line, str);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&ccli->history_lock);
+	return ret;
 }
 
 static void restore_current(struct ccli *ccli, struct line_buf *line)
 {
 	/* Restore the command that was before moving in history */
-	if (ccli->temp_line) {
+	if (ccli->temp_saved) {
 		clear_line(ccli, line);
 		line_replace(line, ccli->temp_line);
-		free(ccli->temp_line);
-		ccli->temp_line = NULL;
+		ccli->temp_saved = false;
 	}
 }
 
 __hidden int history_down(struct ccli *ccli, struct line_buf *line, int cnt)
 {
-	int current = ccli->current_line;
-	int idx;
-	char *str;
+	unsigned long current;
+	unsigned long end;
+	unsigned long seq;
+	char *str = NULL;
+	int ret = 1;
 
-	ccli->current_line += cnt;
+	pthread_mutex_lock(&ccli->history_lock);
 
-	if (ccli->current_line > (ccli->history_size))
-		ccli->current_line = ccli->history_size;
+	current = ccli->current_line;
+	end = history_end(ccli);
 
-	if (ccli->current_line == ccli->history_size) {
+	/* Skip lines that a shared history no longer has */
+	for (seq = current + cnt; seq < end; seq++) {
+		str = history_get(ccli, seq, ccli->shared_buf);
+		if (str)
+			break;
+	}
+
+	if (seq >= end) {
+		ccli->current_line = end;
 		restore_current(ccli, line);
-		return 1;
+		goto out;
 	}
 
 	clear_line(ccli, line);
 
-	/* Store the current line in case it was modifed */
-	str = strdup(ccli->line->line);
-	if (str) {
-		idx = history_idx(ccli, current);
-		free(ccli->history[idx]);
-		ccli->history[idx] = str;
-	}
+	history_update(ccli, current);
 
-	idx = history_idx(ccli, ccli->current_line);
-	line_replace(line, ccli->history[idx]);
-	return 0;
+	ccli->current_line = seq;
+	line_replace(line, str);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&ccli->history_lock);
+	return ret;
 }
 
 #define REVERSE_STR	"reverse-i-search"
@@ -167,28 +336,37 @@ static void refresh(struct ccli *ccli, struct line_buf *line,
 
 __hidden int history_search(struct ccli *ccli, struct line_buf *line, int *pad)
 {
+	unsigned long save_current_line;
+	unsigned long min;
+	unsigned long end;
+	unsigned long top;
+	unsigned long i;
 	struct line_buf search;
 	char *last_hist = NULL;
 	char *hist = NULL;
 	char *p = NULL;
-	int save_current_line = ccli->current_line;
 	int old_len;
 	int pos = line->pos;
-	int min;
-	int idx;
 	int ret;
 	int ch;
-	int i;
 
 	*pad = 0;
 
-	if (line_init(&search))
+	stat_add(ccli, history_searches, 1);
+	trace_probe(history__search__start);
+
+	if (line_init(&search, &ccli->pools[CCLI_POOL_LINE]))
 		return CHAR_INTR;
 
 	old_len = line->len + strlen(REVERSE_STR) + 6;
 
-	min = ccli->history_size > ccli->history_max ?
-		ccli->history_size - ccli->history_max : 0;
+	pthread_mutex_lock(&ccli->history_lock);
+	history_refresh(ccli);
+	save_current_line = ccli->current_line;
+
+	min = history_first(ccli);
+	end = history_end(ccli);
+	pthread_mutex_unlock(&ccli->history_lock);
 
 	echo_str(ccli, "\r(" REVERSE_STR ")`': ");
 	echo_str(ccli, line->line);
@@ -196,18 +374,23 @@ __hidden int history_search(struct ccli *ccli, struct line_buf *line, int *pad)
 	for (i = 0; i < pos; i++)
 		echo(ccli, '\b');
 
-	pos = ccli->current_line;
+	/* Lines below @top are searched, starting with the one before it */
+	top = ccli->current_line + 1;
 
 	for (;;) {
 		ch = read_char(ccli);
 		switch (ch) {
 		case CHAR_INTR:
 			echo_str(ccli, "^C\n");
+			pthread_mutex_lock(&ccli->history_lock);
 			ccli->current_line = save_current_line;
+			pthread_mutex_unlock(&ccli->history_lock);
 			line_reset(line);
 			line_reset(&search);
 			goto out;
 		case CHAR_IGNORE_START_H ... CHAR_IGNORE_END:
+		case CHAR_ERROR:
+		case CHAR_EXIT:
 		case '\n':
 			goto out;
 		case CHAR_BACKSPACE:
@@ -217,41 +400,53 @@ __hidden int history_search(struct ccli *ccli, struct line_buf *line, int *pad)
 			goto search;
 			break;
 		case CHAR_REVERSE:
-			pos--;
-			last_hist = hist;
+			if (top > min)
+				top--;
+			/*
+			 * Skip lines that are the same as the last match. It
+			 * was copied into @line, as the history may change
+			 * once the lock is released.
+			 */
+			last_hist = p ? line->line : NULL;
 			goto search;
 		default:
 			ret = line_insert(&search, ch);
 			if (ret)
 				break;
  search:
+			pthread_mutex_lock(&ccli->history_lock);
 			p = NULL;
-			for (i = pos; i >= min; i--) {
-				if (i >= ccli->history_size)
+			for (i = top; i-- > min; ) {
+				if (i >= end)
 					continue;
-				idx = history_idx(ccli, i);
-				hist = ccli->history[idx];
-				p = strstr(hist, search.line);
+				hist = history_get(ccli, i, ccli->shared_buf);
+				if (!hist)
+					continue;
+				p = str_find(hist, search.line, search.len);
 				if (!p)
 					continue;
 				/* Skip duplicates */
-				if (last_hist && strcmp(last_hist, hist) == 0)
+				if (last_hist && strcmp(last_hist, hist) == 0) {
+					p = NULL;
 					continue;
+				}
 				break;
 			}
 			if (p) {
-				if (ccli->current_line >= ccli->history_size)
+				if (ccli->current_line >= end)
 					save_current(ccli, ccli->current_line);
 				ccli->current_line = i;
 				line_replace(line, hist);
 				line->pos = p - hist + search.len;
-				pos = i;
+				top = i + 1;
 			}
+			pthread_mutex_unlock(&ccli->history_lock);
 			refresh(ccli, line, &search, &old_len, p);
 			break;
 		}
 	}
  out:
+	trace_probe(history__search__end, p != NULL);
 	*pad = search.len + line->len + sizeof(REVERSE_STR) + 5;
 	line_cleanup(&search);
 	return ch;
@@ -264,55 +459,97 @@ __hidden int history_search(struct ccli *ccli, struct line_buf *line, int *pad)
  *
  * Reads the line that happened @past commands ago and returns it.
  *
+ * If @ccli uses a shared history (see ccli_set_shared_history()), then
+ * the line is a copy that is only valid until the next call.
+ *
+ * The returned string may be freed when a line is added to the history,
+ * so it must only be used by the thread that runs ccli_loop(). Other
+ * threads should use ccli_history_copy().
+ *
  * Returns a string that should not be modifiied if there was
  *   a command that happened @past commands ago, otherwise NULL.
  */
 const char *ccli_history(struct ccli *ccli, int past)
 {
-	int idx;
+	const char *str = NULL;
 
-	if (past > ccli->history_size ||
-	    past > ccli->history_max)
-		return NULL;
+	pthread_mutex_lock(&ccli->history_lock);
 
-	idx = ccli->history_size - past;
-	idx %= ccli->history_max;
+	history_refresh(ccli);
 
-	return ccli->history[idx];
+	if (past >= 1 && past <= history_end(ccli) - history_first(ccli))
+		str = history_get(ccli, history_end(ccli) - past,
+				  ccli->shared_buf);
+
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	return str;
 }
 
 /**
- * ccli_history_save_fd - Write the history into the file descriptor
- * @ccli: The ccli descriptor to write the history of
- * @tag: The tag to give this history segment
- * @fd: The file descriptor to write the history into
+ * ccli_history_copy - copy a previous entered line from the past
+ * @ccli: The ccli descriptor to read the history from
+ * @past: How far back to go
+ * @buf: The buffer to copy the line into
+ * @size: The size of @buf
  *
- * Will write the contents of the history into the file descriptor.
- * It will first write a special line that will denote the @tag and
- * size of the history. The @tag is used so that multiple histories
- * can be loaded into the same file, and can be retrieved via the
- * @tag.
+ * Like ccli_history(), but copies the line into @buf, such that it
+ * is safe to call from any thread, even while another thread is
+ * running ccli_loop(). If the line does not fit in @buf, it is
+ * truncated. @buf is always nul terminated if @size is not zero.
  *
- * Returns the number of history lines written on success and -1
- *  on error.
+ * Returns the length of the line (which if it is @size or more
+ *   means the line was truncated), or -1 if there was no command
+ *   @past commands ago.
  */
-int ccli_history_save_fd(struct ccli *ccli, const char *tag, int fd)
+int ccli_history_copy(struct ccli *ccli, int past, char *buf, size_t size)
+{
+	char *str = NULL;
+	int len = -1;
+
+	if (!ccli || (!buf && size)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ccli->history_lock);
+
+	history_refresh(ccli);
+
+	if (past >= 1 && past <= history_end(ccli) - history_first(ccli))
+		str = history_get(ccli, history_end(ccli) - past,
+				  ccli->shared_buf);
+
+	if (str) {
+		len = strlen(str);
+		if (size) {
+			size = len < size ? len : size - 1;
+			memcpy(buf, str, size);
+			buf[size] = '\0';
+		}
+	} else {
+		errno = ENOENT;
+	}
+
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	return len;
+}
+
+#ifndef CCLI_NO_HISTORY_FILE
+static int save_fd(struct ccli *ccli, const char *tag, int fd)
 {
 	char *str = CCLI_HISTORY_LINE_START;
+	unsigned long first;
 	char buf[64];
 	int cnt;
 	int ret;
-	int idx;
 	int i;
 
-	if (!ccli || !tag || fd < 0) {
-		errno = EINVAL;
-		return -1;
-	}
+	history_refresh(ccli);
 
-	cnt = ccli->history_size;
-	if (cnt > ccli->history_max)
-		cnt = ccli->history_max;
+	first = history_first(ccli);
+	cnt = history_end(ccli) - first;
 
 	/* Do nothing if there's no history */
 	if (!cnt)
@@ -336,11 +573,11 @@ int ccli_history_save_fd(struct ccli *ccli, const char *tag, int fd)
 	if (ret < strlen(buf))
 		return -1;
 
-	idx = ccli->history_size - cnt;
-
-	for (i = 0; i < cnt; i++, idx++) {
-		idx = idx % ccli->history_max;
-		str = ccli->history[idx];
+	for (i = 0; i < cnt; i++) {
+		/* Lines a shared history no longer has are left empty */
+		str = history_get(ccli, first + i, ccli->shared_buf);
+		if (!str)
+			str = "";
 		ret = write(fd, str, strlen(str));
 		if (ret < strlen(str))
 			return -1;
@@ -372,14 +609,45 @@ int ccli_history_save_fd(struct ccli *ccli, const char *tag, int fd)
 	return cnt;
 }
 
-static char *update_line(char *line, int *linesz, int cnt)
+/**
+ * ccli_history_save_fd - Write the history into the file descriptor
+ * @ccli: The ccli descriptor to write the history of
+ * @tag: The tag to give this history segment
+ * @fd: The file descriptor to write the history into
+ *
+ * Will write the contents of the history into the file descriptor.
+ * It will first write a special line that will denote the @tag and
+ * size of the history. The @tag is used so that multiple histories
+ * can be loaded into the same file, and can be retrieved via the
+ * @tag.
+ *
+ * Returns the number of history lines written on success and -1
+ *  on error.
+ */
+int ccli_history_save_fd(struct ccli *ccli, const char *tag, int fd)
+{
+	int ret;
+
+	if (!ccli || !tag || fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ccli->history_lock);
+	ret = save_fd(ccli, tag, fd);
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	return ret;
+}
+
+static char *update_line(struct ccli *ccli, char *line, int *linesz, int cnt)
 {
 	char *tmp;
 
 	if (*linesz <= (cnt + 1)) {
-		tmp = realloc(line, cnt + BUFSIZ);
+		tmp = mem_realloc(ccli, line, cnt + BUFSIZ);
 		if (!tmp) {
-			free(line);
+			mem_free(ccli, line);
 			return NULL;
 		}
 		line = tmp;
@@ -388,35 +656,38 @@ static char *update_line(char *line, int *linesz, int cnt)
 	return line;
 }
 
-static int read_bytes(int fd, char **pline, int *linesz)
+static int read_bytes(struct ccli *ccli, int fd, char **pline, int *linesz)
 {
 	char *line = *pline;
 	char ch;
 	int cnt = 0;
 	int r;
 
-	while ((r = read(fd, &ch, 1)) < 1) {
+	while ((r = read(fd, &ch, 1)) == 1) {
 		if (ch == '\n')
 			break;
-		line = update_line(line, linesz, cnt);
-		if (!line)
+		line = update_line(ccli, line, linesz, cnt + 1);
+		if (!line) {
+			*pline = NULL;
 			return -1;
+		}
 		line[cnt++] = ch;
 	}
-	if (!cnt)
-		return r > 0 ? 0 : -1;
-
 	if (r < 0)
 		return -1;
-	if (cnt)
-		line[cnt] = '\0';
+
+	line[cnt] = '\0';
 	*pline = line;
+
+	if (!cnt)
+		return r > 0 ? 0 : -1;
+
 	return cnt;
 }
 
-static int read_line(int fd, char **pline, int *linesz)
+static int read_line(struct ccli *ccli, int fd, char **pline, int *linesz)
 {
-	char buf[BUFSIZ+1];
+	char buf[BUFSIZ];
 	char *line;
 	char *p;
 	off64_t offset;
@@ -425,8 +696,11 @@ static int read_line(int fd, char **pline, int *linesz)
 	int r;
 
 	/* Make sure line is allocated */
-	*pline = update_line(*pline, linesz, 0);
+	*pline = update_line(ccli, *pline, linesz, 0);
 	line = *pline;
+	if (!line)
+		return -1;
+	line[0] = '\0';
 
 	offset = lseek64(fd, 0, SEEK_CUR);
 	if (offset < 0) {
@@ -435,18 +709,19 @@ static int read_line(int fd, char **pline, int *linesz)
 		 * to read any more than we have to. So we are stuck with
 		 * reading one byte at a time.
 		 */
-		return read_bytes(fd, pline, linesz);
+		return read_bytes(ccli, fd, pline, linesz);
 	}
 
 	while ((r = read(fd, buf, BUFSIZ)) > 0) {
-		buf[r] = '\0';
-		p = strchr(buf, '\n');
+		p = memchr(buf, '\n', r);
 
 		len = p ? p - buf : r;
 
-		line = update_line(line, linesz, cnt + len);
-		if (!line)
+		line = update_line(ccli, line, linesz, cnt + len);
+		if (!line) {
+			*pline = NULL;
 			return -1;
+		}
 		memcpy(line + cnt, buf, len);
 		cnt += len;
 		line[cnt] = '\0';
@@ -454,14 +729,15 @@ static int read_line(int fd, char **pline, int *linesz)
 		if (p)
 			break;
 	}
-	if (!cnt)
-		return r ? 0 : -1;
+	*pline = line;
+
+	if (r < 0 || (!r && !cnt))
+		return -1;
 
 	/* Put back to after the new line (cnt is at new line) */
 	offset = lseek64(fd, offset + cnt + 1, SEEK_SET);
 	// What should we do if this fails?
 
-	*pline = line;
 	return cnt;
 }
 
@@ -503,7 +779,7 @@ int ccli_history_load_fd(struct ccli *ccli, const char *tag, int fd)
 	char *line = NULL;
 	char *p;
 	int linesz = 0;
-	int cnt;
+	int cnt = -1;
 	int ret;
 	int i;
 
@@ -513,14 +789,14 @@ int ccli_history_load_fd(struct ccli *ccli, const char *tag, int fd)
 	}
 
 	do {
-		ret = read_line(fd, &line, &linesz);
+		ret = read_line(ccli, fd, &line, &linesz);
 		if (ret < 0)
 			break;
 		cnt = has_tag(line, str, tag);
 	} while (cnt < 0);
 
 	for (i = 0; i < cnt; i++) {
-		ret = read_line(fd, &line, &linesz);
+		ret = read_line(ccli, fd, &line, &linesz);
 		if (ret < 0)
 			break;
 		/* Do not add empty lines */
@@ -538,10 +814,10 @@ int ccli_history_load_fd(struct ccli *ccli, const char *tag, int fd)
 	if (i < cnt)
 		goto out;
 
-	read_line(fd, &line, &linesz);
+	read_line(ccli, fd, &line, &linesz);
 	/* TODO: test for the end tag. */
 out:
-	free(line);
+	mem_free(ccli, line);
 
 	return cnt;
 }
@@ -613,19 +889,19 @@ int ccli_history_save_file(struct ccli *ccli, const char *tag, const char *file)
 	/* First remove the current tag */
 	do {
 		start = lseek(fd, 0, SEEK_CUR);
-		ret = read_line(fd, &line, &linesz);
+		ret = read_line(ccli, fd, &line, &linesz);
 		if (ret < 0)
 			break;
 		cnt = has_tag(line, str, tag);
 	} while (cnt < 0);
 
 	for (i = 0; i < cnt; i++) {
-		ret = read_line(fd, &line, &linesz);
+		ret = read_line(ccli, fd, &line, &linesz);
 		if (ret < 0)
 			break;
 	}
 	/* read one more line for end tag */
-	read_line(fd, &line, &linesz);
+	read_line(ccli, fd, &line, &linesz);
 	end = lseek(fd, 0, SEEK_CUR);
 
 	/* Remove this section if found */
@@ -640,7 +916,7 @@ int ccli_history_save_file(struct ccli *ccli, const char *tag, const char *file)
 	end = lseek(fd, 0, SEEK_CUR);
 	ftruncate(fd, end);
 out:
-	free(line);
+	mem_free(ccli, line);
 	close(fd);
 	return ret;
 }
@@ -673,7 +949,7 @@ int ccli_history_load_file(struct ccli *ccli, const char *tag, const char *file)
 	return ret;
 }
 
-static char *get_cache_file(void)
+static char *get_cache_file(struct ccli *ccli)
 {
 	char *cache_path;
 	char *home;
@@ -685,18 +961,18 @@ static char *get_cache_file(void)
 		home = secure_getenv("HOME");
 		if (!home)
 			return NULL;
-		ret = asprintf(&cache_path, "%s/.cache", home);
+		ret = mem_asprintf(ccli, &cache_path, "%s/.cache", home);
 		if (ret < 0)
 			return NULL;
 	} else {
 		/* So we can always free it later */
-		cache_path = strdup(cache_path);
+		cache_path = mem_strdup(ccli, cache_path);
 	}
 	if (!cache_path)
 		return NULL;
 
-	ret = asprintf(&file, "%s/ccli", cache_path);
-	free(cache_path);
+	ret = mem_asprintf(ccli, &file, "%s/ccli", cache_path);
+	mem_free(ccli, cache_path);
 
 	return ret < 0 ? NULL : file;
 }
@@ -723,9 +999,9 @@ int ccli_history_save(struct ccli *ccli, const char *tag)
 	char *file;
 	int ret;
 
-	file = get_cache_file();
+	file = get_cache_file(ccli);
 	ret = ccli_history_save_file(ccli, tag, file);
-	free(file);
+	mem_free(ccli, file);
 
 	return ret;
 }
@@ -748,9 +1024,47 @@ int ccli_history_load(struct ccli *ccli, const char *tag)
 	char *file;
 	int ret;
 
-	file = get_cache_file();
+	file = get_cache_file(ccli);
 	ret = ccli_history_load_file(ccli, tag, file);
-	free(file);
+	mem_free(ccli, file);
 
 	return ret;
 }
+#else
+/* Built with CCLI_NO_HISTORY_FILE: the history is only kept in memory */
+int ccli_history_save_fd(struct ccli *ccli, const char *tag, int fd)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_history_load_fd(struct ccli *ccli, const char *tag, int fd)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_history_save_file(struct ccli *ccli, const char *tag, const char *file)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_history_load_file(struct ccli *ccli, const char *tag, const char *file)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_history_save(struct ccli *ccli, const char *tag)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_history_load(struct ccli *ccli, const char *tag)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
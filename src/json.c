@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * A JSON writer that does not allocate.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include "ccli-local.h"
+
+/*
+ * The writer lives on the stack of its caller, and the JSON is built in
+ * its buffer, which is written out (or added to a capture) when it is
+ * full and at json_flush(). A record that fits in the buffer is written
+ * with one write, so that a reader gets whole lines.
+ */
+
+__hidden void json_init(struct json_writer *w, struct ccli *ccli,
+			struct capture *cap)
+{
+	w->ccli = ccli;
+	w->cap = cap;
+	w->len = 0;
+	w->ret = 0;
+	w->comma = false;
+}
+
+__hidden int json_flush(struct json_writer *w)
+{
+	int ret;
+
+	if (!w->len)
+		return w->ret;
+
+	if (w->cap)
+		ret = capture_add(w->ccli, w->cap, w->buf, w->len);
+	else
+		ret = print_str(w->ccli, w->buf, w->len);
+	if (ret < 0)
+		w->ret = -1;
+
+	w->len = 0;
+	return w->ret;
+}
+
+__hidden void json_raw(struct json_writer *w, const char *str, int len)
+{
+	int n;
+
+	while (len) {
+		if (w->len == JSON_BUF)
+			json_flush(w);
+		n = JSON_BUF - w->len < len ? JSON_BUF - w->len : len;
+		memcpy(w->buf + w->len, str, n);
+		w->len += n;
+		str += n;
+		len -= n;
+	}
+}
+
+__hidden void json_string(struct json_writer *w, const char *str)
+{
+	const char *p = str;
+	char esc[8];
+	int len;
+
+	json_raw(w, "\"", 1);
+	for (; *p; p++) {
+		if (*p != '"' && *p != '\\' && (unsigned char)*p >= ' ')
+			continue;
+
+		json_raw(w, str, p - str);
+		str = p + 1;
+
+		switch (*p) {
+		case '\n':
+			json_raw(w, "\\n", 2);
+			break;
+		case '\t':
+			json_raw(w, "\\t", 2);
+			break;
+		case '\r':
+			json_raw(w, "\\r", 2);
+			break;
+		case '"':
+		case '\\':
+			esc[0] = '\\';
+			esc[1] = *p;
+			json_raw(w, esc, 2);
+			break;
+		default:
+			len = snprintf(esc, sizeof(esc), "\\u%04x", *p);
+			json_raw(w, esc, len);
+		}
+	}
+	json_raw(w, str, p - str);
+	json_raw(w, "\"", 1);
+}
+
+static inline bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/* Is @str a number as JSON has it? */
+__hidden bool json_number(const char *str)
+{
+	const char *p = str;
+
+	if (*p == '-')
+		p++;
+	if (*p == '0')
+		p++;
+	else if (is_digit(*p))
+		while (is_digit(*p))
+			p++;
+	else
+		return false;
+
+	if (*p == '.') {
+		if (!is_digit(*++p))
+			return false;
+		while (is_digit(*p))
+			p++;
+	}
+
+	if (*p == 'e' || *p == 'E') {
+		p++;
+		if (*p == '+' || *p == '-')
+			p++;
+		if (!is_digit(*p))
+			return false;
+		while (is_digit(*p))
+			p++;
+	}
+	return !*p;
+}
+
+__hidden void json_begin(struct json_writer *w)
+{
+	json_raw(w, "{", 1);
+	w->comma = false;
+}
+
+/* Ends the object, and the line it is on */
+__hidden void json_end(struct json_writer *w)
+{
+	json_raw(w, "}\n", 2);
+}
+
+__hidden void json_key(struct json_writer *w, const char *key)
+{
+	if (w->comma)
+		json_raw(w, ",", 1);
+	w->comma = true;
+
+	json_string(w, key);
+	json_raw(w, ":", 1);
+}
+
+/*
+ * Null if @str is NULL, a number if @number is set and @str is one as
+ * JSON has it, and a string otherwise. The caller says what the value
+ * is, so that a string like a zip code or a version stays a string.
+ */
+__hidden void json_value(struct json_writer *w, const char *str, bool number)
+{
+	if (!str)
+		json_raw(w, "null", 4);
+	else if (number && json_number(str))
+		json_raw(w, str, strlen(str));
+	else
+		json_string(w, str);
+}
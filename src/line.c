@@ -7,15 +7,37 @@
 __hidden void free_argv(int argc, char **argv)
 {
 	for (argc--; argc >= 0; argc--)
-		free(argv[argc]);
-	free(argv);
+		mem_free(NULL, argv[argc]);
+	mem_free(NULL, argv);
 }
 
-__hidden int line_init(struct line_buf *line)
+static char *line_alloc(struct pool *pool, int size)
 {
+	if (pool)
+		return pool_zalloc(pool, size);
+	return mem_zalloc(NULL, size);
+}
+
+/* The longest a line from @pool may get (0 for no limit) */
+static int line_max(struct pool *pool)
+{
+	return pool ? pool->ccli->limits.line_max : 0;
+}
+
+__hidden int line_init(struct line_buf *line, struct pool *pool)
+{
+	int max = line_max(pool);
+	int size = BUFSIZ;
+
+	/* No need to allocate more than the line can hold */
+	if (max && max + 1 < size)
+		size = max + 1;
+
 	memset(line, 0, sizeof(*line));
-	line->line = calloc(1, BUFSIZ);
-	line->size = BUFSIZ;
+	line->line = line_alloc(pool, size);
+	line->size = size;
+	line->max = max;
+	line->pool = pool;
 	if (!line->line)
 		return -1;
 	return 0;
@@ -25,22 +47,37 @@ __hidden int line_init(struct line_buf *line)
  * line_init_str - Initialize a line_buf with a given string
  * @line: The line_buf to initialize
  * @str: The string to initialize it with.
+ * @pool: The pool to allocate the line from (NULL for malloc)
  *
  * Initilize the line with a given string.
  *
  * Returns 0 on success and -1 on failure.
  */
-__hidden int line_init_str(struct line_buf *line, const char *str)
+__hidden int line_init_str(struct line_buf *line, const char *str,
+			   struct pool *pool)
 {
+	int max = line_max(pool);
 	int len = strlen(str);
 	/* strlen(str) + 1 + BUFSIZ - 1 */
 	int size = ((len + BUFSIZ) / BUFSIZ) * BUFSIZ;
 
 	memset(line, 0, sizeof(*line));
-	line->line = calloc(1, size);
+
+	if (max) {
+		if (len > max) {
+			errno = E2BIG;
+			return -1;
+		}
+		if (max + 1 < size)
+			size = max + 1;
+	}
+
+	line->line = line_alloc(pool, size);
 	line->size = size;
+	line->max = max;
 	line->len = len;
 	line->pos = len;
+	line->pool = pool;
 
 	if (!line->line)
 		return -1;
@@ -60,7 +97,10 @@ __hidden void line_reset(struct line_buf *line)
 
 __hidden void line_cleanup(struct line_buf *line)
 {
-	free(line->line);
+	if (line->pool)
+		pool_free(line->pool, line->line);
+	else
+		mem_free(NULL, line->line);
 	memset(line, 0, sizeof(*line));
 }
 
@@ -87,10 +127,21 @@ __hidden int line_insert(struct line_buf *line, char ch)
 		line->start = line->len;
 		return 0;
 	}
-	if (line->len == line->size) {
-		extend_line = realloc(line->line, line->size + BUFSIZ);
+	if (line->max && line->len >= line->max) {
+		errno = E2BIG;
+		return -1;
+	}
+	if (line->len == line->size - 1) {
+		if (line->pool)
+			extend_line = pool_realloc(line->pool, line->line,
+						   line->size + BUFSIZ);
+		else
+			extend_line = mem_realloc(NULL, line->line,
+						  line->size + BUFSIZ);
 		if (!extend_line)
 			return -1;
+		/* The line must always stay nul terminated */
+		memset(extend_line + line->size, 0, BUFSIZ);
 		line->line = extend_line;
 		line->size += BUFSIZ;
 	}
@@ -223,8 +274,11 @@ __hidden void line_del(struct line_buf *line)
 
 __hidden int line_copy(struct line_buf *dst, struct line_buf *src, int len)
 {
+	memset(dst, 0, sizeof(*dst));
 	dst->size = src->size;
-	dst->line = calloc(1, src->size);
+	dst->max = src->max;
+	dst->pool = src->pool;
+	dst->line = line_alloc(src->pool, src->size);
 	if (!dst->line)
 		return -1;
 
@@ -237,6 +291,92 @@ __hidden int line_copy(struct line_buf *dst, struct line_buf *src, int len)
 	return 0;
 }
 
+/*
+ * Find the next word in @p. Returns the start of the word and sets @end
+ * to the character after it, or returns NULL if there's no more words.
+ */
+static const char *next_word(const char *p, const char **end)
+{
+	const char *word;
+	bool last = false;
+	char q = 0;
+
+	while (ISSPACE(*p))
+		p++;
+
+	if (!*p)
+		return NULL;
+
+	word = p;
+
+	for ( ; !last && *p; p++) {
+
+		/* Outside of quotes, skip what can not end the word at once */
+		if (!q) {
+			p += str_plain(p);
+			if (!*p)
+				break;
+		}
+
+		switch (*p) {
+		case '\'':
+		case '"':
+			if (!q)
+				q = *p;
+			else if (*p == q)
+				q = 0;
+			break;
+		case '\\':
+			p++;
+			if (!*p)
+				p--;
+			break;
+
+		default:
+			if (q)
+				break;
+			if (ISSPACE(*p))
+				last = true;
+			break;
+		}
+	}
+
+	/* Do not include the space that was found */
+	if (last)
+		p--;
+
+	*end = p;
+	return word;
+}
+
+/* Copy @len bytes of @word into @arg with the quotes and backslashes removed */
+static void copy_word(char *arg, const char *word, int len)
+{
+	const char *end = word + len;
+	char q = 0;
+
+	for (; word < end; word++) {
+		switch (*word) {
+		case '\'':
+		case '"':
+			if (!q)
+				q = *word;
+			else if (*word == q)
+				q = 0;
+			break;
+		case '\\':
+			/* A backslash at the end is kept */
+			if (word + 1 < end)
+				word++;
+			/* fallthrough */
+		default:
+			*arg++ = *word;
+			break;
+		}
+	}
+	*arg = '\0';
+}
+
 /**
  * ccli_line_parse - parse a string into its arguments
  * @line: The string to parse
@@ -255,13 +395,10 @@ __hidden int line_copy(struct line_buf *dst, struct line_buf *src, int len)
 int ccli_line_parse(const char *line, char ***pargv)
 {
 	char **argv = NULL;
+	const char *word;
+	const char *p;
 	char *arg;
 	char **v;
-	const char *p = line;
-	const char *word;
-	char *w;
-	char *u;
-	char q = 0;
 	int argc = 0;
 	int len;
 
@@ -273,86 +410,22 @@ int ccli_line_parse(const char *line, char ***pargv)
 	/* In case ccli_argv_free() gets called on a return of zero */
 	*pargv = NULL;
 
-	while (*p) {
-		bool last = false;
-
-		while (ISSPACE(*p))
-			p++;
-
-		if (!*p)
-			break;
-
-		word = p;
-
-		for ( ; !last && *p; p++) {
-
-			switch (*p) {
-			case '\'':
-			case '"':
-				if (!q)
-					q = *p;
-				else if (*p == q)
-					q = 0;
-				break;
-			case '\\':
-				p++;
-				if (!*p)
-					p--;
-				break;
-
-			default:
-				if (q)
-					break;
-				if (ISSPACE(*p))
-					last = true;
-				break;
-			}
-		}
-
-		/* Do not include the space that was found */
-		if (last)
-			p--;
-
+	for (p = line; (word = next_word(p, &p)); ) {
 		len = p - word;
 
-		arg = malloc(len + 1);
+		arg = mem_alloc(NULL, len + 1);
 		if (!arg)
 			goto fail;
 
 		/* Add two, one for a NULL value at the end */
-		v = realloc(argv, sizeof(*v) * (argc + 2));
+		v = mem_realloc(NULL, argv, sizeof(*v) * (argc + 2));
 		if (!v) {
-			free(arg);
+			mem_free(NULL, arg);
 			goto fail;
 		}
 		argv = v;
 
-		strncpy(arg, word, len);
-		arg[len] = '\0';
-
-		/* Now remove quotes and backslashes */
-		u = w = arg;
-		q = 0;
-		for (; *u; u++) {
-			switch (*u) {
-			case '\'':
-			case '"':
-				if (!q)
-					q = *u;
-				else if (*u == q)
-					q = 0;
-				break;
-			case '\\':
-				u++;
-				if (!*u)
-					u--;
-				/* fallthrough */
-			default:
-				*w++ = *u;
-				break;
-			}
-		}
-		*w = '\0';
+		copy_word(arg, word, len);
 		argv[argc++] = arg;
 		argv[argc] = NULL;
 	}
@@ -380,13 +453,75 @@ void ccli_argv_free(char **argv)
 		return;
 
 	for (i = 0; argv[i]; i++)
-		free(argv[i]);
-	free(argv);
+		mem_free(NULL, argv[i]);
+	mem_free(NULL, argv);
 }
 
-__hidden int line_parse(const char *line, char ***pargv)
+/**
+ * line_parse - parse a line for the ccli internals
+ * @ccli: The CLI descriptor to take the memory from
+ * @line: The string to parse
+ * @pargv: A pointer to place the array of strings
+ *
+ * Works like ccli_line_parse(), but the array and all the strings are
+ * placed in a single block from the argv pool of @ccli. As every word
+ * is at least followed by one space, there can not be more than
+ * half the length of @line words, and all the words with their
+ * nul terminators can not take up more than the length of @line
+ * plus one.
+ *
+ * Returns the number of arguments or -1 on error. @pargv must be
+ *  freed with line_argv_free().
+ */
+__hidden int line_parse(struct ccli *ccli, const char *line, char ***pargv)
 {
-	return ccli_line_parse(line, pargv);
+	const char *word;
+	const char *p;
+	char **argv;
+	char *arg;
+	size_t size;
+	int argc = 0;
+	int len;
+
+	len = strlen(line);
+	size = sizeof(*argv) * (len / 2 + 2) + len + 1;
+
+	argv = pool_alloc(&ccli->pools[CCLI_POOL_ARGV], size);
+	if (!argv)
+		return -1;
+
+	arg = (char *)(argv + len / 2 + 2);
+
+	for (p = line; (word = next_word(p, &p)); ) {
+		len = p - word;
+		copy_word(arg, word, len);
+		argv[argc++] = arg;
+		arg += strlen(arg) + 1;
+	}
+	argv[argc] = NULL;
+
+	*pargv = argv;
+
+	return argc;
+}
+
+/* Returns where word @n (from zero) of @line starts, as line_parse() splits it */
+__hidden const char *line_word(const char *line, int n)
+{
+	const char *word;
+	const char *p;
+
+	for (p = line; (word = next_word(p, &p)); n--) {
+		if (!n)
+			return word;
+	}
+
+	return NULL;
+}
+
+__hidden void line_argv_free(struct ccli *ccli, char **argv)
+{
+	pool_free(&ccli->pools[CCLI_POOL_ARGV], argv);
 }
 
 __hidden void line_replace(struct line_buf *line, char *str)
@@ -405,6 +540,7 @@ __hidden void line_replace(struct line_buf *line, char *str)
 
 __hidden void line_refresh(struct ccli *ccli, struct line_buf *line, int pad)
 {
+	unsigned long start = stat_read(ccli, bytes_written);
 	char padding[pad + 3];
 	int len;
 
@@ -414,6 +550,8 @@ __hidden void line_refresh(struct ccli *ccli, struct line_buf *line, int pad)
 	memset(padding, ' ', pad);
 	padding[pad] = '\0';
 
+	stat_add(ccli, redraws, 1);
+
 	echo(ccli, '\r');
 
 	if (line->start)
@@ -427,4 +565,71 @@ __hidden void line_refresh(struct ccli *ccli, struct line_buf *line, int pad)
 
 	for (len = line->len; len > line->pos; len--)
 		echo(ccli, '\b');
+
+	trace_probe(redraw, stat_read(ccli, bytes_written) - start);
+}
+
+/* Output of a refresh, written out in as few writes as it takes */
+struct refresh_buf {
+	struct ccli		*ccli;
+	int			len;
+	char			buf[256];
+};
+
+static void refresh_flush(struct refresh_buf *rb)
+{
+	if (rb->len)
+		echo_str_len(rb->ccli, rb->buf, rb->len);
+	rb->len = 0;
+}
+
+static void refresh_add(struct refresh_buf *rb, const char *str, int len)
+{
+	int n;
+
+	while (len) {
+		if (rb->len == sizeof(rb->buf))
+			refresh_flush(rb);
+		n = sizeof(rb->buf) - rb->len;
+		if (n > len)
+			n = len;
+		memcpy(rb->buf + rb->len, str, n);
+		rb->len += n;
+		str += n;
+		len -= n;
+	}
+}
+
+static void refresh_fill(struct refresh_buf *rb, char ch, int cnt)
+{
+	for (; cnt; cnt--) {
+		if (rb->len == sizeof(rb->buf))
+			refresh_flush(rb);
+		rb->buf[rb->len++] = ch;
+	}
+}
+
+/*
+ * After an insert or a delete at @from, where the cursor is, only what
+ * is after it moved. Write that out instead of the prompt and the whole
+ * line, so that typing costs the same however long the line is. @back is
+ * how far the cursor is past @from on the screen (one after a backspace),
+ * and @pad is how many characters the line got shorter, which are cleared
+ * after it. It all goes out in one write, unless the tail does not fit.
+ */
+__hidden void line_refresh_tail(struct ccli *ccli, struct line_buf *line,
+				int from, int back, int pad)
+{
+	unsigned long start = stat_read(ccli, bytes_written);
+	struct refresh_buf rb = { .ccli = ccli };
+
+	stat_add(ccli, redraws, 1);
+
+	refresh_fill(&rb, '\b', back);
+	refresh_add(&rb, line->line + from, line->len - from);
+	refresh_fill(&rb, ' ', pad);
+	refresh_fill(&rb, '\b', line->len - line->pos + pad);
+	refresh_flush(&rb);
+
+	trace_probe(redraw, stat_read(ccli, bytes_written) - start);
 }
@@ -0,0 +1,371 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Export the counters and the times of the commands to a file.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "ccli-local.h"
+
+/*
+ * The file is in the text format of Prometheus, for the textfile
+ * collector of the node exporter to pick up. It is written to a new
+ * file next to it, and then renamed over it, so that the collector
+ * never sees one that is half written. This runs from the loop, when
+ * the timer fires while waiting for input, so nothing is exported while
+ * a command executes, and no other thread is needed.
+ */
+struct metrics {
+	char			*file;
+	char			*tmp;		/* Template for mkstemp() */
+	int			tfd;
+	struct capture		buf;
+};
+
+static const struct {
+	const char		*name;
+	const char		*help;
+	size_t			offset;
+} counters[] = {
+	{ "reads_total", "read() calls made on the input",
+	  offsetof(struct ccli_stats, reads) },
+	{ "read_bytes_total", "Bytes read from the input",
+	  offsetof(struct ccli_stats, bytes_read) },
+	{ "writes_total", "write() calls made on the output",
+	  offsetof(struct ccli_stats, writes) },
+	{ "written_bytes_total", "Bytes written to the output",
+	  offsetof(struct ccli_stats, bytes_written) },
+	{ "redraws_total", "Times the line was drawn again",
+	  offsetof(struct ccli_stats, redraws) },
+	{ "allocs_total", "Allocations and reallocations made",
+	  offsetof(struct ccli_stats, allocs) },
+	{ "completions_total", "Completions done",
+	  offsetof(struct ccli_stats, completions) },
+	{ "history_searches_total", "Reverse history searches done",
+	  offsetof(struct ccli_stats, history_searches) },
+};
+
+static const char *pool_names[CCLI_NR_POOLS] = {
+	[CCLI_POOL_LINE]	= "line",
+	[CCLI_POOL_ARGV]	= "argv",
+	[CCLI_POOL_COMPLETION]	= "completion",
+};
+
+__attribute__((__format__(printf, 3, 4)))
+static void buf_printf(struct ccli *ccli, struct capture *cap,
+		       const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+	int size;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (cap->len + len >= cap->size) {
+		size = cap->size ? cap->size : 4096;
+		while (size <= cap->len + len)
+			size *= 2;
+		buf = mem_realloc(ccli, cap->buf, size);
+		if (!buf) {
+			/* Sticks until metrics_write() starts over */
+			cap->failed = true;
+			return;
+		}
+		cap->buf = buf;
+		cap->size = size;
+	}
+
+	va_start(ap, fmt);
+	cap->len += vsnprintf(cap->buf + cap->len, cap->size - cap->len, fmt, ap);
+	va_end(ap);
+}
+
+/* A label value, with '\', '"' and newline escaped */
+static void buf_label(struct ccli *ccli, struct capture *cap, const char *str)
+{
+	const char *p;
+
+	for (p = str; *p; p++) {
+		switch (*p) {
+		case '\\':
+		case '"':
+			buf_printf(ccli, cap, "\\%c", *p);
+			break;
+		case '\n':
+			buf_printf(ccli, cap, "\\n");
+			break;
+		default:
+			buf_printf(ccli, cap, "%c", *p);
+		}
+	}
+}
+
+static void help(struct ccli *ccli, struct capture *cap, const char *name,
+		 const char *help, const char *type)
+{
+	buf_printf(ccli, cap, "# HELP ccli_%s %s.\n", name, help);
+	buf_printf(ccli, cap, "# TYPE ccli_%s %s\n", name, type);
+}
+
+static void export_counters(struct ccli *ccli, struct capture *cap)
+{
+	struct ccli_stats stats;
+	int i;
+
+	ccli_stats(ccli, &stats);
+
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+		help(ccli, cap, counters[i].name, counters[i].help, "counter");
+		buf_printf(ccli, cap, "ccli_%s %lu\n", counters[i].name,
+			   *(unsigned long *)((char *)&stats + counters[i].offset));
+	}
+}
+
+static void export_pools(struct ccli *ccli, struct capture *cap)
+{
+	struct ccli_pool_stats stats[CCLI_NR_POOLS];
+	int i;
+
+	for (i = 0; i < CCLI_NR_POOLS; i++)
+		ccli_pool_stats(ccli, i, &stats[i]);
+
+#define POOL_METRIC(field, type, help_str, suffix)			\
+	help(ccli, cap, "pool_" #field suffix, help_str, type);		\
+	for (i = 0; i < CCLI_NR_POOLS; i++)				\
+		buf_printf(ccli, cap, "ccli_pool_" #field suffix	\
+			   "{pool=\"%s\"} %lu\n",			\
+			   pool_names[i], stats[i].field)
+
+	POOL_METRIC(allocs, "counter", "Allocations asked of the pool", "_total");
+	POOL_METRIC(hits, "counter", "Allocations the pool had cached", "_total");
+	POOL_METRIC(cached_bytes, "gauge", "Bytes the pool has cached", "");
+#undef POOL_METRIC
+}
+
+static void export_history(struct ccli *ccli, struct capture *cap)
+{
+	int lines;
+	int bytes;
+
+	pthread_mutex_lock(&ccli->history_lock);
+	lines = ccli->history_size;
+	bytes = ccli->history_bytes;
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	help(ccli, cap, "history_lines", "Lines in the history", "gauge");
+	buf_printf(ccli, cap, "ccli_history_lines %d\n", lines);
+	help(ccli, cap, "history_bytes", "Bytes of text in the history", "gauge");
+	buf_printf(ccli, cap, "ccli_history_bytes %d\n", bytes);
+}
+
+static void export_timing(struct ccli *ccli, struct capture *cap,
+			  struct timing *t)
+{
+	unsigned long cnt = 0;
+	int b;
+
+	/* The last bucket is the same as +Inf */
+	for (b = 0; b < TIMING_BUCKETS - 1; b++) {
+		cnt += t->buckets[b];
+		buf_printf(ccli, cap, "ccli_command_duration_seconds_bucket{command=\"");
+		buf_label(ccli, cap, t->name);
+		buf_printf(ccli, cap, "\",le=\"%g\"} %lu\n",
+			   (double)(1ULL << b) / 1000000, cnt);
+	}
+
+	buf_printf(ccli, cap, "ccli_command_duration_seconds_bucket{command=\"");
+	buf_label(ccli, cap, t->name);
+	buf_printf(ccli, cap, "\",le=\"+Inf\"} %lu\n", t->count);
+
+	buf_printf(ccli, cap, "ccli_command_duration_seconds_sum{command=\"");
+	buf_label(ccli, cap, t->name);
+	buf_printf(ccli, cap, "\"} %.9f\n", t->sum_ns / 1000000000.0);
+
+	buf_printf(ccli, cap, "ccli_command_duration_seconds_count{command=\"");
+	buf_label(ccli, cap, t->name);
+	buf_printf(ccli, cap, "\"} %lu\n", t->count);
+}
+
+static void export_timings(struct ccli *ccli, struct capture *cap)
+{
+	struct timing *t;
+	int i;
+
+	help(ccli, cap, "command_duration_seconds",
+	     "Time the commands took to execute", "histogram");
+
+	for (i = 0; i < TIMING_HASH; i++) {
+		for (t = ccli->timings->hash[i]; t; t = t->next)
+			export_timing(ccli, cap, t);
+	}
+}
+
+static int metrics_write(struct ccli *ccli)
+{
+	struct metrics *metrics = ccli->metrics;
+	struct capture *cap = &metrics->buf;
+	int ret;
+	int fd;
+
+	cap->len = 0;
+	cap->failed = false;
+	export_counters(ccli, cap);
+	export_pools(ccli, cap);
+	export_history(ccli, cap);
+	if (ccli->timings)
+		export_timings(ccli, cap);
+
+	/* Better to leave the last file in place than a partial one */
+	if (cap->failed) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	strcpy(metrics->tmp + strlen(metrics->file), ".XXXXXX");
+	fd = mkstemp(metrics->tmp);
+	if (fd < 0)
+		return -1;
+
+	/* mkstemp() only lets the owner read it */
+	fchmod(fd, 0644);
+
+	ret = write(fd, cap->buf, cap->len);
+	if (ret >= 0 && ret != cap->len) {
+		errno = ENOSPC;
+		ret = -1;
+	}
+	if (close(fd) < 0)
+		ret = -1;
+	if (ret < 0)
+		goto fail;
+
+	if (rename(metrics->tmp, metrics->file) < 0)
+		goto fail;
+
+	return 0;
+ fail:
+	unlink(metrics->tmp);
+	return -1;
+}
+
+__hidden int metrics_fd(struct ccli *ccli)
+{
+	return ccli->metrics ? ccli->metrics->tfd : -1;
+}
+
+/* Called from the loop when the timer fired */
+__hidden void metrics_handle(struct ccli *ccli)
+{
+	uint64_t val;
+
+	if (read(ccli->metrics->tfd, &val, sizeof(val)) != sizeof(val))
+		return;
+
+	metrics_write(ccli);
+}
+
+__hidden void metrics_free(struct ccli *ccli)
+{
+	struct metrics *metrics = ccli->metrics;
+
+	if (!metrics)
+		return;
+
+	if (metrics->tfd >= 0)
+		close(metrics->tfd);
+	mem_free(ccli, metrics->buf.buf);
+	mem_free(ccli, metrics->tmp);
+	mem_free(ccli, metrics->file);
+	mem_free(ccli, metrics);
+	ccli->metrics = NULL;
+}
+
+/**
+ * ccli_metrics_file - Write the counters to a file every so often
+ * @ccli: The CLI descriptor to export the counters of
+ * @file: The file to write them to (NULL to stop)
+ * @ms: How often to write the file in milliseconds
+ *
+ * Write the counters of ccli_stats() and ccli_pool_stats(), the size
+ * of the history and a histogram of the times of each command (which
+ * this starts to keep) to @file, in the text format that Prometheus
+ * reads, and do so again every @ms milliseconds while ccli_loop()
+ * waits for input. The file is replaced with rename(), so that whatever
+ * reads it never sees it half written.
+ *
+ * The file is written once before this returns, to report if it can
+ * not be.
+ *
+ * The timer is polled by ccli_loop(), so this may only be called from
+ * the thread that runs it (like from a command), or while it is not
+ * running.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_metrics_file(struct ccli *ccli, const char *file, int ms)
+{
+	struct metrics *metrics;
+	struct itimerspec its;
+	int len;
+
+	if (!ccli || (file && ms <= 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The loop may be polling the timer that this closes */
+	if (other_thread(ccli)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	metrics_free(ccli);
+	if (!file)
+		return 0;
+
+	if (timings_init(ccli) < 0)
+		return -1;
+
+	metrics = mem_zalloc(ccli, sizeof(*metrics));
+	if (!metrics)
+		return -1;
+
+	ccli->metrics = metrics;
+	metrics->tfd = -1;
+
+	len = strlen(file);
+	metrics->file = mem_strdup(ccli, file);
+	metrics->tmp = mem_alloc(ccli, len + sizeof(".XXXXXX"));
+	if (!metrics->file || !metrics->tmp)
+		goto fail;
+	strcpy(metrics->tmp, file);
+
+	metrics->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (metrics->tfd < 0)
+		goto fail;
+
+	if (metrics_write(ccli) < 0)
+		goto fail;
+
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(metrics->tfd, 0, &its, NULL) < 0)
+		goto fail;
+
+	return 0;
+ fail:
+	len = errno;
+	metrics_free(ccli);
+	errno = len;
+	return -1;
+}
@@ -0,0 +1,711 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * A pager for the output of commands, that scrolls both ways and
+ * searches.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "ccli-local.h"
+
+#ifndef CCLI_NO_PAGER
+
+/*
+ * Between ccli_pager_start() and ccli_pager_stop(), what the loop thread
+ * writes is kept in fixed size chunks, so that a large output is never
+ * copied to grow it, along with the offset of the start of each line.
+ * When it is stopped, the output is shown one screen at a time, and the
+ * user can go back and forth through it, and search it, without the
+ * command having to run again.
+ *
+ * If keeping the output runs out of memory, what was kept is written out,
+ * and so is everything after it, as if there was no pager.
+ */
+
+#define PAGER_CHUNK		(16 * 1024)
+#define PAGER_PATTERN_MAX	256
+#define PAGER_TAB		8
+
+#define PAGE_USAGE	"usage: page command [args...]\n"
+
+#define PAGER_HELP	"q:quit space/b:page j/k:line g/G:top/end /?:search n/N:next"
+
+struct pager {
+	char			**chunks;
+	int			nr_chunks;
+	size_t			len;
+	size_t			*lines;		/* Offset of the start of each line */
+	int			nr_lines;
+	int			max_lines;
+	bool			bol;		/* The next byte starts a line */
+	bool			failed;		/* Out of memory, write it out */
+};
+
+/* What is shown of the pager */
+struct pager_view {
+	struct pager		*pager;
+	struct capture		screen;
+	char			*line;		/* The line from view_line() */
+	int			line_size;
+	int			rows;		/* Of output, the last one is for status */
+	int			cols;
+	int			top;
+	const char		*msg;
+	char			pattern[PAGER_PATTERN_MAX];
+	int			plen;
+	bool			backward;
+};
+
+static int index_line(struct ccli *ccli, struct pager *pager)
+{
+	size_t *lines;
+	int max;
+
+	if (pager->nr_lines == pager->max_lines) {
+		max = pager->max_lines ? pager->max_lines * 2 : 256;
+		lines = mem_realloc(ccli, pager->lines, sizeof(*lines) * max);
+		if (!lines)
+			return -1;
+		pager->lines = lines;
+		pager->max_lines = max;
+	}
+	pager->lines[pager->nr_lines++] = pager->len;
+	return 0;
+}
+
+static int copy_in(struct ccli *ccli, struct pager *pager,
+		   const char *str, int len)
+{
+	char **chunks;
+	int chunk;
+	int off;
+	int n;
+
+	while (len) {
+		chunk = pager->len / PAGER_CHUNK;
+		off = pager->len % PAGER_CHUNK;
+
+		if (chunk == pager->nr_chunks) {
+			chunks = mem_realloc(ccli, pager->chunks,
+					     sizeof(*chunks) * (chunk + 1));
+			if (!chunks)
+				return -1;
+			pager->chunks = chunks;
+			chunks[chunk] = mem_alloc(ccli, PAGER_CHUNK);
+			if (!chunks[chunk])
+				return -1;
+			pager->nr_chunks++;
+		}
+
+		n = PAGER_CHUNK - off < len ? PAGER_CHUNK - off : len;
+		memcpy(pager->chunks[chunk] + off, str, n);
+		pager->len += n;
+		str += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void write_kept(struct ccli *ccli, struct pager *pager)
+{
+	int i;
+
+	for (i = 0; i < pager->nr_chunks; i++) {
+		write_out(ccli, pager->chunks[i],
+			  i < pager->nr_chunks - 1 ? PAGER_CHUNK :
+			  pager->len - (size_t)i * PAGER_CHUNK);
+	}
+}
+
+static void free_kept(struct ccli *ccli, struct pager *pager)
+{
+	int i;
+
+	for (i = 0; i < pager->nr_chunks; i++)
+		mem_free(ccli, pager->chunks[i]);
+	mem_free(ccli, pager->chunks);
+	mem_free(ccli, pager->lines);
+	pager->chunks = NULL;
+	pager->nr_chunks = 0;
+	pager->len = 0;
+	pager->lines = NULL;
+	pager->nr_lines = 0;
+	pager->max_lines = 0;
+}
+
+/* Keep what is written while paging, instead of writing it out */
+__hidden int pager_add(struct ccli *ccli, const char *str, int len)
+{
+	struct pager *pager = ccli->pager;
+	size_t start = pager->len;
+	const char *nl;
+	int n;
+	int i;
+
+	if (pager->failed)
+		return write_out(ccli, str, len);
+
+	for (i = 0; i < len; i += n) {
+		if (pager->bol) {
+			if (index_line(ccli, pager) < 0)
+				goto failed;
+			pager->bol = false;
+		}
+
+		nl = memchr(str + i, '\n', len - i);
+		n = nl ? nl - (str + i) + 1 : len - i;
+		if (copy_in(ccli, pager, str + i, n) < 0)
+			goto failed;
+
+		pager->bol = nl != NULL;
+	}
+	return len;
+
+ failed:
+	/* Part of @str may have been kept already */
+	n = pager->len - start;
+	write_kept(ccli, pager);
+	free_kept(ccli, pager);
+	pager->failed = true;
+	if (write_out(ccli, str + n, len - n) < 0)
+		return -1;
+	return len;
+}
+
+static void free_pager(struct ccli *ccli, struct pager *pager)
+{
+	free_kept(ccli, pager);
+	mem_free(ccli, pager);
+}
+
+__hidden void pager_free(struct ccli *ccli)
+{
+	if (!ccli->pager)
+		return;
+
+	free_pager(ccli, ccli->pager);
+	ccli->pager = NULL;
+}
+
+/* The watchdog looks at where the output goes, see write_now() */
+static void set_pager(struct ccli *ccli, struct pager *pager, bool viewing)
+{
+	pthread_mutex_lock(&ccli->out_lock);
+	ccli->pager = pager;
+	ccli->viewing = viewing;
+	pthread_mutex_unlock(&ccli->out_lock);
+}
+
+/* Copy line @nr, without its newline, into view->line */
+static const char *view_line(struct ccli *ccli, struct pager_view *view,
+			    int nr, int *plen)
+{
+	struct pager *pager = view->pager;
+	size_t start = pager->lines[nr];
+	size_t end;
+	char *line;
+	int len;
+	int off;
+	int n;
+
+	end = nr + 1 < pager->nr_lines ? pager->lines[nr + 1] : pager->len;
+	len = end - start;
+
+	if (len >= view->line_size) {
+		line = mem_realloc(ccli, view->line, len + 1);
+		if (!line)
+			return NULL;
+		view->line = line;
+		view->line_size = len + 1;
+	}
+
+	/* A line may go over the end of a chunk */
+	for (off = 0; off < len; off += n) {
+		n = PAGER_CHUNK - (start + off) % PAGER_CHUNK;
+		if (n > len - off)
+			n = len - off;
+		memcpy(view->line + off,
+		       pager->chunks[(start + off) / PAGER_CHUNK] +
+		       (start + off) % PAGER_CHUNK, n);
+	}
+
+	if (len && view->line[len - 1] == '\n')
+		len--;
+	view->line[len] = '\0';
+
+	*plen = len;
+	return view->line;
+}
+
+/* The window may have been resized since it was last drawn */
+static void view_size(struct ccli *ccli, struct pager_view *view)
+{
+	struct winsize w;
+
+	if (!ioctl(ccli->in, TIOCGWINSZ, &w) && w.ws_row > 1 && w.ws_col) {
+		view->rows = w.ws_row;
+		view->cols = w.ws_col;
+	}
+
+	/* SIGWINCH clears it, see view_resized() */
+	ccli->w_row = view->rows;
+}
+
+/*
+ * The length of the UTF-8 character at @s, or zero if it is not a valid
+ * one, or a C1 control that the terminal could act on. @width is set to
+ * the columns it takes: two for the wide ones, and none for the marks
+ * that combine with the character before them.
+ */
+static int utf8_char(const unsigned char *s, int len, int *width)
+{
+	unsigned int c;
+	int n;
+	int i;
+
+	if (s[0] < 0xc2 || s[0] > 0xf4)
+		return 0;
+
+	n = s[0] >= 0xf0 ? 4 : s[0] >= 0xe0 ? 3 : 2;
+	if (n > len)
+		return 0;
+
+	c = s[0] & (0x7f >> n);
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+		c = c << 6 | (s[i] & 0x3f);
+	}
+
+	/* Overlong, C1 controls, surrogates and past the last code point */
+	if ((n == 2 && c < 0xa0) || (n == 3 && c < 0x800) ||
+	    (n == 4 && c < 0x10000) || (c >= 0xd800 && c <= 0xdfff) ||
+	    c > 0x10ffff)
+		return 0;
+
+	if ((c >= 0x300 && c <= 0x36f) || (c >= 0x200b && c <= 0x200f))
+		*width = 0;
+	else if ((c >= 0x1100 && c <= 0x115f) || (c >= 0x2e80 && c <= 0xa4cf) ||
+		 (c >= 0xac00 && c <= 0xd7a3) || (c >= 0xf900 && c <= 0xfaff) ||
+		 (c >= 0xfe30 && c <= 0xfe4f) || (c >= 0xff00 && c <= 0xff60) ||
+		 (c >= 0xffe0 && c <= 0xffe6) || (c >= 0x1f300 && c <= 0x1f64f) ||
+		 (c >= 0x1f900 && c <= 0x1f9ff) || (c >= 0x20000 && c <= 0x3fffd))
+		*width = 2;
+	else
+		*width = 1;
+
+	return n;
+}
+
+/*
+ * Add @line to the screen as it shows, cut at the width of the window.
+ * Tabs are expanded, and the output can not move the cursor or change
+ * the colors of the pager: other control characters show as ^X, and
+ * bytes that are not UTF-8 as <XX>.
+ */
+static void draw_line(struct ccli *ccli, struct pager_view *view,
+		      const char *line, int len)
+{
+	const unsigned char *s = (const unsigned char *)line;
+	const char *out;
+	char buf[PAGER_TAB];
+	int width;
+	int col = 0;
+	int n;
+	int i;
+
+	for (i = 0; i < len; i += n) {
+		out = line + i;
+		n = 1;
+		width = 1;
+
+		if (s[i] == '\t') {
+			width = PAGER_TAB - col % PAGER_TAB;
+			if (col + width > view->cols)
+				width = view->cols - col;
+			memset(buf, ' ', width);
+			out = buf;
+		} else if (s[i] < ' ' || s[i] == 0x7f) {
+			buf[0] = '^';
+			buf[1] = s[i] ^ 0x40;
+			out = buf;
+			width = 2;
+		} else if (s[i] >= 0x80) {
+			n = utf8_char(s + i, len - i, &width);
+			if (!n) {
+				snprintf(buf, sizeof(buf), "<%02X>", s[i]);
+				out = buf;
+				n = 1;
+				width = 4;
+			}
+		}
+
+		if (col + width > view->cols)
+			break;
+
+		/* What is written out is as long as what it shows */
+		capture_add(ccli, &view->screen, out,
+			    out == line + i ? n : width);
+		col += width;
+	}
+}
+
+static int last_top(struct pager_view *view)
+{
+	int top = view->pager->nr_lines - (view->rows - 1);
+
+	return top > 0 ? top : 0;
+}
+
+static void draw_view(struct ccli *ccli, struct pager_view *view)
+{
+	struct capture *screen = &view->screen;
+	struct pager *pager = view->pager;
+	const char *line;
+	char status[64];
+	int bottom;
+	int len;
+	int r;
+
+	screen->len = 0;
+	capture_add(ccli, screen, "\033[H\033[2J", 7);
+
+	for (r = 0; r < view->rows - 1; r++) {
+		if (view->top + r >= pager->nr_lines) {
+			capture_add(ccli, screen, "~\n", 2);
+			continue;
+		}
+		line = view_line(ccli, view, view->top + r, &len);
+		if (!line)
+			continue;
+		draw_line(ccli, view, line, len);
+		capture_add(ccli, screen, "\n", 1);
+	}
+
+	bottom = view->top + view->rows - 1;
+	if (bottom > pager->nr_lines)
+		bottom = pager->nr_lines;
+
+	if (view->msg) {
+		len = snprintf(status, sizeof(status), "%s", view->msg);
+		view->msg = NULL;
+	} else {
+		len = snprintf(status, sizeof(status), "lines %d-%d/%d%s",
+			       view->top + 1, bottom, pager->nr_lines,
+			       bottom == pager->nr_lines ? " (END)" : "");
+	}
+	if (len >= sizeof(status))
+		len = sizeof(status) - 1;
+	if (len > view->cols)
+		len = view->cols;
+
+	capture_add(ccli, screen, "\033[7m", 4);
+	capture_add(ccli, screen, status, len);
+	capture_add(ccli, screen, "\033[0m", 4);
+
+	write_out(ccli, screen->buf, screen->len);
+	stat_add(ccli, redraws, 1);
+	trace_probe(redraw, screen->len);
+}
+
+/* Read what to search for on the status line. Returns false if cancelled */
+static bool read_pattern(struct ccli *ccli, struct pager_view *view, char type)
+{
+	char pattern[PAGER_PATTERN_MAX];
+	int len = 0;
+	int ch;
+
+	write_out(ccli, "\r\033[K", 4);
+	echo(ccli, type);
+
+	for (;;) {
+		ch = read_char(ccli);
+		switch (ch) {
+		case '\n':
+		case '\r':
+			if (!len)
+				return view->plen > 0;
+			memcpy(view->pattern, pattern, len);
+			view->pattern[len] = '\0';
+			view->plen = len;
+			return true;
+		case CHAR_BACKSPACE:
+			if (!len)
+				return false;
+			len--;
+			write_out(ccli, "\b \b", 3);
+			break;
+		case CHAR_INTR:
+		case CHAR_ERROR:
+		case CHAR_EXIT:
+			return false;
+		default:
+			if (ch < ' ' || ch > '~' || len == sizeof(pattern) - 1)
+				break;
+			pattern[len++] = ch;
+			echo(ccli, ch);
+		}
+	}
+}
+
+/* Put the next line (or the one before with @backward) that matches at the top */
+static void search_view(struct ccli *ccli, struct pager_view *view, bool backward)
+{
+	const char *line;
+	int dir = backward ? -1 : 1;
+	int len;
+	int nr;
+
+	if (!view->plen) {
+		view->msg = "No previous pattern";
+		return;
+	}
+
+	for (nr = view->top + dir; nr >= 0 && nr < view->pager->nr_lines; nr += dir) {
+		line = view_line(ccli, view, nr, &len);
+		if (line && str_find(line, view->pattern, view->plen)) {
+			view->top = nr;
+			return;
+		}
+	}
+	view->msg = "Pattern not found";
+}
+
+static int show_view(struct ccli *ccli, struct pager *pager, int rows, int cols)
+{
+	struct pager_view view;
+	int ch;
+
+	memset(&view, 0, sizeof(view));
+	view.pager = pager;
+	view.rows = rows;
+	view.cols = cols;
+	view.msg = PAGER_HELP;
+
+	for (;;) {
+		view_size(ccli, &view);
+		if (view.top > last_top(&view))
+			view.top = last_top(&view);
+		if (view.top < 0)
+			view.top = 0;
+
+		draw_view(ccli, &view);
+
+		ch = read_char(ccli);
+		switch (ch) {
+		case 'q':
+		case 'Q':
+		case CHAR_INTR:
+		case CHAR_ERROR:
+		case CHAR_EXIT:
+			goto out;
+		case ' ':
+		case 'f':
+		case CHAR_PAGEDOWN:
+			view.top += view.rows - 1;
+			break;
+		case 'b':
+		case CHAR_PAGEUP:
+			view.top -= view.rows - 1;
+			break;
+		case 'j':
+		case '\n':
+		case '\r':
+		case CHAR_DOWN:
+			view.top++;
+			break;
+		case 'k':
+		case CHAR_UP:
+			view.top--;
+			break;
+		case 'g':
+		case '<':
+		case CHAR_HOME:
+			view.top = 0;
+			break;
+		case 'G':
+		case '>':
+		case CHAR_END:
+			view.top = last_top(&view);
+			break;
+		case '/':
+		case '?':
+			if (read_pattern(ccli, &view, ch)) {
+				view.backward = ch == '?';
+				search_view(ccli, &view, view.backward);
+			}
+			break;
+		case 'n':
+			search_view(ccli, &view, view.backward);
+			break;
+		case 'N':
+			search_view(ccli, &view, !view.backward);
+			break;
+		case CHAR_RESIZE:
+			/* Drawn again for the new size */
+			break;
+		}
+	}
+ out:
+	/* Leave the last screen, but not the status line */
+	write_out(ccli, "\r\033[K", 4);
+
+	mem_free(ccli, view.line);
+	mem_free(ccli, view.screen.buf);
+
+	return ch == CHAR_ERROR ? -1 : 0;
+}
+
+/**
+ * ccli_pager_start - Keep the output to show it in a pager
+ * @ccli: The CLI descriptor to page the output of
+ *
+ * From now until ccli_pager_stop() is called, what is written with
+ * ccli_printf() and the other output functions of @ccli (by the thread
+ * that runs the commands) is kept, and not written out. ccli_page()
+ * does not stop at each window full, nor does it need to count the
+ * lines, as the pager does that.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_pager_start(struct ccli *ccli)
+{
+	struct pager *pager;
+
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Output that is being captured (like by watch) can not be paged */
+	if (ccli->pager || ccli->capture) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	pager = mem_zalloc(ccli, sizeof(*pager));
+	if (!pager)
+		return -1;
+
+	pager->bol = true;
+	set_pager(ccli, pager, false);
+	return 0;
+}
+
+/**
+ * ccli_pager_stop - Show the output kept since ccli_pager_start()
+ * @ccli: The CLI descriptor to page the output of
+ *
+ * If the input of @ccli is a terminal, and the output kept does not fit
+ * in its window, it is shown a screen at a time, where the user can
+ * scroll forward and back, jump to the top or the end, and search, until
+ * 'q' or Ctrl^C is hit. Otherwise, it is written out as is.
+ *
+ * Lines are cut at the width of the window, tabs are expanded, and other
+ * control characters and bytes that are not UTF-8 are shown escaped. The
+ * size of the window is read again before each screen is drawn, and if
+ * SIGWINCH is registered with ccli_register_signal(), it is drawn again
+ * as soon as the window is resized.
+ *
+ * If there was not enough memory to keep all of the output, it was
+ * written out as it came instead, and nothing is left to show.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_pager_stop(struct ccli *ccli)
+{
+	struct pager *pager;
+	struct winsize w;
+	bool view;
+	int ret = 0;
+
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pager = ccli->pager;
+	if (!pager) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	view = ccli->in_tty && !ioctl(ccli->in, TIOCGWINSZ, &w) &&
+		w.ws_row > 1 && w.ws_col && pager->nr_lines >= w.ws_row;
+
+	/* What is written from now on is written out */
+	set_pager(ccli, NULL, view);
+
+	if (view) {
+		ret = show_view(ccli, pager, w.ws_row, w.ws_col);
+		set_pager(ccli, NULL, false);
+	} else {
+		write_kept(ccli, pager);
+	}
+
+	free_pager(ccli, pager);
+	return ret;
+}
+
+static int page_command(struct ccli *ccli, const char *command,
+			const char *line, void *data,
+			int argc, char **argv)
+{
+	const char *cmd;
+	int ret;
+
+	/* Use what was typed, so that the quoting is kept */
+	cmd = line_word(line, 1);
+	if (!cmd) {
+		echo_str(ccli, PAGE_USAGE);
+		return 0;
+	}
+
+	if (ccli_pager_start(ccli) < 0) {
+		echo_str(ccli, "page: can not page this output\n");
+		return 0;
+	}
+
+	ret = execute(ccli, cmd, false);
+
+	ccli_pager_stop(ccli);
+
+	return ret;
+}
+
+/**
+ * ccli_register_pager - Add the "page" command
+ * @ccli: The CLI descriptor to add the command to
+ *
+ * Registers the command "page command [args...]", which executes the
+ * given command with its output kept, and then shows it with the pager
+ * of ccli_pager_stop().
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_pager(struct ccli *ccli)
+{
+	return ccli_register_command(ccli, "page", page_command, NULL);
+}
+#else
+/* Built with CCLI_NO_PAGER */
+int ccli_pager_start(struct ccli *ccli)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_pager_stop(struct ccli *ccli)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_register_pager(struct ccli *ccli)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Per session memory pools.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include "ccli-local.h"
+
+/*
+ * Every block handed out by the pool has this header in front of it.
+ * While the block is in use, only the size is valid. When the block
+ * is freed back to the pool, next is used to link it on the free list.
+ */
+struct pool_block {
+	struct pool_block	*next;
+	size_t			size;
+};
+
+static inline struct pool_block *to_block(void *ptr)
+{
+	return (struct pool_block *)ptr - 1;
+}
+
+/**
+ * pool_alloc - allocate a block from a pool
+ * @pool: The pool to allocate from
+ * @size: The minimum size of the block
+ *
+ * Returns the smallest block on the free list of @pool that can hold
+ * @size bytes, and only if there is none, allocates a new one.
+ *
+ * Returns the block or NULL on allocation failure.
+ */
+__hidden void *pool_alloc(struct pool *pool, size_t size)
+{
+	struct pool_block **best = NULL;
+	struct pool_block **last;
+	struct pool_block *blk;
+
+	pool->stats.allocs++;
+
+	for (last = &pool->free; *last; last = &(*last)->next) {
+		if ((*last)->size < size)
+			continue;
+		if (!best || (*last)->size < (*best)->size)
+			best = last;
+	}
+
+	if (best) {
+		blk = *best;
+		*best = blk->next;
+		pool->stats.hits++;
+		pool->stats.cached--;
+		pool->stats.cached_bytes -= blk->size;
+		return blk + 1;
+	}
+
+	pool->stats.misses++;
+
+	blk = mem_alloc(pool->ccli, sizeof(*blk) + size);
+	if (!blk)
+		return NULL;
+
+	blk->size = size;
+	return blk + 1;
+}
+
+__hidden void *pool_zalloc(struct pool *pool, size_t size)
+{
+	void *ptr;
+
+	ptr = pool_alloc(pool, size);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+/**
+ * pool_realloc - grow a block that came from a pool
+ * @pool: The pool that @ptr came from
+ * @ptr: The block to grow (may be NULL)
+ * @size: The new size
+ *
+ * Nothing is done if @ptr is already big enough. Otherwise, this acts
+ * like realloc(), where @ptr is still valid if this fails.
+ *
+ * Returns the new block or NULL on failure.
+ */
+__hidden void *pool_realloc(struct pool *pool, void *ptr, size_t size)
+{
+	struct pool_block *blk;
+
+	if (!ptr)
+		return pool_alloc(pool, size);
+
+	blk = to_block(ptr);
+	if (blk->size >= size)
+		return ptr;
+
+	pool->stats.allocs++;
+	pool->stats.misses++;
+
+	blk = mem_realloc(pool->ccli, blk, sizeof(*blk) + size);
+	if (!blk)
+		return NULL;
+
+	blk->size = size;
+	return blk + 1;
+}
+
+/* Return the usable size of a block returned by pool_alloc() */
+__hidden size_t pool_size(void *ptr)
+{
+	return to_block(ptr)->size;
+}
+
+/**
+ * pool_free - put a block back into a pool
+ * @pool: The pool that @ptr came from
+ * @ptr: The block to free
+ *
+ * Adds @ptr to the free list of @pool to be used by the next
+ * pool_alloc(). If the pool already has POOL_MAX_FREE blocks
+ * cached, or @ptr is bigger than POOL_MAX_BLOCK, then @ptr is really
+ * freed.
+ */
+__hidden void pool_free(struct pool *pool, void *ptr)
+{
+	struct pool_block *blk;
+
+	if (!ptr)
+		return;
+
+	blk = to_block(ptr);
+
+	if (pool->stats.cached >= POOL_MAX_FREE || blk->size > POOL_MAX_BLOCK) {
+		pool->stats.releases++;
+		mem_free(pool->ccli, blk);
+		return;
+	}
+
+	blk->next = pool->free;
+	pool->free = blk;
+	pool->stats.cached++;
+	pool->stats.cached_bytes += blk->size;
+}
+
+__hidden void pool_destroy(struct pool *pool)
+{
+	struct pool_block *blk;
+
+	while (pool->free) {
+		blk = pool->free;
+		pool->free = blk->next;
+		mem_free(pool->ccli, blk);
+	}
+	pool->stats.cached = 0;
+	pool->stats.cached_bytes = 0;
+}
+
+/**
+ * ccli_pool_stats - read the statistics of a memory pool
+ * @ccli: The CLI descriptor that owns the pool
+ * @type: Which pool to read
+ * @stats: Where to store the statistics
+ *
+ * Each ccli descriptor keeps a cache of the memory used for
+ * line buffers, parsed arguments and completions, so that executing
+ * commands does not need to go back to malloc() once it has warmed up.
+ * This reads how well the @type pool is doing.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_pool_stats(struct ccli *ccli, enum ccli_pool_type type,
+		    struct ccli_pool_stats *stats)
+{
+	if (!ccli || !stats || type < 0 || type >= CCLI_NR_POOLS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*stats = ccli->pools[type].stats;
+	return 0;
+}
@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Recording what the user types.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "ccli-local.h"
+
+#ifndef CCLI_NO_RECORD
+/*
+ * A recording is the magic "CCLIREC" followed by a version byte, and
+ * then one record for every read of the input and every change of the
+ * terminal size. Each record is a type byte, the time since the last
+ * record in microseconds, and its data. Numbers are stored as unsigned
+ * LEB128 (seven bits per byte, the high bit set on all but the last).
+ *
+ *   'I' <usecs> <len> <bytes...>	Input that was read
+ *   'W' <usecs> <rows> <cols>		The size of the terminal
+ *   'O' <usecs> <len> <bytes...>	Output (only written by ccli-replay)
+ *
+ * A typed key costs about four bytes, so a day of typing is well under
+ * a megabyte.
+ */
+
+#define RECORD_ENV		"CCLI_RECORD"
+
+/* The longest a record header gets: type, usecs and len */
+#define RECORD_HDR_MAX		(1 + 10 + 5)
+
+struct recorder {
+	int			fd;
+	bool			owned;		/* Opened from CCLI_RECORD */
+	unsigned long long	last;
+	unsigned short		rows;
+	unsigned short		cols;
+};
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int put_num(unsigned char *buf, unsigned long long val)
+{
+	int len = 0;
+
+	do {
+		buf[len] = val & 0x7f;
+		val >>= 7;
+		if (val)
+			buf[len] |= 0x80;
+		len++;
+	} while (val);
+
+	return len;
+}
+
+static int put_header(struct recorder *rec, unsigned char *buf, char type)
+{
+	unsigned long long now = now_us();
+	int len = 0;
+
+	buf[len++] = type;
+	len += put_num(buf + len, now - rec->last);
+	rec->last = now;
+
+	return len;
+}
+
+static void record_write(struct ccli *ccli, const void *buf, int len)
+{
+	struct recorder *rec = ccli->recorder;
+
+	/* Give up on the recording if it can not be written */
+	if (write(rec->fd, buf, len) != len)
+		ccli_record_stop(ccli);
+}
+
+static void record_winsize(struct ccli *ccli)
+{
+	struct recorder *rec = ccli->recorder;
+	unsigned char buf[RECORD_HDR_MAX + 5];
+	struct winsize w;
+	int len;
+
+	if (!ccli->in_tty || ioctl(ccli->in, TIOCGWINSZ, &w) < 0)
+		return;
+
+	if (w.ws_row == rec->rows && w.ws_col == rec->cols)
+		return;
+
+	rec->rows = w.ws_row;
+	rec->cols = w.ws_col;
+
+	len = put_header(rec, buf, 'W');
+	len += put_num(buf + len, w.ws_row);
+	len += put_num(buf + len, w.ws_col);
+
+	record_write(ccli, buf, len);
+}
+
+/* Called by read_in() with what was read from the input */
+__hidden void record_input(struct ccli *ccli, const void *data, int size)
+{
+	unsigned char buf[RECORD_HDR_MAX + 16];
+	struct recorder *rec = ccli->recorder;
+	int len;
+
+	/* The size is checked at every read, as SIGWINCH may not be handled */
+	record_winsize(ccli);
+	if (!ccli->recorder)
+		return;
+
+	len = put_header(rec, buf, 'I');
+	len += put_num(buf + len, size);
+
+	/* Keys are short, and most records take a single write */
+	if (size <= sizeof(buf) - len) {
+		memcpy(buf + len, data, size);
+		record_write(ccli, buf, len + size);
+		return;
+	}
+
+	record_write(ccli, buf, len);
+	if (ccli->recorder)
+		record_write(ccli, data, size);
+}
+
+/*
+ * Open @file to record into, only if it is a regular file of our own.
+ * It is not truncated until that is known, and a symlink is not followed,
+ * so that the name can not be used to clobber some other file.
+ */
+static int record_open(const char *file)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(file, O_WRONLY | O_CREAT | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC,
+		  0600);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid() || ftruncate(fd, 0) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Called by ccli_loop(), to start recording if the application allowed
+ * it with ccli_record_env() and CCLI_RECORD is set.
+ */
+__hidden void record_env_start(struct ccli *ccli)
+{
+	const char *file;
+	int fd;
+
+	if (ccli->recorder || !ccli->record_env)
+		return;
+
+	/* Not for setuid programs, whose environment is not to be trusted */
+	file = secure_getenv(RECORD_ENV);
+	if (!file || !*file)
+		return;
+
+	fd = record_open(file);
+	if (fd < 0)
+		return;
+
+	if (ccli_record_start(ccli, fd) < 0) {
+		close(fd);
+		return;
+	}
+
+	ccli->recorder->owned = true;
+}
+
+/* Called when ccli_loop() exits, to stop what record_env_start() started */
+__hidden void record_env_stop(struct ccli *ccli)
+{
+	if (ccli->recorder && ccli->recorder->owned)
+		ccli_record_stop(ccli);
+}
+
+/**
+ * ccli_record_start - Record what is typed into a file
+ * @ccli: The CLI descriptor to record the input of
+ * @fd: The file descriptor to write the recording to
+ *
+ * Writes everything that is read from the input of @ccli into @fd,
+ * along with when it was read and the size of the terminal, such
+ * that the session can be played back with ccli-replay.
+ *
+ * See ccli_record_env() to record into the file that the environment
+ * variable CCLI_RECORD names.
+ *
+ * This can only be called from the thread that runs ccli_loop(), or
+ * when no thread is running it.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_record_start(struct ccli *ccli, int fd)
+{
+	static const char magic[8] = "CCLIREC\1";
+	struct recorder *rec;
+
+	if (!ccli || fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ccli->recorder) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (write(fd, magic, sizeof(magic)) != sizeof(magic))
+		return -1;
+
+	rec = mem_zalloc(ccli, sizeof(*rec));
+	if (!rec)
+		return -1;
+
+	rec->fd = fd;
+	rec->last = now_us();
+	ccli->recorder = rec;
+
+	record_winsize(ccli);
+
+	return 0;
+}
+
+/**
+ * ccli_record_stop - Stop recording what is typed
+ * @ccli: The CLI descriptor to stop recording
+ *
+ * Stops the recording that ccli_record_start() started. The file
+ * descriptor that was passed to it is not closed.
+ *
+ * Returns 0 on success and -1 if @ccli was not recording.
+ */
+int ccli_record_stop(struct ccli *ccli)
+{
+	struct recorder *rec;
+
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	rec = ccli->recorder;
+	if (!rec) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	ccli->recorder = NULL;
+	if (rec->owned)
+		close(rec->fd);
+	mem_free(ccli, rec);
+
+	return 0;
+}
+
+/**
+ * ccli_record_env - Allow recording into the file named by CCLI_RECORD
+ * @ccli: The CLI descriptor to record the input of
+ * @enable: True to allow it, false to stop allowing it
+ *
+ * This is a debugging hook. Once enabled, if the environment variable
+ * CCLI_RECORD is set to a file name when ccli_loop() starts, then it
+ * records into that file until it returns. The file is only written if
+ * it is a regular file owned by the user (it is created if it does not
+ * exist), and CCLI_RECORD is ignored in setuid and setgid programs.
+ *
+ * A recording has every key that is typed, including passwords read
+ * with ccli_getchar(), so only enable this where that is fine.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_record_env(struct ccli *ccli, bool enable)
+{
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ccli->record_env = enable;
+	return 0;
+}
+#else
+/* Built with CCLI_NO_RECORD */
+int ccli_record_start(struct ccli *ccli, int fd)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_record_stop(struct ccli *ccli)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int ccli_record_env(struct ccli *ccli, bool enable)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * History that is shared between sessions.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <stdint.h>
+
+#include "ccli-local.h"
+
+/*
+ * The shared history is a ring of fixed size slots. A line is added by
+ * atomically incrementing the head to reserve a sequence number, which
+ * maps to the slot (seq & mask). Each slot has a stamp that works as a
+ * sequence lock:
+ *
+ *   0                - Nothing was ever written to the slot
+ *   (seq + 1) << 1 | 1 - The line for seq is being written
+ *   (seq + 1) << 1   - The slot holds the line for seq
+ *
+ * Readers never block writers. They copy the line out and then check
+ * that the stamp did not change while they did so. Writers never wait
+ * on each other either. If the slot is still being written by an older
+ * line (the ring wrapped while it was being written), or a newer line
+ * already owns the slot, then the line is dropped.
+ *
+ * The text of a slot is accessed a word at a time with atomics, as
+ * readers can be copying it while it is being overwritten. The words
+ * are stored with release and loaded with acquire, so that a reader
+ * that sees any of the new text also sees the stamp that marks the
+ * slot as busy.
+ */
+struct ring_slot {
+	unsigned long		stamp;
+	unsigned long		len;
+	unsigned long		text[];
+};
+
+struct ccli_shared_history {
+	unsigned long		head;
+	unsigned long		mask;
+	int			line_max;
+	size_t			stride;
+	struct ccli_allocator	allocator;
+	char			data[] __attribute__((aligned(sizeof(long))));
+};
+
+#define WORD_SIZE	sizeof(unsigned long)
+
+static inline size_t text_words(int len)
+{
+	return (len + WORD_SIZE - 1) / WORD_SIZE;
+}
+
+static inline struct ring_slot *ring_slot(struct ccli_shared_history *hist,
+					  unsigned long seq)
+{
+	return (struct ring_slot *)(hist->data + (seq & hist->mask) * hist->stride);
+}
+
+static inline unsigned long seq_stamp(unsigned long seq)
+{
+	return (seq + 1) << 1;
+}
+
+/* The size of the buffer a session needs to read lines out of @hist */
+__hidden size_t ring_buf_size(struct ccli_shared_history *hist)
+{
+	return text_words(hist->line_max + 1) * WORD_SIZE;
+}
+
+__hidden int ring_size(struct ccli_shared_history *hist)
+{
+	return hist->mask + 1;
+}
+
+/* The sequence number the next line added will get */
+__hidden unsigned long ring_head(struct ccli_shared_history *hist)
+{
+	return __atomic_load_n(&hist->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * ring_add - add a line to the shared history
+ * @hist: The shared history to add to
+ * @line: The line to add
+ *
+ * Returns 0 on success (even if the line was dropped due to the ring
+ *   wrapping while adding it), and -1 if @line is too big for @hist.
+ */
+__hidden int ring_add(struct ccli_shared_history *hist, const char *line)
+{
+	struct ring_slot *slot;
+	unsigned long stamp;
+	unsigned long seq;
+	unsigned long old;
+	unsigned long w;
+	size_t len;
+	size_t i;
+
+	len = strlen(line);
+	if (len > hist->line_max) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	seq = __atomic_fetch_add(&hist->head, 1, __ATOMIC_RELAXED);
+	slot = ring_slot(hist, seq);
+	stamp = seq_stamp(seq);
+
+	old = __atomic_load_n(&slot->stamp, __ATOMIC_RELAXED);
+	do {
+		if ((old & 1) || old > stamp)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&slot->stamp, &old, stamp | 1,
+					      true, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	__atomic_store_n(&slot->len, len, __ATOMIC_RELEASE);
+	for (i = 0; i < text_words(len); i++) {
+		w = 0;
+		memcpy(&w, line + i * WORD_SIZE,
+		       len - i * WORD_SIZE < WORD_SIZE ? len - i * WORD_SIZE : WORD_SIZE);
+		__atomic_store_n(&slot->text[i], w, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&slot->stamp, stamp, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * ring_get - read a line from the shared history
+ * @hist: The shared history to read from
+ * @seq: The sequence number of the line to read
+ * @buf: Where to copy the line to (at least ring_buf_size() bytes)
+ *
+ * Returns @buf holding the line, or NULL if the line for @seq is not
+ *   in the ring (it was overwritten, dropped, or is still being written).
+ */
+__hidden char *ring_get(struct ccli_shared_history *hist, unsigned long seq,
+			char *buf)
+{
+	struct ring_slot *slot;
+	unsigned long stamp;
+	unsigned long w;
+	size_t len;
+	size_t i;
+
+	if (seq >= ring_head(hist))
+		return NULL;
+
+	slot = ring_slot(hist, seq);
+	stamp = seq_stamp(seq);
+
+	if (__atomic_load_n(&slot->stamp, __ATOMIC_ACQUIRE) != stamp)
+		return NULL;
+
+	len = __atomic_load_n(&slot->len, __ATOMIC_ACQUIRE);
+	if (len > hist->line_max)
+		return NULL;
+
+	for (i = 0; i < text_words(len); i++) {
+		w = __atomic_load_n(&slot->text[i], __ATOMIC_ACQUIRE);
+		memcpy(buf + i * WORD_SIZE, &w, WORD_SIZE);
+	}
+
+	if (__atomic_load_n(&slot->stamp, __ATOMIC_RELAXED) != stamp)
+		return NULL;
+
+	buf[len] = '\0';
+	return buf;
+}
+
+/**
+ * ccli_shared_history_alloc - allocate a history to share between sessions
+ * @lines: The number of lines the history holds
+ * @line_max: The longest line that can be added
+ *
+ * Allocates a history that can be given to several ccli descriptors
+ * with ccli_set_shared_history(), including ones that run in different
+ * threads. Lines that any of them enter are seen by all of them.
+ *
+ * @lines is rounded up to a power of two. Lines longer than @line_max
+ * are not added to the history.
+ *
+ * Returns the shared history (must be freed with ccli_shared_history_free())
+ *   or NULL on error.
+ */
+struct ccli_shared_history *ccli_shared_history_alloc(int lines, int line_max)
+{
+	struct ccli_shared_history *hist;
+	struct ccli_allocator a;
+	unsigned long size = 1;
+	size_t stride;
+
+	if (lines < 1 || line_max < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	while (size < lines)
+		size <<= 1;
+
+	stride = sizeof(struct ring_slot) + text_words(line_max) * WORD_SIZE;
+
+	if (size > (SIZE_MAX - sizeof(*hist)) / stride) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	get_global_allocator(&a);
+	hist = a.malloc(sizeof(*hist) + size * stride, a.data);
+	if (!hist)
+		return NULL;
+
+	memset(hist, 0, sizeof(*hist) + size * stride);
+	hist->mask = size - 1;
+	hist->line_max = line_max;
+	hist->stride = stride;
+	hist->allocator = a;
+
+	return hist;
+}
+
+/**
+ * ccli_shared_history_free - free a shared history
+ * @hist: The shared history to free
+ *
+ * Frees @hist that was allocated by ccli_shared_history_alloc().
+ * No ccli descriptor may still be using it.
+ */
+void ccli_shared_history_free(struct ccli_shared_history *hist)
+{
+	struct ccli_allocator *a;
+
+	if (!hist)
+		return;
+
+	a = &hist->allocator;
+	a->free(hist, a->data);
+}
+
+/**
+ * ccli_set_shared_history - have a ccli descriptor use a shared history
+ * @ccli: The CLI descriptor to use the shared history
+ * @hist: The shared history to use (NULL to go back to its own)
+ *
+ * Have @ccli add its lines to @hist, and navigate and search through
+ * @hist instead of its own history. Each descriptor keeps its own place
+ * in the shared history, and lines that other sessions add while it is
+ * moving through the history do not move it.
+ *
+ * Lines from the shared history that are modified are not written back
+ * to it. The history that @ccli had before is left as is, and is used
+ * again when @hist is set to NULL.
+ *
+ * This can not be done from within ccli_loop() or ccli_execute().
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_set_shared_history(struct ccli *ccli, struct ccli_shared_history *hist)
+{
+	char *buf = NULL;
+
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ccli->line) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (hist) {
+		buf = mem_alloc(ccli, ring_buf_size(hist));
+		if (!buf)
+			return -1;
+	}
+
+	mem_free(ccli, ccli->shared_buf);
+	ccli->shared_buf = buf;
+	ccli->shared = hist;
+
+	if (hist) {
+		ccli->shared_end = ring_head(hist);
+		ccli->current_line = ccli->shared_end;
+	} else {
+		ccli->current_line = ccli->history_size;
+	}
+
+	return 0;
+}
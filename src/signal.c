@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Signal handling for the ccli loop.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+
+#include "ccli-local.h"
+
+/*
+ * Registered signals are blocked and read from a signalfd in the same
+ * poll() that waits for input. The callbacks are then called from the
+ * loop itself, and not from a signal handler, so they can do anything
+ * a command can do.
+ */
+
+static int update_signalfd(struct ccli *ccli)
+{
+	int fd;
+
+	if (sigisemptyset(&ccli->sigmask)) {
+		if (ccli->sigfd >= 0)
+			close(ccli->sigfd);
+		ccli->sigfd = -1;
+		return 0;
+	}
+
+	fd = signalfd(ccli->sigfd, &ccli->sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	ccli->sigfd = fd;
+	return 0;
+}
+
+/* Block the registered signals that were not blocked to begin with */
+__hidden void signal_block(struct ccli *ccli)
+{
+	if (!sigisemptyset(&ccli->sigblocked))
+		pthread_sigmask(SIG_BLOCK, &ccli->sigblocked, NULL);
+}
+
+/* Unblock the signals that signal_block() blocked */
+__hidden void signal_unblock(struct ccli *ccli)
+{
+	if (!sigisemptyset(&ccli->sigblocked))
+		pthread_sigmask(SIG_UNBLOCK, &ccli->sigblocked, NULL);
+}
+
+__hidden void signal_cleanup(struct ccli *ccli)
+{
+	signal_unblock(ccli);
+	sigemptyset(&ccli->sigblocked);
+	sigemptyset(&ccli->sigmask);
+	update_signalfd(ccli);
+}
+
+/*
+ * Call the callbacks of the signals that are waiting on the signalfd.
+ * Returns non-zero if one of the callbacks asks to exit the loop.
+ */
+__hidden int signal_handle(struct ccli *ccli)
+{
+	struct signalfd_siginfo info;
+	struct signal_handler *handler;
+	int ret = 0;
+	int sig;
+
+	while (read(ccli->sigfd, &info, sizeof(info)) == sizeof(info)) {
+		sig = info.ssi_signo;
+
+#ifndef CCLI_NO_PAGER
+		/*
+		 * The window size is read again the next time it is needed,
+		 * and the pager draws itself again, see view_resized().
+		 */
+		if (sig == SIGWINCH)
+			ccli->w_row = 0;
+#endif
+
+		if (sig >= NSIG)
+			continue;
+
+		handler = &ccli->signals[sig];
+		if (handler->callback)
+			ret |= handler->callback(ccli, sig, handler->data);
+	}
+
+	return ret;
+}
+
+/**
+ * ccli_register_signal - Register a callback for a signal
+ * @ccli: The CLI descriptor to register the signal for
+ * @sig: The signal to handle
+ * @callback: The function to call when @sig comes in
+ * @data: The data to pass to @callback
+ *
+ * Have @callback called from ccli_loop() when the process receives
+ * @sig. The signal is blocked, and instead of interrupting the
+ * program, it is read from a signalfd while ccli_loop() waits for
+ * input. Because @callback is not called from a signal handler, it
+ * is not limited to async-signal-safe functions. If @callback prints
+ * something, it can call ccli_line_refresh() to show the line being
+ * entered again.
+ *
+ * If @callback returns non-zero, then ccli_loop() exits.
+ *
+ * Signals that come in while a command is executing are handled
+ * after the command returns. @callback may be NULL to just have the
+ * signal ignored. When SIGWINCH comes in, the window size used by
+ * ccli_page() is updated, and the pager of ccli_pager_stop() is drawn
+ * again, even if @callback is NULL.
+ *
+ * The signal is only blocked in the calling thread. For signals
+ * sent to the process, they should be blocked in all threads
+ * (or registered before any other thread is created), and only
+ * one descriptor should register them.
+ *
+ * ccli_console_release() unblocks the signals, and ccli_console_acquire()
+ * blocks them again, such that a child that is forked can release the
+ * console and get the signals that it expects.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_signal(struct ccli *ccli, int sig, ccli_signal callback,
+			 void *data)
+{
+	sigset_t mask;
+	sigset_t old;
+
+	if (!ccli || sig < 1 || sig >= NSIG ||
+	    sig == SIGKILL || sig == SIGSTOP) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!sigismember(&ccli->sigmask, sig)) {
+		sigaddset(&ccli->sigmask, sig);
+		if (update_signalfd(ccli) < 0) {
+			sigdelset(&ccli->sigmask, sig);
+			return -1;
+		}
+
+		sigemptyset(&mask);
+		sigaddset(&mask, sig);
+		pthread_sigmask(SIG_BLOCK, &mask, &old);
+		if (!sigismember(&old, sig))
+			sigaddset(&ccli->sigblocked, sig);
+	}
+
+	ccli->signals[sig].callback = callback;
+	ccli->signals[sig].data = data;
+
+	return 0;
+}
+
+/**
+ * ccli_unregister_signal - Stop handling a signal
+ * @ccli: The CLI descriptor to unregister the signal from
+ * @sig: The signal to stop handling
+ *
+ * Removes the callback for @sig that was registered with
+ * ccli_register_signal(). If the signal was not blocked before
+ * it was registered, it is unblocked.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_unregister_signal(struct ccli *ccli, int sig)
+{
+	sigset_t mask;
+
+	if (!ccli || sig < 1 || sig >= NSIG) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!sigismember(&ccli->sigmask, sig)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	sigdelset(&ccli->sigmask, sig);
+	update_signalfd(ccli);
+
+	if (sigismember(&ccli->sigblocked, sig)) {
+		sigdelset(&ccli->sigblocked, sig);
+		sigemptyset(&mask);
+		sigaddset(&mask, sig);
+		pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+	}
+
+	ccli->signals[sig].callback = NULL;
+	ccli->signals[sig].data = NULL;
+
+	return 0;
+}
@@ -0,0 +1,511 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * SIMD versions of the string kernels of the hot paths.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ *
+ * Each kernel has a plain C version that runs everywhere, and versions
+ * for SSE2 and AVX2 on x86_64, and NEON on arm64. The best one that the
+ * CPU supports is picked once when the library is loaded (the plain C
+ * one is used until then). Setting CCLI_SIMD to the name of a version
+ * ("scalar", "sse2", "avx2" or "neon") picks that one instead, if the
+ * CPU supports it.
+ *
+ * The strings are terminated by a NUL, and their length is not known.
+ * The vector versions read whole vectors, and may read past the NUL, but
+ * never into the next page, so that they can not fault. That is invisible
+ * to the program, but not to the sanitizers, which are turned off for
+ * them.
+ */
+#include <stdint.h>
+
+#include "ccli-local.h"
+
+#define SIMD_ENV		"CCLI_SIMD"
+#define SIMD_PAGE_SIZE		4096
+
+/* find() of longer needles is left to strstr() */
+#define FIND_MAX_NEEDLE		256
+
+#if defined(__has_attribute)
+# if __has_attribute(no_sanitize)
+#  define __no_sanitize __attribute__((no_sanitize("address", "thread")))
+# endif
+#endif
+#ifndef __no_sanitize
+# define __no_sanitize
+#endif
+
+/* If a vector of @size bytes at @p would go into the next page */
+static inline bool page_cross(const char *p, int size)
+{
+	return ((uintptr_t)p & (SIMD_PAGE_SIZE - 1)) > SIMD_PAGE_SIZE - size;
+}
+
+/* The bytes that end a run of str_plain(): the spaces of isspace(), quotes and '\' */
+static inline bool special(unsigned char ch)
+{
+	switch (ch) {
+	case '\0':
+	case ' ':
+	case '\t': case '\n': case '\v': case '\f': case '\r':
+	case '\'':
+	case '"':
+	case '\\':
+		return true;
+	}
+	return false;
+}
+
+/* ---- Plain C ---- */
+
+static bool scalar_supported(void)
+{
+	return true;
+}
+
+static int scalar_prefix(const char *a, const char *b)
+{
+	int i;
+
+	for (i = 0; a[i] && a[i] == b[i]; i++)
+		;
+	return i;
+}
+
+static int scalar_plain(const char *s)
+{
+	int i;
+
+	for (i = 0; !special(s[i]); i++)
+		;
+	return i;
+}
+
+static const char *scalar_find(const char *hay, const char *needle, int nlen)
+{
+	return strstr(hay, needle);
+}
+
+static const struct simd_ops simd_scalar = {
+	.name		= "scalar",
+	.supported	= scalar_supported,
+	.prefix		= scalar_prefix,
+	.plain		= scalar_plain,
+	.find		= scalar_find,
+};
+
+/*
+ * The candidates of find() are where both the first and the last byte of
+ * @needle match, found a vector at a time. Each one is then compared,
+ * with strncmp() as @hay may end before @nlen. @mask has 1 << @shift
+ * bits set for each candidate of the vector at @i.
+ */
+static inline const char *find_check(const char *hay, int i, uint64_t mask,
+				     int shift, const char *needle, int nlen)
+{
+	int bit;
+
+	while (mask) {
+		bit = __builtin_ctzll(mask) >> shift;
+		if (strncmp(hay + i + bit + 1, needle + 1, nlen - 1) == 0)
+			return hay + i + bit;
+		/* Clear the bits of that byte */
+		mask &= ~(((1ULL << (1 << shift)) - 1) << (bit << shift));
+	}
+	return NULL;
+}
+
+/*
+ * Check @hay + @i one byte at a time, for where the vectors of find()
+ * would go into the next page. Returns 1 if it was found there, -1 if
+ * @hay ends there, and 0 to go on.
+ */
+static inline int find_byte(const char *hay, int i, const char *needle, int nlen)
+{
+	if (!hay[i])
+		return -1;
+	if (hay[i] == needle[0] && strncmp(hay + i + 1, needle + 1, nlen - 1) == 0)
+		return 1;
+	return 0;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/* ---- SSE2 (every x86_64 has it) ---- */
+
+static bool sse2_supported(void)
+{
+	return true;
+}
+
+static inline __m128i sse2_special(__m128i v)
+{
+	__m128i ws = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+	__m128i m;
+
+	/* '\t' to '\r' are the bytes where v - '\t' (unsigned) is at most 4 */
+	m = _mm_cmpeq_epi8(_mm_min_epu8(ws, _mm_set1_epi8(4)), ws);
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+	return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+}
+
+__no_sanitize
+static int sse2_prefix(const char *a, const char *b)
+{
+	__m128i va, vb;
+	unsigned int mask;
+	int i = 0;
+
+	for (;;) {
+		if (page_cross(a + i, 16) || page_cross(b + i, 16)) {
+			if (!a[i] || a[i] != b[i])
+				return i;
+			i++;
+			continue;
+		}
+		va = _mm_loadu_si128((const __m128i *)(a + i));
+		vb = _mm_loadu_si128((const __m128i *)(b + i));
+		/* The bytes that differ, or are the end of @a */
+		mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) |
+			_mm_movemask_epi8(_mm_cmpeq_epi8(va, _mm_setzero_si128()));
+		mask &= 0xffff;
+		if (mask)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+}
+
+__no_sanitize
+static int sse2_plain(const char *s)
+{
+	const char *p = (const char *)((uintptr_t)s & ~15UL);
+	unsigned int mask;
+
+	/* Aligned loads never cross a page. Skip what is before @s */
+	mask = _mm_movemask_epi8(sse2_special(_mm_load_si128((const __m128i *)p)));
+	mask >>= s - p;
+	if (mask)
+		return __builtin_ctz(mask);
+
+	for (;;) {
+		p += 16;
+		mask = _mm_movemask_epi8(sse2_special(_mm_load_si128((const __m128i *)p)));
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+}
+
+__no_sanitize
+static const char *sse2_find(const char *hay, const char *needle, int nlen)
+{
+	__m128i first, last, f, l;
+	unsigned int mask, end;
+	const char *p;
+	int i = 0;
+	int ret;
+
+	if (nlen < 2 || nlen > FIND_MAX_NEEDLE)
+		return strstr(hay, needle);
+
+	first = _mm_set1_epi8(needle[0]);
+	last = _mm_set1_epi8(needle[nlen - 1]);
+
+	for (;;) {
+		if (page_cross(hay + i, 16 + nlen - 1)) {
+			ret = find_byte(hay, i, needle, nlen);
+			if (ret)
+				return ret > 0 ? hay + i : NULL;
+			i++;
+			continue;
+		}
+		f = _mm_loadu_si128((const __m128i *)(hay + i));
+		l = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(f, first),
+						       _mm_cmpeq_epi8(l, last)));
+		/* Only what is before the end of @hay */
+		end = _mm_movemask_epi8(_mm_cmpeq_epi8(f, _mm_setzero_si128()));
+		if (end)
+			mask &= (end & -end) - 1;
+		p = find_check(hay, i, mask, 0, needle, nlen);
+		if (p || end)
+			return p;
+		i += 16;
+	}
+}
+
+static const struct simd_ops simd_sse2 = {
+	.name		= "sse2",
+	.supported	= sse2_supported,
+	.prefix		= sse2_prefix,
+	.plain		= sse2_plain,
+	.find		= sse2_find,
+};
+
+/* ---- AVX2 ---- */
+
+#define __avx2 __attribute__((target("avx2")))
+
+static bool avx2_supported(void)
+{
+	/* This may run before the constructor of libgcc that sets this up */
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+__avx2
+static inline __m256i avx2_special(__m256i v)
+{
+	__m256i ws = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+	__m256i m;
+
+	m = _mm256_cmpeq_epi8(_mm256_min_epu8(ws, _mm256_set1_epi8(4)), ws);
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+	return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+}
+
+__avx2 __no_sanitize
+static int avx2_prefix(const char *a, const char *b)
+{
+	__m256i va, vb;
+	unsigned int mask;
+	int i = 0;
+
+	for (;;) {
+		if (page_cross(a + i, 32) || page_cross(b + i, 32)) {
+			if (!a[i] || a[i] != b[i])
+				return i;
+			i++;
+			continue;
+		}
+		va = _mm256_loadu_si256((const __m256i *)(a + i));
+		vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) |
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, _mm256_setzero_si256()));
+		if (mask)
+			return i + __builtin_ctz(mask);
+		i += 32;
+	}
+}
+
+__avx2 __no_sanitize
+static int avx2_plain(const char *s)
+{
+	const char *p = (const char *)((uintptr_t)s & ~31UL);
+	unsigned int mask;
+
+	mask = _mm256_movemask_epi8(avx2_special(_mm256_load_si256((const __m256i *)p)));
+	mask >>= s - p;
+	if (mask)
+		return __builtin_ctz(mask);
+
+	for (;;) {
+		p += 32;
+		mask = _mm256_movemask_epi8(avx2_special(_mm256_load_si256((const __m256i *)p)));
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+}
+
+__avx2 __no_sanitize
+static const char *avx2_find(const char *hay, const char *needle, int nlen)
+{
+	__m256i first, last, f, l;
+	unsigned int mask, end;
+	const char *p;
+	int i = 0;
+	int ret;
+
+	if (nlen < 2 || nlen > FIND_MAX_NEEDLE)
+		return strstr(hay, needle);
+
+	first = _mm256_set1_epi8(needle[0]);
+	last = _mm256_set1_epi8(needle[nlen - 1]);
+
+	for (;;) {
+		if (page_cross(hay + i, 32 + nlen - 1)) {
+			ret = find_byte(hay, i, needle, nlen);
+			if (ret)
+				return ret > 0 ? hay + i : NULL;
+			i++;
+			continue;
+		}
+		f = _mm256_loadu_si256((const __m256i *)(hay + i));
+		l = _mm256_loadu_si256((const __m256i *)(hay + i + nlen - 1));
+		mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(f, first),
+							     _mm256_cmpeq_epi8(l, last)));
+		end = _mm256_movemask_epi8(_mm256_cmpeq_epi8(f, _mm256_setzero_si256()));
+		if (end)
+			mask &= (end & -end) - 1;
+		p = find_check(hay, i, mask, 0, needle, nlen);
+		if (p || end)
+			return p;
+		i += 32;
+	}
+}
+
+static const struct simd_ops simd_avx2 = {
+	.name		= "avx2",
+	.supported	= avx2_supported,
+	.prefix		= avx2_prefix,
+	.plain		= avx2_plain,
+	.find		= avx2_find,
+};
+
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+/* ---- NEON (every arm64 has it) ---- */
+
+static bool neon_supported(void)
+{
+	return true;
+}
+
+/* NEON has no movemask: narrow each byte of @eq to four bits of the result */
+static inline uint64_t neon_mask(uint8x16_t eq)
+{
+	uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+
+	return vget_lane_u64(vreinterpret_u64_u8(n), 0);
+}
+
+static inline uint8x16_t neon_special(uint8x16_t v)
+{
+	uint8x16_t m;
+
+	m = vcleq_u8(vsubq_u8(v, vdupq_n_u8('\t')), vdupq_n_u8(4));
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(0)));
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(' ')));
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\'')));
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('"')));
+	return vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\\')));
+}
+
+__no_sanitize
+static int neon_prefix(const char *a, const char *b)
+{
+	uint8x16_t va, vb;
+	uint64_t mask;
+	int i = 0;
+
+	for (;;) {
+		if (page_cross(a + i, 16) || page_cross(b + i, 16)) {
+			if (!a[i] || a[i] != b[i])
+				return i;
+			i++;
+			continue;
+		}
+		va = vld1q_u8((const uint8_t *)(a + i));
+		vb = vld1q_u8((const uint8_t *)(b + i));
+		mask = neon_mask(vorrq_u8(vmvnq_u8(vceqq_u8(va, vb)),
+					  vceqq_u8(va, vdupq_n_u8(0))));
+		if (mask)
+			return i + (__builtin_ctzll(mask) >> 2);
+		i += 16;
+	}
+}
+
+__no_sanitize
+static int neon_plain(const char *s)
+{
+	const char *p = (const char *)((uintptr_t)s & ~15UL);
+	uint64_t mask;
+
+	mask = neon_mask(neon_special(vld1q_u8((const uint8_t *)p)));
+	mask >>= (s - p) << 2;
+	if (mask)
+		return __builtin_ctzll(mask) >> 2;
+
+	for (;;) {
+		p += 16;
+		mask = neon_mask(neon_special(vld1q_u8((const uint8_t *)p)));
+		if (mask)
+			return p - s + (__builtin_ctzll(mask) >> 2);
+	}
+}
+
+__no_sanitize
+static const char *neon_find(const char *hay, const char *needle, int nlen)
+{
+	uint8x16_t first, last, f, l;
+	uint64_t mask, end;
+	const char *p;
+	int i = 0;
+	int ret;
+
+	if (nlen < 2 || nlen > FIND_MAX_NEEDLE)
+		return strstr(hay, needle);
+
+	first = vdupq_n_u8(needle[0]);
+	last = vdupq_n_u8(needle[nlen - 1]);
+
+	for (;;) {
+		if (page_cross(hay + i, 16 + nlen - 1)) {
+			ret = find_byte(hay, i, needle, nlen);
+			if (ret)
+				return ret > 0 ? hay + i : NULL;
+			i++;
+			continue;
+		}
+		f = vld1q_u8((const uint8_t *)(hay + i));
+		l = vld1q_u8((const uint8_t *)(hay + i + nlen - 1));
+		mask = neon_mask(vandq_u8(vceqq_u8(f, first), vceqq_u8(l, last)));
+		end = neon_mask(vceqq_u8(f, vdupq_n_u8(0)));
+		if (end)
+			mask &= (end & -end) - 1;
+		p = find_check(hay, i, mask, 2, needle, nlen);
+		if (p || end)
+			return p;
+		i += 16;
+	}
+}
+
+static const struct simd_ops simd_neon = {
+	.name		= "neon",
+	.supported	= neon_supported,
+	.prefix		= neon_prefix,
+	.plain		= neon_plain,
+	.find		= neon_find,
+};
+#endif
+
+/* From the slowest to the fastest */
+__hidden const struct simd_ops *simd_variants[] = {
+	&simd_scalar,
+#if defined(__x86_64__)
+	&simd_sse2,
+	&simd_avx2,
+#elif defined(__aarch64__)
+	&simd_neon,
+#endif
+	NULL,
+};
+
+__hidden const struct simd_ops *simd = &simd_scalar;
+
+__attribute__((constructor))
+static void simd_init(void)
+{
+	const struct simd_ops *best = &simd_scalar;
+	const char *name = getenv(SIMD_ENV);
+	int i;
+
+	for (i = 0; simd_variants[i]; i++) {
+		if (!simd_variants[i]->supported())
+			continue;
+		if (name && strcmp(name, simd_variants[i]->name) == 0) {
+			simd = simd_variants[i];
+			return;
+		}
+		best = simd_variants[i];
+	}
+	simd = best;
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+#ifndef __CCLI_SIMD_H
+#define __CCLI_SIMD_H
+
+#include <stdbool.h>
+
+/*
+ * The string kernels of the hot paths, with a version for each SIMD
+ * instruction set (see simd.c). The best one that the CPU supports is
+ * picked once when the library is loaded.
+ */
+struct simd_ops {
+	const char	*name;
+	bool		(*supported)(void);
+	/* The number of bytes at the start of @a that are in @b, up to a NUL */
+	int		(*prefix)(const char *a, const char *b);
+	/* The number of bytes at the start of @s before a space, quote, '\' or NUL */
+	int		(*plain)(const char *s);
+	/* Like strstr(), where @nlen is the length of @needle */
+	const char	*(*find)(const char *hay, const char *needle, int nlen);
+};
+
+/* What is used, and all the versions built in (ending with NULL) */
+extern const struct simd_ops *simd;
+extern const struct simd_ops *simd_variants[];
+
+static inline int str_prefix(const char *a, const char *b)
+{
+	return simd->prefix(a, b);
+}
+
+static inline int str_plain(const char *s)
+{
+	return simd->plain(s);
+}
+
+/* Like strstr(), returns a pointer into @hay that is not const */
+static inline char *str_find(const char *hay, const char *needle, int nlen)
+{
+	return (char *)simd->find(hay, needle, nlen);
+}
+
+#endif
@@ -0,0 +1,503 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * The "stats" and "perf" commands, to see what the commands and the
+ * library cost from the prompt.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include "ccli-local.h"
+
+/*
+ * Once ccli_register_stats() is called, every command that is executed
+ * is timed, and the time is added to a histogram for that command. The
+ * histogram has a bucket for each power of two of microseconds, which is
+ * enough to tell a command that is always slow from one that is only
+ * slow once in a while, and costs a clock read and a hash lookup for
+ * each command. The histograms are only touched by the thread that
+ * executes the commands.
+ */
+
+#define TIMING_UNKNOWN		"(unknown)"
+
+#define STATS_USAGE	"usage: stats [-r] [command]\n"
+#define PERF_USAGE	"usage: perf [on|off]\n"
+
+/* The longest a bar of the histogram of "stats command" gets */
+#define BAR_MAX			40
+
+static unsigned long long elapsed_ns(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000ULL +
+		now.tv_nsec - start->tv_nsec;
+}
+
+static unsigned int timing_hash(const char *name)
+{
+	unsigned int hash = 5381;
+
+	while (*name)
+		hash = hash * 33 + (unsigned char)*name++;
+
+	return hash & (TIMING_HASH - 1);
+}
+
+static struct timing *timing_find(struct timings *timings, const char *name)
+{
+	struct timing *t;
+
+	for (t = timings->hash[timing_hash(name)]; t; t = t->next) {
+		if (strcmp(t->name, name) == 0)
+			return t;
+	}
+	return NULL;
+}
+
+static struct timing *timing_get(struct ccli *ccli, const char *name)
+{
+	struct timings *timings = ccli->timings;
+	struct timing *t;
+	unsigned int h;
+
+	t = timing_find(timings, name);
+	if (t)
+		return t;
+
+	t = mem_zalloc(ccli, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->name = mem_strdup(ccli, name);
+	if (!t->name) {
+		mem_free(ccli, t);
+		return NULL;
+	}
+
+	h = timing_hash(name);
+	t->next = timings->hash[h];
+	timings->hash[h] = t;
+	timings->nr++;
+
+	return t;
+}
+
+/* The bucket for @ns, where bucket i is for less than 2^i microseconds */
+static int timing_bucket(unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	int b = 0;
+
+	while (us) {
+		us >>= 1;
+		b++;
+	}
+	return b < TIMING_BUCKETS ? b : TIMING_BUCKETS - 1;
+}
+
+__hidden void timing_start(struct ccli *ccli, struct timing_save *save)
+{
+	save->stats = ccli->stats;
+	clock_gettime(CLOCK_MONOTONIC, &save->start);
+}
+
+static void perf_print(struct ccli *ccli, unsigned long long ns,
+		       struct timing_save *save)
+{
+	struct ccli_stats *stats = &ccli->stats;
+
+	ccli_printf(ccli, "perf: %llu.%03llu ms, %lu reads (%lu bytes), "
+		    "%lu writes (%lu bytes), %lu allocs\n",
+		    ns / 1000000, (ns / 1000) % 1000,
+		    stats->reads - save->stats.reads,
+		    stats->bytes_read - save->stats.bytes_read,
+		    stats->writes - save->stats.writes,
+		    stats->bytes_written - save->stats.bytes_written,
+		    stats->allocs - save->stats.allocs);
+}
+
+/*
+ * Add the time since timing_start() to the histogram of @name (NULL for
+ * a command that is not registered).
+ */
+__hidden void timing_end(struct ccli *ccli, const char *name,
+			 struct timing_save *save)
+{
+	unsigned long long ns = elapsed_ns(&save->start);
+	struct timing *t;
+
+	/* The command may have been "perf on" */
+	if (ccli->timings->perf)
+		perf_print(ccli, ns, save);
+
+	t = timing_get(ccli, name ? name : TIMING_UNKNOWN);
+	if (!t)
+		return;
+
+	t->count++;
+	t->sum_ns += ns;
+	if (ns > t->max_ns)
+		t->max_ns = ns;
+	t->buckets[timing_bucket(ns)]++;
+}
+
+static void timings_reset(struct ccli *ccli)
+{
+	struct timings *timings = ccli->timings;
+	struct timing *t;
+	int i;
+
+	for (i = 0; i < TIMING_HASH; i++) {
+		while ((t = timings->hash[i])) {
+			timings->hash[i] = t->next;
+			mem_free(ccli, t->name);
+			mem_free(ccli, t);
+		}
+	}
+	timings->nr = 0;
+}
+
+/* Start timing the commands that @ccli executes */
+__hidden int timings_init(struct ccli *ccli)
+{
+	if (ccli->timings)
+		return 0;
+
+	ccli->timings = mem_zalloc(ccli, sizeof(*ccli->timings));
+	return ccli->timings ? 0 : -1;
+}
+
+__hidden void timings_free(struct ccli *ccli)
+{
+	if (!ccli->timings)
+		return;
+
+	timings_reset(ccli);
+	mem_free(ccli, ccli->timings);
+	ccli->timings = NULL;
+}
+
+/* Print @ns into @buf in a unit that keeps it short */
+static char *fmt_ns(char *buf, int size, unsigned long long ns)
+{
+	if (ns < 1000)
+		snprintf(buf, size, "%lluns", ns);
+	else if (ns < 1000000)
+		snprintf(buf, size, "%.1fus", ns / 1000.0);
+	else if (ns < 1000000000)
+		snprintf(buf, size, "%.1fms", ns / 1000000.0);
+	else
+		snprintf(buf, size, "%.2fs", ns / 1000000000.0);
+	return buf;
+}
+
+/*
+ * The time that @pct percent of the runs took no more than. This is
+ * the top of the bucket it falls in, or the longest time if that is
+ * less.
+ */
+static unsigned long long timing_pct(struct timing *t, int pct)
+{
+	unsigned long long want = (t->count * pct + 99) / 100;
+	unsigned long long sum = 0;
+	unsigned long long ns;
+	int b;
+
+	for (b = 0; b < TIMING_BUCKETS - 1; b++) {
+		sum += t->buckets[b];
+		if (sum >= want)
+			break;
+	}
+
+	ns = (1ULL << b) * 1000;
+	return b < TIMING_BUCKETS - 1 && ns < t->max_ns ? ns : t->max_ns;
+}
+
+static int cmp_timing(const void *a, const void *b)
+{
+	struct timing * const *ta = a;
+	struct timing * const *tb = b;
+
+	if ((*ta)->sum_ns != (*tb)->sum_ns)
+		return (*ta)->sum_ns < (*tb)->sum_ns ? 1 : -1;
+	return strcmp((*ta)->name, (*tb)->name);
+}
+
+/* Returns the commands that were timed, the most total time first */
+static struct timing **timings_sorted(struct ccli *ccli)
+{
+	struct timings *timings = ccli->timings;
+	struct timing **list;
+	struct timing *t;
+	int n = 0;
+	int i;
+
+	list = mem_alloc(ccli, sizeof(*list) * (timings->nr + 1));
+	if (!list)
+		return NULL;
+
+	for (i = 0; i < TIMING_HASH; i++) {
+		for (t = timings->hash[i]; t; t = t->next)
+			list[n++] = t;
+	}
+	list[n] = NULL;
+
+	qsort(list, n, sizeof(*list), cmp_timing);
+	return list;
+}
+
+static size_t commands_bytes(struct ccli *ccli, int *nr)
+{
+	struct command_table *cmds;
+	size_t bytes;
+	int i;
+
+	cmds = commands_get(ccli);
+	*nr = cmds->nr_commands;
+	bytes = sizeof(*cmds) + sizeof(struct command) * cmds->nr_commands;
+	for (i = 0; i < cmds->nr_commands; i++)
+		bytes += strlen(cmds->commands[i].cmd) + 1;
+	commands_put(ccli);
+
+	return bytes;
+}
+
+static size_t timings_bytes(struct ccli *ccli)
+{
+	struct timings *timings = ccli->timings;
+	struct timing *t;
+	size_t bytes = sizeof(*timings);
+	int i;
+
+	for (i = 0; i < TIMING_HASH; i++) {
+		for (t = timings->hash[i]; t; t = t->next)
+			bytes += sizeof(*t) + strlen(t->name) + 1;
+	}
+	return bytes;
+}
+
+static int show_counters(struct ccli *ccli, int line)
+{
+	struct ccli_stats stats;
+
+	ccli_stats(ccli, &stats);
+
+	line = ccli_page(ccli, line, "Counters:\n");
+	line = ccli_page(ccli, line, "  reads              %10lu (%lu bytes)\n",
+			 stats.reads, stats.bytes_read);
+	line = ccli_page(ccli, line, "  writes             %10lu (%lu bytes)\n",
+			 stats.writes, stats.bytes_written);
+	line = ccli_page(ccli, line, "  redraws            %10lu\n", stats.redraws);
+	line = ccli_page(ccli, line, "  allocs             %10lu\n", stats.allocs);
+	line = ccli_page(ccli, line, "  completions        %10lu\n", stats.completions);
+	line = ccli_page(ccli, line, "  history searches   %10lu\n",
+			 stats.history_searches);
+	return line;
+}
+
+static int show_memory(struct ccli *ccli, int line)
+{
+	struct ccli_pool_stats pstats;
+	size_t history;
+	size_t cached = 0;
+	size_t bytes;
+	int lines;
+	int nr;
+	int i;
+
+	pthread_mutex_lock(&ccli->history_lock);
+	history = ccli->history_bytes + sizeof(char *) * ccli->history_max;
+	lines = ccli->history_size;
+	pthread_mutex_unlock(&ccli->history_lock);
+
+	if (ccli->shared_buf)
+		history += ring_buf_size(ccli->shared);
+
+	line = ccli_page(ccli, line, "Memory:\n");
+	line = ccli_page(ccli, line, "  history            %10zu bytes (%d lines)\n",
+			 history, lines);
+
+	bytes = commands_bytes(ccli, &nr);
+	line = ccli_page(ccli, line, "  commands           %10zu bytes (%d commands)\n",
+			 bytes, nr);
+
+	for (i = 0; i < CCLI_NR_POOLS; i++) {
+		ccli_pool_stats(ccli, i, &pstats);
+		cached += pstats.cached_bytes;
+	}
+	line = ccli_page(ccli, line, "  pool caches        %10zu bytes\n", cached);
+
+	if (ccli->line) {
+		line = ccli_page(ccli, line, "  line buffer        %10d bytes\n",
+				 ccli->line->size);
+	}
+
+	line = ccli_page(ccli, line, "  timings            %10zu bytes (%d commands)\n",
+			 timings_bytes(ccli), ccli->timings->nr);
+	return line;
+}
+
+static int show_timings(struct ccli *ccli, int line)
+{
+	struct timing **list;
+	struct timing *t;
+	char avg[16], p50[16], p99[16], max[16];
+	int i;
+
+	list = timings_sorted(ccli);
+	if (!list)
+		return -1;
+
+	line = ccli_page(ccli, line, "Commands:          %10s %9s %9s %9s %9s\n",
+			 "count", "avg", "p50", "p99", "max");
+
+	for (i = 0; line >= 0 && (t = list[i]); i++) {
+		line = ccli_page(ccli, line, "  %-16s %10lu %9s %9s %9s %9s\n",
+				 t->name, t->count,
+				 fmt_ns(avg, sizeof(avg), t->sum_ns / t->count),
+				 fmt_ns(p50, sizeof(p50), timing_pct(t, 50)),
+				 fmt_ns(p99, sizeof(p99), timing_pct(t, 99)),
+				 fmt_ns(max, sizeof(max), t->max_ns));
+	}
+
+	mem_free(ccli, list);
+	return line;
+}
+
+/* The histogram of the times of one command */
+static void show_histogram(struct ccli *ccli, struct timing *t)
+{
+	unsigned long most = 0;
+	char avg[16], max[16];
+	int first = -1, last = 0;
+	int line = 1;
+	int b;
+
+	for (b = 0; b < TIMING_BUCKETS; b++) {
+		if (!t->buckets[b])
+			continue;
+		if (first < 0)
+			first = b;
+		last = b;
+		if (t->buckets[b] > most)
+			most = t->buckets[b];
+	}
+
+	line = ccli_page(ccli, line, "%s: %lu runs, avg %s, max %s\n",
+			 t->name, t->count,
+			 fmt_ns(avg, sizeof(avg), t->sum_ns / t->count),
+			 fmt_ns(max, sizeof(max), t->max_ns));
+
+	for (b = first; line >= 0 && b <= last; b++) {
+		if (b < TIMING_BUCKETS - 1)
+			line = ccli_page(ccli, line, "  < %10lluus %10lu |",
+					 1ULL << b, t->buckets[b]);
+		else
+			line = ccli_page(ccli, line, "  >=%10lluus %10lu |",
+					 1ULL << (b - 1), t->buckets[b]);
+		ccli_printf(ccli, "%.*s\n", (int)(t->buckets[b] * BAR_MAX / most),
+			    "########################################");
+	}
+}
+
+static int stats_command(struct ccli *ccli, const char *command,
+			 const char *line_str, void *data,
+			 int argc, char **argv)
+{
+	struct timing *t;
+	int line = 1;
+
+	if (argc > 2)
+		goto usage;
+
+	if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+		ccli_stats_reset(ccli);
+		timings_reset(ccli);
+		return 0;
+	}
+
+	if (argc == 2) {
+		if (argv[1][0] == '-')
+			goto usage;
+		t = timing_find(ccli->timings, argv[1]);
+		if (!t)
+			ccli_printf(ccli, "%s has not been executed\n", argv[1]);
+		else
+			show_histogram(ccli, t);
+		return 0;
+	}
+
+	line = show_counters(ccli, line);
+	if (line >= 0)
+		line = show_memory(ccli, line);
+	if (line >= 0)
+		show_timings(ccli, line);
+
+	return 0;
+ usage:
+	echo_str(ccli, STATS_USAGE);
+	return 0;
+}
+
+static int perf_command(struct ccli *ccli, const char *command,
+			const char *line, void *data,
+			int argc, char **argv)
+{
+	struct timings *timings = ccli->timings;
+
+	if (argc == 1) {
+		ccli_printf(ccli, "perf is %s\n", timings->perf ? "on" : "off");
+		return 0;
+	}
+
+	if (argc != 2)
+		goto usage;
+
+	if (strcmp(argv[1], "on") == 0)
+		timings->perf = true;
+	else if (strcmp(argv[1], "off") == 0)
+		timings->perf = false;
+	else
+		goto usage;
+
+	return 0;
+ usage:
+	echo_str(ccli, PERF_USAGE);
+	return 0;
+}
+
+/**
+ * ccli_register_stats - Add the "stats" and "perf" commands
+ * @ccli: The CLI descriptor to add the commands to
+ *
+ * Registers the command "stats [-r] [command]", which shows the
+ * counters of ccli_stats(), the memory used by the history, the
+ * commands, the pool caches and the timings, and how long each
+ * command took to execute. With a command name, it shows a histogram
+ * of the times of that command, and with "-r" it zeros it all.
+ *
+ * Also registers "perf [on|off]", which when on, prints after each
+ * command how long it took and the reads, writes and allocations it
+ * made.
+ *
+ * From this call on, every command that is executed is timed.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_stats(struct ccli *ccli)
+{
+	if (!ccli) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (timings_init(ccli) < 0)
+		return -1;
+
+	if (ccli_register_command(ccli, "stats", stats_command, NULL) < 0 ||
+	    ccli_register_command(ccli, "perf", perf_command, NULL) < 0)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,564 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Output of tables, with the columns laid out for the widest cell.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "ccli-local.h"
+
+/*
+ * The cells are copied into an arena as they are added, and the width
+ * of each column is kept up to date then, so that the table is laid out
+ * without going over the cells a second time. ccli_table_end() then
+ * writes it out a window full at a time (or every TABLE_FLUSH bytes when
+ * the output is not a terminal), and hands a table that does not fit in
+ * the window to the pager.
+ */
+
+#define TABLE_FLUSH		(64 * 1024)
+
+/* The gap between two columns */
+#define TABLE_GAP		2
+
+struct table_chunk {
+	struct table_chunk	*next;
+	size_t			size;
+	size_t			used;
+	char			data[];
+};
+
+/* The first chunk, each new chunk doubles in size */
+#define TABLE_CHUNK		(BUFSIZ - sizeof(struct table_chunk))
+
+struct ccli_table {
+	struct ccli		*ccli;
+	struct table_chunk	*arena;
+	const char		**cells;	/* The headers, then each row */
+	int			nr_cells;
+	int			max_cells;
+	int			cols;
+	int			*widths;
+	unsigned char		*kinds;		/* What the cells of each column hold */
+};
+
+/* The kinds of a column */
+#define COL_NUMBER		(1 << 0)
+#define COL_TEXT		(1 << 1)
+
+static char *table_alloc(struct ccli_table *table, size_t len)
+{
+	struct table_chunk *chunk = table->arena;
+	size_t size;
+	char *p;
+
+	if (!chunk || chunk->used + len > chunk->size) {
+		size = chunk ? chunk->size * 2 : TABLE_CHUNK;
+		while (size < len)
+			size *= 2;
+		chunk = mem_alloc(table->ccli, sizeof(*chunk) + size);
+		if (!chunk)
+			return NULL;
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->next = table->arena;
+		table->arena = chunk;
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += len;
+	return p;
+}
+
+/* What is left of the current chunk */
+static size_t table_room(struct ccli_table *table, char **p)
+{
+	struct table_chunk *chunk = table->arena;
+
+	if (!chunk) {
+		*p = NULL;
+		return 0;
+	}
+	*p = chunk->data + chunk->used;
+	return chunk->size - chunk->used;
+}
+
+/* A column of numbers (empty cells aside) is right aligned */
+static bool numeric(struct ccli_table *table, int col)
+{
+	return table->kinds[col] == COL_NUMBER;
+}
+
+/* The columns @str takes up, where a UTF-8 character takes one */
+static int str_width(const char *str)
+{
+	int width = 0;
+
+	for (; *str; str++)
+		width += (*str & 0xc0) != 0x80;
+	return width;
+}
+
+/* Add @str (already in the arena) as the next cell */
+static int add_cell(struct ccli_table *table, const char *str)
+{
+	const char **cells;
+	int col = table->nr_cells % table->cols;
+	int width;
+	int max;
+
+	if (table->nr_cells == table->max_cells) {
+		max = table->max_cells * 2;
+		cells = mem_realloc(table->ccli, table->cells, sizeof(*cells) * max);
+		if (!cells)
+			return -1;
+		table->cells = cells;
+		table->max_cells = max;
+	}
+	table->cells[table->nr_cells++] = str;
+
+	width = str_width(str);
+	if (width > table->widths[col])
+		table->widths[col] = width;
+
+	/* The header and empty cells do not count */
+	if (table->nr_cells > table->cols && *str)
+		table->kinds[col] |= json_number(str) ? COL_NUMBER : COL_TEXT;
+
+	return 0;
+}
+
+static int copy_cell(struct ccli_table *table, const char *str)
+{
+	int len = strlen(str);
+	char *p;
+
+	p = table_alloc(table, len + 1);
+	if (!p)
+		return -1;
+	memcpy(p, str, len + 1);
+	return add_cell(table, p);
+}
+
+static void free_table(struct ccli_table *table)
+{
+	struct ccli *ccli = table->ccli;
+	struct table_chunk *chunk;
+
+	while (table->arena) {
+		chunk = table->arena;
+		table->arena = chunk->next;
+		mem_free(ccli, chunk);
+	}
+	mem_free(ccli, table->cells);
+	mem_free(ccli, table->widths);
+	mem_free(ccli, table->kinds);
+	mem_free(ccli, table);
+}
+
+/**
+ * ccli_table_begin - Start a table to write to the ccli output
+ * @ccli: The CLI descriptor to write the table to
+ * @header: The header of the first column, followed by the others, and NULL
+ *
+ * Start a table that has a column for each header given. The rows are
+ * added with ccli_table_row() and ccli_table_cell(), and the table is
+ * written out and freed by ccli_table_end().
+ *
+ * Returns the table on success, and NULL on error.
+ */
+struct ccli_table *ccli_table_begin(struct ccli *ccli, const char *header, ...)
+{
+	struct ccli_table *table;
+	const char *h;
+	va_list ap;
+	int cols = 0;
+
+	if (!ccli || !header) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	va_start(ap, header);
+	for (h = header; h; h = va_arg(ap, const char *))
+		cols++;
+	va_end(ap);
+
+	table = mem_zalloc(ccli, sizeof(*table));
+	if (!table)
+		return NULL;
+
+	table->ccli = ccli;
+	table->cols = cols;
+	table->max_cells = cols * 16;
+	table->cells = mem_alloc(ccli, sizeof(*table->cells) * table->max_cells);
+	table->widths = mem_zalloc(ccli, sizeof(*table->widths) * cols);
+	table->kinds = mem_zalloc(ccli, sizeof(*table->kinds) * cols);
+	if (!table->cells || !table->widths || !table->kinds)
+		goto fail;
+
+	va_start(ap, header);
+	for (h = header; h; h = va_arg(ap, const char *)) {
+		if (copy_cell(table, h) < 0)
+			break;
+	}
+	va_end(ap);
+
+	if (h)
+		goto fail;
+
+	return table;
+ fail:
+	free_table(table);
+	return NULL;
+}
+
+/* Fill what is left of a row that is not complete with empty cells */
+static int finish_row(struct ccli_table *table)
+{
+	while (table->nr_cells % table->cols) {
+		if (add_cell(table, "") < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * ccli_table_row - Add a row to a table
+ * @table: The table from ccli_table_begin()
+ * @cell: The first cell of the row, followed by the others
+ *
+ * Adds a row with a cell for each column of @table, so there must be
+ * as many strings passed in as there are columns. A NULL cell is left
+ * empty. If the last row was started by ccli_table_cell() and is not
+ * complete, the rest of its cells are left empty.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_table_row(struct ccli_table *table, const char *cell, ...)
+{
+	va_list ap;
+	int ret = 0;
+	int i;
+
+	if (!table) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (finish_row(table) < 0)
+		return -1;
+
+	va_start(ap, cell);
+	for (i = 0; i < table->cols && ret >= 0; i++) {
+		ret = copy_cell(table, cell ? cell : "");
+		if (i < table->cols - 1)
+			cell = va_arg(ap, const char *);
+	}
+	va_end(ap);
+
+	return ret;
+}
+
+/**
+ * ccli_table_cell - Add the next cell to a table
+ * @table: The table from ccli_table_begin()
+ * @fmt: A printf() like format of what goes in the cell
+ *
+ * Adds the next cell of the row being filled in, and after the last
+ * column, starts the next row. The text is formatted straight into the
+ * table, so there is no need to format it into a buffer first.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_table_cell(struct ccli_table *table, const char *fmt, ...)
+{
+	va_list ap;
+	size_t room;
+	char *p;
+	int len;
+
+	if (!table || !fmt) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	room = table_room(table, &p);
+
+	va_start(ap, fmt);
+	len = room ? vsnprintf(p, room, fmt, ap) : vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (len < 0)
+		return -1;
+
+	if (len < room) {
+		/* It fit in what was left of the arena */
+		p = table_alloc(table, len + 1);
+	} else {
+		p = table_alloc(table, len + 1);
+		if (!p)
+			return -1;
+		va_start(ap, fmt);
+		vsnprintf(p, len + 1, fmt, ap);
+		va_end(ap);
+	}
+
+	return add_cell(table, p);
+}
+
+static int table_flush(struct ccli_table *table, struct capture *out)
+{
+	int ret;
+
+	ret = print_str(table->ccli, out->buf, out->len);
+	out->len = 0;
+	return ret < 0 ? -1 : 0;
+}
+
+static void add_pad(struct ccli *ccli, struct capture *out, int pad)
+{
+	static const char spaces[] = "                                ";
+	int n;
+
+	for (; pad > 0; pad -= n) {
+		n = pad < sizeof(spaces) - 1 ? pad : sizeof(spaces) - 1;
+		capture_add(ccli, out, spaces, n);
+	}
+}
+
+static void text_row(struct ccli_table *table, struct capture *out,
+		     const char **cells)
+{
+	struct ccli *ccli = table->ccli;
+	int last = table->cols - 1;
+	int start = out->len;
+	int pad;
+	int c;
+
+	for (c = 0; c <= last; c++) {
+		pad = table->widths[c] - str_width(cells[c]);
+
+		/* Numbers are right aligned, and their header with them */
+		if (numeric(table, c))
+			add_pad(ccli, out, pad);
+
+		capture_add(ccli, out, cells[c], strlen(cells[c]));
+
+		if (c < last)
+			add_pad(ccli, out, TABLE_GAP + (numeric(table, c) ? 0 : pad));
+	}
+
+	/* Do not leave spaces at the end of the line */
+	while (out->len > start && out->buf[out->len - 1] == ' ')
+		out->len--;
+	capture_add(ccli, out, "\n", 1);
+}
+
+static void text_rule(struct ccli_table *table, struct capture *out)
+{
+	static const char dashes[] = "--------------------------------";
+	struct ccli *ccli = table->ccli;
+	int n;
+	int w;
+	int c;
+
+	for (c = 0; c < table->cols; c++) {
+		for (w = table->widths[c]; w > 0; w -= n) {
+			n = w < sizeof(dashes) - 1 ? w : sizeof(dashes) - 1;
+			capture_add(ccli, out, dashes, n);
+		}
+		if (c < table->cols - 1)
+			add_pad(ccli, out, TABLE_GAP);
+	}
+	capture_add(ccli, out, "\n", 1);
+}
+
+static void csv_cell(struct ccli *ccli, struct capture *out, const char *cell)
+{
+	const char *p;
+	const char *q;
+
+	if (!cell[strcspn(cell, ",\"\r\n")]) {
+		capture_add(ccli, out, cell, strlen(cell));
+		return;
+	}
+
+	/* Quoted, with the quotes in it doubled */
+	capture_add(ccli, out, "\"", 1);
+	for (p = cell; (q = strchr(p, '"')); p = q + 1) {
+		capture_add(ccli, out, p, q - p + 1);
+		capture_add(ccli, out, "\"", 1);
+	}
+	capture_add(ccli, out, p, strlen(p));
+	capture_add(ccli, out, "\"", 1);
+}
+
+static void csv_row(struct ccli_table *table, struct capture *out,
+		    const char **cells)
+{
+	int c;
+
+	for (c = 0; c < table->cols; c++) {
+		if (c)
+			capture_add(table->ccli, out, ",", 1);
+		csv_cell(table->ccli, out, cells[c]);
+	}
+	capture_add(table->ccli, out, "\n", 1);
+}
+
+/* An object for each row, keyed by the headers, one per line */
+static void json_row(struct ccli_table *table, struct capture *out,
+		     const char **cells)
+{
+	struct json_writer w;
+	int c;
+
+	json_init(&w, table->ccli, out);
+	json_begin(&w);
+	for (c = 0; c < table->cols; c++) {
+		json_key(&w, table->cells[c]);
+		if (numeric(table, c))
+			json_value(&w, *cells[c] ? cells[c] : NULL, true);
+		else
+			json_string(&w, cells[c]);
+	}
+	json_end(&w);
+	json_flush(&w);
+}
+
+static int write_table(struct ccli_table *table, enum ccli_table_format format,
+		       int rows)
+{
+	struct ccli *ccli = table->ccli;
+	struct capture out = { };
+	int lines = 0;
+	int ret = 0;
+	int r;
+
+	switch (format) {
+	case CCLI_TABLE_TEXT:
+		text_row(table, &out, table->cells);
+		text_rule(table, &out);
+		lines = 2;
+		break;
+	case CCLI_TABLE_CSV:
+		csv_row(table, &out, table->cells);
+		lines = 1;
+		break;
+	case CCLI_TABLE_JSON:
+		break;
+	}
+
+	for (r = table->cols; r < table->nr_cells; r += table->cols) {
+		switch (format) {
+		case CCLI_TABLE_TEXT:
+			text_row(table, &out, table->cells + r);
+			break;
+		case CCLI_TABLE_CSV:
+			csv_row(table, &out, table->cells + r);
+			break;
+		case CCLI_TABLE_JSON:
+			json_row(table, &out, table->cells + r);
+			break;
+		}
+
+		/* A write for each window full */
+		if (++lines == rows || out.len >= TABLE_FLUSH) {
+			if (table_flush(table, &out) < 0)
+				ret = -1;
+			lines = 0;
+		}
+	}
+
+	if (out.len && table_flush(table, &out) < 0)
+		ret = -1;
+
+	mem_free(ccli, out.buf);
+	return ret;
+}
+
+/**
+ * ccli_table_end - Write out a table and free it
+ * @table: The table from ccli_table_begin()
+ *
+ * Writes out @table, with each column as wide as its widest cell, and
+ * the columns that only have numbers right aligned. If the output is a
+ * terminal, and the table does not fit in the window, it is shown in the
+ * pager of ccli_pager_stop(). If the output is not a terminal, the table
+ * is written as set by ccli_set_table_format(), and in the JSON mode of
+ * ccli_set_output_mode() it is always written as JSON.
+ *
+ * @table is freed, even on error.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_table_end(struct ccli_table *table)
+{
+	enum ccli_table_format format = CCLI_TABLE_TEXT;
+	struct ccli *ccli;
+	struct winsize w;
+	bool page = false;
+	int rows = 0;
+	int ret;
+
+	if (!table) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ccli = table->ccli;
+
+	if (finish_row(table) < 0) {
+		free_table(table);
+		return -1;
+	}
+
+	if (ccli->output_mode == CCLI_OUTPUT_JSON)
+		format = CCLI_TABLE_JSON;
+	else if (!isatty(ccli->out))
+		format = ccli->table_format;
+
+	if (ccli->in_tty && !ioctl(ccli->in, TIOCGWINSZ, &w))
+		rows = w.ws_row;
+
+	/* The pager reads the input, which only the loop thread may do */
+	if (format == CCLI_TABLE_TEXT && rows && !paging(ccli) &&
+	    !ccli->capture && !other_thread(ccli) &&
+	    table->nr_cells / table->cols + 1 >= rows)
+		page = !ccli_pager_start(ccli);
+
+	ret = write_table(table, format, rows);
+
+	if (page && ccli_pager_stop(ccli) < 0)
+		ret = -1;
+
+	free_table(table);
+	return ret;
+}
+
+/**
+ * ccli_set_table_format - Set how tables are written when not to a terminal
+ * @ccli: The CLI descriptor to set the format of
+ * @format: The format of the tables
+ *
+ * Sets how ccli_table_end() writes tables when the output of @ccli is
+ * not a terminal. CCLI_TABLE_TEXT (the default) lays them out as they
+ * are on a terminal, CCLI_TABLE_CSV writes them as comma separated
+ * values, and CCLI_TABLE_JSON writes each row as a JSON object on a line
+ * of its own.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_set_table_format(struct ccli *ccli, enum ccli_table_format format)
+{
+	if (!ccli || format < CCLI_TABLE_TEXT || format > CCLI_TABLE_JSON) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ccli->table_format = format;
+	return 0;
+}
@@ -0,0 +1,372 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * The "watch" command, to run a command over and over.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <poll.h>
+#include <math.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+
+#include "ccli-local.h"
+
+/*
+ * The command being watched has its output captured into a buffer
+ * instead of being written out. The output is then compared line by
+ * line with what the last run printed, and only the lines that changed
+ * are redrawn, by moving the cursor to them. On a slow link, a status
+ * command that prints a screen full where only a counter changes costs
+ * only the bytes of that counter.
+ */
+
+#define WATCH_DEFAULT_MS	2000
+#define WATCH_MIN_MS		100
+
+/* The rows that the header takes before the output of the command */
+#define WATCH_HEADER_ROWS	2
+
+#define WATCH_USAGE	"usage: watch [-n seconds] command [args...]\n"
+
+/* The watchdog looks at where the output goes, see write_now() */
+__hidden void set_capture(struct ccli *ccli, struct capture *cap)
+{
+	pthread_mutex_lock(&ccli->out_lock);
+	ccli->capture = cap;
+	pthread_mutex_unlock(&ccli->out_lock);
+}
+
+__hidden int capture_add(struct ccli *ccli, struct capture *cap,
+			 const char *str, int len)
+{
+	char *buf;
+	int size;
+
+	if (cap->len + len > cap->size) {
+		size = cap->size ? cap->size : 256;
+		while (size < cap->len + len)
+			size *= 2;
+		buf = mem_realloc(ccli, cap->buf, size);
+		if (!buf) {
+			cap->failed = true;
+			return -1;
+		}
+		cap->buf = buf;
+		cap->size = size;
+	}
+
+	memcpy(cap->buf + cap->len, str, len);
+	cap->len += len;
+	return len;
+}
+
+__attribute__((__format__(printf, 3, 4)))
+static void capture_printf(struct ccli *ccli, struct capture *cap,
+			   const char *fmt, ...)
+{
+	char buf[64];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	capture_add(ccli, cap, buf, len);
+}
+
+/* Get the line at @pos of @cap, and move @pos past it */
+static bool get_line(struct capture *cap, int *pos, const char **line, int *len)
+{
+	char *nl;
+
+	if (*pos >= cap->len)
+		return false;
+
+	*line = cap->buf + *pos;
+	nl = memchr(*line, '\n', cap->len - *pos);
+	*len = nl ? nl - *line : cap->len - *pos;
+	*pos += *len + (nl ? 1 : 0);
+
+	return true;
+}
+
+/*
+ * Write into @screen what it takes to turn the output of @old into
+ * the output of @new, where the output starts at @row. Lines are cut
+ * at @cols, and nothing goes past @rows (zero for no limit).
+ */
+static void repaint(struct ccli *ccli, struct capture *screen,
+		    struct capture *old, struct capture *new,
+		    int row, int rows, int cols)
+{
+	const char *oline, *nline;
+	int opos = 0, npos = 0;
+	int olen, nlen;
+	bool ohas, nhas;
+
+	for (; !rows || row <= rows; row++) {
+		ohas = get_line(old, &opos, &oline, &olen);
+		nhas = get_line(new, &npos, &nline, &nlen);
+		if (!ohas && !nhas)
+			break;
+
+		if (!ohas)
+			olen = 0;
+		if (!nhas)
+			nlen = 0;
+
+		if (cols) {
+			if (olen > cols)
+				olen = cols;
+			if (nlen > cols)
+				nlen = cols;
+		}
+
+		if (ohas && nhas && olen == nlen && !memcmp(oline, nline, nlen))
+			continue;
+
+		capture_printf(ccli, screen, "\033[%d;1H", row);
+		if (nlen)
+			capture_add(ccli, screen, nline, nlen);
+		capture_add(ccli, screen, "\033[K", 3);
+	}
+}
+
+static int count_lines(struct capture *cap)
+{
+	const char *line;
+	int pos = 0;
+	int len;
+	int cnt;
+
+	for (cnt = 0; get_line(cap, &pos, &line, &len); cnt++)
+		;
+
+	return cnt;
+}
+
+struct watch {
+	struct capture		old;
+	struct capture		new;
+	struct capture		screen;
+	const char		*cmd;
+	int			ms;
+};
+
+/* Run the command, and update the screen with what changed */
+static int watch_run(struct ccli *ccli, struct watch *watch)
+{
+	struct capture tmp;
+	struct winsize w;
+	int rows = 0;
+	int cols = 0;
+	int row;
+	int ret;
+
+	watch->new.len = 0;
+	set_capture(ccli, &watch->new);
+	ret = execute(ccli, watch->cmd, false);
+	set_capture(ccli, NULL);
+
+	if (ccli->in_tty && !ioctl(ccli->in, TIOCGWINSZ, &w)) {
+		rows = w.ws_row;
+		cols = w.ws_col;
+	}
+
+	repaint(ccli, &watch->screen, &watch->old, &watch->new,
+		WATCH_HEADER_ROWS + 1, rows, cols);
+
+	/* Leave the cursor after the output, if anything was drawn */
+	if (watch->screen.len) {
+		row = WATCH_HEADER_ROWS + 1 + count_lines(&watch->new);
+		if (rows && row > rows)
+			row = rows;
+		capture_printf(ccli, &watch->screen, "\033[%d;1H", row);
+		write_out(ccli, watch->screen.buf, watch->screen.len);
+		stat_add(ccli, redraws, 1);
+		trace_probe(redraw, watch->screen.len);
+		watch->screen.len = 0;
+	}
+
+	tmp = watch->old;
+	watch->old = watch->new;
+	watch->new = tmp;
+
+	return ret;
+}
+
+static int parse_interval(const char *str, int *ms)
+{
+	double sec;
+	char *end;
+
+	sec = strtod(str, &end);
+	if (end == str || *end || sec < 0)
+		return -1;
+
+	/* Also keep "inf", "nan" and huge values from overflowing @ms */
+	if (!isfinite(sec) || sec > INT_MAX / 1000)
+		return -1;
+
+	*ms = sec * 1000;
+	if (*ms < WATCH_MIN_MS)
+		*ms = WATCH_MIN_MS;
+
+	return 0;
+}
+
+/* Returns 1 if the user asked to stop watching, and -1 on error */
+static int watch_input(struct ccli *ccli)
+{
+	char ch;
+
+	if (read_in(ccli, &ch, 1) != 1)
+		return -1;
+
+	return ch == 'q' || ch == 3 ? 1 : 0;
+}
+
+static int watch_loop(struct ccli *ccli, struct watch *watch, int tfd)
+{
+	struct pollfd fds[3];
+	uint64_t ticks;
+	int nr;
+	int ret;
+
+	ret = watch_run(ccli, watch);
+
+	/* A timeout on watch itself stops the watching */
+	while (!ret && !ccli_cancelled(ccli)) {
+		fds[0].fd = ccli->in;
+		fds[0].events = POLLIN;
+		fds[1].fd = tfd;
+		fds[1].events = POLLIN;
+		fds[2].fd = ccli->sigfd;
+		fds[2].events = POLLIN;
+		nr = ccli->sigfd >= 0 ? 3 : 2;
+
+		if (poll(fds, nr, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (nr > 2 && (fds[2].revents & POLLIN)) {
+			ret = signal_handle(ccli);
+			if (ret)
+				break;
+		}
+
+		if (fds[0].revents) {
+			if (watch_input(ccli))
+				break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			/* Ticks that were missed while running are dropped */
+			read(tfd, &ticks, sizeof(ticks));
+			ret = watch_run(ccli, watch);
+		}
+	}
+
+	return ret;
+}
+
+static int watch_command(struct ccli *ccli, const char *command,
+			 const char *line, void *data,
+			 int argc, char **argv)
+{
+	struct itimerspec its;
+	struct watch watch;
+	int arg = 1;
+	int tfd;
+	int ret;
+
+	/* The output of the watched command is already being captured */
+	if (ccli->capture) {
+		echo_str(ccli, "watch: can not watch watch\n");
+		return 0;
+	}
+
+	/* The screen is repainted, which can not be kept for the pager */
+	if (paging(ccli)) {
+		echo_str(ccli, "watch: can not watch in the pager\n");
+		return 0;
+	}
+
+	memset(&watch, 0, sizeof(watch));
+	watch.ms = WATCH_DEFAULT_MS;
+
+	if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+		if (parse_interval(argv[2], &watch.ms) < 0)
+			goto usage;
+		arg = 3;
+	}
+
+	/* Use what was typed, so that the quoting is kept */
+	watch.cmd = line_word(line, arg);
+	if (!watch.cmd)
+		goto usage;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (tfd < 0) {
+		echo_str(ccli, "watch: can not create timer\n");
+		return 0;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = watch.ms / 1000;
+	its.it_value.tv_nsec = (watch.ms % 1000) * 1000000;
+	its.it_interval = its.it_value;
+	timerfd_settime(tfd, 0, &its, NULL);
+
+	/* Clear the screen and show the header */
+	capture_printf(ccli, &watch.screen, "\033[H\033[2JEvery %d.%ds: ",
+		       watch.ms / 1000, (watch.ms % 1000) / 100);
+	capture_add(ccli, &watch.screen, watch.cmd, strlen(watch.cmd));
+	capture_add(ccli, &watch.screen, "\n", 1);
+
+	ret = watch_loop(ccli, &watch, tfd);
+
+	echo(ccli, '\n');
+
+	close(tfd);
+	mem_free(ccli, watch.old.buf);
+	mem_free(ccli, watch.new.buf);
+	mem_free(ccli, watch.screen.buf);
+
+	return ret;
+ usage:
+	echo_str(ccli, WATCH_USAGE);
+	return 0;
+}
+
+/**
+ * ccli_register_watch - Add the "watch" command
+ * @ccli: The CLI descriptor to add the command to
+ *
+ * Registers the command "watch [-n seconds] command [args...]", which
+ * clears the screen and executes the given command every @seconds
+ * (two by default, and no less than a tenth of a second) until the
+ * user hits 'q' or Ctrl^C.
+ *
+ * The output of the command is captured, and only the lines that are
+ * different from the last time it was executed are redrawn. Only the
+ * output that the command writes with ccli_printf() and the like is
+ * captured, and not what it writes directly to the output descriptor.
+ *
+ * If the command returns non-zero, then watch stops, and returns
+ * the same, such that "watch exit" exits ccli_loop().
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_register_watch(struct ccli *ccli)
+{
+	return ccli_register_command(ccli, "watch", watch_command, NULL);
+}
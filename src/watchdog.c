@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Deadlines for commands.
+ *
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <time.h>
+
+#include "ccli-local.h"
+
+/*
+ * Commands execute in the thread that runs the loop, so nothing in the
+ * loop can notice that one is taking too long. Once a timeout is set, a
+ * watchdog thread is started that sleeps until the deadline of the
+ * command that is executing. If the command is still executing when it
+ * wakes up, it writes a warning and sets the flag that ccli_cancelled()
+ * returns. It is up to the command to check it and return.
+ *
+ * The warning is written right away, so that a command that is stuck
+ * does not leave the console silent. write_out() and write_now() hold
+ * out_lock, so it lands between two writes of the command and never in
+ * the middle of one. If the output of the command is captured (by watch)
+ * or paged, the warning is queued like ccli_printf() from other threads,
+ * and written when the command returns.
+ *
+ * A command that executes another one (like watch) saves the deadline
+ * of the outer command and restores it when the inner one is done.
+ */
+struct watchdog {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t		thread;
+	struct ccli		*ccli;
+	const char		*cmd;
+	struct timespec		deadline;
+	int			timeout;	/* Default for all commands */
+	int			ms;		/* Timeout of the armed command */
+	bool			armed;
+	bool			cancelled;
+	bool			stop;
+};
+
+static bool deadline_passed(struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (now.tv_sec != deadline->tv_sec)
+		return now.tv_sec > deadline->tv_sec;
+	return now.tv_nsec >= deadline->tv_nsec;
+}
+
+/* Called with wd->lock held */
+static void watchdog_fire(struct watchdog *wd)
+{
+	char buf[128];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "\n%s: timed out after %d.%03ds\n",
+		       wd->cmd, wd->ms / 1000, wd->ms % 1000);
+	if (len >= sizeof(buf)) {
+		len = sizeof(buf) - 1;
+		buf[len - 1] = '\n';
+	}
+
+	/* Written first, so that it is out when the command sees the flag */
+	write_now(wd->ccli, buf, len);
+
+	__atomic_store_n(&wd->cancelled, true, __ATOMIC_RELEASE);
+}
+
+static void *watchdog_thread(void *arg)
+{
+	struct watchdog *wd = arg;
+
+	pthread_mutex_lock(&wd->lock);
+	while (!wd->stop) {
+		if (!wd->armed || wd->cancelled) {
+			pthread_cond_wait(&wd->cond, &wd->lock);
+			continue;
+		}
+
+		pthread_cond_timedwait(&wd->cond, &wd->lock, &wd->deadline);
+
+		/* The command may have finished, or another one armed it */
+		if (wd->armed && !wd->cancelled && deadline_passed(&wd->deadline))
+			watchdog_fire(wd);
+	}
+	pthread_mutex_unlock(&wd->lock);
+
+	return NULL;
+}
+
+/* Start the watchdog thread (under cmd_lock) */
+static struct watchdog *watchdog_create(struct ccli *ccli)
+{
+	struct watchdog *wd;
+	pthread_condattr_t attr;
+	sigset_t mask;
+	sigset_t old;
+	int ret;
+
+	wd = mem_zalloc(ccli, sizeof(*wd));
+	if (!wd)
+		return NULL;
+
+	wd->ccli = ccli;
+	pthread_mutex_init(&wd->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wd->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* Signals that the loop reads from its signalfd must not go here */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old);
+	ret = pthread_create(&wd->thread, NULL, watchdog_thread, wd);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		pthread_cond_destroy(&wd->cond);
+		pthread_mutex_destroy(&wd->lock);
+		mem_free(ccli, wd);
+		errno = ret;
+		return NULL;
+	}
+
+	__atomic_store_n(&ccli->watchdog, wd, __ATOMIC_RELEASE);
+	return wd;
+}
+
+/* Only called when nothing else can be using @ccli */
+__hidden void watchdog_free(struct ccli *ccli)
+{
+	struct watchdog *wd = ccli->watchdog;
+
+	if (!wd)
+		return;
+
+	pthread_mutex_lock(&wd->lock);
+	wd->stop = true;
+	pthread_cond_signal(&wd->cond);
+	pthread_mutex_unlock(&wd->lock);
+
+	pthread_join(wd->thread, NULL);
+
+	pthread_cond_destroy(&wd->cond);
+	pthread_mutex_destroy(&wd->lock);
+	mem_free(ccli, wd);
+	ccli->watchdog = NULL;
+}
+
+/**
+ * watchdog_arm - start the deadline of a command
+ * @ccli: The CLI descriptor the command is executing on
+ * @cmd: The name of the command (must stay valid until watchdog_disarm())
+ * @ms: The timeout of the command (0 for the default, negative for none)
+ * @save: Where to save the deadline of a command that is already armed
+ *
+ * Returns true if the command has a deadline, and watchdog_disarm()
+ *   must be called with @save when it returns.
+ */
+__hidden bool watchdog_arm(struct ccli *ccli, const char *cmd, int ms,
+			   struct watchdog_save *save)
+{
+	struct watchdog *wd;
+
+	wd = __atomic_load_n(&ccli->watchdog, __ATOMIC_ACQUIRE);
+	if (!wd)
+		return false;
+
+	if (!ms)
+		ms = __atomic_load_n(&wd->timeout, __ATOMIC_RELAXED);
+	if (ms <= 0)
+		return false;
+
+	pthread_mutex_lock(&wd->lock);
+
+	save->cmd = wd->cmd;
+	save->deadline = wd->deadline;
+	save->ms = wd->ms;
+	save->armed = wd->armed;
+	save->cancelled = wd->cancelled;
+
+	clock_gettime(CLOCK_MONOTONIC, &wd->deadline);
+	wd->deadline.tv_sec += ms / 1000;
+	wd->deadline.tv_nsec += (ms % 1000) * 1000000;
+	if (wd->deadline.tv_nsec >= 1000000000) {
+		wd->deadline.tv_sec++;
+		wd->deadline.tv_nsec -= 1000000000;
+	}
+	wd->cmd = cmd;
+	wd->ms = ms;
+	wd->armed = true;
+	__atomic_store_n(&wd->cancelled, false, __ATOMIC_RELAXED);
+
+	pthread_cond_signal(&wd->cond);
+	pthread_mutex_unlock(&wd->lock);
+
+	return true;
+}
+
+__hidden void watchdog_disarm(struct ccli *ccli, struct watchdog_save *save)
+{
+	struct watchdog *wd = ccli->watchdog;
+
+	pthread_mutex_lock(&wd->lock);
+
+	wd->cmd = save->cmd;
+	wd->deadline = save->deadline;
+	wd->ms = save->ms;
+	wd->armed = save->armed;
+	__atomic_store_n(&wd->cancelled, save->cancelled, __ATOMIC_RELAXED);
+
+	/* The outer command may have passed its deadline in the meantime */
+	if (wd->armed)
+		pthread_cond_signal(&wd->cond);
+	pthread_mutex_unlock(&wd->lock);
+
+	/* Write the warning if it was queued, unless watch is capturing */
+	if (!ccli->capture)
+		output_flush(ccli);
+}
+
+/**
+ * ccli_cancelled - Test if the executing command ran out of time
+ * @ccli: The CLI descriptor the command is executing on
+ *
+ * A command that may take a long time should call this from time
+ * to time, and return when it is true. It becomes true when the
+ * command runs past the timeout set by ccli_set_timeout(), and
+ * goes back to false when the next command executes.
+ *
+ * This may be called from any thread, such as one that the command
+ * is waiting on.
+ *
+ * Returns true if the command executing on @ccli was cancelled.
+ */
+bool ccli_cancelled(struct ccli *ccli)
+{
+	struct watchdog *wd;
+
+	if (!ccli)
+		return false;
+
+	wd = __atomic_load_n(&ccli->watchdog, __ATOMIC_ACQUIRE);
+	return wd && __atomic_load_n(&wd->cancelled, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * ccli_set_timeout - Set how long commands may execute
+ * @ccli: The CLI descriptor to set the timeout for
+ * @command: The command to set the timeout of, or NULL for all commands
+ * @ms: The timeout in milliseconds
+ *
+ * When a command executes for longer than its timeout, a warning is
+ * written to the output and ccli_cancelled() returns true until the
+ * command returns. The command is not stopped, it must check
+ * ccli_cancelled() and return on its own.
+ *
+ * If @command is NULL, then @ms is the timeout of all commands that
+ * do not have their own, and zero means they have none. Otherwise
+ * it is the timeout of @command only, where zero means it uses the
+ * timeout for all commands, and a negative value means it has none,
+ * even if the others do. Replacing @command with ccli_register_command()
+ * keeps its timeout.
+ *
+ * The first time a timeout is set, a thread is created to watch
+ * over the commands. It exits when @ccli is freed.
+ *
+ * This may be called from any thread, even while another thread is
+ * running ccli_loop().
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int ccli_set_timeout(struct ccli *ccli, const char *command, int ms)
+{
+	struct command_table *cmds;
+	struct command *cmd;
+	struct watchdog *wd;
+	int ret = -1;
+
+	if (!ccli || (!command && ms < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ccli->cmd_lock);
+
+	if (command) {
+		cmd = find_command(ccli->cmds, command);
+		if (!cmd) {
+			errno = ENOENT;
+			goto out;
+		}
+	}
+
+	wd = ccli->watchdog;
+	if (!wd && ms > 0) {
+		wd = watchdog_create(ccli);
+		if (!wd)
+			goto out;
+	}
+
+	if (!command) {
+		if (wd)
+			__atomic_store_n(&wd->timeout, ms, __ATOMIC_RELAXED);
+		ret = 0;
+		goto out;
+	}
+
+	cmds = commands_copy(ccli, 0);
+	if (!cmds)
+		goto out;
+
+	cmds->commands[cmd - ccli->cmds->commands].timeout = ms;
+	commands_publish(ccli, cmds, NULL);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&ccli->cmd_lock);
+	return ret;
+}
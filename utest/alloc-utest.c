@@ -0,0 +1,299 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ *
+ * Allocation budgets of the hot paths.
+ *
+ * All memory of libccli goes through a counting allocator, and the
+ * loop is fed scripted input where each part to measure is between two
+ * Ctrl^C. The interrupt callback takes a snapshot of the count, so the
+ * difference between two snapshots is what that part of the input
+ * allocated, and nothing else.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include "ccli.h"
+#include "ccli-utest.h"
+
+#define ALLOC_SUITE		"ccli allocations"
+#define ALLOC_PROMPT		"alloc> "
+
+/* The budgets: exceeding one of these is a regression */
+#define BUDGET_KEY		0	/* Per printable key */
+#define BUDGET_EXECUTE		3	/* Per command executed */
+#define BUDGET_COMPLETION	3	/* Per hit of tab */
+#define BUDGET_HISTORY		0	/* Per move through the history */
+#define BUDGET_LONG_LIST	16	/* Per hit of tab with LONG_LIST words */
+
+#define LONG_LIST		10000
+
+#define MAX_SNAPSHOTS		16
+
+#define KEY_UP			"\033[A"
+#define KEY_DOWN		"\033[B"
+
+struct alloc_test {
+	unsigned long		count[MAX_SNAPSHOTS];
+	int			nr;
+};
+
+static unsigned long allocs;
+
+static void *count_malloc(size_t size, void *data)
+{
+	allocs++;
+	return malloc(size);
+}
+
+static void *count_realloc(void *ptr, size_t size, void *data)
+{
+	allocs++;
+	return realloc(ptr, size);
+}
+
+static void count_free(void *ptr, void *data)
+{
+	free(ptr);
+}
+
+static const struct ccli_allocator count_allocator = {
+	.malloc		= count_malloc,
+	.realloc	= count_realloc,
+	.free		= count_free,
+};
+
+static int snapshot(struct ccli *ccli, const char *line, int pos, void *data)
+{
+	struct alloc_test *test = data;
+
+	if (test->nr < MAX_SNAPSHOTS)
+		test->count[test->nr++] = allocs;
+	return 0;
+}
+
+/* Returns what was allocated between snapshot @n and the one after it */
+static long allocated(struct alloc_test *test, int n)
+{
+	if (n + 1 >= test->nr)
+		return -1;
+	return test->count[n + 1] - test->count[n];
+}
+
+static int command_nop(struct ccli *ccli, const char *command,
+		       const char *line, void *data,
+		       int argc, char **argv)
+{
+	return 0;
+}
+
+static int complete_words(struct ccli *ccli, const char *command,
+			  const char *line, int word, char *match,
+			  char ***list, void *data)
+{
+	static const char *words[] = { "alpha", "beta", "gamma", "delta" };
+	int cnt = 0;
+	int i;
+
+	for (i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+		ccli_list_add(ccli, list, &cnt, words[i]);
+	return cnt;
+}
+
+static int complete_many(struct ccli *ccli, const char *command,
+			 const char *line, int word, char *match,
+			 char ***list, void *data)
+{
+	char buf[16];
+	int cnt = 0;
+	int i;
+
+	for (i = 0; i < LONG_LIST; i++) {
+		snprintf(buf, sizeof(buf), "w%d", i);
+		ccli_list_add(ccli, list, &cnt, buf);
+	}
+	return cnt;
+}
+
+static int alloc_ccli(struct alloc_test *test, struct pipe_ccli *p)
+{
+	struct ccli *ccli;
+	char line[64];
+	int i;
+
+	memset(test, 0, sizeof(*test));
+
+	if (create_pipe_ccli(p, ALLOC_PROMPT) < 0)
+		return -1;
+
+	ccli = p->ccli;
+
+	ccli_register_command(ccli, "nop", command_nop, NULL);
+	ccli_register_command(ccli, "words", command_nop, NULL);
+	ccli_register_completion(ccli, "words", complete_words);
+	ccli_register_command(ccli, "many", command_nop, NULL);
+	ccli_register_completion(ccli, "many", complete_many);
+	ccli_register_interrupt(ccli, snapshot, test);
+
+	for (i = 0; i < 20; i++) {
+		snprintf(line, sizeof(line), "nop history line %d", i);
+		ccli_execute(ccli, line, true);
+	}
+
+	return 0;
+}
+
+/* Run the loop on @input (which must fit in the pipes) until it ends */
+static void run(struct pipe_ccli *p, const char *input)
+{
+	char buf[BUFSIZ];
+	int r;
+
+	run_pipe_ccli(p, input);
+
+	/* Nothing reads the output, so drop it */
+	while ((r = read(p->out[0], buf, sizeof(buf))) > 0)
+		;
+}
+
+static void test_alloc_keys(void)
+{
+	struct alloc_test test;
+	struct pipe_ccli p;
+
+	if (alloc_ccli(&test, &p) < 0)
+		return;
+
+	/* Type a line, edit it, and type into the middle of it */
+	run(&p,
+	    "\003the quick brown fox jumps over the lazy dog\003"
+	    "\177\177\177\033[D\033[D\033[Dxyz\003");
+
+	CU_TEST(test.nr == 3);
+	CU_TEST(allocated(&test, 0) <= BUDGET_KEY * 43);
+	CU_TEST(allocated(&test, 1) <= BUDGET_KEY * 9);
+
+	destroy_pipe_ccli(&p);
+}
+
+static void test_alloc_execute(void)
+{
+	struct alloc_test test;
+	struct pipe_ccli p;
+
+	if (alloc_ccli(&test, &p) < 0)
+		return;
+
+	run(&p,
+	    "\003nop\n\003nop with some arguments \"and a quoted one\"\n\003"
+	    "unknown command\n\003");
+
+	CU_TEST(test.nr == 4);
+	CU_TEST(allocated(&test, 0) <= BUDGET_EXECUTE);
+	CU_TEST(allocated(&test, 1) <= BUDGET_EXECUTE);
+	CU_TEST(allocated(&test, 2) <= BUDGET_EXECUTE);
+
+	destroy_pipe_ccli(&p);
+}
+
+static void test_alloc_completion(void)
+{
+	struct alloc_test test;
+	struct pipe_ccli p;
+
+	if (alloc_ccli(&test, &p) < 0)
+		return;
+
+	/* Complete a command, the list of words, and then one word */
+	run(&p, "wo\003\t\003\t\003\t\003al\003\t\003");
+
+	CU_TEST(test.nr == 6);
+	CU_TEST(allocated(&test, 0) <= BUDGET_COMPLETION);
+	CU_TEST(allocated(&test, 1) <= BUDGET_COMPLETION);
+	CU_TEST(allocated(&test, 2) <= BUDGET_COMPLETION);
+	CU_TEST(allocated(&test, 4) <= BUDGET_COMPLETION);
+
+	destroy_pipe_ccli(&p);
+}
+
+static void test_alloc_long_list(void)
+{
+	struct alloc_test test;
+	struct pipe_ccli p;
+
+	if (alloc_ccli(&test, &p) < 0)
+		return;
+
+	/* The list grows a few times, not once per block of words */
+	run(&p, "many \003\t\003\t\003");
+
+	CU_TEST(test.nr == 3);
+	CU_TEST(allocated(&test, 0) <= BUDGET_LONG_LIST);
+	CU_TEST(allocated(&test, 1) <= BUDGET_LONG_LIST);
+
+	destroy_pipe_ccli(&p);
+}
+
+static void test_alloc_history(void)
+{
+	struct alloc_test test;
+	struct pipe_ccli p;
+
+	if (alloc_ccli(&test, &p) < 0)
+		return;
+
+	/*
+	 * Leaving a typed line to go up saves it. That can allocate the
+	 * first time, but not after that.
+	 */
+	run(&p,
+	    "typed" KEY_UP KEY_DOWN "\003"
+	    KEY_UP KEY_UP KEY_UP KEY_DOWN KEY_UP KEY_UP "\003"
+	    KEY_DOWN KEY_DOWN KEY_DOWN KEY_DOWN KEY_DOWN KEY_DOWN "\003"
+	    "more" KEY_UP KEY_DOWN KEY_UP KEY_DOWN "\003");
+
+	CU_TEST(test.nr == 4);
+	CU_TEST(allocated(&test, 0) <= BUDGET_HISTORY * 6);
+	CU_TEST(allocated(&test, 1) <= BUDGET_HISTORY * 6);
+	CU_TEST(allocated(&test, 2) <= BUDGET_HISTORY * 4);
+
+	destroy_pipe_ccli(&p);
+}
+
+/* Everything that libccli allocates while the suite runs is counted */
+static int alloc_suite_init(void)
+{
+	return ccli_set_allocator(NULL, &count_allocator);
+}
+
+static int alloc_suite_destroy(void)
+{
+	return ccli_set_allocator(NULL, NULL);
+}
+
+void test_alloc_lib(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite(ALLOC_SUITE, alloc_suite_init, alloc_suite_destroy);
+	if (suite == NULL) {
+		fprintf(stderr, "Suite \"%s\" cannot be created\n", ALLOC_SUITE);
+		return;
+	}
+
+	CU_add_test(suite, "keys",
+		    test_alloc_keys);
+	CU_add_test(suite, "execute",
+		    test_alloc_execute);
+	CU_add_test(suite, "completion",
+		    test_alloc_completion);
+	CU_add_test(suite, "long list",
+		    test_alloc_long_list);
+	CU_add_test(suite, "history",
+		    test_alloc_history);
+}
@@ -17,6 +17,8 @@
 enum unit_tests {
 	RUN_NONE	= 0,
 	RUN_CCLI	= (1 << 0),
+	RUN_ALLOC	= (1 << 1),
+	RUN_SIMD	= (1 << 2),
 	RUN_ALL		= 0xFFFF
 };
 
@@ -26,6 +28,8 @@ static void print_help(char **argv)
 	printf("\t-s, --silent\tPrint test summary\n");
 	printf("\t-r, --run test\tRun specific test:\n");
 	printf("\t\t  ccli   run libccli tests\n");
+	printf("\t\t  alloc  run the allocation budget tests\n");
+	printf("\t\t  simd   run the SIMD cross checks\n");
 	printf("\t-h, --help\tPrint usage information\n");
 	exit(0);
 }
@@ -34,6 +38,7 @@ int main(int argc, char **argv)
 {
 	CU_BasicRunMode verbose = CU_BRM_VERBOSE;
 	enum unit_tests tests = RUN_NONE;
+	unsigned int failures;
 
 	for (;;) {
 		int c;
@@ -53,6 +58,10 @@ int main(int argc, char **argv)
 		case 'r':
 			if (strcmp(optarg, "ccli") == 0)
 				tests |= RUN_CCLI;
+			else if (strcmp(optarg, "alloc") == 0)
+				tests |= RUN_ALLOC;
+			else if (strcmp(optarg, "simd") == 0)
+				tests |= RUN_SIMD;
 			else
 				print_help(argv);
 			break;
@@ -76,9 +85,16 @@ int main(int argc, char **argv)
 
 	if (tests & RUN_CCLI)
 		test_ccli_lib();
+	if (tests & RUN_ALLOC)
+		test_alloc_lib();
+	if (tests & RUN_SIMD)
+		test_simd_lib();
 
 	CU_basic_set_mode(verbose);
 	CU_basic_run_tests();
+	failures = CU_get_number_of_failures();
 	CU_cleanup_registry();
-	return 0;
+
+	/* Let "make check" fail when a test does */
+	return failures ? 1 : 0;
 }
@@ -2,6 +2,22 @@
 #ifndef __CCLI_UTEST_H
 #define __CCLI_UTEST_H
 
+struct ccli;
+
+/* A ccli descriptor that tests feed and read through pipes */
+struct pipe_ccli {
+	struct ccli		*ccli;
+	int			in[2];		/* in[1] feeds the loop */
+	int			out[2];		/* out[0] reads what it writes */
+};
+
+int open_pipe_ccli(struct pipe_ccli *p);
+int create_pipe_ccli(struct pipe_ccli *p, const char *prompt);
+void destroy_pipe_ccli(struct pipe_ccli *p);
+int run_pipe_ccli(struct pipe_ccli *p, const char *input);
+
 void test_ccli_lib(void);
+void test_alloc_lib(void);
+void test_simd_lib(void);
 
 #endif
@@ -7,15 +7,25 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
 
 #include "ccli.h"
+#include "ccli-utest.h"
+#include "vt.h"
 
 #define CCLI_SUITE		"ccli library"
 #define TEST_INSTANCE_NAME	"cunit_test_iter"
@@ -121,6 +131,82 @@ static void destroy_ccli(void)
 	close(ccli_connect.cons_out);
 }
 
+/*
+ * Open the pipes of @p, for a test that allocates p->ccli itself on
+ * p->in[0] and p->out[1]. destroy_pipe_ccli() frees it.
+ */
+int open_pipe_ccli(struct pipe_ccli *p)
+{
+	p->ccli = NULL;
+	p->in[0] = p->in[1] = -1;
+	p->out[0] = p->out[1] = -1;
+
+	if (pipe(p->in) < 0 || pipe(p->out) < 0) {
+		CU_TEST(0);
+		destroy_pipe_ccli(p);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Allocate a ccli descriptor that reads p->in[0] and writes p->out[1].
+ * A test that closes one of the ends early sets it to -1, and
+ * destroy_pipe_ccli() closes the rest.
+ */
+int create_pipe_ccli(struct pipe_ccli *p, const char *prompt)
+{
+	if (open_pipe_ccli(p) < 0)
+		return -1;
+
+	p->ccli = ccli_alloc(prompt, p->in[0], p->out[1]);
+	CU_TEST(p->ccli != NULL);
+	if (!p->ccli) {
+		destroy_pipe_ccli(p);
+		return -1;
+	}
+	return 0;
+}
+
+void destroy_pipe_ccli(struct pipe_ccli *p)
+{
+	int i;
+
+	ccli_free(p->ccli);
+	p->ccli = NULL;
+
+	for (i = 0; i < 2; i++) {
+		if (p->in[i] >= 0)
+			close(p->in[i]);
+		if (p->out[i] >= 0)
+			close(p->out[i]);
+		p->in[i] = p->out[i] = -1;
+	}
+}
+
+/*
+ * Run the loop on @input (which must fit in the pipe) until it reads the
+ * end of it. The write end of the output is closed after, so that what
+ * the loop wrote can be read from p->out[0] up to its end.
+ */
+int run_pipe_ccli(struct pipe_ccli *p, const char *input)
+{
+	int len = strlen(input);
+	int ret;
+
+	ret = write(p->in[1], input, len);
+	CU_TEST(ret == len);
+	close(p->in[1]);
+	p->in[1] = -1;
+
+	ret = ccli_loop(p->ccli);
+
+	close(p->out[1]);
+	p->out[1] = -1;
+
+	return ret;
+}
+
 static void wait_for_console(void)
 {
 	pthread_barrier_wait(&pbarrier);
@@ -234,30 +320,2043 @@ static void test_ccli_command(void)
 	return;
 }
 
-static int test_suite_destroy(void)
+static int command_count(struct ccli *ccli, const char *command,
+			 const char *line, void *data,
+			 int argc, char **argv)
 {
-	void *cret;
+	int *cnt = data;
 
-	ccli_connect.run = false;
-	wait_for_console();
-	pthread_join(cons_thread, &cret);
-	ccli_free(ccli_connect.ccli);
+	CU_TEST(argc == 4);
+	(*cnt)++;
 	return 0;
 }
 
-static void *ccli_console(void *data)
+#define BIG_LINE	(64 * 1024)
+
+static void test_ccli_pools(void)
 {
-	struct test_ccli_connect *conn = data;
+	struct ccli_pool_stats argv_stats;
+	struct ccli_pool_stats line_stats;
+	struct ccli_pool_stats stats;
+	struct ccli *ccli;
+	char *big;
+	int cnt = 0;
+	int r;
+	int i;
 
-	do {
-		pthread_barrier_wait(&pbarrier);
-		if (!conn->run)
-			break;
-		printf("start loop\n");
-		conn->ret = ccli_loop(conn->ccli);
-		printf("end loop\n");
-		pthread_barrier_wait(&pbarrier);
-	} while (conn->run);
+	if (create_ccli(CCLI_PROMPT) < 0)
+		return;
+
+	ccli = ccli_connect.ccli;
+
+	r = ccli_register_command(ccli, "count", command_count, &cnt);
+	CU_TEST(!r);
+
+	/* The first execute warms up the pools */
+	ccli_execute(ccli, "count one 'two three' four", false);
+
+	r = ccli_pool_stats(ccli, CCLI_POOL_ARGV, &argv_stats);
+	CU_TEST(!r);
+	r = ccli_pool_stats(ccli, CCLI_POOL_LINE, &line_stats);
+	CU_TEST(!r);
+
+	for (i = 0; i < 100; i++)
+		ccli_execute(ccli, "count one 'two three' four", false);
+
+	CU_TEST(cnt == 101);
+
+	/* Nothing more should have been allocated */
+	ccli_pool_stats(ccli, CCLI_POOL_ARGV, &stats);
+	CU_TEST(stats.misses == argv_stats.misses);
+	CU_TEST(stats.hits == argv_stats.hits + 100);
+
+	ccli_pool_stats(ccli, CCLI_POOL_LINE, &stats);
+	CU_TEST(stats.misses == line_stats.misses);
+	CU_TEST(stats.hits == line_stats.hits + 100);
+
+	/* A huge line is not kept in the pool once it is done with */
+	big = malloc(BIG_LINE);
+	if (big) {
+		memset(big, 'x', BIG_LINE - 1);
+		big[BIG_LINE - 1] = '\0';
+		memcpy(big, "count one 'two three' ", 22);
+		ccli_execute(ccli, big, false);
+		free(big);
+
+		CU_TEST(cnt == 102);
+		ccli_pool_stats(ccli, CCLI_POOL_LINE, &stats);
+		CU_TEST(stats.releases > line_stats.releases);
+		CU_TEST(stats.cached_bytes < BIG_LINE);
+	}
+
+	r = ccli_pool_stats(ccli, CCLI_NR_POOLS, &stats);
+	CU_TEST(r < 0);
+
+	destroy_ccli();
+}
+
+struct count_alloc {
+	int			allocs;
+	int			frees;
+};
+
+static void *count_malloc(size_t size, void *data)
+{
+	struct count_alloc *count = data;
+
+	count->allocs++;
+	return malloc(size);
+}
+
+static void *count_realloc(void *ptr, size_t size, void *data)
+{
+	struct count_alloc *count = data;
+
+	if (!ptr)
+		count->allocs++;
+	return realloc(ptr, size);
+}
+
+static void count_free(void *ptr, void *data)
+{
+	struct count_alloc *count = data;
+
+	count->frees++;
+	free(ptr);
+}
+
+static void test_ccli_allocator(void)
+{
+	struct count_alloc global = { 0 };
+	struct count_alloc local = { 0 };
+	struct ccli_allocator allocator = {
+		.malloc		= count_malloc,
+		.realloc	= count_realloc,
+		.free		= count_free,
+	};
+	struct ccli *ccli;
+	int cnt = 0;
+	int r;
+
+	allocator.data = &global;
+	r = ccli_set_allocator(NULL, &allocator);
+	CU_TEST(!r);
+
+	if (create_ccli(CCLI_PROMPT) < 0)
+		goto out;
+
+	ccli = ccli_connect.ccli;
+
+	/* The descriptor, prompt and "exit" command */
+	CU_TEST(global.allocs > 0);
+
+	r = ccli_register_command(ccli, "count", command_count, &cnt);
+	CU_TEST(!r);
+	ccli_execute(ccli, "count one 'two three' four", true);
+
+	/* Move everything over to the local allocator */
+	allocator.data = &local;
+	r = ccli_set_allocator(ccli, &allocator);
+	CU_TEST(!r);
+	CU_TEST(local.allocs > 0);
+
+	ccli_execute(ccli, "count one 'two three' four", true);
+	CU_TEST(cnt == 2);
+	CU_TEST(strcmp(ccli_history(ccli, 1), "count one 'two three' four") == 0);
+
+	destroy_ccli();
+
+	/* Everything should have been freed by the one that allocated it */
+	CU_TEST(global.allocs == global.frees);
+	CU_TEST(local.allocs == local.frees);
+ out:
+	ccli_set_allocator(NULL, NULL);
+}
+
+static void test_ccli_static(void)
+{
+	struct count_alloc global = { 0 };
+	struct ccli_allocator allocator = {
+		.malloc		= count_malloc,
+		.realloc	= count_realloc,
+		.free		= count_free,
+		.data		= &global,
+	};
+	struct ccli_limits limits = {
+		.line_max		= 64,
+		.history_bytes		= 128,
+		.commands_max		= 3,
+		.completions_max	= 8,
+	};
+	static char mem[64 * 1024];
+	char line[100];
+	char **list = NULL;
+	struct pipe_ccli p;
+	struct ccli *ccli;
+	int cnt = 0;
+	int nr = 0;
+	int r;
+	int i;
+
+	/* Anything that goes to the heap would come through here */
+	r = ccli_set_allocator(NULL, &allocator);
+	CU_TEST(!r);
+
+	if (open_pipe_ccli(&p) < 0)
+		goto out;
+
+	ccli = ccli_alloc_static(CCLI_PROMPT, p.in[0], p.out[1], mem, 64, &limits);
+	CU_TEST(ccli == NULL && errno == ENOMEM);
+
+	ccli = ccli_alloc_static(CCLI_PROMPT, p.in[0], p.out[1], mem,
+				 sizeof(mem), &limits);
+	CU_TEST(ccli != NULL);
+	p.ccli = ccli;
+	if (!ccli)
+		goto close;
+
+	/* "exit" is the first of the three commands */
+	r = ccli_register_command(ccli, "count", command_count, &cnt);
+	CU_TEST(!r);
+	r = ccli_register_command(ccli, "run", command_run, NULL);
+	CU_TEST(!r);
+	r = ccli_register_command(ccli, "full", command_run, NULL);
+	CU_TEST(r < 0 && errno == ENOSPC);
+
+	for (i = 0; i < 20; i++)
+		ccli_execute(ccli, "count one 'two three' four", true);
+	CU_TEST(cnt == 20);
+
+	/* Each line takes 27 bytes, so only 4 fit in 128 */
+	CU_TEST(ccli_history(ccli, 4) != NULL);
+	CU_TEST(ccli_history(ccli, 5) == NULL);
+
+	memset(line, 'x', sizeof(line) - 1);
+	line[sizeof(line) - 1] = '\0';
+	r = ccli_execute(ccli, line, true);
+	CU_TEST(r < 0 && errno == E2BIG);
+
+	for (i = 0; i < 8; i++) {
+		r = ccli_list_add(ccli, &list, &nr, "word");
+		CU_TEST(r == i + 1);
+	}
+	r = ccli_list_add(ccli, &list, &nr, "word");
+	CU_TEST(r < 0 && errno == ENOSPC);
+	ccli_list_free(ccli, &list, nr);
+
+ close:
+	destroy_pipe_ccli(&p);
+	CU_TEST(global.allocs == 0);
+ out:
+	ccli_set_allocator(NULL, NULL);
+}
+
+#define SHARED_THREADS		4
+#define SHARED_LINES		1000
+
+struct shared_session {
+	struct pipe_ccli	p;
+	struct ccli		*ccli;
+	int			id;
+};
+
+static int command_nop(struct ccli *ccli, const char *command,
+		       const char *line, void *data,
+		       int argc, char **argv)
+{
+	return 0;
+}
+
+static void shared_session_cleanup(struct shared_session *sess)
+{
+	destroy_pipe_ccli(&sess->p);
+	sess->ccli = NULL;
+}
+
+static int shared_session_init(struct shared_session *sess,
+			       struct ccli_shared_history *hist, int id)
+{
+	if (create_pipe_ccli(&sess->p, CCLI_PROMPT) < 0)
+		return -1;
+
+	sess->id = id;
+	sess->ccli = sess->p.ccli;
+
+	ccli_register_command(sess->ccli, "add", command_nop, NULL);
+	if (ccli_set_shared_history(sess->ccli, hist) < 0)
+		goto fail;
+
+	return 0;
+ fail:
+	shared_session_cleanup(sess);
+	return -1;
+}
+
+/* Each session adds lines that are made up of just its own letter */
+static void *shared_writer(void *data)
+{
+	struct shared_session *sess = data;
+	char line[64];
+	int len;
+	int i;
+
+	for (i = 0; i < SHARED_LINES; i++) {
+		len = snprintf(line, sizeof(line), "add ");
+		memset(line + len, 'a' + sess->id, 4 + i % 32);
+		line[len + 4 + i % 32] = '\0';
+		ccli_execute(sess->ccli, line, true);
+	}
+	return NULL;
+}
+
+/* Returns true if the line is not a mix of two lines */
+static bool shared_line_ok(const char *line)
+{
+	const char *p;
+
+	if (strncmp(line, "add ", 4) != 0)
+		return false;
+
+	for (p = line + 5; *p; p++) {
+		if (*p != line[4])
+			return false;
+	}
+	return true;
+}
+
+static void test_ccli_shared_history(void)
+{
+	struct shared_session sessions[SHARED_THREADS + 1];
+	struct shared_session *reader = &sessions[SHARED_THREADS];
+	struct ccli_shared_history *hist;
+	pthread_t threads[SHARED_THREADS];
+	const char *line;
+	int nr = 0;
+	int bad = 0;
+	int i, j;
+
+	hist = ccli_shared_history_alloc(64, 63);
+	CU_TEST(hist != NULL);
+	if (!hist)
+		return;
+
+	for (nr = 0; nr <= SHARED_THREADS; nr++) {
+		if (shared_session_init(&sessions[nr], hist, nr) < 0) {
+			CU_TEST(0);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < SHARED_THREADS; i++)
+		pthread_create(&threads[i], NULL, shared_writer, &sessions[i]);
+
+	/* Read while the others are writing */
+	for (i = 0; i < SHARED_LINES; i++) {
+		for (j = 1; j <= 64; j++) {
+			line = ccli_history(reader->ccli, j);
+			if (line && !shared_line_ok(line))
+				bad++;
+		}
+	}
+
+	for (i = 0; i < SHARED_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	CU_TEST(bad == 0);
+
+	/* All sessions see everything that was added */
+	for (j = 1; j <= 64; j++) {
+		line = ccli_history(reader->ccli, j);
+		CU_TEST(line && shared_line_ok(line));
+	}
+	CU_TEST(ccli_history(reader->ccli, 65) == NULL);
+
+	ccli_execute(sessions[0].ccli, "add shared", true);
+	line = ccli_history(sessions[1].ccli, 1);
+	CU_TEST(line && strcmp(line, "add shared") == 0);
+
+	/* Going back to its own history */
+	ccli_set_shared_history(sessions[1].ccli, NULL);
+	line = ccli_history(sessions[1].ccli, 1);
+	CU_TEST(line == NULL);
+
+ out:
+	for (i = 0; i < nr; i++)
+		shared_session_cleanup(&sessions[i]);
+	ccli_shared_history_free(hist);
+}
+
+static int signal_count(struct ccli *ccli, int sig, void *data)
+{
+	int *cnt = data;
+
+	CU_TEST(sig == SIGUSR1);
+	(*cnt)++;
+	return 0;
+}
+
+static int signal_exit(struct ccli *ccli, int sig, void *data)
+{
+	return 1;
+}
+
+static void test_ccli_signal(void)
+{
+	struct pipe_ccli p;
+	struct ccli *ccli;
+	sigset_t mask;
+	int cnt = 0;
+	int r;
+
+	if (create_pipe_ccli(&p, CCLI_PROMPT) < 0)
+		return;
+
+	ccli = p.ccli;
+
+	r = ccli_register_signal(ccli, SIGKILL, signal_count, &cnt);
+	CU_TEST(r < 0 && errno == EINVAL);
+
+	r = ccli_register_signal(ccli, SIGUSR1, signal_count, &cnt);
+	CU_TEST(!r);
+
+	/* The signal is blocked and waits to be read by the loop */
+	pthread_sigmask(SIG_SETMASK, NULL, &mask);
+	CU_TEST(sigismember(&mask, SIGUSR1));
+
+	write(p.in[1], "x", 1);
+	raise(SIGUSR1);
+	CU_TEST(cnt == 0);
+
+	r = ccli_getchar(ccli);
+	CU_TEST(r == 'x');
+	CU_TEST(cnt == 1);
+
+	/* The loop exits when the callback returns non-zero */
+	r = ccli_register_signal(ccli, SIGUSR1, signal_exit, NULL);
+	CU_TEST(!r);
+	raise(SIGUSR1);
+	r = ccli_loop(ccli);
+	CU_TEST(r == 0);
+
+	r = ccli_unregister_signal(ccli, SIGUSR1);
+	CU_TEST(!r);
+	r = ccli_unregister_signal(ccli, SIGUSR1);
+	CU_TEST(r < 0 && errno == ENOENT);
+
+	pthread_sigmask(SIG_SETMASK, NULL, &mask);
+	CU_TEST(!sigismember(&mask, SIGUSR1));
+
+	destroy_pipe_ccli(&p);
+}
+
+#define HISTORY_FILE						\
+	"####---ccli---#### test 4\n"				\
+	"one\n"							\
+	"\n"							\
+	"three\n"						\
+	"exit\n"							\
+	"%%%%---ccli---%%%% test\n"
+
+static void test_ccli_history_fd(void)
+{
+	struct ccli *save, *load;
+	int fds[2];
+	int null;
+	int fd;
+	int r;
+
+	null = open("/dev/null", O_RDWR);
+	save = ccli_alloc(CCLI_PROMPT, null, null);
+	load = ccli_alloc(CCLI_PROMPT, null, null);
+	CU_TEST(save != NULL && load != NULL);
+	if (!save || !load)
+		goto out;
+
+#ifdef CCLI_NO_HISTORY_FILE
+	r = ccli_history_load_fd(load, "test", null);
+	CU_TEST(r < 0 && errno == ENOTSUP);
+	goto out;
+#endif
+
+	/* A pipe can not seek, and is read a byte at a time */
+	ccli_execute(save, "first line", true);
+	ccli_execute(save, "second 'line'", true);
+
+	if (pipe(fds) < 0) {
+		CU_TEST(0);
+		goto out;
+	}
+	r = ccli_history_save_fd(save, "test", fds[1]);
+	CU_TEST(r == 2);
+	close(fds[1]);
+
+	r = ccli_history_load_fd(load, "test", fds[0]);
+	CU_TEST(r == 2);
+	close(fds[0]);
+	CU_TEST(ccli_history(load, 1) && strcmp(ccli_history(load, 1), "second 'line'") == 0);
+	CU_TEST(ccli_history(load, 2) && strcmp(ccli_history(load, 2), "first line") == 0);
+
+	/* An empty line must not lose the lines after it */
+	fd = memfd_create("history", 0);
+	CU_TEST(fd >= 0);
+	if (fd < 0)
+		goto out;
+	r = write(fd, HISTORY_FILE, strlen(HISTORY_FILE));
+	CU_TEST(r == strlen(HISTORY_FILE));
+	lseek(fd, 0, SEEK_SET);
+
+	r = ccli_history_load_fd(load, "test", fd);
+	CU_TEST(r == 4);
+	close(fd);
+	CU_TEST(ccli_history(load, 1) && strcmp(ccli_history(load, 1), "three") == 0);
+	CU_TEST(ccli_history(load, 2) && strcmp(ccli_history(load, 2), "one") == 0);
+
+	/* An empty file has no history */
+	fd = memfd_create("history", 0);
+	CU_TEST(fd >= 0);
+	if (fd < 0)
+		goto out;
+	r = ccli_history_load_fd(load, "test", fd);
+	CU_TEST(r < 0);
+	close(fd);
+ out:
+	ccli_free(save);
+	ccli_free(load);
+	close(null);
+}
+
+struct watch_test {
+	int			in;
+	int			cnt;
+};
+
+static int command_ticker(struct ccli *ccli, const char *command,
+			  const char *line, void *data,
+			  int argc, char **argv)
+{
+	struct watch_test *test = data;
+
+	ccli_printf(ccli, "static line\ncount %d\n", ++test->cnt);
+
+	/* Have watch stop after the third run */
+	if (test->cnt == 3)
+		write(test->in, "q", 1);
+	return 0;
+}
+
+static int count_str(const char *buf, const char *str)
+{
+	int cnt = 0;
+
+	for (; (buf = strstr(buf, str)); buf++)
+		cnt++;
+	return cnt;
+}
+
+static void test_ccli_watch(void)
+{
+	struct watch_test test = { };
+	struct pipe_ccli p;
+	struct ccli *ccli;
+	char buf[BUFSIZ + 1];
+	int r;
+
+	if (create_pipe_ccli(&p, CCLI_PROMPT) < 0)
+		return;
+
+	ccli = p.ccli;
+
+	test.in = p.in[1];
+	r = ccli_register_command(ccli, "ticker", command_ticker, &test);
+	CU_TEST(!r);
+	r = ccli_register_watch(ccli);
+	CU_TEST(!r);
+
+	r = ccli_execute(ccli, "watch -n 0.1 ticker", false);
+	CU_TEST(r == 0);
+	CU_TEST(test.cnt == 3);
+
+	r = read(p.out[0], buf, BUFSIZ);
+	CU_TEST(r > 0);
+	if (r < 0)
+		r = 0;
+	buf[r] = '\0';
+
+	CU_TEST(strstr(buf, "Every 0.1s: ticker\n") != NULL);
+
+	/* Only the line that changed is written again */
+	CU_TEST(count_str(buf, "static line") == 1);
+	CU_TEST(count_str(buf, "count 1") == 1);
+	CU_TEST(count_str(buf, "count 2") == 1);
+	CU_TEST(count_str(buf, "count 3") == 1);
+
+	/* Watching watch is not allowed */
+	write(p.in[1], "q", 1);
+	r = ccli_execute(ccli, "watch watch ticker", false);
+	CU_TEST(r == 0);
+	CU_TEST(test.cnt == 3);
+
+	r = read(p.out[0], buf, BUFSIZ);
+	CU_TEST(r > 0);
+	if (r < 0)
+		r = 0;
+	buf[r] = '\0';
+	CU_TEST(strstr(buf, "can not watch watch") != NULL);
+
+	/* Intervals that do not fit in milliseconds are rejected */
+	r = ccli_execute(ccli, "watch -n 1e10 ticker", false);
+	CU_TEST(r == 0);
+	r = ccli_execute(ccli, "watch -n inf ticker", false);
+	CU_TEST(r == 0);
+	r = ccli_execute(ccli, "watch -n nan ticker", false);
+	CU_TEST(r == 0);
+	CU_TEST(test.cnt == 3);
+
+	r = read(p.out[0], buf, BUFSIZ);
+	CU_TEST(r > 0);
+	if (r < 0)
+		r = 0;
+	buf[r] = '\0';
+	CU_TEST(count_str(buf, "usage: watch") == 3);
+
+	destroy_pipe_ccli(&p);
+}
+
+static void read_out(int fd, char *buf)
+{
+	int r;
+
+	r = read(fd, buf, BUFSIZ);
+	CU_TEST(r > 0);
+	if (r < 0)
+		r = 0;
+	buf[r] = '\0';
+}
+
+#define BAR_40	"########################################"
+
+static void test_ccli_stats_commands(void)
+{
+	struct pipe_ccli p;
+	struct ccli *ccli;
+	char buf[BUFSIZ + 1];
+	int r;
+
+	if (create_pipe_ccli(&p, CCLI_PROMPT) < 0)
+		return;
+
+	ccli = p.ccli;
+
+	r = ccli_register_command(ccli, "nop", command_nop, NULL);
+	CU_TEST(!r);
+	r = ccli_register_stats(ccli);
+	CU_TEST(!r);
+
+	ccli_execute(ccli, "nop", false);
+	ccli_execute(ccli, "nop a b", false);
+	ccli_execute(ccli, "nop", false);
+	ccli_execute(ccli, "nosuch", false);
+	read_out(p.out[0], buf);
+
+	r = ccli_execute(ccli, "stats", false);
+	CU_TEST(r == 0);
+	read_out(p.out[0], buf);
+	CU_TEST(strstr(buf, "Counters:\n") != NULL);
+	CU_TEST(strstr(buf, "Memory:\n") != NULL);
+	CU_TEST(strstr(buf, "  nop                       3 ") != NULL);
+	CU_TEST(strstr(buf, "  (unknown)                 1 ") != NULL);
+
+	ccli_execute(ccli, "stats nop", false);
+	read_out(p.out[0], buf);
+	CU_TEST(strncmp(buf, "nop: 3 runs, ", 13) == 0);
+	/* The runs may fall in different buckets, the fullest has the longest bar */
+	CU_TEST(strstr(buf, "|" BAR_40 "\n") != NULL);
+	CU_TEST(strstr(buf, BAR_40 "#") == NULL);
+
+	/* perf prints the cost after each command, including "perf on" */
+	ccli_execute(ccli, "perf on", false);
+	ccli_execute(ccli, "nop", false);
+	read_out(p.out[0], buf);
+	CU_TEST(count_str(buf, "perf: ") == 2);
+	CU_TEST(strstr(buf, " ms, 0 reads (0 bytes), 0 writes (0 bytes), 0 allocs\n") != NULL);
+
+	ccli_execute(ccli, "perf off", false);
+	ccli_execute(ccli, "perf", false);
+	read_out(p.out[0], buf);
+	CU_TEST(strstr(buf, "perf is off\n") != NULL);
+
+	ccli_execute(ccli, "stats -r", false);
+	ccli_execute(ccli, "stats nop", false);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "nop has not been executed\n") == 0);
+
+	destroy_pipe_ccli(&p);
+}
+
+/* An allocator that can not give out a page or more */
+static void *small_malloc(size_t size, void *data)
+{
+	return size < 4096 ? malloc(size) : NULL;
+}
+
+static void *small_realloc(void *ptr, size_t size, void *data)
+{
+	return size < 4096 ? realloc(ptr, size) : NULL;
+}
+
+static void small_free(void *ptr, void *data)
+{
+	free(ptr);
+}
+
+static const struct ccli_allocator small_allocator = {
+	.malloc		= small_malloc,
+	.realloc	= small_realloc,
+	.free		= small_free,
+};
+
+#define PAGER_LINES		100
+
+static int command_lines(struct ccli *ccli, const char *command,
+			 const char *line, void *data,
+			 int argc, char **argv)
+{
+	int l = 1;
+	int i;
+
+	for (i = 1; i <= PAGER_LINES && l >= 0; i++)
+		l = ccli_page(ccli, l, "line %d\n", i);
+	return 0;
+}
+
+static int command_table(struct ccli *ccli, const char *command,
+			 const char *line, void *data,
+			 int argc, char **argv)
+{
+	struct ccli_table *table;
+	int i;
+
+	table = ccli_table_begin(ccli, "NAME", NULL);
+	for (i = 1; i <= PAGER_LINES; i++)
+		ccli_table_cell(table, "row %d", i);
+	return ccli_table_end(table);
+}
+
+#define E_ACUTE		"\xc3\xa9"		/* One column */
+#define HAN		"\xe6\xbc\xa2"	/* Two columns */
+
+/* Lines that do not take a column per byte */
+static int command_escapes(struct ccli *ccli, const char *command,
+			   const char *line, void *data,
+			   int argc, char **argv)
+{
+	int i;
+
+	ccli_printf(ccli, "tab\there\033[31mred\001\n");
+	ccli_printf(ccli, "\xff\xc2\x9b bytes\n");
+	for (i = 0; i < 50; i++)
+		ccli_printf(ccli, E_ACUTE);
+	ccli_printf(ccli, "\n");
+	for (i = 0; i < 30; i++)
+		ccli_printf(ccli, HAN);
+	ccli_printf(ccli, "\n");
+	for (i = 5; i <= PAGER_LINES; i++)
+		ccli_printf(ccli, "%d: the quick brown fox jumps over the lazy dog\n", i);
+	return 0;
+}
+
+/* What the pager wrote the last time, as it was written */
+static char pager_raw[BUFSIZ * 8 + 1];
+static int pager_raw_len;
+
+struct pager_resize {
+	pthread_t		loop;
+	struct winsize		w;
+	int			master;
+	const char		*keys;
+};
+
+/* Resize the window while the pager shows it, and then type the keys */
+static void *pager_resize(void *arg)
+{
+	struct pager_resize *resize = arg;
+	struct timespec ts = { .tv_nsec = 100000000 };
+
+	nanosleep(&ts, NULL);
+	ioctl(resize->master, TIOCSWINSZ, &resize->w);
+	pthread_kill(resize->loop, SIGWINCH);
+	nanosleep(&ts, NULL);
+	write(resize->master, resize->keys, strlen(resize->keys));
+	return NULL;
+}
+
+/*
+ * Execute @cmd in a 10x40 terminal, typing @keys. If @resize is given,
+ * the keys are typed after the window is resized to it.
+ */
+static void __run_pager(struct vt *vt, const char *cmd, const char *keys,
+			struct winsize *resize)
+{
+	struct winsize w = { .ws_row = 10, .ws_col = 40 };
+	struct pager_resize pr;
+	struct ccli *ccli;
+	pthread_t thread;
+	char buf[BUFSIZ];
+	int out[2];
+	int master;
+	int slave;
+	int r;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		/* No terminals to test with */
+		if (master >= 0)
+			close(master);
+		return;
+	}
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if (slave < 0 || pipe(out) < 0) {
+		CU_TEST(0);
+		goto out_slave;
+	}
+	ioctl(slave, TIOCSWINSZ, &w);
+
+	ccli = ccli_alloc(CCLI_PROMPT, slave, out[1]);
+	CU_TEST(ccli != NULL);
+	if (!ccli)
+		goto out;
+
+	ccli_register_command(ccli, "lines", command_lines, NULL);
+	ccli_register_command(ccli, "table", command_table, NULL);
+	ccli_register_command(ccli, "escapes", command_escapes, NULL);
+	ccli_register_pager(ccli);
+
+	/* After ccli_alloc() has taken the terminal out of line mode */
+	if (resize) {
+		ccli_register_signal(ccli, SIGWINCH, NULL, NULL);
+		pr.loop = pthread_self();
+		pr.w = *resize;
+		pr.master = master;
+		pr.keys = keys;
+		pthread_create(&thread, NULL, pager_resize, &pr);
+	} else {
+		write(master, keys, strlen(keys));
+	}
+	r = ccli_execute(ccli, cmd, false);
+	CU_TEST(r == 0);
+	if (resize)
+		pthread_join(thread, NULL);
+	ccli_free(ccli);
+
+	close(out[1]);
+	out[1] = -1;
+	vt_clear(vt);
+	pager_raw_len = 0;
+	while ((r = read(out[0], buf, sizeof(buf))) > 0) {
+		vt_write(vt, buf, r);
+		if (r > sizeof(pager_raw) - 1 - pager_raw_len)
+			r = sizeof(pager_raw) - 1 - pager_raw_len;
+		memcpy(pager_raw + pager_raw_len, buf, r);
+		pager_raw_len += r;
+	}
+	pager_raw[pager_raw_len] = '\0';
+ out:
+	close(out[0]);
+	if (out[1] >= 0)
+		close(out[1]);
+ out_slave:
+	if (slave >= 0)
+		close(slave);
+	close(master);
+}
+
+static void run_pager(struct vt *vt, const char *cmd, const char *keys)
+{
+	__run_pager(vt, cmd, keys, NULL);
+}
+
+/* @n times @str, and then @end */
+static const char *repeat(char *buf, const char *str, int n, const char *end)
+{
+	int len = 0;
+
+	while (n--)
+		len += sprintf(buf + len, "%s", str);
+	sprintf(buf + len, "%s", end);
+	return buf;
+}
+
+static void test_ccli_pager(void)
+{
+	struct winsize resize = { .ws_row = 10, .ws_col = 20 };
+	struct pipe_ccli p;
+	char expect[BUFSIZ];
+	char buf[BUFSIZ + 1];
+	struct vt *vt;
+	int len = 0;
+	int r;
+	int i;
+
+	if (create_pipe_ccli(&p, CCLI_PROMPT) < 0)
+		return;
+
+#ifdef CCLI_NO_PAGER
+	r = ccli_pager_start(p.ccli);
+	CU_TEST(r < 0 && errno == ENOTSUP);
+	destroy_pipe_ccli(&p);
+	return;
+#endif
+
+	r = ccli_register_command(p.ccli, "lines", command_lines, NULL);
+	CU_TEST(!r);
+	r = ccli_register_pager(p.ccli);
+	CU_TEST(!r);
+
+	/* Not a terminal: the output is written as it is, without stopping */
+	r = ccli_execute(p.ccli, "page lines", false);
+	CU_TEST(r == 0);
+	read_out(p.out[0], buf);
+	for (i = 1; i <= PAGER_LINES; i++)
+		len += sprintf(expect + len, "line %d\n", i);
+	CU_TEST(strcmp(buf, expect) == 0);
+
+	r = ccli_pager_stop(p.ccli);
+	CU_TEST(r < 0 && errno == ENOENT);
+
+	/* Nothing is written until the pager stops */
+	r = ccli_pager_start(p.ccli);
+	CU_TEST(r == 0);
+	r = ccli_pager_start(p.ccli);
+	CU_TEST(r < 0 && errno == EBUSY);
+	ccli_printf(p.ccli, "kept");
+	ccli_printf(p.ccli, " line\n");
+	ccli_execute(p.ccli, "page page lines", false);
+	r = ccli_pager_stop(p.ccli);
+	CU_TEST(r == 0);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "kept line\npage: can not page this output\n") == 0);
+
+	/* Without the memory to keep it, the output is written out as it comes */
+	r = ccli_set_allocator(p.ccli, &small_allocator);
+	CU_TEST(r == 0);
+	r = ccli_pager_start(p.ccli);
+	CU_TEST(r == 0);
+	ccli_printf(p.ccli, "not kept\n");
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "not kept\n") == 0);
+	ccli_printf(p.ccli, "nor this\n");
+	r = ccli_pager_stop(p.ccli);
+	CU_TEST(r == 0);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "nor this\n") == 0);
+	ccli_set_allocator(p.ccli, NULL);
+
+	destroy_pipe_ccli(&p);
+
+	vt = vt_alloc(10, 40);
+	CU_TEST(vt != NULL);
+	if (!vt)
+		return;
+
+	/* Quit at once shows the first screen, without the status line */
+	run_pager(vt, "page lines", "q");
+	CU_TEST(strcmp(vt_line(vt, 0), "line 1") == 0);
+	CU_TEST(strcmp(vt_line(vt, 8), "line 9") == 0);
+	CU_TEST(strcmp(vt_line(vt, 9), "") == 0);
+
+	/* Page down twice and back up once, then a line down */
+	run_pager(vt, "page lines", "  bjq");
+	CU_TEST(strcmp(vt_line(vt, 0), "line 11") == 0);
+
+	/* The end, and searching back from it */
+	run_pager(vt, "page lines", "Gq");
+	CU_TEST(strcmp(vt_line(vt, 0), "line 92") == 0);
+	CU_TEST(strcmp(vt_line(vt, 8), "line 100") == 0);
+	run_pager(vt, "page lines", "G?line 3\rq");
+	CU_TEST(strcmp(vt_line(vt, 0), "line 39") == 0);
+
+	/* Search forward, the next match, and one that is not there */
+	run_pager(vt, "page lines", "/line 5\rn/nosuch\rq");
+	CU_TEST(strcmp(vt_line(vt, 0), "line 50") == 0);
+
+	/* Lines are cut by the columns they take, and can not draw on their own */
+	run_pager(vt, "page escapes", "q");
+	CU_TEST(strstr(pager_raw, "tab     here^[[31mred^A\n") != NULL);
+	CU_TEST(strstr(pager_raw, "<FF><C2><9B> bytes\n") != NULL);
+	CU_TEST(strstr(pager_raw, repeat(expect, E_ACUTE, 40, "\n")) != NULL);
+	CU_TEST(strstr(pager_raw, repeat(expect, E_ACUTE, 41, "")) == NULL);
+	CU_TEST(strstr(pager_raw, repeat(expect, HAN, 20, "\n")) != NULL);
+	CU_TEST(strstr(pager_raw, repeat(expect, HAN, 21, "")) == NULL);
+	CU_TEST(strcmp(vt_line(vt, 4), "5: the quick brown fox jumps over the la") == 0);
+
+	/* A resize while it is shown draws it again for the new size */
+	__run_pager(vt, "page escapes", "q", &resize);
+	CU_TEST(strcmp(vt_line(vt, 4), "5: the quick brown f") == 0);
+
+	vt_free(vt);
+}
+
+static void test_ccli_table(void)
+{
+	struct ccli_table *table;
+	struct pipe_ccli p;
+	char buf[BUFSIZ + 1];
+	char big[5001];
+#ifndef CCLI_NO_PAGER
+	struct vt *vt;
+#endif
+	int r;
+	int i;
+
+	if (create_pipe_ccli(&p, CCLI_PROMPT) < 0)
+		return;
+
+	table = ccli_table_begin(p.ccli, NULL);
+	CU_TEST(table == NULL && errno == EINVAL);
+	r = ccli_table_end(NULL);
+	CU_TEST(r < 0 && errno == EINVAL);
+	r = ccli_set_table_format(p.ccli, CCLI_TABLE_JSON + 1);
+	CU_TEST(r < 0 && errno == EINVAL);
+
+	/* The same table in each format, the output is not a terminal */
+	for (i = CCLI_TABLE_TEXT; i <= CCLI_TABLE_JSON; i++) {
+		r = ccli_set_table_format(p.ccli, i);
+		CU_TEST(r == 0);
+
+		table = ccli_table_begin(p.ccli, "NAME", "COUNT", "NOTE", NULL);
+		CU_TEST(table != NULL);
+		r = ccli_table_row(table, "alpha", "3", "first");
+		CU_TEST(r == 0);
+		r = ccli_table_row(table, "b", "1024", NULL);
+		CU_TEST(r == 0);
+		/* The last cell of this row is left out */
+		r = ccli_table_cell(table, "%s, %s", "gamma", "delta");
+		CU_TEST(r == 0);
+		r = ccli_table_cell(table, "%d", -7);
+		CU_TEST(r == 0);
+		r = ccli_table_end(table);
+		CU_TEST(r == 0);
+		read_out(p.out[0], buf);
+
+		switch (i) {
+		case CCLI_TABLE_TEXT:
+			/* Numbers are right aligned, and lines are not padded */
+			CU_TEST(strcmp(buf,
+				       "NAME          COUNT  NOTE\n"
+				       "------------  -----  -----\n"
+				       "alpha             3  first\n"
+				       "b              1024\n"
+				       "gamma, delta     -7\n") == 0);
+			break;
+		case CCLI_TABLE_CSV:
+			CU_TEST(strcmp(buf,
+				       "NAME,COUNT,NOTE\n"
+				       "alpha,3,first\n"
+				       "b,1024,\n"
+				       "\"gamma, delta\",-7,\n") == 0);
+			break;
+		case CCLI_TABLE_JSON:
+			CU_TEST(strcmp(buf,
+				       "{\"NAME\":\"alpha\",\"COUNT\":3,\"NOTE\":\"first\"}\n"
+				       "{\"NAME\":\"b\",\"COUNT\":1024,\"NOTE\":\"\"}\n"
+				       "{\"NAME\":\"gamma, delta\",\"COUNT\":-7,\"NOTE\":\"\"}\n") == 0);
+			break;
+		}
+	}
+
+	/* Quoting */
+	table = ccli_table_begin(p.ccli, "K", NULL);
+	ccli_table_row(table, "say \"hi\"\n\001");
+	ccli_table_end(table);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "{\"K\":\"say \\\"hi\\\"\\n\\u0001\"}\n") == 0);
+
+	ccli_set_table_format(p.ccli, CCLI_TABLE_CSV);
+	table = ccli_table_begin(p.ccli, "K", NULL);
+	ccli_table_row(table, "say \"hi\"\n");
+	ccli_table_end(table);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "K\n\"say \"\"hi\"\"\n\"\n") == 0);
+
+	/* Cells that do not fit in what is left of the arena */
+	memset(big, 'a', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	table = ccli_table_begin(p.ccli, "K", NULL);
+	for (i = 0; i < 1000; i++)
+		ccli_table_cell(table, "%d", i);
+	r = ccli_table_cell(table, "%s", big);
+	CU_TEST(r == 0);
+	r = ccli_table_end(table);
+	CU_TEST(r == 0);
+	read_out(p.out[0], buf);
+	CU_TEST(strncmp(buf, "K\n0\n1\n2\n", 8) == 0);
+	CU_TEST(strstr(buf, "\n998\n999\naaaa") != NULL);
+	r = strlen(buf);
+	while (r < 2 + 3890 + 5001) {
+		i = read(p.out[0], buf, BUFSIZ);
+		if (i <= 0)
+			break;
+		buf[i] = '\0';
+		r += i;
+	}
+	CU_TEST(r == 2 + 3890 + 5001);
+	CU_TEST(r > 5000 && strcmp(buf + strlen(buf) - 5, "aaaa\n") == 0);
+
+	destroy_pipe_ccli(&p);
+
+#ifndef CCLI_NO_PAGER
+	/* A table that does not fit in the window goes to the pager */
+	vt = vt_alloc(10, 40);
+	CU_TEST(vt != NULL);
+	if (!vt)
+		return;
+	run_pager(vt, "table", "q");
+	CU_TEST(strcmp(vt_line(vt, 0), "NAME") == 0);
+	CU_TEST(strcmp(vt_line(vt, 1), "-------") == 0);
+	run_pager(vt, "table", "Gq");
+	CU_TEST(strcmp(vt_line(vt, 8), "row 100") == 0);
+	vt_free(vt);
+#endif
+}
+
+static void test_ccli_emit(void)
+{
+	struct ccli_table *table;
+	struct pipe_ccli p;
+	struct ccli *ccli;
+	char buf[BUFSIZ + 1];
+	char big[3001];
+	int len;
+	int r;
+
+	if (create_pipe_ccli(&p, CCLI_PROMPT) < 0)
+		return;
+
+	ccli = p.ccli;
+
+	r = ccli_set_output_mode(ccli, CCLI_OUTPUT_JSON + 1);
+	CU_TEST(r < 0 && errno == EINVAL);
+	r = ccli_emit_kv(ccli, NULL, "%d", 1);
+	CU_TEST(r < 0 && errno == EINVAL);
+	CU_TEST(ccli_get_output_mode(ccli) == CCLI_OUTPUT_TEXT);
+
+	r = ccli_register_output(ccli);
+	CU_TEST(!r);
+
+	/* Text, with the values of a record lined up */
+	r = ccli_emit_kv(ccli, "count", "%d", 3);
+	CU_TEST(r == 0);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "count: 3\n") == 0);
+
+	r = ccli_emit_record(ccli, "name", "alpha", "size", "12",
+			     "owner id", "a \"b\"", "note", NULL, NULL);
+	CU_TEST(r == 0);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf,
+		       "name:     alpha\n"
+		       "size:     12\n"
+		       "owner id: a \"b\"\n"
+		       "note:\n") == 0);
+
+	/* JSON, switched by the command */
+	ccli_execute(ccli, "output json", false);
+	CU_TEST(ccli_get_output_mode(ccli) == CCLI_OUTPUT_JSON);
+
+	ccli_emit_kv(ccli, "count", "%d", 3);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "{\"count\":3}\n") == 0);
+
+	/* The format says what is a number, not what the value looks like */
+	ccli_emit_kv(ccli, "ratio", "%.2f", 0.5);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "{\"ratio\":0.50}\n") == 0);
+	ccli_emit_kv(ccli, "zip", "%s", "02134");
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "{\"zip\":\"02134\"}\n") == 0);
+	ccli_emit_kv(ccli, "id", "#%d", 7);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "{\"id\":\"#7\"}\n") == 0);
+	ccli_emit_kv(ccli, "limit", "%f", 1.0 / 0.0);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "{\"limit\":\"inf\"}\n") == 0);
+
+	ccli_emit_record(ccli, "name", "alpha", "size", "12",
+			 "owner id", "a \"b\"", "note", NULL, NULL);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "{\"name\":\"alpha\",\"size\":\"12\","
+		       "\"owner id\":\"a \\\"b\\\"\",\"note\":null}\n") == 0);
+
+	ccli_execute(ccli, "output", false);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "{\"output\":\"json\"}\n") == 0);
+
+	ccli_execute(ccli, "output xml", false);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "{\"error\":\"usage: output [text|json]\"}\n") == 0);
+	CU_TEST(ccli_get_output_mode(ccli) == CCLI_OUTPUT_JSON);
+
+	/* Tables follow the mode */
+	table = ccli_table_begin(ccli, "K", "V", NULL);
+	ccli_table_row(table, "x", "1");
+	ccli_table_end(table);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "{\"K\":\"x\",\"V\":1}\n") == 0);
+
+	/* Longer than the buffers of the writer */
+	memset(big, 'b', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	r = ccli_emit_kv(ccli, "big", "%s", big);
+	CU_TEST(r == 0);
+	for (len = 0; len < sizeof("{\"big\":\"\"}\n") - 1 + 3000; len += r) {
+		r = read(p.out[0], buf + len, BUFSIZ - len);
+		if (r <= 0)
+			break;
+	}
+	buf[len] = '\0';
+	CU_TEST(len == sizeof("{\"big\":\"\"}\n") - 1 + 3000);
+	CU_TEST(strncmp(buf, "{\"big\":\"bbb", 11) == 0);
+	CU_TEST(strcmp(buf + len - 5, "bb\"}\n") == 0);
+
+	ccli_execute(ccli, "output text", false);
+	ccli_execute(ccli, "output", false);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "output: text\n") == 0);
+
+	ccli_execute(ccli, "output xml", false);
+	read_out(p.out[0], buf);
+	CU_TEST(strcmp(buf, "usage: output [text|json]\n") == 0);
+
+	destroy_pipe_ccli(&p);
+}
+
+static int command_hang(struct ccli *ccli, const char *command,
+			const char *line, void *data,
+			int argc, char **argv)
+{
+	int *cnt = data;
+
+	/* Stops only when the watchdog says so */
+	while (!ccli_cancelled(ccli))
+		usleep(1000);
+	(*cnt)++;
+	return 0;
+}
+
+struct block_test {
+	struct ccli		*ccli;
+	bool			release;
+};
+
+static int command_block(struct ccli *ccli, const char *command,
+			 const char *line, void *data,
+			 int argc, char **argv)
+{
+	struct block_test *test = data;
+
+	/* Stuck, without printing or checking ccli_cancelled() */
+	while (!__atomic_load_n(&test->release, __ATOMIC_ACQUIRE))
+		usleep(1000);
+	return 0;
+}
+
+static void *execute_block(void *data)
+{
+	struct block_test *test = data;
+
+	ccli_execute(test->ccli, "block", false);
+	return NULL;
+}
+
+static int command_cancelled(struct ccli *ccli, const char *command,
+			     const char *line, void *data,
+			     int argc, char **argv)
+{
+	*(bool *)data = ccli_cancelled(ccli);
+	return 0;
+}
+
+static void test_ccli_timeout(void)
+{
+	struct timespec start, end;
+	struct block_test block = { };
+	struct pipe_ccli p;
+	struct pollfd pfd;
+	struct ccli *ccli;
+	pthread_t thread;
+	char buf[BUFSIZ + 1];
+	bool cancelled = true;
+	int cnt = 0;
+	long ms;
+	int r;
+
+	if (create_pipe_ccli(&p, CCLI_PROMPT) < 0)
+		return;
+
+	ccli = p.ccli;
+
+	ccli_register_command(ccli, "hang", command_hang, &cnt);
+	ccli_register_command(ccli, "check", command_cancelled, &cancelled);
+	ccli_register_command(ccli, "block", command_block, &block);
+
+	r = ccli_set_timeout(ccli, "nothere", 10);
+	CU_TEST(r < 0 && errno == ENOENT);
+	r = ccli_set_timeout(ccli, NULL, -1);
+	CU_TEST(r < 0 && errno == EINVAL);
+
+	r = ccli_set_timeout(ccli, "hang", 50);
+	CU_TEST(!r);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = ccli_execute(ccli, "hang", false);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	CU_TEST(r == 0);
+	CU_TEST(cnt == 1);
+
+	ms = (end.tv_sec - start.tv_sec) * 1000 +
+		(end.tv_nsec - start.tv_nsec) / 1000000;
+	CU_TEST(ms >= 50);
+
+	r = read(p.out[0], buf, BUFSIZ);
+	CU_TEST(r > 0);
+	if (r < 0)
+		r = 0;
+	buf[r] = '\0';
+	CU_TEST(strstr(buf, "hang: timed out after 0.050s") != NULL);
+
+	/* The next command starts out not cancelled */
+	r = ccli_set_timeout(ccli, NULL, 1000);
+	CU_TEST(!r);
+	r = ccli_execute(ccli, "check", false);
+	CU_TEST(r == 0);
+	CU_TEST(!cancelled);
+
+	/* The warning is out while a command that is stuck is still stuck */
+	r = ccli_set_timeout(ccli, "block", 50);
+	CU_TEST(!r);
+	block.ccli = ccli;
+	pthread_create(&thread, NULL, execute_block, &block);
+
+	pfd.fd = p.out[0];
+	pfd.events = POLLIN;
+	r = poll(&pfd, 1, 5000);
+	CU_TEST(r == 1);
+	if (r == 1) {
+		r = read(p.out[0], buf, BUFSIZ);
+		CU_TEST(r > 0);
+		if (r < 0)
+			r = 0;
+		buf[r] = '\0';
+		CU_TEST(strstr(buf, "block: timed out after 0.050s") != NULL);
+	}
+
+	__atomic_store_n(&block.release, true, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	destroy_pipe_ccli(&p);
+}
+
+static void test_ccli_stats(void)
+{
+	const char input[] = "he\t\025\022\nexit\n";
+	struct ccli_stats stats;
+	struct pipe_ccli p;
+	struct ccli *ccli;
+	char buf[BUFSIZ];
+	int total = 0;
+	int r;
+
+	if (create_pipe_ccli(&p, CCLI_PROMPT) < 0)
+		return;
+
+	ccli = p.ccli;
+
+	r = ccli_stats(ccli, NULL);
+	CU_TEST(r < 0 && errno == EINVAL);
+
+	ccli_stats_reset(ccli);
+	r = ccli_stats(ccli, &stats);
+	CU_TEST(!r);
+	CU_TEST(stats.writes == 0 && stats.allocs == 0);
+
+	/* Type, complete, clear the line, search and exit */
+	r = run_pipe_ccli(&p, input);
+	CU_TEST(r == 0);
+
+	while ((r = read(p.out[0], buf, sizeof(buf))) > 0)
+		total += r;
+
+	ccli_stats(ccli, &stats);
+	CU_TEST(stats.reads == sizeof(input) - 1);
+	CU_TEST(stats.bytes_read == sizeof(input) - 1);
+	CU_TEST(stats.bytes_written == total);
+	CU_TEST(stats.writes > 0 && stats.writes <= total);
+	CU_TEST(stats.redraws > 0);
+	CU_TEST(stats.completions == 1);
+	CU_TEST(stats.history_searches == 1);
+
+	ccli_stats_reset(ccli);
+	ccli_stats(ccli, &stats);
+	CU_TEST(stats.reads == 0 && stats.bytes_written == 0 &&
+		stats.redraws == 0 && stats.completions == 0);
+
+	destroy_pipe_ccli(&p);
+}
+
+static int get_num(const unsigned char *buf, int len, int *pos)
+{
+	int shift = 0;
+	int val = 0;
+	int ch;
+
+	do {
+		if (*pos >= len)
+			return -1;
+		ch = buf[(*pos)++];
+		val |= (ch & 0x7f) << shift;
+		shift += 7;
+	} while (ch & 0x80);
+
+	return val;
+}
+
+#define METRICS_FILE	"/tmp/libccli-utest-metrics.prom"
+
+static int read_file(const char *file, char *buf)
+{
+	int fd;
+	int r;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	r = read(fd, buf, BUFSIZ * 4);
+	close(fd);
+	if (r < 0)
+		r = 0;
+	buf[r] = '\0';
+	return r;
+}
+
+struct metrics_thread {
+	struct ccli		*ccli;
+	int			fd;
+	int			ret;
+	int			err;
+};
+
+/* Try to stop the metrics while the loop runs, then have it exit */
+static void *metrics_stop(void *data)
+{
+	struct metrics_thread *mt = data;
+
+	usleep(100000);
+	mt->ret = ccli_metrics_file(mt->ccli, NULL, 0);
+	mt->err = errno;
+	write(mt->fd, "exit\n", 5);
+	return NULL;
+}
+
+static void test_ccli_metrics(void)
+{
+	static char buf[BUFSIZ * 4 + 1];
+	struct metrics_thread mt;
+	struct pipe_ccli p;
+	struct ccli *ccli;
+	pthread_t thread;
+	int r;
+
+	if (create_pipe_ccli(&p, CCLI_PROMPT) < 0)
+		return;
+
+	ccli = p.ccli;
+
+	ccli_register_command(ccli, "nop", command_nop, NULL);
+
+	r = ccli_metrics_file(ccli, METRICS_FILE, 0);
+	CU_TEST(r < 0 && errno == EINVAL);
+	r = ccli_metrics_file(ccli, "/nonexistent/ccli.prom", 1000);
+	CU_TEST(r < 0 && errno == ENOENT);
+
+	/* It is written right away */
+	unlink(METRICS_FILE);
+	r = ccli_metrics_file(ccli, METRICS_FILE, 60000);
+	CU_TEST(r == 0);
+	r = read_file(METRICS_FILE, buf);
+	CU_TEST(r > 0);
+	CU_TEST(strstr(buf, "# TYPE ccli_writes_total counter\n"
+			    "ccli_writes_total ") != NULL);
+	CU_TEST(strstr(buf, "ccli_pool_hits_total{pool=\"line\"} ") != NULL);
+	CU_TEST(strstr(buf, "# TYPE ccli_command_duration_seconds histogram\n") != NULL);
+	CU_TEST(strstr(buf, "{command=") == NULL);
+
+	ccli_execute(ccli, "nop", false);
+	ccli_execute(ccli, "nop", false);
+
+	/* And every interval while the loop waits for input */
+	r = ccli_metrics_file(ccli, METRICS_FILE, 10);
+	CU_TEST(r == 0);
+	unlink(METRICS_FILE);
+
+	/* Only the thread of the loop may change it while it runs */
+	mt.ccli = ccli;
+	mt.fd = p.in[1];
+	pthread_create(&thread, NULL, metrics_stop, &mt);
+	ccli_loop(ccli);
+	pthread_join(thread, NULL);
+	CU_TEST(mt.ret < 0 && mt.err == EBUSY);
+
+	r = read_file(METRICS_FILE, buf);
+	CU_TEST(r > 0);
+	CU_TEST(strstr(buf, "ccli_command_duration_seconds_bucket"
+			    "{command=\"nop\",le=\"+Inf\"} 2\n") != NULL);
+	CU_TEST(strstr(buf, "ccli_command_duration_seconds_count"
+			    "{command=\"nop\"} 2\n") != NULL);
+	CU_TEST(strstr(buf, "ccli_command_duration_seconds_sum"
+			    "{command=\"nop\"} ") != NULL);
+
+	/* Stop writing it */
+	r = ccli_metrics_file(ccli, NULL, 0);
+	CU_TEST(r == 0);
+
+	/* A file that could not be built in full does not replace the last */
+	r = ccli_set_allocator(ccli, &small_allocator);
+	CU_TEST(r == 0);
+	r = ccli_metrics_file(ccli, METRICS_FILE, 60000);
+	CU_TEST(r < 0 && errno == ENOMEM);
+	r = read_file(METRICS_FILE, buf);
+	CU_TEST(r > 0);
+	CU_TEST(strstr(buf, "{command=\"nop\"} 2\n") != NULL);
+	ccli_set_allocator(ccli, NULL);
+
+	destroy_pipe_ccli(&p);
+	unlink(METRICS_FILE);
+}
+
+#define RECORD_FILE	"/tmp/libccli-utest-record"
+#define RECORD_TARGET	"/tmp/libccli-utest-record-target"
+
+static void test_ccli_record(void)
+{
+	const char input[] = "echo x\nexit\n";
+	unsigned char buf[BUFSIZ];
+	char typed[sizeof(input)];
+	struct pipe_ccli p;
+	struct ccli *ccli;
+	int typed_len = 0;
+	int rec[2];
+	int len = 0;
+	int pos;
+	int cnt;
+	int fd;
+	int r;
+
+	if (pipe(rec) < 0) {
+		CU_TEST(0);
+		return;
+	}
+
+	if (create_pipe_ccli(&p, CCLI_PROMPT) < 0)
+		goto out;
+
+	ccli = p.ccli;
+
+#ifdef CCLI_NO_RECORD
+	r = ccli_record_start(ccli, rec[1]);
+	CU_TEST(r < 0 && errno == ENOTSUP);
+	r = ccli_record_env(ccli, true);
+	CU_TEST(r < 0 && errno == ENOTSUP);
+	destroy_pipe_ccli(&p);
+	goto out;
+#endif
+
+	r = ccli_record_start(ccli, -1);
+	CU_TEST(r < 0 && errno == EINVAL);
+
+	r = ccli_record_stop(ccli);
+	CU_TEST(r < 0 && errno == ENOENT);
+
+	r = ccli_record_start(ccli, rec[1]);
+	CU_TEST(r == 0);
+
+	r = ccli_record_start(ccli, rec[1]);
+	CU_TEST(r < 0 && errno == EBUSY);
+
+	write(p.in[1], input, sizeof(input) - 1);
+	r = ccli_loop(ccli);
+	CU_TEST(r == 0);
+
+	r = ccli_record_stop(ccli);
+	CU_TEST(r == 0);
+
+	/* The descriptor is left open */
+	close(rec[1]);
+	rec[1] = -1;
+	while ((r = read(rec[0], buf + len, sizeof(buf) - len)) > 0)
+		len += r;
+
+	CU_TEST(len > 8 && memcmp(buf, "CCLIREC\1", 8) == 0);
+
+	/* A pipe has no size, so there are only input records */
+	for (pos = 8, cnt = 0; pos < len; cnt++) {
+		if (buf[pos++] != 'I')
+			break;
+		if (get_num(buf, len, &pos) < 0)
+			break;
+		r = get_num(buf, len, &pos);
+		if (r <= 0 || pos + r > len || typed_len + r >= sizeof(typed))
+			break;
+		memcpy(typed + typed_len, buf + pos, r);
+		typed_len += r;
+		pos += r;
+	}
+	CU_TEST(pos == len);
+	CU_TEST(cnt == sizeof(input) - 1);
+	CU_TEST(typed_len == sizeof(input) - 1 &&
+		memcmp(typed, input, typed_len) == 0);
+
+	/* The environment is ignored unless the application allows it */
+	setenv("CCLI_RECORD", RECORD_FILE, 1);
+	unlink(RECORD_FILE);
+	write(p.in[1], "exit\n", 5);
+	r = ccli_loop(ccli);
+	CU_TEST(r == 0);
+	CU_TEST(access(RECORD_FILE, F_OK) < 0);
+
+	r = ccli_record_env(NULL, true);
+	CU_TEST(r < 0 && errno == EINVAL);
+	r = ccli_record_env(ccli, true);
+	CU_TEST(r == 0);
+
+	/* A symlink is not followed to the file it points to */
+	fd = open(RECORD_TARGET, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	CU_TEST(fd >= 0);
+	if (fd >= 0) {
+		write(fd, "kept", 4);
+		close(fd);
+	}
+	r = symlink(RECORD_TARGET, RECORD_FILE);
+	CU_TEST(r == 0);
+	write(p.in[1], "exit\n", 5);
+	r = ccli_loop(ccli);
+	CU_TEST(r == 0);
+	fd = open(RECORD_TARGET, O_RDONLY);
+	CU_TEST(fd >= 0);
+	if (fd >= 0) {
+		len = read(fd, buf, sizeof(buf));
+		CU_TEST(len == 4 && memcmp(buf, "kept", 4) == 0);
+		close(fd);
+	}
+	unlink(RECORD_FILE);
+	unlink(RECORD_TARGET);
+
+	/* Recording with the environment stops when the loop exits */
+	write(p.in[1], "exit\n", 5);
+	r = ccli_loop(ccli);
+	CU_TEST(r == 0);
+	unsetenv("CCLI_RECORD");
+
+	r = ccli_record_stop(ccli);
+	CU_TEST(r < 0 && errno == ENOENT);
+
+	fd = open(RECORD_FILE, O_RDONLY);
+	CU_TEST(fd >= 0);
+	if (fd >= 0) {
+		len = read(fd, buf, sizeof(buf));
+		CU_TEST(len > 8 && memcmp(buf, "CCLIREC\1", 8) == 0);
+		close(fd);
+	}
+	unlink(RECORD_FILE);
+
+	destroy_pipe_ccli(&p);
+ out:
+	close(rec[0]);
+	if (rec[1] >= 0)
+		close(rec[1]);
+}
+
+/* Run ccli_loop() on @input, and draw what it writes on @vt */
+static int run_screen(struct vt *vt, const char *input)
+{
+	struct pipe_ccli p;
+	char buf[BUFSIZ];
+	int ret;
+	int r;
+
+	if (create_pipe_ccli(&p, CCLI_PROMPT) < 0)
+		return -1;
+
+	/* The loop exits when it reads the end of the input */
+	ret = run_pipe_ccli(&p, input);
+
+	while ((r = read(p.out[0], buf, sizeof(buf))) > 0)
+		vt_write(vt, buf, r);
+
+	destroy_pipe_ccli(&p);
+	return ret;
+}
+
+/* The bytes it takes to draw @input on a clear screen */
+static unsigned long screen_bytes(struct vt *vt, const char *input)
+{
+	vt_clear(vt);
+	vt_reset_counts(vt);
+	run_screen(vt, input);
+	return vt->bytes;
+}
+
+/* The writes it takes to run @input */
+static unsigned long screen_writes(const char *input)
+{
+	struct ccli_stats stats;
+	struct pipe_ccli p;
+	char buf[BUFSIZ];
+
+	if (create_pipe_ccli(&p, CCLI_PROMPT) < 0)
+		return 0;
+
+	run_pipe_ccli(&p, input);
+	while (read(p.out[0], buf, sizeof(buf)) > 0)
+		;
+
+	ccli_stats(p.ccli, &stats);
+	destroy_pipe_ccli(&p);
+	return stats.writes;
+}
+
+/* Allowed to draw a key typed at the end of the line, however long it is */
+#define KEY_BUDGET		4
+
+/* Allowed to draw an edit in the middle of the line, with @tail after it */
+#define EDIT_BUDGET(tail)	(2 * (tail) + 4)
+
+#define KEY_LEFT		"\033[D"
+
+#define TYPED_LINE	"the quick brown fox jumps over the lazy dog"
+
+static void test_ccli_screen(void)
+{
+	static const int tails[] = { 1, 10, 30 };
+	unsigned long before;
+	unsigned long bytes;
+	unsigned long worst = 0;
+	char input[BUFSIZ];
+	struct vt *vt;
+	int prompt = strlen(CCLI_PROMPT);
+	int len;
+	int i;
+	int t;
+
+	vt = vt_alloc(24, 80);
+	CU_TEST(vt != NULL);
+	if (!vt)
+		return;
+
+	/* The model itself */
+	vt_write(vt, "abc\bX\r\n\033[2;4Hde\033[1;2H\033[K", 24);
+	CU_TEST(strcmp(vt_line(vt, 0), "a") == 0);
+	CU_TEST(strcmp(vt_line(vt, 1), "   de") == 0);
+	CU_TEST(vt->row == 0 && vt->col == 1);
+	CU_TEST(vt->escapes == 3 && vt->unknown == 0);
+	vt_write(vt, "\033[2J\033[24;79Hxyz", 15);
+	CU_TEST(vt->scrolls == 1);
+	CU_TEST(strcmp(vt_line(vt, 22), "                                                                              xy") == 0);
+	CU_TEST(strcmp(vt_line(vt, 23), "z") == 0);
+
+	/* Typing a line draws it, and leaves the cursor after it */
+	vt_clear(vt);
+	vt_reset_counts(vt);
+	snprintf(input, sizeof(input), "%s\025exit\n", TYPED_LINE);
+	run_screen(vt, input);
+	CU_TEST(strcmp(vt_line(vt, 0), CCLI_PROMPT "exit") == 0);
+	CU_TEST(vt->unknown == 0);
+
+	/*
+	 * Each key typed at the end of the line must fit in the same budget.
+	 * What it cost is what typing up to it costs less typing up to the
+	 * key before it.
+	 */
+	before = screen_bytes(vt, "");
+	for (i = 1; i <= strlen(TYPED_LINE); i++) {
+		snprintf(input, sizeof(input), "%.*s", i, TYPED_LINE);
+		bytes = screen_bytes(vt, input);
+		if (bytes - before > worst)
+			worst = bytes - before;
+		before = bytes;
+	}
+	CU_TEST(worst <= KEY_BUDGET);
+
+	/* An edit in the middle only costs what is after it */
+	for (t = 0; t < sizeof(tails) / sizeof(tails[0]); t++) {
+		len = snprintf(input, sizeof(input), "%s", TYPED_LINE);
+		for (i = 0; i < tails[t]; i++)
+			len += snprintf(input + len, sizeof(input) - len, KEY_LEFT);
+		before = screen_bytes(vt, input);
+
+		input[len] = 'X';
+		input[len + 1] = '\0';
+		bytes = screen_bytes(vt, input);
+		CU_TEST(bytes - before <= EDIT_BUDGET(tails[t]));
+
+		/* Backspace */
+		input[len] = '\177';
+		bytes = screen_bytes(vt, input);
+		CU_TEST(bytes - before <= EDIT_BUDGET(tails[t]));
+
+		/* Each of them is drawn with a single write */
+		input[len] = '\0';
+		before = screen_writes(input);
+		input[len] = 'X';
+		CU_TEST(screen_writes(input) == before + 1);
+		input[len] = '\177';
+		CU_TEST(screen_writes(input) == before + 1);
+	}
+
+	/* Editing in the middle of the line */
+	vt_clear(vt);
+	vt_reset_counts(vt);
+	/* Ctrl^C exits the loop by default */
+	run_screen(vt, "hello\033[D\033[DXY\033[H>\033[F!\003");
+	CU_TEST(strcmp(vt_line(vt, 0), CCLI_PROMPT ">helXYlo!^C") == 0);
+	CU_TEST(vt->row == 1 && vt->col == 0);
+	CU_TEST(vt->unknown == 0);
+
+	/* The cursor follows the edits */
+	vt_clear(vt);
+	run_screen(vt, "hello\033[D\033[DXY");
+	CU_TEST(vt->row == 0 && vt->col == prompt + 5);
+	CU_TEST(strcmp(vt_line(vt, 0), CCLI_PROMPT "helXYlo") == 0);
+
+	vt_free(vt);
+}
+
+#define THREAD_LINES		500
+#define THREAD_PRINTS		200
+
+struct thread_test {
+	struct ccli		*ccli;
+	int			in[2];
+	int			out[2];
+	char			*output;
+	int			output_len;
+	int			count;
+	int			bad;
+	int			ret;
+	bool			stop;
+};
+
+static int command_atomic_count(struct ccli *ccli, const char *command,
+				const char *line, void *data,
+				int argc, char **argv)
+{
+	__atomic_fetch_add((int *)data, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static bool thread_stop(struct thread_test *test)
+{
+	return __atomic_load_n(&test->stop, __ATOMIC_SEQ_CST);
+}
+
+static bool thread_wait_count(struct thread_test *test, int count)
+{
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		if (__atomic_load_n(&test->count, __ATOMIC_SEQ_CST) >= count)
+			return true;
+		usleep(1000);
+	}
+	return false;
+}
+
+static void *thread_loop(void *data)
+{
+	struct thread_test *test = data;
+
+	test->ret = ccli_loop(test->ccli);
+	return NULL;
+}
+
+/* Read everything the loop writes */
+static void *thread_drain(void *data)
+{
+	struct thread_test *test = data;
+	char buf[BUFSIZ];
+	char *output;
+	int r;
+
+	while ((r = read(test->out[0], buf, sizeof(buf))) > 0) {
+		output = realloc(test->output, test->output_len + r + 1);
+		if (!output)
+			break;
+		memcpy(output + test->output_len, buf, r);
+		test->output_len += r;
+		output[test->output_len] = '\0';
+		test->output = output;
+	}
+	return NULL;
+}
+
+/* Change the commands while the loop is executing them */
+static void *thread_register(void *data)
+{
+	struct thread_test *test = data;
+	char name[16];
+	int i;
+
+	for (i = 0; !thread_stop(test); i++) {
+		snprintf(name, sizeof(name), "tmp%d", i % 8);
+		ccli_register_command(test->ccli, name, command_nop, NULL);
+		snprintf(name, sizeof(name), "tmp%d", (i + 4) % 8);
+		ccli_unregister_command(test->ccli, name);
+		ccli_register_command(test->ccli, "count", command_atomic_count,
+				      &test->count);
+	}
+	return NULL;
+}
+
+static void *thread_print(void *data)
+{
+	struct thread_test *test = data;
+	int i;
+
+	for (i = 0; i < THREAD_PRINTS; i++)
+		ccli_printf(test->ccli, "message %d\n", i);
+	return NULL;
+}
+
+static void *thread_history(void *data)
+{
+	struct thread_test *test = data;
+	char buf[16];
+	int i;
+
+	while (!thread_stop(test)) {
+		for (i = 1; i <= 8; i++) {
+			if (ccli_history_copy(test->ccli, i, buf, sizeof(buf)) < 0)
+				continue;
+			if (strcmp(buf, "count") != 0 && strncmp(buf, "tmp", 3) != 0)
+				test->bad++;
+		}
+	}
+	return NULL;
+}
+
+static void test_ccli_threads(void)
+{
+	struct thread_test test;
+	pthread_t loop, drain, reg, print, hist;
+	char line[64];
+	char *p;
+	int count = 1;
+	int i;
+
+	memset(&test, 0, sizeof(test));
+
+	if (pipe(test.in) < 0 || pipe(test.out) < 0) {
+		CU_TEST(0);
+		return;
+	}
+
+	test.ccli = ccli_alloc(CCLI_PROMPT, test.in[0], test.out[1]);
+	CU_TEST(test.ccli != NULL);
+	if (!test.ccli)
+		goto out;
+
+	ccli_register_command(test.ccli, "count", command_atomic_count,
+			      &test.count);
+
+	pthread_create(&drain, NULL, thread_drain, &test);
+	pthread_create(&loop, NULL, thread_loop, &test);
+
+	/* Make sure the loop is running */
+	write(test.in[1], "count\n", 6);
+	CU_TEST(thread_wait_count(&test, count));
+
+	pthread_create(&reg, NULL, thread_register, &test);
+	pthread_create(&print, NULL, thread_print, &test);
+	pthread_create(&hist, NULL, thread_history, &test);
+
+	for (i = 0; i < THREAD_LINES; i++) {
+		if (i & 1) {
+			snprintf(line, sizeof(line), "tmp%d\n", i % 8);
+		} else {
+			strcpy(line, "count\n");
+			count++;
+		}
+		write(test.in[1], line, strlen(line));
+	}
+
+	pthread_join(print, NULL);
+	CU_TEST(thread_wait_count(&test, count));
+
+	/* The loop injects it into the line, and then it is executed */
+	CU_TEST(ccli_line_inject(test.ccli, "count", -1) == 0);
+	write(test.in[1], "\n", 1);
+	CU_TEST(thread_wait_count(&test, ++count));
+
+	__atomic_store_n(&test.stop, true, __ATOMIC_SEQ_CST);
+	pthread_join(reg, NULL);
+	pthread_join(hist, NULL);
+
+	write(test.in[1], "exit\n", 5);
+	pthread_join(loop, NULL);
+	CU_TEST(test.ret == 0);
+
+	close(test.out[1]);
+	test.out[1] = -1;
+	pthread_join(drain, NULL);
+
+	CU_TEST(test.count == count);
+	CU_TEST(test.bad == 0);
+
+	/* All the messages made it out whole and in order */
+	p = test.output;
+	for (i = 0; p && i < THREAD_PRINTS; i++) {
+		snprintf(line, sizeof(line), "message %d\n", i);
+		p = strstr(p, line);
+	}
+	CU_TEST(p != NULL);
+
+	/* Without the loop running, there is no line to inject into */
+	CU_TEST(ccli_line_inject(test.ccli, "count", -1) < 0);
+
+	ccli_free(test.ccli);
+	free(test.output);
+ out:
+	close(test.in[0]);
+	close(test.in[1]);
+	close(test.out[0]);
+	if (test.out[1] >= 0)
+		close(test.out[1]);
+}
+
+static int test_suite_destroy(void)
+{
+	void *cret;
+
+	ccli_connect.run = false;
+	wait_for_console();
+	pthread_join(cons_thread, &cret);
+	ccli_free(ccli_connect.ccli);
+	return 0;
+}
+
+static void *ccli_console(void *data)
+{
+	struct test_ccli_connect *conn = data;
+
+	/* Only read run after the barrier that test_suite_destroy() waits on */
+	for (;;) {
+		pthread_barrier_wait(&pbarrier);
+		if (!conn->run)
+			break;
+		printf("start loop\n");
+		conn->ret = ccli_loop(conn->ccli);
+		printf("end loop\n");
+		pthread_barrier_wait(&pbarrier);
+	}
 
 	printf("exit loop\n");
 	return NULL;
@@ -298,4 +2397,38 @@ void test_ccli_lib(void)
 		    test_ccli_exit);
 	CU_add_test(suite, "ccli command",
 		    test_ccli_command);
+	CU_add_test(suite, "ccli pools",
+		    test_ccli_pools);
+	CU_add_test(suite, "ccli allocator",
+		    test_ccli_allocator);
+	CU_add_test(suite, "ccli static",
+		    test_ccli_static);
+	CU_add_test(suite, "ccli shared history",
+		    test_ccli_shared_history);
+	CU_add_test(suite, "ccli history fd",
+		    test_ccli_history_fd);
+	CU_add_test(suite, "ccli signal",
+		    test_ccli_signal);
+	CU_add_test(suite, "ccli threads",
+		    test_ccli_threads);
+	CU_add_test(suite, "ccli watch",
+		    test_ccli_watch);
+	CU_add_test(suite, "ccli stats commands",
+		    test_ccli_stats_commands);
+	CU_add_test(suite, "ccli pager",
+		    test_ccli_pager);
+	CU_add_test(suite, "ccli table",
+		    test_ccli_table);
+	CU_add_test(suite, "ccli emit",
+		    test_ccli_emit);
+	CU_add_test(suite, "ccli metrics",
+		    test_ccli_metrics);
+	CU_add_test(suite, "ccli timeout",
+		    test_ccli_timeout);
+	CU_add_test(suite, "ccli stats",
+		    test_ccli_stats);
+	CU_add_test(suite, "ccli record",
+		    test_ccli_record);
+	CU_add_test(suite, "ccli screen",
+		    test_ccli_screen);
 }
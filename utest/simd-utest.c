@@ -0,0 +1,231 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ *
+ * Cross check every SIMD version of the string kernels (that the CPU
+ * supports) against the plain C one, on generated strings at every
+ * alignment, and on strings that end right before a page that can not
+ * be read.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include "simd.h"
+#include "ccli-utest.h"
+
+#define SIMD_SUITE		"ccli simd"
+
+#define MAX_LEN			100
+#define MAX_OFFSET		64
+#define ROUNDS			2000
+
+static const struct simd_ops *scalar;
+static unsigned int seed;
+
+/* A few letters, so that the strings have long runs that match */
+static const char letters[] = "aab";
+static const char specials[] = " \t\n\v\f\r'\"\\";
+
+static void fill(char *buf, int len, bool special)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (special && !(rand_r(&seed) % 16))
+			buf[i] = specials[rand_r(&seed) % (sizeof(specials) - 1)];
+		else
+			buf[i] = letters[rand_r(&seed) % (sizeof(letters) - 1)];
+	}
+	buf[len] = '\0';
+}
+
+/* Every version that the CPU supports, but the plain C one */
+#define for_each_variant(v, i)					\
+	for (i = 0; (v = simd_variants[i]); i++)		\
+		if (v != scalar && v->supported())
+
+static void test_simd_variants(void)
+{
+	const struct simd_ops *v;
+	bool found = false;
+	int i;
+
+	CU_TEST(scalar != NULL);
+
+	/* What is used must be one of the versions that the CPU supports */
+	for (i = 0; (v = simd_variants[i]); i++) {
+		if (v == simd)
+			found = v->supported();
+	}
+	CU_TEST(found);
+}
+
+static void test_simd_prefix(void)
+{
+	char a[MAX_OFFSET + MAX_LEN + 1];
+	char b[MAX_OFFSET + MAX_LEN + 1];
+	const struct simd_ops *v;
+	int oa, ob, la, lb;
+	int bad = 0;
+	int r, i;
+
+	for (r = 0; r < ROUNDS; r++) {
+		oa = rand_r(&seed) % MAX_OFFSET;
+		ob = rand_r(&seed) % MAX_OFFSET;
+		la = rand_r(&seed) % MAX_LEN;
+		lb = rand_r(&seed) % MAX_LEN;
+		fill(a + oa, la, false);
+		fill(b + ob, lb, false);
+		/* Make half of them share a prefix */
+		if (r & 1)
+			memcpy(b + ob, a + oa, (la < lb ? la : lb) / 2);
+
+		for_each_variant(v, i) {
+			if (v->prefix(a + oa, b + ob) != scalar->prefix(a + oa, b + ob))
+				bad++;
+		}
+	}
+	CU_TEST(bad == 0);
+}
+
+static void test_simd_plain(void)
+{
+	char s[MAX_OFFSET + MAX_LEN + 1];
+	const struct simd_ops *v;
+	int off, len;
+	int bad = 0;
+	int r, i;
+
+	for (r = 0; r < ROUNDS; r++) {
+		off = rand_r(&seed) % MAX_OFFSET;
+		len = rand_r(&seed) % MAX_LEN;
+		fill(s + off, len, r & 1);
+
+		for_each_variant(v, i) {
+			if (v->plain(s + off) != scalar->plain(s + off))
+				bad++;
+		}
+	}
+	CU_TEST(bad == 0);
+}
+
+static void test_simd_find(void)
+{
+	char hay[MAX_OFFSET + MAX_LEN + 1];
+	char needle[MAX_LEN / 4 + 1];
+	const struct simd_ops *v;
+	int off, hlen, nlen;
+	int bad = 0;
+	int r, i;
+
+	for (r = 0; r < ROUNDS; r++) {
+		off = rand_r(&seed) % MAX_OFFSET;
+		hlen = rand_r(&seed) % MAX_LEN;
+		nlen = rand_r(&seed) % (MAX_LEN / 4);
+		fill(hay + off, hlen, false);
+		fill(needle, nlen, false);
+		/* Make sure that some are found, and some near the end */
+		if ((r & 1) && nlen <= hlen)
+			memcpy(hay + off + rand_r(&seed) % (hlen - nlen + 1),
+			       needle, nlen);
+
+		for_each_variant(v, i) {
+			if (v->find(hay + off, needle, nlen) != strstr(hay + off, needle))
+				bad++;
+		}
+	}
+	CU_TEST(bad == 0);
+}
+
+/* The strings end at the last byte of a page, and the next one can not be read */
+static void test_simd_page_end(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	const struct simd_ops *v;
+	char *end, *a, *b;
+	char *map;
+	int bad = 0;
+	int len, i;
+
+	map = mmap(NULL, page * 2, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	CU_TEST(map != MAP_FAILED);
+	if (map == MAP_FAILED)
+		return;
+
+	CU_TEST(mprotect(map + page, page, PROT_NONE) == 0);
+	end = map + page;
+
+	for (len = 0; len < MAX_LEN; len++) {
+		/* @a ends at the end of the page, @b in the middle of it */
+		a = end - len - 1;
+		b = map + page / 2 + len % 32;
+		memset(a, 'x', len);
+		a[len] = '\0';
+		memset(b, 'x', len);
+		b[len] = '\0';
+
+		for_each_variant(v, i) {
+			if (v->prefix(a, b) != len || v->prefix(b, a) != len)
+				bad++;
+			if (v->plain(a) != len)
+				bad++;
+			if (len > 1 && v->find(a, "xx", 2) != a)
+				bad++;
+			if (v->find(a, "xy", 2) != NULL)
+				bad++;
+		}
+
+		/* The same, where they differ only at the last byte */
+		if (len) {
+			b[len - 1] = 'y';
+			for_each_variant(v, i) {
+				if (v->prefix(a, b) != len - 1)
+					bad++;
+			}
+		}
+	}
+	CU_TEST(bad == 0);
+
+	munmap(map, page * 2);
+}
+
+static int simd_suite_init(void)
+{
+	int i;
+
+	for (i = 0; simd_variants[i]; i++) {
+		if (strcmp(simd_variants[i]->name, "scalar") == 0)
+			scalar = simd_variants[i];
+	}
+	seed = 1;
+	return scalar ? 0 : 1;
+}
+
+void test_simd_lib(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite(SIMD_SUITE, simd_suite_init, NULL);
+	if (suite == NULL) {
+		fprintf(stderr, "Suite \"%s\" cannot be created\n", SIMD_SUITE);
+		return;
+	}
+
+	CU_add_test(suite, "variants",
+		    test_simd_variants);
+	CU_add_test(suite, "prefix",
+		    test_simd_prefix);
+	CU_add_test(suite, "plain",
+		    test_simd_plain);
+	CU_add_test(suite, "find",
+		    test_simd_find);
+	CU_add_test(suite, "page end",
+		    test_simd_page_end);
+}
@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Copyright (C) 2022 Steven Rostedt <rostedt@goodmis.org>
+ *
+ * A minimal VT100 screen model.
+ *
+ * It understands what ccli writes: printable characters, carriage
+ * return, new line, backspace, tab, and the CSI sequences that move the
+ * cursor and erase (A B C D G H J K P X @ d f). Attributes (m) and the
+ * private modes (like "\033[?25l") are counted but have no effect on
+ * the screen. Anything else is counted as unknown, so that a test can
+ * tell when the library writes something this model does not handle.
+ *
+ * Like a VT100, writing the last column leaves the cursor on it, and the
+ * next character wraps to the next line. Backspace stops at the first
+ * column, and a new line at the bottom scrolls the screen up.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "vt.h"
+
+enum {
+	VT_GROUND,
+	VT_ESC,
+	VT_CSI,
+};
+
+#define NR_PARAMS	(sizeof(((struct vt *)0)->params) / sizeof(int))
+
+static char *cell(struct vt *vt, int row, int col)
+{
+	return vt->grid + row * vt->cols + col;
+}
+
+struct vt *vt_alloc(int rows, int cols)
+{
+	struct vt *vt;
+
+	if (rows <= 0 || cols <= 0)
+		return NULL;
+
+	vt = calloc(1, sizeof(*vt));
+	if (!vt)
+		return NULL;
+
+	vt->grid = malloc(rows * cols);
+	vt->line = malloc(cols + 1);
+	if (!vt->grid || !vt->line) {
+		vt_free(vt);
+		return NULL;
+	}
+
+	vt->rows = rows;
+	vt->cols = cols;
+	vt->onlcr = true;
+	vt_clear(vt);
+
+	return vt;
+}
+
+void vt_free(struct vt *vt)
+{
+	if (!vt)
+		return;
+
+	free(vt->grid);
+	free(vt->line);
+	free(vt);
+}
+
+/* Blank the screen, and put the cursor at the top left */
+void vt_clear(struct vt *vt)
+{
+	memset(vt->grid, ' ', vt->rows * vt->cols);
+	vt->row = 0;
+	vt->col = 0;
+	vt->wrap = false;
+	vt->state = VT_GROUND;
+}
+
+void vt_reset_counts(struct vt *vt)
+{
+	vt->bytes = 0;
+	vt->printed = 0;
+	vt->controls = 0;
+	vt->escapes = 0;
+	vt->unknown = 0;
+	vt->scrolls = 0;
+}
+
+/* Returns @row of the screen without the trailing blanks */
+const char *vt_line(struct vt *vt, int row)
+{
+	int len = vt->cols;
+
+	if (row < 0 || row >= vt->rows)
+		return NULL;
+
+	memcpy(vt->line, cell(vt, row, 0), len);
+	while (len && vt->line[len - 1] == ' ')
+		len--;
+	vt->line[len] = '\0';
+
+	return vt->line;
+}
+
+static void erase(struct vt *vt, int row, int from, int to)
+{
+	if (from < to)
+		memset(cell(vt, row, from), ' ', to - from);
+}
+
+static void line_feed(struct vt *vt)
+{
+	if (vt->row < vt->rows - 1) {
+		vt->row++;
+		return;
+	}
+
+	memmove(vt->grid, cell(vt, 1, 0), (vt->rows - 1) * vt->cols);
+	erase(vt, vt->rows - 1, 0, vt->cols);
+	vt->scrolls++;
+}
+
+static void put_char(struct vt *vt, char ch)
+{
+	if (vt->wrap) {
+		vt->col = 0;
+		line_feed(vt);
+		vt->wrap = false;
+	}
+
+	*cell(vt, vt->row, vt->col) = ch;
+	vt->printed++;
+
+	if (vt->col < vt->cols - 1)
+		vt->col++;
+	else
+		vt->wrap = true;
+}
+
+static void control(struct vt *vt, char ch)
+{
+	vt->controls++;
+
+	switch (ch) {
+	case '\r':
+		vt->col = 0;
+		break;
+	case '\n':
+		if (vt->onlcr)
+			vt->col = 0;
+		line_feed(vt);
+		break;
+	case '\b':
+		if (vt->col)
+			vt->col--;
+		break;
+	case '\t':
+		vt->col = (vt->col + 8) & ~7;
+		if (vt->col >= vt->cols)
+			vt->col = vt->cols - 1;
+		break;
+	default:
+		/* Bell and the like do not change the screen */
+		break;
+	}
+	vt->wrap = false;
+}
+
+static int param(struct vt *vt, int i, int def)
+{
+	if (i >= vt->nr_params || !vt->params[i])
+		return def;
+	return vt->params[i];
+}
+
+static int clamp(int val, int max)
+{
+	if (val < 0)
+		return 0;
+	if (val > max)
+		return max;
+	return val;
+}
+
+static void csi(struct vt *vt, char final)
+{
+	int n = param(vt, 0, 1);
+	int i;
+
+	vt->escapes++;
+
+	if (vt->private) {
+		/* Modes like showing the cursor do not change the screen */
+		if (final != 'h' && final != 'l')
+			vt->unknown++;
+		return;
+	}
+
+	switch (final) {
+	case 'A':
+		vt->row = clamp(vt->row - n, vt->rows - 1);
+		break;
+	case 'B':
+		vt->row = clamp(vt->row + n, vt->rows - 1);
+		break;
+	case 'C':
+		vt->col = clamp(vt->col + n, vt->cols - 1);
+		break;
+	case 'D':
+		vt->col = clamp(vt->col - n, vt->cols - 1);
+		break;
+	case 'G':
+		vt->col = clamp(n - 1, vt->cols - 1);
+		break;
+	case 'd':
+		vt->row = clamp(n - 1, vt->rows - 1);
+		break;
+	case 'H':
+	case 'f':
+		vt->row = clamp(param(vt, 0, 1) - 1, vt->rows - 1);
+		vt->col = clamp(param(vt, 1, 1) - 1, vt->cols - 1);
+		break;
+	case 'J':
+		switch (param(vt, 0, 0)) {
+		case 0:
+			erase(vt, vt->row, vt->col, vt->cols);
+			for (i = vt->row + 1; i < vt->rows; i++)
+				erase(vt, i, 0, vt->cols);
+			break;
+		case 1:
+			for (i = 0; i < vt->row; i++)
+				erase(vt, i, 0, vt->cols);
+			erase(vt, vt->row, 0, vt->col + 1);
+			break;
+		default:
+			for (i = 0; i < vt->rows; i++)
+				erase(vt, i, 0, vt->cols);
+			break;
+		}
+		break;
+	case 'K':
+		switch (param(vt, 0, 0)) {
+		case 0:
+			erase(vt, vt->row, vt->col, vt->cols);
+			break;
+		case 1:
+			erase(vt, vt->row, 0, vt->col + 1);
+			break;
+		default:
+			erase(vt, vt->row, 0, vt->cols);
+			break;
+		}
+		break;
+	case 'P':
+		n = clamp(n, vt->cols - vt->col);
+		memmove(cell(vt, vt->row, vt->col), cell(vt, vt->row, vt->col + n),
+			vt->cols - vt->col - n);
+		erase(vt, vt->row, vt->cols - n, vt->cols);
+		break;
+	case '@':
+		n = clamp(n, vt->cols - vt->col);
+		memmove(cell(vt, vt->row, vt->col + n), cell(vt, vt->row, vt->col),
+			vt->cols - vt->col - n);
+		erase(vt, vt->row, vt->col, vt->col + n);
+		break;
+	case 'X':
+		erase(vt, vt->row, vt->col, clamp(vt->col + n, vt->cols));
+		break;
+	case 'm':
+		/* Colors and the like do not change the text */
+		return;
+	default:
+		vt->unknown++;
+		return;
+	}
+	vt->wrap = false;
+}
+
+/**
+ * vt_write - Feed output into the screen
+ * @vt: The screen to update
+ * @buf: What was written to the terminal
+ * @len: The length of @buf
+ *
+ * An escape sequence may be split over several writes.
+ */
+void vt_write(struct vt *vt, const char *buf, int len)
+{
+	unsigned char ch;
+	int i;
+
+	vt->bytes += len;
+
+	for (i = 0; i < len; i++) {
+		ch = buf[i];
+
+		switch (vt->state) {
+		case VT_GROUND:
+			if (ch == '\033')
+				vt->state = VT_ESC;
+			else if (ch < ' ' || ch == 0x7f)
+				control(vt, ch);
+			else
+				put_char(vt, ch);
+			break;
+		case VT_ESC:
+			if (ch == '[') {
+				memset(vt->params, 0, sizeof(vt->params));
+				vt->nr_params = 0;
+				vt->private = false;
+				vt->state = VT_CSI;
+				break;
+			}
+			/* Only CSI sequences are understood */
+			vt->escapes++;
+			vt->unknown++;
+			vt->state = VT_GROUND;
+			break;
+		case VT_CSI:
+			if (ch >= '0' && ch <= '9') {
+				if (!vt->nr_params)
+					vt->nr_params = 1;
+				if (vt->nr_params <= NR_PARAMS) {
+					int *p = &vt->params[vt->nr_params - 1];
+
+					*p = *p * 10 + ch - '0';
+				}
+			} else if (ch == ';') {
+				if (!vt->nr_params)
+					vt->nr_params = 1;
+				vt->nr_params++;
+			} else if (ch == '?') {
+				vt->private = true;
+			} else if (ch >= 0x40 && ch <= 0x7e) {
+				if (vt->nr_params > NR_PARAMS)
+					vt->nr_params = NR_PARAMS;
+				csi(vt, ch);
+				vt->state = VT_GROUND;
+			}
+			break;
+		}
+	}
+}
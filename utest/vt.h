@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+#ifndef __CCLI_VT_H
+#define __CCLI_VT_H
+
+#include <stdbool.h>
+
+/*
+ * A minimal VT100 screen, for tests to see what the output of ccli
+ * draws, and what it costs to draw it.
+ */
+struct vt {
+	char			*grid;		/* rows * cols characters */
+	char			*line;		/* Returned by vt_line() */
+	int			rows;
+	int			cols;
+	int			row;		/* The cursor, from zero */
+	int			col;
+	bool			wrap;		/* The next character wraps */
+	bool			onlcr;		/* '\n' also returns the cursor */
+
+	/* What was written since vt_reset_counts() */
+	unsigned long		bytes;
+	unsigned long		printed;	/* Characters drawn */
+	unsigned long		controls;	/* '\r', '\n', '\b', ... */
+	unsigned long		escapes;	/* Escape sequences */
+	unsigned long		unknown;	/* Sequences that were ignored */
+	unsigned long		scrolls;
+
+	/* The escape sequence being parsed */
+	int			state;
+	int			params[8];
+	int			nr_params;
+	bool			private;
+};
+
+struct vt *vt_alloc(int rows, int cols);
+void vt_free(struct vt *vt);
+void vt_write(struct vt *vt, const char *buf, int len);
+void vt_clear(struct vt *vt);
+void vt_reset_counts(struct vt *vt);
+const char *vt_line(struct vt *vt, int row);
+
+#endif